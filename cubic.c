@@ -10,9 +10,19 @@
 #define RPT 3
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
 
+#if defined(__AVX512F__) || defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifdef BENCHMARK
+#include <stdlib.h>
+#include <time.h>
+#endif
+
 #ifndef PI
 #define PI (4 * atan(1))
 #endif
@@ -55,6 +65,578 @@ void SolveCubic(double a, double b, double c, double d, int *solutions, double *
   }
 }
 
+/* --------------------------- batch solver --------------------------- */
+
+/* SolveCubicBatch solves count cubics a[i] x^3 + b[i] x^2 + c[i] x + d[i]
+   held as arrays, a vector of them at a time, without long
+   double. Each lane computes both the three root and the one root
+   solution of SolveCubic and keeps the one its discriminant selects, so
+   there are no branches. cbrt, acos and cos are computed inline:
+
+     cbrt  an estimate from the exponent, as in fdlibm, then three
+           Halley steps y (y^3 + 2v) / (2 y^3 + v);
+     acos  the Cephes rational approximation of asin on [-0.5, 0.5],
+           with acos t = 2 asin sqrt((1 - t) / 2) beyond;
+     cos   cos and sin of theta / 3, in [0, pi / 3], by Taylor series;
+           the other two angles are that one rotated by 2 pi / 3.
+
+   Q, R and the discriminant R^2 - Q^3 are formed in double-double, as
+   SolveCubic forms them in long double, so both pick the same case and
+   lose about as much to close roots.
+
+   solutions[i] receives 3 or 1. x0[i] receives the root SolveCubic
+   returns first; x1[i] and x2[i] receive the other two, or NAN when
+   there is one real root. polish Newton steps are applied to every
+   root afterwards, with f in double-double.
+
+   On cubics with roots in [-10, 10] the roots agree with SolveCubic to
+   about 2e-13 relative, which is SolveCubic's own error where two roots
+   are close; one Newton step brings them to within rounding of the
+   exact roots. Neither is accurate when the coefficients differ by many
+   orders of magnitude. */
+
+#define CUBIC_PI 3.14159265358979323846
+
+/* Equations main solves with SolveCubicBatch: the fixed ones, and
+   random ones checked to BATCH_EPS relative to the larger of 1 and the
+   root. */
+#define BATCH_CHECK 20
+#define BATCH_RANDOM 1000
+#define BATCH_EPS 1.0e-12
+
+#define batch_eq(exp, actual)                                                 \
+  (fabs((exp) - (actual)) <= BATCH_EPS * fmax(1.0, fabs(exp)))
+
+#if defined(__AVX512F__)
+#define VDLANES 8
+typedef __m512d vdouble;
+typedef __mmask8 vdmask;
+#define VDLOAD(p) _mm512_loadu_pd(p)
+#define VDSTORE(p, x) _mm512_storeu_pd(p, x)
+#define VDSET1(x) _mm512_set1_pd(x)
+#define VDADD(x, y) _mm512_add_pd(x, y)
+#define VDSUB(x, y) _mm512_sub_pd(x, y)
+#define VDMUL(x, y) _mm512_mul_pd(x, y)
+#define VDDIV(x, y) _mm512_div_pd(x, y)
+#define VDSQRT(x) _mm512_sqrt_pd(x)
+#define VDABS(x) _mm512_abs_pd(x)
+#define VDMAX(x, y) _mm512_max_pd(x, y)
+#define VDMIN(x, y) _mm512_min_pd(x, y)
+#define VDLE(x, y) _mm512_cmp_pd_mask(x, y, _CMP_LE_OQ)
+#define VDLT(x, y) _mm512_cmp_pd_mask(x, y, _CMP_LT_OQ)
+#define VDNE(x, y) _mm512_cmp_pd_mask(x, y, _CMP_NEQ_OQ)
+#define VDSEL(m, x, y) _mm512_mask_blend_pd(m, y, x)
+#define VDFMS(x, y, z) _mm512_fmsub_pd(x, y, z)
+
+static inline vdouble
+vd_cbrt0(vdouble v)
+{
+  __m512i hi = _mm512_srli_epi64(_mm512_castpd_si512(v), 32);
+  __m512i q = _mm512_srli_epi64(
+      _mm512_mul_epu32(hi, _mm512_set1_epi64(0xaaaaaaab)), 33);
+
+  return _mm512_castsi512_pd(_mm512_slli_epi64(
+      _mm512_add_epi64(q, _mm512_set1_epi64(715094163)), 32));
+}
+#elif defined(__AVX2__)
+#define VDLANES 4
+typedef __m256d vdouble;
+typedef __m256d vdmask;
+#define VDLOAD(p) _mm256_loadu_pd(p)
+#define VDSTORE(p, x) _mm256_storeu_pd(p, x)
+#define VDSET1(x) _mm256_set1_pd(x)
+#define VDADD(x, y) _mm256_add_pd(x, y)
+#define VDSUB(x, y) _mm256_sub_pd(x, y)
+#define VDMUL(x, y) _mm256_mul_pd(x, y)
+#define VDDIV(x, y) _mm256_div_pd(x, y)
+#define VDSQRT(x) _mm256_sqrt_pd(x)
+#define VDABS(x) _mm256_andnot_pd(_mm256_set1_pd(-0.0), x)
+#define VDMAX(x, y) _mm256_max_pd(x, y)
+#define VDMIN(x, y) _mm256_min_pd(x, y)
+#define VDLE(x, y) _mm256_cmp_pd(x, y, _CMP_LE_OQ)
+#define VDLT(x, y) _mm256_cmp_pd(x, y, _CMP_LT_OQ)
+#define VDNE(x, y) _mm256_cmp_pd(x, y, _CMP_NEQ_OQ)
+#define VDSEL(m, x, y) _mm256_blendv_pd(y, x, m)
+#ifdef __FMA__
+#define VDFMS(x, y, z) _mm256_fmsub_pd(x, y, z)
+#endif
+
+static inline vdouble
+vd_cbrt0(vdouble v)
+{
+  __m256i hi = _mm256_srli_epi64(_mm256_castpd_si256(v), 32);
+  __m256i q = _mm256_srli_epi64(
+      _mm256_mul_epu32(hi, _mm256_set1_epi64x(0xaaaaaaab)), 33);
+
+  return _mm256_castsi256_pd(_mm256_slli_epi64(
+      _mm256_add_epi64(q, _mm256_set1_epi64x(715094163)), 32));
+}
+#elif defined(__SSE2__)
+#define VDLANES 2
+typedef __m128d vdouble;
+typedef __m128d vdmask;
+#define VDLOAD(p) _mm_loadu_pd(p)
+#define VDSTORE(p, x) _mm_storeu_pd(p, x)
+#define VDSET1(x) _mm_set1_pd(x)
+#define VDADD(x, y) _mm_add_pd(x, y)
+#define VDSUB(x, y) _mm_sub_pd(x, y)
+#define VDMUL(x, y) _mm_mul_pd(x, y)
+#define VDDIV(x, y) _mm_div_pd(x, y)
+#define VDSQRT(x) _mm_sqrt_pd(x)
+#define VDABS(x) _mm_andnot_pd(_mm_set1_pd(-0.0), x)
+#define VDMAX(x, y) _mm_max_pd(x, y)
+#define VDMIN(x, y) _mm_min_pd(x, y)
+#define VDLE(x, y) _mm_cmple_pd(x, y)
+#define VDLT(x, y) _mm_cmplt_pd(x, y)
+#define VDNE(x, y) _mm_cmpneq_pd(x, y)
+#define VDSEL(m, x, y) _mm_or_pd(_mm_and_pd(m, x), _mm_andnot_pd(m, y))
+#ifdef __FMA__
+#define VDFMS(x, y, z) _mm_fmsub_pd(x, y, z)
+#endif
+
+static inline vdouble
+vd_cbrt0(vdouble v)
+{
+  __m128i hi = _mm_srli_epi64(_mm_castpd_si128(v), 32);
+  __m128i q = _mm_srli_epi64(
+      _mm_mul_epu32(hi, _mm_set1_epi64x(0xaaaaaaab)), 33);
+
+  return _mm_castsi128_pd(
+      _mm_slli_epi64(_mm_add_epi64(q, _mm_set1_epi64x(715094163)), 32));
+}
+#else
+#define VDLANES 1
+typedef double vdouble;
+typedef int vdmask;
+#define VDLOAD(p) (*(p))
+#define VDSTORE(p, x) (*(p) = (x))
+#define VDSET1(x) (x)
+#define VDADD(x, y) ((x) + (y))
+#define VDSUB(x, y) ((x) - (y))
+#define VDMUL(x, y) ((x) * (y))
+#define VDDIV(x, y) ((x) / (y))
+#define VDSQRT(x) sqrt(x)
+#define VDABS(x) fabs(x)
+#define VDMAX(x, y) ((x) > (y) ? (x) : (y))
+#define VDMIN(x, y) ((x) < (y) ? (x) : (y))
+#define VDLE(x, y) ((x) <= (y))
+#define VDLT(x, y) ((x) < (y))
+#define VDNE(x, y) ((x) != (y))
+#define VDSEL(m, x, y) ((m) ? (x) : (y))
+#ifdef __FMA__
+#define VDFMS(x, y, z) fma(x, y, -(z))
+#endif
+
+static inline vdouble
+vd_cbrt0(vdouble v)
+{
+  uint64_t u;
+
+  memcpy(&u, &v, sizeof(u));
+  u = ((u >> 32) / 3 + 715094163) << 32;
+  memcpy(&v, &u, sizeof(u));
+  return v;
+}
+#endif
+
+#define VDMULADD(x, y, z) VDADD(VDMUL(x, y), z)
+
+/* Double-double arithmetic for Q, R and the discriminant, which
+   SolveCubic forms in long double: a value is hi + lo, with lo at most
+   half an ulp of hi. The rounding error of a product comes from a fused
+   multiply-subtract where the target has one, else from Dekker's
+   splitting. */
+
+typedef struct
+{
+  vdouble hi, lo;
+} vdd;
+
+static inline vdouble
+vd_prod_err(vdouble a, vdouble b, vdouble p)
+{
+#ifdef VDFMS
+  return VDFMS(a, b, p);
+#else
+  vdouble k = VDSET1(134217729.0), ca = VDMUL(k, a), cb = VDMUL(k, b);
+  vdouble ah = VDSUB(ca, VDSUB(ca, a)), al = VDSUB(a, ah);
+  vdouble bh = VDSUB(cb, VDSUB(cb, b)), bl = VDSUB(b, bh);
+
+  return VDADD(VDADD(VDADD(VDSUB(VDMUL(ah, bh), p), VDMUL(ah, bl)),
+                     VDMUL(al, bh)),
+               VDMUL(al, bl));
+#endif
+}
+
+/* s + e for |s| >= |e|, renormalised. */
+
+static inline vdd
+vdd_norm(vdouble s, vdouble e)
+{
+  vdd r;
+
+  r.hi = VDADD(s, e);
+  r.lo = VDSUB(e, VDSUB(r.hi, s));
+  return r;
+}
+
+static inline vdd
+vdd_from(vdouble x)
+{
+  vdd r;
+
+  r.hi = x;
+  r.lo = VDSET1(0.0);
+  return r;
+}
+
+/* The exact product of two doubles. */
+
+static inline vdd
+vdd_prod(vdouble a, vdouble b)
+{
+  vdd r;
+
+  r.hi = VDMUL(a, b);
+  r.lo = vd_prod_err(a, b, r.hi);
+  return r;
+}
+
+static inline vdd
+vdd_add(vdd a, vdd b)
+{
+  vdouble s = VDADD(a.hi, b.hi), v = VDSUB(s, a.hi);
+  vdouble e = VDADD(VDSUB(a.hi, VDSUB(s, v)), VDSUB(b.hi, v));
+
+  return vdd_norm(s, VDADD(e, VDADD(a.lo, b.lo)));
+}
+
+static inline vdd
+vdd_mul(vdd a, vdd b)
+{
+  vdd p = vdd_prod(a.hi, b.hi);
+
+  return vdd_norm(p.hi, VDADD(p.lo, VDADD(VDMUL(a.hi, b.lo),
+                                          VDMUL(a.lo, b.hi))));
+}
+
+/* a times k, a power of two, exactly. */
+
+static inline vdd
+vdd_scale(vdd a, double k)
+{
+  a.hi = VDMUL(a.hi, VDSET1(k));
+  a.lo = VDMUL(a.lo, VDSET1(k));
+  return a;
+}
+
+/* Cube root of v > 0. */
+
+static inline vdouble
+vd_cbrt(vdouble v)
+{
+  vdouble y = vd_cbrt0(v), y3, v2 = VDADD(v, v);
+  int k;
+
+  for (k = 0; k < 3; k++)
+  {
+    y3 = VDMUL(VDMUL(y, y), y);
+    y = VDDIV(VDMUL(y, VDADD(y3, v2)), VDADD(VDADD(y3, y3), v));
+  }
+  return y;
+}
+
+/* asin x for |x| <= 0.5, x + x^3 P(x^2) / Q(x^2). */
+
+static inline vdouble
+vd_asin_small(vdouble x)
+{
+  vdouble z = VDMUL(x, x), p, q;
+
+  p = VDSET1(4.253011369004428248960E-3);
+  p = VDMULADD(p, z, VDSET1(-6.019598008014123785661E-1));
+  p = VDMULADD(p, z, VDSET1(5.444622390564711410273E0));
+  p = VDMULADD(p, z, VDSET1(-1.626247967210700244449E1));
+  p = VDMULADD(p, z, VDSET1(1.956261983317594739197E1));
+  p = VDMULADD(p, z, VDSET1(-8.198089802484824371615E0));
+  q = VDADD(z, VDSET1(-1.474091372988853791896E1));
+  q = VDMULADD(q, z, VDSET1(7.049610280856842141659E1));
+  q = VDMULADD(q, z, VDSET1(-1.471791292232726029859E2));
+  q = VDMULADD(q, z, VDSET1(1.395105614657485689735E2));
+  q = VDMULADD(q, z, VDSET1(-4.918853881490881290097E1));
+  return VDADD(x, VDMUL(VDMUL(x, z), VDDIV(p, q)));
+}
+
+/* acos t for t in [-1, 1]. */
+
+static inline vdouble
+vd_acos(vdouble t)
+{
+  vdouble at = VDABS(t), half = VDSET1(0.5);
+  vdmask big = VDLT(half, at);
+  vdouble s = VDSEL(big, VDSQRT(VDMUL(half, VDSUB(VDSET1(1.0), at))), t);
+  vdouble y = vd_asin_small(s), twice = VDADD(y, y);
+
+  return VDSEL(big,
+               VDSEL(VDLT(t, VDSET1(0.0)), VDSUB(VDSET1(CUBIC_PI), twice),
+                     twice),
+               VDSUB(VDSET1(CUBIC_PI / 2), y));
+}
+
+/* cos and sin of x in [0, pi / 3]. */
+
+static inline void
+vd_cossin(vdouble x, vdouble *c, vdouble *s)
+{
+  vdouble z = VDMUL(x, x), pc, ps;
+
+  pc = VDSET1(-1.5619206968586225e-16);
+  pc = VDMULADD(pc, z, VDSET1(4.779477332387385e-14));
+  pc = VDMULADD(pc, z, VDSET1(-1.1470745597729725e-11));
+  pc = VDMULADD(pc, z, VDSET1(2.08767569878681e-09));
+  pc = VDMULADD(pc, z, VDSET1(-2.755731922398589e-07));
+  pc = VDMULADD(pc, z, VDSET1(2.48015873015873e-05));
+  pc = VDMULADD(pc, z, VDSET1(-0.001388888888888889));
+  pc = VDMULADD(pc, z, VDSET1(0.041666666666666664));
+  pc = VDMULADD(pc, z, VDSET1(-0.5));
+  *c = VDMULADD(pc, z, VDSET1(1.0));
+
+  ps = VDSET1(-8.22063524662433e-18);
+  ps = VDMULADD(ps, z, VDSET1(2.8114572543455206e-15));
+  ps = VDMULADD(ps, z, VDSET1(-7.647163731819816e-13));
+  ps = VDMULADD(ps, z, VDSET1(1.6059043836821613e-10));
+  ps = VDMULADD(ps, z, VDSET1(-2.505210838544172e-08));
+  ps = VDMULADD(ps, z, VDSET1(2.7557319223985893e-06));
+  ps = VDMULADD(ps, z, VDSET1(-0.0001984126984126984));
+  ps = VDMULADD(ps, z, VDSET1(0.008333333333333333));
+  ps = VDMULADD(ps, z, VDSET1(-0.16666666666666666));
+  *s = VDMUL(x, VDMULADD(ps, z, VDSET1(1.0)));
+}
+
+/* x^3 + a1 x^2 + a2 x + a3, evaluated in double-double: near a root it
+   is mostly cancellation, and in double it would be noise wherever the
+   root is ill-conditioned. */
+
+static inline vdouble
+vd_cubic(vdouble x, vdouble a1, vdouble a2, vdouble a3)
+{
+  vdd xx = vdd_from(x), h = vdd_add(xx, vdd_from(a1));
+
+  h = vdd_add(vdd_mul(h, xx), vdd_from(a2));
+  return vdd_add(vdd_mul(h, xx), vdd_from(a3)).hi;
+}
+
+/* x - f(x) / f'(x) for f(x) = x^3 + a1 x^2 + a2 x + a3. The step is kept
+   only where f' != 0 and it does not increase |f|, so a root that is
+   near a double root, where Newton can jump far away, is left as it
+   is. */
+
+static inline vdouble
+vd_newton(vdouble x, vdouble a1, vdouble a2, vdouble a3)
+{
+  vdouble f = vd_cubic(x, a1, a2, a3), xn;
+  vdouble df = VDMULADD(VDMULADD(VDSET1(3.0), x, VDADD(a1, a1)), x, a2);
+  vdmask ok = VDNE(df, VDSET1(0.0)), better;
+
+  xn = VDSUB(x, VDDIV(f, VDSEL(ok, df, VDSET1(1.0))));
+  better = VDLE(VDABS(vd_cubic(xn, a1, a2, a3)), VDABS(f));
+  return VDSEL(ok, VDSEL(better, xn, x), x);
+}
+
+static void
+SolveCubicLanes(const double *a, const double *b, const double *c,
+                const double *d, double *nsol, double *x0, double *x1,
+                double *x2, int polish)
+{
+  vdouble va = VDLOAD(a), zero = VDSET1(0.0), one = VDSET1(1.0);
+  vdouble a1 = VDDIV(VDLOAD(b), va), a2 = VDDIV(VDLOAD(c), va);
+  vdouble a3 = VDDIV(VDLOAD(d), va), a1_3 = VDDIV(a1, VDSET1(3.0));
+
+  /* 9 Q = a1^2 - 3 a2, 54 R = 2 a1^3 - 9 a1 a2 + 27 a3 and
+     2916 (R^2 - Q^3) = (54 R)^2 - 4 (9 Q)^3, in double-double. */
+  vdd a1sq = vdd_prod(a1, a1);
+  vdd Q9 = vdd_add(a1sq, vdd_prod(VDSET1(-3.0), a2));
+  vdd R54 = vdd_add(vdd_add(vdd_scale(vdd_mul(a1sq, vdd_from(a1)), 2.0),
+                            vdd_mul(vdd_prod(a1, a2), vdd_from(VDSET1(-9.0)))),
+                    vdd_prod(VDSET1(27.0), a3));
+  vdd Q9_3 = vdd_mul(vdd_mul(Q9, Q9), Q9);
+  vdd D2916 = vdd_add(vdd_mul(R54, R54), vdd_scale(Q9_3, -4.0));
+  vdouble Q = VDDIV(Q9.hi, VDSET1(9.0)), R = VDDIV(R54.hi, VDSET1(54.0));
+  vdouble D = VDDIV(D2916.hi, VDSET1(2916.0));
+  vdmask three = VDLE(D, zero);
+  vdouble sq, t, cs, sn, m, r0, r1, r2, A, u;
+  vdouble nan = VDSET1(NAN);
+  int k;
+
+  /* Three real roots; Q and t clamped so the other lanes stay finite.
+     R / sqrt(Q^3) is 54 R / (2 sqrt((9 Q)^3)). */
+  sq = VDSQRT(VDMAX(Q, zero));
+  t = VDDIV(R54.hi,
+            VDMUL(VDSET1(2.0), VDSQRT(VDMAX(Q9_3.hi, VDSET1(1e-300)))));
+  t = VDMAX(VDMIN(t, one), VDSET1(-1.0));
+  vd_cossin(VDDIV(vd_acos(t), VDSET1(3.0)), &cs, &sn);
+  m = VDMUL(VDSET1(-2.0), sq);
+  sn = VDMUL(sn, VDSET1(0.86602540378443864676));
+  cs = VDMUL(cs, VDSET1(0.5));
+  r0 = VDSUB(VDMUL(m, VDADD(cs, cs)), a1_3);
+  r1 = VDSUB(VDMUL(m, VDSUB(VDSUB(zero, cs), sn)), a1_3);
+  r2 = VDSUB(VDMUL(m, VDSUB(sn, cs)), a1_3);
+
+  /* One real root. */
+  A = vd_cbrt(VDMAX(VDADD(VDSQRT(VDMAX(D, zero)), VDABS(R)),
+                    VDSET1(1e-300)));
+  u = VDADD(A, VDDIV(Q, A));
+  u = VDSUB(VDSEL(VDLT(R, zero), u, VDSUB(zero, u)), a1_3);
+
+  r0 = VDSEL(three, r0, u);
+  for (k = 0; k < polish; k++)
+  {
+    r0 = vd_newton(r0, a1, a2, a3);
+    r1 = vd_newton(r1, a1, a2, a3);
+    r2 = vd_newton(r2, a1, a2, a3);
+  }
+  VDSTORE(nsol, VDSEL(three, VDSET1(3.0), one));
+  VDSTORE(x0, r0);
+  VDSTORE(x1, VDSEL(three, r1, nan));
+  VDSTORE(x2, VDSEL(three, r2, nan));
+}
+
+void SolveCubicBatch(int count, const double *a, const double *b,
+                     const double *c, const double *d, int *solutions,
+                     double *x0, double *x1, double *x2, int polish)
+{
+  double ta[VDLANES], tb[VDLANES], tc[VDLANES], td[VDLANES];
+  double ns[VDLANES], t0[VDLANES], t1[VDLANES], t2[VDLANES];
+  int i = 0, k, rest;
+
+  for (; i + VDLANES <= count; i += VDLANES)
+  {
+    SolveCubicLanes(a + i, b + i, c + i, d + i, ns, x0 + i, x1 + i, x2 + i,
+                    polish);
+    for (k = 0; k < VDLANES; k++)
+      solutions[i + k] = (int)ns[k];
+  }
+
+  /* The tail, padded with x^3 - 1. */
+  rest = count - i;
+  if (rest > 0)
+  {
+    for (k = 0; k < VDLANES; k++)
+    {
+      ta[k] = k < rest ? a[i + k] : 1.0;
+      tb[k] = k < rest ? b[i + k] : 0.0;
+      tc[k] = k < rest ? c[i + k] : 0.0;
+      td[k] = k < rest ? d[i + k] : -1.0;
+    }
+    SolveCubicLanes(ta, tb, tc, td, ns, t0, t1, t2, polish);
+    for (k = 0; k < rest; k++)
+    {
+      solutions[i + k] = (int)ns[k];
+      x0[i + k] = t0[k];
+      x1[i + k] = t1[k];
+      x2[i + k] = t2[k];
+    }
+  }
+}
+
+/* Fills a, b, c and d with count cubics with random real roots in
+   [-10, 10], odd ones with three and even ones with a complex pair in
+   place of two of them. roots, if not NULL, receives the three roots of
+   each, the last two NAN for a complex pair. */
+
+static void
+RandomCubics(int count, unsigned int seed, double *a, double *b, double *c,
+             double *d, double *roots)
+{
+  double r[3], q;
+  int i, k;
+
+  for (i = 0; i < count; i++)
+  {
+    for (k = 0; k < 3; k++)
+    {
+      seed = seed * 1103515245u + 12345u;
+      r[k] = (double)((seed >> 8) & 0xffff) / 3276.8 - 10.0;
+    }
+    a[i] = 1.0;
+    if (i & 1)
+    {
+      b[i] = -(r[0] + r[1] + r[2]);
+      c[i] = r[0] * r[1] + r[0] * r[2] + r[1] * r[2];
+      d[i] = -r[0] * r[1] * r[2];
+    }
+    else
+    {
+      q = r[1] * r[1] + r[2] * r[2] + 1.0;
+      b[i] = -(r[0] + 2 * r[1]);
+      c[i] = 2 * r[1] * r[0] + q;
+      d[i] = -r[0] * q;
+      r[1] = r[2] = NAN;
+    }
+    if (roots != NULL)
+      for (k = 0; k < 3; k++)
+        roots[3 * i + k] = r[k];
+  }
+}
+
+/* ---------------------------- benchmark ---------------------------- */
+
+#ifdef BENCHMARK
+
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define BENCH_COUNT 4096
+
+/* Solves per second of SolveCubic and of SolveCubicBatch with 0 and 1
+   Newton steps, on the cubics RandomCubics makes. */
+
+static void
+benchmark(void)
+{
+  static double a[BENCH_COUNT], b[BENCH_COUNT], c[BENCH_COUNT];
+  static double d[BENCH_COUNT], x0[BENCH_COUNT], x1[BENCH_COUNT];
+  static double x2[BENCH_COUNT];
+  static int ns[BENCH_COUNT];
+  double x[3], t0, t, sink = 0;
+  int i, k, reps = 200, rep, n;
+
+  RandomCubics(BENCH_COUNT, 1, a, b, c, d, NULL);
+
+  t0 = now_seconds();
+  for (rep = 0; rep < reps; rep++)
+    for (i = 0; i < BENCH_COUNT; i++)
+    {
+      SolveCubic(a[i], b[i], c[i], d[i], &n, x);
+      sink += x[0];
+    }
+  t = now_seconds() - t0;
+  printf("SolveCubic:             %8.2f M solves/s\n",
+         (double)reps * BENCH_COUNT / t * 1e-6);
+
+  for (k = 0; k < 2; k++)
+  {
+    t0 = now_seconds();
+    for (rep = 0; rep < reps; rep++)
+    {
+      SolveCubicBatch(BENCH_COUNT, a, b, c, d, ns, x0, x1, x2, k);
+      sink += x0[rep];
+    }
+    t = now_seconds() - t0;
+    printf("SolveCubicBatch, %d step: %8.2f M solves/s\n", k,
+           (double)reps * BENCH_COUNT / t * 1e-6);
+  }
+  printf("checksum: %g\n", sink);
+}
+
+#endif
+
 /* ------------------------------ main ------------------------------ */
 
 int main()
@@ -107,10 +689,97 @@ int main()
   const double exp_res1 = 2.5;
   res = (3 == soln_cnt0) && double_eq_beebs(exp_res0[0], res0[0]) && double_eq_beebs(exp_res0[1], res0[1]) && double_eq_beebs(exp_res0[2], res0[2]) && (1 == soln_cnt1) && double_eq_beebs(exp_res1, res1);
 
+  /* SolveCubicBatch on the same equations, with and without a Newton
+     step, agrees with SolveCubic. */
+  {
+    double ba[BATCH_CHECK], bb[BATCH_CHECK], bc[BATCH_CHECK];
+    double bd[BATCH_CHECK], x0[BATCH_CHECK], x1[BATCH_CHECK];
+    double x2[BATCH_CHECK], x[3];
+    double a1, b1, c1, d1;
+    int ns[BATCH_CHECK], n = 0, polish, solutions;
+
+    static const double fixed[4][4] = {{1.0, -10.5, 32.0, -30.0},
+                                       {1.0, -4.5, 17.0, -30.0},
+                                       {1.0, -3.5, 22.0, -31.0},
+                                       {1.0, -13.7, 1.0, -35.0}};
+
+    for (n = 0; n < 4; n++)
+    {
+      ba[n] = fixed[n][0];
+      bb[n] = fixed[n][1];
+      bc[n] = fixed[n][2];
+      bd[n] = fixed[n][3];
+    }
+    for (a1 = 1; a1 < 3; a1++)
+      for (b1 = 10; b1 > 8; b1--)
+        for (c1 = 5; c1 < 6; c1 += 0.5)
+          for (d1 = -1; d1 > -3; d1--, n++)
+          {
+            ba[n] = a1;
+            bb[n] = b1;
+            bc[n] = c1;
+            bd[n] = d1;
+          }
+
+    for (polish = 0; polish < 2; polish++)
+    {
+      SolveCubicBatch(n, ba, bb, bc, bd, ns, x0, x1, x2, polish);
+      for (i = 0; i < n; i++)
+      {
+        SolveCubic(ba[i], bb[i], bc[i], bd[i], &solutions, x);
+        res &= solutions == ns[i] && double_eq_beebs(x[0], x0[i]);
+        if (solutions == 3)
+          res &= double_eq_beebs(x[1], x1[i]) &&
+                 double_eq_beebs(x[2], x2[i]);
+      }
+    }
+  }
+
+  /* And on random equations, where the tolerance is BATCH_EPS relative:
+     with ill-conditioned roots SolveCubic itself is off by about
+     2e-13. With a Newton step the batch roots are also checked against
+     the roots the equations were made from. */
+  {
+    static double ra[BATCH_RANDOM], rb[BATCH_RANDOM], rc[BATCH_RANDOM];
+    static double rd[BATCH_RANDOM], rx0[BATCH_RANDOM], rx1[BATCH_RANDOM];
+    static double rx2[BATCH_RANDOM], roots[3 * BATCH_RANDOM];
+    static int rns[BATCH_RANDOM];
+    double x[3], *bx[3];
+    int polish, solutions, k, j, found;
+
+    RandomCubics(BATCH_RANDOM, 12345, ra, rb, rc, rd, roots);
+    bx[0] = rx0;
+    bx[1] = rx1;
+    bx[2] = rx2;
+    for (polish = 0; polish < 2; polish++)
+    {
+      SolveCubicBatch(BATCH_RANDOM, ra, rb, rc, rd, rns, rx0, rx1, rx2,
+                      polish);
+      for (i = 0; i < BATCH_RANDOM; i++)
+      {
+        SolveCubic(ra[i], rb[i], rc[i], rd[i], &solutions, x);
+        res &= solutions == rns[i];
+        for (k = 0; k < solutions && res; k++)
+          res &= batch_eq(x[k], bx[k][i]);
+        for (k = 0; k < 3 && polish > 0 && res; k++)
+          if (!isnan(roots[3 * i + k]))
+          {
+            for (j = 0, found = 0; j < rns[i]; j++)
+              found |= batch_eq(roots[3 * i + k], bx[j][i]);
+            res &= found;
+          }
+      }
+    }
+  }
+
   correct = res == 1 ? 1 : 0;
 
   printf("The result is: %d\n", correct);
 
+#ifdef BENCHMARK
+  benchmark();
+#endif
+
   return 0;
 }
 
@@ -37,6 +37,17 @@
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EDN_X86 1
+#include <immintrin.h>
+#endif
+
+#include <stdlib.h>
+
+#ifdef BENCHMARK
+#include <time.h>
+#endif
+
 #define N 100
 #define ORDER 50
 
@@ -238,6 +249,738 @@ void jpegdct(short *d, short *r)
   }
 }
 
+/*****************************************************
+ *		Kernel sets		     *
+ *****************************************************/
+
+/*
+ * vec_mpy1, mac, fir, fir_no_red_ld and jpegdct for any length, in
+ * scalar C and with SSE2 and AVX2, the vector versions giving the same
+ * bits as the scalar ones for every input. A kernel set is chosen at
+ * run time from what the CPU supports; edn_kernels() returns the best.
+ *
+ * The products of 16-bit data are formed with pmaddwd, two products
+ * summed in each 32-bit lane, and widened to 64 bits before they are
+ * accumulated, as the long accumulators are. A pair sum can only
+ * overflow 32 bits when all four operands are -32768, giving exactly
+ * 2^31, which reads back as INT_MIN; since no true pair sum is as low
+ * as that, INT_MIN lanes are widened as +2^31. jpegdct works across
+ * the eight rows and then the eight columns of a block in 32-bit lanes:
+ * every result is cut to 16 bits before or after a shift of at most 16,
+ * so the low 32 bits of each intermediate are enough.
+ *
+ * latsynth and iir1 stay scalar: each step of their recurrences takes
+ * the 64-bit result of the step before. So does codebook, whose loop
+ * body is empty.
+ */
+
+void vec_mpy1_n(short y[], const short x[], short scaler, long int n)
+{
+  long int i;
+
+  for (i = 0; i < n; i++)
+    y[i] += ((scaler * x[i]) >> 15);
+}
+
+long int
+mac_n(const short *a, const short *b, long int n, long int sqr,
+      long int *sum)
+{
+  long int i;
+  long int dotp = *sum;
+
+  for (i = 0; i < n; i++)
+  {
+    dotp += b[i] * a[i];
+    sqr += b[i] * b[i];
+  }
+
+  *sum = dotp;
+  return sqr;
+}
+
+/* nout outputs of an order tap filter. */
+void fir_n(const short array1[], const short coeff[], long int output[],
+           long int nout, long int order)
+{
+  long int i, j, sum;
+
+  for (i = 0; i < nout; i++)
+  {
+    sum = 0;
+    for (j = 0; j < order; j++)
+      sum += array1[i + j] * coeff[j];
+    output[i] = sum >> 15;
+  }
+}
+
+/* fir_no_red_ld for an even number of outputs and of taps. */
+void fir_no_red_ld_n(const short x[], const short h[], long int y[],
+                     long int nout, long int taps)
+{
+  long int i, j;
+  long int sum0, sum1;
+  short x0, x1, h0, h1;
+  for (j = 0; j < nout; j += 2)
+  {
+    sum0 = 0;
+    sum1 = 0;
+    x0 = x[j];
+    for (i = 0; i < taps; i += 2)
+    {
+      x1 = x[j + i + 1];
+      h0 = h[i];
+      sum0 += x0 * h0;
+      sum1 += x1 * h0;
+      x0 = x[j + i + 2];
+      h1 = h[i + 1];
+      sum0 += x1 * h1;
+      sum1 += x0 * h1;
+    }
+    y[j] = sum0 >> 15;
+    y[j + 1] = sum1 >> 15;
+  }
+}
+
+/* jpegdct on nblocks consecutive 8x8 blocks. */
+void jpegdct_n(short *d, short *r, long int nblocks)
+{
+  long int i;
+
+  for (i = 0; i < nblocks; i++)
+    jpegdct(d + 64 * i, r);
+}
+
+typedef struct
+{
+  const char *name;
+  int (*supported)(void);
+  void (*vec_mpy1)(short y[], const short x[], short scaler, long int n);
+  long int (*mac)(const short *a, const short *b, long int n, long int sqr,
+                  long int *sum);
+  void (*fir)(const short array1[], const short coeff[], long int output[],
+              long int nout, long int order);
+  void (*fir_no_red_ld)(const short x[], const short h[], long int y[],
+                        long int nout, long int taps);
+  void (*jpegdct)(short *d, short *r, long int nblocks);
+} EdnKernels;
+
+static int
+edn_always(void)
+{
+  return 1;
+}
+
+static const EdnKernels edn_scalar = {"scalar", edn_always, vec_mpy1_n,
+                                      mac_n, fir_n, fir_no_red_ld_n,
+                                      jpegdct_n};
+
+#ifdef EDN_X86
+
+/* One step of the 8x8 DCT in jpegdct, on the eight rows or columns of a
+   block at once: e[j] holds element j of each, o[j] receives it. V is
+   the vector type, with ADD, SUB, MUL by a 16-bit constant, SRA by a
+   count and SHORT, which cuts each lane to 16 bits. */
+
+#define EDN_DCT_PASS(V, ADD, SUB, MUL, SRA, SHORT, e, o, m, n, r)            \
+  do                                                                         \
+  {                                                                          \
+    V t0 = ADD(e[0], e[7]), t7 = SUB(e[0], e[7]);                            \
+    V t1 = ADD(e[1], e[6]), t6 = SUB(e[1], e[6]);                            \
+    V t2 = ADD(e[2], e[5]), t5 = SUB(e[2], e[5]);                            \
+    V t3 = ADD(e[3], e[4]), t4 = SUB(e[3], e[4]);                            \
+    V t8 = ADD(t0, t3), t9 = SUB(t0, t3);                                    \
+    V t10 = ADD(t1, t2), t11 = SUB(t1, t2);                                  \
+                                                                             \
+    o[0] = SRA(ADD(t8, t10), m);                                             \
+    o[4] = SRA(SUB(t8, t10), m);                                             \
+    t8 = MUL(SHORT(ADD(t11, t9)), r[10]);                                    \
+    o[2] = ADD(t8, SHORT(SRA(MUL(t9, r[9]), n)));                            \
+    o[6] = ADD(t8, SHORT(SRA(MUL(t11, r[11]), n)));                          \
+    t0 = MUL(SHORT(ADD(t4, t7)), r[2]);                                      \
+    t1 = MUL(SHORT(ADD(t5, t6)), r[0]);                                      \
+    t2 = ADD(t4, t6);                                                        \
+    t3 = ADD(t5, t7);                                                        \
+    t8 = MUL(SHORT(ADD(t2, t3)), r[8]);                                      \
+    t2 = ADD(MUL(SHORT(t2), r[1]), t8);                                      \
+    t3 = ADD(MUL(SHORT(t3), r[3]), t8);                                      \
+    o[7] = SRA(SHORT(ADD(ADD(MUL(t4, r[4]), t0), t2)), n);                   \
+    o[5] = SRA(SHORT(ADD(ADD(MUL(t5, r[6]), t1), t3)), n);                   \
+    o[3] = SRA(SHORT(ADD(ADD(MUL(t6, r[5]), t1), t2)), n);                   \
+    o[1] = SRA(SHORT(ADD(ADD(MUL(t7, r[7]), t0), t3)), n);                   \
+  } while (0)
+
+/* Transposes the 8x8 block of 16-bit elements in x. */
+
+#define EDN_TRANSPOSE8(x)                                                    \
+  do                                                                         \
+  {                                                                          \
+    __m128i a0 = _mm_unpacklo_epi16(x[0], x[1]);                             \
+    __m128i a1 = _mm_unpackhi_epi16(x[0], x[1]);                             \
+    __m128i a2 = _mm_unpacklo_epi16(x[2], x[3]);                             \
+    __m128i a3 = _mm_unpackhi_epi16(x[2], x[3]);                             \
+    __m128i a4 = _mm_unpacklo_epi16(x[4], x[5]);                             \
+    __m128i a5 = _mm_unpackhi_epi16(x[4], x[5]);                             \
+    __m128i a6 = _mm_unpacklo_epi16(x[6], x[7]);                             \
+    __m128i a7 = _mm_unpackhi_epi16(x[6], x[7]);                             \
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);                                 \
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);                                 \
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);                                 \
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);                                 \
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);                                 \
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);                                 \
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);                                 \
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);                                 \
+    x[0] = _mm_unpacklo_epi64(b0, b4);                                       \
+    x[1] = _mm_unpackhi_epi64(b0, b4);                                       \
+    x[2] = _mm_unpacklo_epi64(b1, b5);                                       \
+    x[3] = _mm_unpackhi_epi64(b1, b5);                                       \
+    x[4] = _mm_unpacklo_epi64(b2, b6);                                       \
+    x[5] = _mm_unpackhi_epi64(b2, b6);                                       \
+    x[6] = _mm_unpacklo_epi64(b3, b7);                                       \
+    x[7] = _mm_unpackhi_epi64(b3, b7);                                       \
+  } while (0)
+
+/* ------------------------------ SSE2 ------------------------------ */
+
+#define EDN_SSE2 __attribute__((target("sse2")))
+
+static int
+edn_has_sse2(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+}
+
+/* The pair sums of pmaddwd, as 64-bit lanes added to acc. */
+
+static inline EDN_SSE2 __m128i
+edn_widen_sse2(__m128i acc, __m128i p)
+{
+  __m128i sign = _mm_andnot_si128(
+      _mm_cmpeq_epi32(p, _mm_set1_epi32((int)0x80000000u)),
+      _mm_srai_epi32(p, 31));
+
+  acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(p, sign));
+  return _mm_add_epi64(acc, _mm_unpackhi_epi32(p, sign));
+}
+
+static inline EDN_SSE2 long int
+edn_hsum_sse2(__m128i acc)
+{
+  long long lane[2];
+
+  _mm_storeu_si128((__m128i *)lane, acc);
+  return (long int)(lane[0] + lane[1]);
+}
+
+/* sum x[i] c[i] over n. */
+
+static inline EDN_SSE2 long int
+edn_dot_sse2(const short *x, const short *c, long int n)
+{
+  __m128i acc = _mm_setzero_si128();
+  long int i, sum;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    acc = edn_widen_sse2(
+        acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(x + i)),
+                            _mm_loadu_si128((const __m128i *)(c + i))));
+  sum = edn_hsum_sse2(acc);
+  for (; i < n; i++)
+    sum += x[i] * c[i];
+  return sum;
+}
+
+static EDN_SSE2 void
+vec_mpy1_sse2(short y[], const short x[], short scaler, long int n)
+{
+  __m128i s = _mm_set1_epi16(scaler);
+  long int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(x + i));
+    __m128i lo = _mm_mullo_epi16(v, s), hi = _mm_mulhi_epi16(v, s);
+
+    /* Bits 15 .. 30 of each product. */
+    v = _mm_or_si128(_mm_slli_epi16(hi, 1), _mm_srli_epi16(lo, 15));
+    _mm_storeu_si128((__m128i *)(y + i),
+                     _mm_add_epi16(_mm_loadu_si128((__m128i *)(y + i)), v));
+  }
+  for (; i < n; i++)
+    y[i] += ((scaler * x[i]) >> 15);
+}
+
+static EDN_SSE2 long int
+mac_sse2(const short *a, const short *b, long int n, long int sqr,
+         long int *sum)
+{
+  __m128i dotp = _mm_setzero_si128(), sq = _mm_setzero_si128();
+  long int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+    dotp = edn_widen_sse2(dotp, _mm_madd_epi16(vb, va));
+    sq = edn_widen_sse2(sq, _mm_madd_epi16(vb, vb));
+  }
+  *sum += edn_hsum_sse2(dotp);
+  sqr += edn_hsum_sse2(sq);
+  for (; i < n; i++)
+  {
+    *sum += b[i] * a[i];
+    sqr += b[i] * b[i];
+  }
+  return sqr;
+}
+
+static EDN_SSE2 void
+fir_sse2(const short array1[], const short coeff[], long int output[],
+         long int nout, long int order)
+{
+  long int i;
+
+  for (i = 0; i < nout; i++)
+    output[i] = edn_dot_sse2(array1 + i, coeff, order) >> 15;
+}
+
+static EDN_SSE2 void
+fir_no_red_ld_sse2(const short x[], const short h[], long int y[],
+                   long int nout, long int taps)
+{
+  fir_sse2(x, h, y, nout, taps);
+}
+
+static inline EDN_SSE2 __m128i
+edn_mul32_sse2(__m128i x, short r)
+{
+  __m128i k = _mm_set1_epi32(r);
+  __m128i even = _mm_mul_epu32(x, k);
+  __m128i odd = _mm_mul_epu32(_mm_srli_si128(x, 4), k);
+
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+#define EDN_SHORT_SSE2(x) _mm_srai_epi32(_mm_slli_epi32(x, 16), 16)
+#define EDN_SRA_SSE2(x, c) _mm_sra_epi32(x, _mm_cvtsi32_si128(c))
+
+/* Both passes of the DCT over the eight vectors of 16-bit x, four
+   lanes at a time. */
+
+static inline EDN_SSE2 void
+edn_dct_pass_sse2(__m128i x[8], int m, int n, const short *r)
+{
+  __m128i e[8], o[8], h[8];
+  int j;
+
+  for (j = 0; j < 8; j++)
+    e[j] = _mm_srai_epi32(_mm_unpacklo_epi16(x[j], x[j]), 16);
+  EDN_DCT_PASS(__m128i, _mm_add_epi32, _mm_sub_epi32, edn_mul32_sse2,
+               EDN_SRA_SSE2, EDN_SHORT_SSE2, e, o, m, n, r);
+  for (j = 0; j < 8; j++)
+    e[j] = _mm_srai_epi32(_mm_unpackhi_epi16(x[j], x[j]), 16);
+  EDN_DCT_PASS(__m128i, _mm_add_epi32, _mm_sub_epi32, edn_mul32_sse2,
+               EDN_SRA_SSE2, EDN_SHORT_SSE2, e, h, m, n, r);
+  for (j = 0; j < 8; j++)
+    x[j] = _mm_packs_epi32(EDN_SHORT_SSE2(o[j]), EDN_SHORT_SSE2(h[j]));
+}
+
+static EDN_SSE2 void
+jpegdct_sse2(short *d, short *r, long int nblocks)
+{
+  __m128i x[8];
+  long int b;
+  int j;
+
+  for (b = 0; b < nblocks; b++, d += 64)
+  {
+    for (j = 0; j < 8; j++)
+      x[j] = _mm_loadu_si128((const __m128i *)(d + 8 * j));
+    EDN_TRANSPOSE8(x);
+    edn_dct_pass_sse2(x, 0, 13, r);
+    EDN_TRANSPOSE8(x);
+    edn_dct_pass_sse2(x, 3, 16, r);
+    for (j = 0; j < 8; j++)
+      _mm_storeu_si128((__m128i *)(d + 8 * j), x[j]);
+  }
+}
+
+static const EdnKernels edn_sse2 = {"sse2", edn_has_sse2, vec_mpy1_sse2,
+                                    mac_sse2, fir_sse2, fir_no_red_ld_sse2,
+                                    jpegdct_sse2};
+
+/* ------------------------------ AVX2 ------------------------------ */
+
+#define EDN_AVX2 __attribute__((target("avx2")))
+
+static int
+edn_has_avx2(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static inline EDN_AVX2 __m256i
+edn_widen_avx2(__m256i acc, __m256i p)
+{
+  __m256i sign = _mm256_andnot_si256(
+      _mm256_cmpeq_epi32(p, _mm256_set1_epi32((int)0x80000000u)),
+      _mm256_srai_epi32(p, 31));
+
+  acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(p, sign));
+  return _mm256_add_epi64(acc, _mm256_unpackhi_epi32(p, sign));
+}
+
+static inline EDN_AVX2 long int
+edn_hsum_avx2(__m256i acc)
+{
+  long long lane[4];
+
+  _mm256_storeu_si256((__m256i *)lane, acc);
+  return (long int)(lane[0] + lane[1] + lane[2] + lane[3]);
+}
+
+static inline EDN_AVX2 long int
+edn_dot_avx2(const short *x, const short *c, long int n)
+{
+  __m256i acc = _mm256_setzero_si256();
+  long int i, sum;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    acc = edn_widen_avx2(
+        acc, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(x + i)),
+                               _mm256_loadu_si256((const __m256i *)(c + i))));
+  sum = edn_hsum_avx2(acc);
+  for (; i < n; i++)
+    sum += x[i] * c[i];
+  return sum;
+}
+
+static EDN_AVX2 void
+vec_mpy1_avx2(short y[], const short x[], short scaler, long int n)
+{
+  __m256i s = _mm256_set1_epi16(scaler);
+  long int i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(x + i));
+    __m256i lo = _mm256_mullo_epi16(v, s), hi = _mm256_mulhi_epi16(v, s);
+
+    v = _mm256_or_si256(_mm256_slli_epi16(hi, 1), _mm256_srli_epi16(lo, 15));
+    _mm256_storeu_si256(
+        (__m256i *)(y + i),
+        _mm256_add_epi16(_mm256_loadu_si256((__m256i *)(y + i)), v));
+  }
+  for (; i < n; i++)
+    y[i] += ((scaler * x[i]) >> 15);
+}
+
+static EDN_AVX2 long int
+mac_avx2(const short *a, const short *b, long int n, long int sqr,
+         long int *sum)
+{
+  __m256i dotp = _mm256_setzero_si256(), sq = _mm256_setzero_si256();
+  long int i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+
+    dotp = edn_widen_avx2(dotp, _mm256_madd_epi16(vb, va));
+    sq = edn_widen_avx2(sq, _mm256_madd_epi16(vb, vb));
+  }
+  *sum += edn_hsum_avx2(dotp);
+  sqr += edn_hsum_avx2(sq);
+  for (; i < n; i++)
+  {
+    *sum += b[i] * a[i];
+    sqr += b[i] * b[i];
+  }
+  return sqr;
+}
+
+static EDN_AVX2 void
+fir_avx2(const short array1[], const short coeff[], long int output[],
+         long int nout, long int order)
+{
+  long int i;
+
+  for (i = 0; i < nout; i++)
+    output[i] = edn_dot_avx2(array1 + i, coeff, order) >> 15;
+}
+
+static EDN_AVX2 void
+fir_no_red_ld_avx2(const short x[], const short h[], long int y[],
+                   long int nout, long int taps)
+{
+  fir_avx2(x, h, y, nout, taps);
+}
+
+#define EDN_MUL_AVX2(x, c) _mm256_mullo_epi32(x, _mm256_set1_epi32(c))
+#define EDN_SHORT_AVX2(x) _mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16)
+#define EDN_SRA_AVX2(x, c) _mm256_sra_epi32(x, _mm_cvtsi32_si128(c))
+
+static inline EDN_AVX2 void
+edn_dct_pass_avx2(__m128i x[8], int m, int n, const short *r)
+{
+  __m256i e[8], o[8];
+  int j;
+
+  for (j = 0; j < 8; j++)
+    e[j] = _mm256_cvtepi16_epi32(x[j]);
+  EDN_DCT_PASS(__m256i, _mm256_add_epi32, _mm256_sub_epi32, EDN_MUL_AVX2,
+               EDN_SRA_AVX2, EDN_SHORT_AVX2, e, o, m, n, r);
+  for (j = 0; j < 8; j++)
+  {
+    __m256i v = EDN_SHORT_AVX2(o[j]);
+
+    x[j] = _mm_packs_epi32(_mm256_castsi256_si128(v),
+                           _mm256_extracti128_si256(v, 1));
+  }
+}
+
+static EDN_AVX2 void
+jpegdct_avx2(short *d, short *r, long int nblocks)
+{
+  __m128i x[8];
+  long int b;
+  int j;
+
+  for (b = 0; b < nblocks; b++, d += 64)
+  {
+    for (j = 0; j < 8; j++)
+      x[j] = _mm_loadu_si128((const __m128i *)(d + 8 * j));
+    EDN_TRANSPOSE8(x);
+    edn_dct_pass_avx2(x, 0, 13, r);
+    EDN_TRANSPOSE8(x);
+    edn_dct_pass_avx2(x, 3, 16, r);
+    for (j = 0; j < 8; j++)
+      _mm_storeu_si128((__m128i *)(d + 8 * j), x[j]);
+  }
+}
+
+static const EdnKernels edn_avx2 = {"avx2", edn_has_avx2, vec_mpy1_avx2,
+                                    mac_avx2, fir_avx2, fir_no_red_ld_avx2,
+                                    jpegdct_avx2};
+
+#endif /* EDN_X86 */
+
+/* Every kernel set, slowest first. */
+static const EdnKernels *const edn_sets[] = {
+    &edn_scalar,
+#ifdef EDN_X86
+    &edn_sse2,
+    &edn_avx2,
+#endif
+};
+
+#define EDN_SETS ((int)(sizeof(edn_sets) / sizeof(edn_sets[0])))
+
+/* The fastest kernel set the CPU supports. */
+const EdnKernels *
+edn_kernels(void)
+{
+  int k;
+
+  for (k = EDN_SETS - 1; k > 0; k--)
+    if (edn_sets[k]->supported())
+      break;
+  return edn_sets[k];
+}
+
+/*****************************************************
+ *		Streaming filters		     *
+ *****************************************************/
+
+/*
+ * fir and iir1 as filter objects that keep their delay lines between
+ * calls, so a continuous signal can be filtered in blocks of any size.
+ * Input and output are interleaved frames of channels samples.
+ *
+ * Output n of a FirStream is fir's sum over the order inputs ending at
+ * input n, with the inputs before the first taken as 0. Each channel's
+ * history is a line of order - 1 + EDN_STREAM_SPAN samples that new
+ * input is appended to, so the fir kernel reads every window in place;
+ * the last order - 1 samples are moved back to the front only when the
+ * line fills, once per EDN_STREAM_SPAN samples, not once per call.
+ *
+ * Output n of an IirStream is what iir1 gives for input n with the
+ * state the previous inputs left. Each block runs section by section
+ * with the two states of the section in registers.
+ */
+
+#define EDN_STREAM_SPAN 4096
+
+typedef struct
+{
+  const short *coeff; /* order taps, as fir */
+  int order, channels;
+  long int fill;      /* Samples in each line. */
+  short *line;        /* channels lines of order - 1 + EDN_STREAM_SPAN */
+  long int *work;     /* EDN_STREAM_SPAN outputs of one channel */
+  const EdnKernels *k;
+} FirStream;
+
+typedef struct
+{
+  const short *coefs; /* 4 per section, as iir1 */
+  int sections, channels;
+  long int *state;    /* 2 per section, for each channel */
+  long int *work;     /* EDN_STREAM_SPAN samples of one channel */
+} IirStream;
+
+void fir_stream_reset(FirStream *f)
+{
+  f->fill = f->order - 1;
+  memset(f->line, 0, f->channels * (f->order - 1 + EDN_STREAM_SPAN)
+                         * sizeof(short));
+}
+
+void fir_stream_free(FirStream *f)
+{
+  free(f->line);
+  free(f->work);
+  f->line = NULL;
+  f->work = NULL;
+}
+
+/* Sets up f for coeff, which must outlive it. Returns 1, or 0 if out of
+   memory, in which case f holds nothing and fir_stream_free is a no-op. */
+int fir_stream_init(FirStream *f, const short *coeff, int order,
+                    int channels)
+{
+  f->coeff = coeff;
+  f->order = order;
+  f->channels = channels;
+  f->k = edn_kernels();
+  f->line = malloc(channels * (order - 1 + EDN_STREAM_SPAN) * sizeof(short));
+  f->work = malloc(EDN_STREAM_SPAN * sizeof(long int));
+  if (!f->line || !f->work)
+  {
+    fir_stream_free(f);
+    return 0;
+  }
+  fir_stream_reset(f);
+  return 1;
+}
+
+/* Filters frames frames of in into out. */
+void fir_stream_process(FirStream *f, const short *in, long int *out,
+                        long int frames)
+{
+  long int span = f->order - 1 + EDN_STREAM_SPAN;
+  int ch = f->channels, c;
+
+  while (frames > 0)
+  {
+    long int m = span - f->fill, i;
+
+    if (m == 0)
+    {
+      for (c = 0; c < ch; c++)
+        memmove(f->line + c * span, f->line + c * span + EDN_STREAM_SPAN,
+                (f->order - 1) * sizeof(short));
+      f->fill = f->order - 1;
+      continue;
+    }
+    if (m > frames)
+      m = frames;
+    for (c = 0; c < ch; c++)
+    {
+      short *line = f->line + c * span + f->fill;
+      long int *y = ch == 1 ? out : f->work;
+
+      for (i = 0; i < m; i++)
+        line[i] = in[i * ch + c];
+      f->k->fir(line - (f->order - 1), f->coeff, y, m, f->order);
+      if (ch > 1)
+        for (i = 0; i < m; i++)
+          out[i * ch + c] = y[i];
+    }
+    f->fill += m;
+    in += m * ch;
+    out += m * ch;
+    frames -= m;
+  }
+}
+
+void iir_stream_reset(IirStream *f)
+{
+  memset(f->state, 0, 2 * f->sections * f->channels * sizeof(long int));
+}
+
+void iir_stream_free(IirStream *f)
+{
+  free(f->state);
+  free(f->work);
+  f->state = NULL;
+  f->work = NULL;
+}
+
+/* Sets up f for coefs, which must outlive it. Returns 1, or 0 if out of
+   memory, in which case f holds nothing and iir_stream_free is a no-op. */
+int iir_stream_init(IirStream *f, const short *coefs, int sections,
+                    int channels)
+{
+  f->coefs = coefs;
+  f->sections = sections;
+  f->channels = channels;
+  f->state = malloc(2 * sections * channels * sizeof(long int));
+  f->work = malloc(EDN_STREAM_SPAN * sizeof(long int));
+  if (!f->state || !f->work)
+  {
+    iir_stream_free(f);
+    return 0;
+  }
+  iir_stream_reset(f);
+  return 1;
+}
+
+void iir_stream_process(IirStream *f, const short *in, long int *out,
+                        long int frames)
+{
+  int ch = f->channels, c, n;
+
+  while (frames > 0)
+  {
+    long int m = frames < EDN_STREAM_SPAN ? frames : EDN_STREAM_SPAN, i;
+
+    for (c = 0; c < ch; c++)
+    {
+      long int *x = f->work, *state = f->state + 2 * f->sections * c;
+      const short *coefs = f->coefs;
+
+      for (i = 0; i < m; i++)
+        x[i] = in[i * ch + c];
+      for (n = 0; n < f->sections; n++, coefs += 4, state += 2)
+      {
+        long int s0 = state[0], s1 = state[1], t;
+
+        for (i = 0; i < m; i++)
+        {
+          t = x[i] + ((coefs[2] * s0 + coefs[3] * s1) >> 15);
+          x[i] = t + ((coefs[0] * s0 + coefs[1] * s1) >> 15);
+          s1 = s0;
+          s0 = t;
+        }
+        state[0] = s0;
+        state[1] = s1;
+      }
+      for (i = 0; i < m; i++)
+        out[i * ch + c] = x[i];
+    }
+    in += m * ch;
+    out += m * ch;
+    frames -= m;
+  }
+}
+
   static short a[200];
   static short b[200];
   static short c;
@@ -245,11 +988,314 @@ void jpegdct(short *d, short *r)
   static int e;
   static long int output[200];
 
+/* Runs the steps of main with kernel set k on in_a and in_b, and checks
+   the results against the scalar ones left in output, c, d and e. */
+static int
+edn_check(const EdnKernels *k, const short unsigned int *in_a,
+          const short unsigned int *in_b)
+{
+  static short ka[200], kb[200];
+  static long int kout[200];
+  short kc = 0x3;
+  long int kd = 0xAAAA;
+  int ke = 0xEEEE;
+  int i;
+
+  for (i = 0; i < 200; i++)
+  {
+    ka[i] = in_a[i];
+    kb[i] = in_b[i];
+    kout[i] = 0;
+  }
+  k->vec_mpy1(ka, kb, kc, 150);
+  kc = k->mac(ka, kb, 150, (long int)kc, kout);
+  k->fir(ka, kb, kout, N - ORDER, ORDER);
+  k->fir_no_red_ld(ka, kb, kout, N, 32);
+  kd = latsynth(ka, kb, N, kd);
+  iir1(ka, kb, &kout[100], kout);
+  ke = codebook(kd, 1, 17, ke, kd, ka, kc, 1);
+  k->jpegdct(ka, kb, 1);
+  return 0 == memcmp(kout, output, sizeof(output)) && kc == c && kd == d
+         && ke == e && 0 == memcmp(ka, a, sizeof(a));
+}
+
+#define EDN_RANDOM_N 1000
+
+static unsigned int edn_seed;
+
+static short
+edn_random(void)
+{
+  edn_seed = edn_seed * 1103515245u + 12345u;
+  return (short)(edn_seed >> 16);
+}
+
+/* Checks kernel set k against the scalar one on full-range data, with
+   lengths that leave vector tails and a run of -32768 to reach the one
+   pair sum that overflows 32 bits. */
+static int
+edn_check_random(const EdnKernels *k)
+{
+  static short x[EDN_RANDOM_N + 64], h[64];
+  static short y0[EDN_RANDOM_N], y1[EDN_RANDOM_N];
+  static long int o0[EDN_RANDOM_N], o1[EDN_RANDOM_N];
+  long int n, s0, s1, q0, q1;
+  int ok = 1, i;
+
+  edn_seed = 12345;
+  for (i = 0; i < EDN_RANDOM_N + 64; i++)
+    x[i] = i >= 100 && i < 164 ? -32768 : edn_random();
+  for (i = 0; i < 64; i++)
+    h[i] = i < 16 ? -32768 : edn_random();
+  for (n = 1; n < EDN_RANDOM_N; n += n / 3 + 1)
+  {
+    for (i = 0; i < n; i++)
+      y0[i] = y1[i] = edn_random();
+    vec_mpy1_n(y0, x, -32768, n);
+    k->vec_mpy1(y1, x, -32768, n);
+    vec_mpy1_n(y0, x + 7, 12345, n);
+    k->vec_mpy1(y1, x + 7, 12345, n);
+    ok &= 0 == memcmp(y0, y1, n * sizeof(y0[0]));
+
+    s0 = s1 = 7;
+    q0 = mac_n(x, x + 100, n, 11, &s0);
+    q1 = k->mac(x, x + 100, n, 11, &s1);
+    ok &= q0 == q1 && s0 == s1;
+
+    fir_n(x, h, o0, n, 37);
+    k->fir(x, h, o1, n, 37);
+    ok &= 0 == memcmp(o0, o1, n * sizeof(o0[0]));
+
+    fir_no_red_ld_n(x, h, o0, n & ~1L, 32);
+    k->fir_no_red_ld(x, h, o1, n & ~1L, 32);
+    ok &= 0 == memcmp(o0, o1, (n & ~1L) * sizeof(o0[0]));
+  }
+  for (i = 0; i < EDN_RANDOM_N; i++)
+    y0[i] = y1[i] = x[i];
+  jpegdct_n(y0, h + 1, EDN_RANDOM_N / 64);
+  k->jpegdct(y1, h + 1, EDN_RANDOM_N / 64);
+  ok &= 0 == memcmp(y0, y1, sizeof(y0));
+  return ok;
+}
+
+#define EDN_STREAM_CHECK 10000
+
+/* Streams two interleaved channels through a FirStream and an IirStream
+   in blocks of changing size, across several wraps of the FIR lines, and
+   checks every output against fir_n on the zero-led signal and against
+   iir1 called sample by sample. */
+static int
+edn_check_stream(void)
+{
+  static short x[2][ORDER - 1 + EDN_STREAM_CHECK], in[2 * EDN_STREAM_CHECK];
+  static short h[ORDER], coefs[4 * 50];
+  static long int ref[EDN_STREAM_CHECK], out[2 * EDN_STREAM_CHECK];
+  static long int state[2][2 * 50];
+  FirStream fs;
+  IirStream is;
+  long int i, done, blk;
+  int c, ok;
+
+  edn_seed = 777;
+  for (i = 0; i < ORDER; i++)
+    h[i] = edn_random();
+  for (i = 0; i < 4 * 50; i++)
+    coefs[i] = edn_random() >> 4;
+  for (c = 0; c < 2; c++)
+    for (i = 0; i < EDN_STREAM_CHECK; i++)
+      in[2 * i + c] = x[c][ORDER - 1 + i] = edn_random();
+
+  ok = fir_stream_init(&fs, h, ORDER, 2);
+  ok &= iir_stream_init(&is, coefs, 50, 2);
+  for (done = 0, blk = 1; ok && done < EDN_STREAM_CHECK; done += blk)
+  {
+    blk = blk * 7 % 1999 + 1;
+    if (blk > EDN_STREAM_CHECK - done)
+      blk = EDN_STREAM_CHECK - done;
+    fir_stream_process(&fs, in + 2 * done, out + 2 * done, blk);
+  }
+  for (c = 0; ok && c < 2; c++)
+  {
+    fir_n(x[c], h, ref, EDN_STREAM_CHECK, ORDER);
+    for (i = 0; i < EDN_STREAM_CHECK; i++)
+      ok &= out[2 * i + c] == ref[i];
+  }
+
+  for (done = 0, blk = 1; ok && done < EDN_STREAM_CHECK; done += blk)
+  {
+    blk = blk * 5 % 4999 + 1;
+    if (blk > EDN_STREAM_CHECK - done)
+      blk = EDN_STREAM_CHECK - done;
+    iir_stream_process(&is, in + 2 * done, out + 2 * done, blk);
+  }
+  for (c = 0; ok && c < 2; c++)
+    for (i = 0; i < EDN_STREAM_CHECK; i++)
+    {
+      long int y;
+
+      iir1(coefs, &in[2 * i + c], &y, state[c]);
+      ok &= out[2 * i + c] == y;
+    }
+  fir_stream_free(&fs);
+  iir_stream_free(&is);
+  return ok;
+}
+
+#ifdef BENCHMARK
+
+#define BENCH_MAX_SAMPLES 1000000
+
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Samples per second of each primitive in each kernel set the CPU
+   supports, for 100 to BENCH_MAX_SAMPLES samples. */
+static void
+benchmark(void)
+{
+  static const char *const prim[] = {"vec_mpy1", "mac", "fir",
+                                     "fir_no_red_ld", "jpegdct"};
+  short *x = malloc((BENCH_MAX_SAMPLES + 64) * sizeof(short));
+  short *y = malloc((BENCH_MAX_SAMPLES + 64) * sizeof(short));
+  long int *o = malloc(BENCH_MAX_SAMPLES * sizeof(long int));
+  volatile long int sink = 0;
+  long int n, i, reps, r, sum;
+  int k, p;
+
+  if (!x || !y || !o)
+  {
+    free(x);
+    free(y);
+    free(o);
+    return;
+  }
+  edn_seed = 1;
+  for (i = 0; i < BENCH_MAX_SAMPLES + 64; i++)
+    x[i] = y[i] = edn_random() >> 2;
+
+  printf("\n%-14s %8s", "samples/s", "n");
+  for (k = 0; k < EDN_SETS; k++)
+    if (edn_sets[k]->supported())
+      printf(" %12s", edn_sets[k]->name);
+  printf("\n");
+  for (p = 0; p < 5; p++)
+    for (n = 100; n <= BENCH_MAX_SAMPLES; n *= 10)
+    {
+      printf("%-14s %8ld", prim[p], n);
+      for (k = 0; k < EDN_SETS; k++)
+      {
+        const EdnKernels *ks = edn_sets[k];
+        double t0, t;
+
+        if (!ks->supported())
+          continue;
+        reps = 4000000 / n + 1;
+        t0 = now_seconds();
+        for (r = 0; r < reps; r++)
+          switch (p)
+          {
+          case 0:
+            ks->vec_mpy1(y, x, 0x3, n);
+            break;
+          case 1:
+            sum = 0;
+            sink += ks->mac(x, y, n, 0, &sum) + sum;
+            break;
+          case 2:
+            ks->fir(x, y, o, n, ORDER);
+            break;
+          case 3:
+            ks->fir_no_red_ld(x, y, o, n, 32);
+            break;
+          default:
+            ks->jpegdct(y, x, n / 64);
+            break;
+          }
+        t = now_seconds() - t0;
+        printf(" %12.4g", (double)(p == 4 ? n / 64 * 64 : n) * reps / t);
+      }
+      printf("\n");
+    }
+  free(x);
+  free(y);
+  free(o);
+}
+
+
+#define BENCH_STREAM_CHANNELS 2
+#define BENCH_MAX_BLOCK 65536
+
+/* Time per block and samples per second of stereo FirStream and
+   IirStream filtering, for blocks of 16 to BENCH_MAX_BLOCK frames. */
+static void
+benchmark_stream(void)
+{
+  short *x = malloc(BENCH_STREAM_CHANNELS * BENCH_MAX_BLOCK * sizeof(short));
+  long int *y = malloc(BENCH_STREAM_CHANNELS * BENCH_MAX_BLOCK
+                       * sizeof(long int));
+  static short h[ORDER], coefs[4 * 50];
+  FirStream fs;
+  IirStream is;
+  long int blk, i, reps, r;
+  int ok;
+
+  ok = fir_stream_init(&fs, h, ORDER, BENCH_STREAM_CHANNELS);
+  ok &= iir_stream_init(&is, coefs, 50, BENCH_STREAM_CHANNELS);
+  if (!x || !y || !ok)
+  {
+    fir_stream_free(&fs);
+    iir_stream_free(&is);
+    free(x);
+    free(y);
+    return;
+  }
+  edn_seed = 3;
+  for (i = 0; i < ORDER; i++)
+    h[i] = edn_random();
+  for (i = 0; i < 4 * 50; i++)
+    coefs[i] = edn_random() >> 4;
+  for (i = 0; i < BENCH_STREAM_CHANNELS * BENCH_MAX_BLOCK; i++)
+    x[i] = edn_random();
+
+  printf("\n%d channels    %12s %12s %12s %12s\n", BENCH_STREAM_CHANNELS,
+         "fir us/blk", "fir samp/s", "iir us/blk", "iir samp/s");
+  for (blk = 16; blk <= BENCH_MAX_BLOCK; blk *= 4)
+  {
+    double t0, tf, ti;
+
+    reps = 2000000 / blk + 1;
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+      fir_stream_process(&fs, x, y, blk);
+    tf = (now_seconds() - t0) / reps;
+    iir_stream_reset(&is);
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+      iir_stream_process(&is, x, y, blk);
+    ti = (now_seconds() - t0) / reps;
+    printf("%-8ld frames %12.3f %12.4g %12.3f %12.4g\n", blk, tf * 1e6,
+           BENCH_STREAM_CHANNELS * blk / tf, ti * 1e6,
+           BENCH_STREAM_CHANNELS * blk / ti);
+  }
+  fir_stream_free(&fs);
+  iir_stream_free(&is);
+  free(x);
+  free(y);
+}
+
+#endif /* BENCHMARK */
+
 /* ------------------------------ main ------------------------------ */
 
 int main()
 {
-  int correct, res, j;
+  int correct, res, j, k, sets_ok = 1;
 
   for (j = 0; j < RPT; j++)
   {
@@ -326,8 +1372,18 @@ int main()
     iir1(a, b, &output[100], output);
     e = codebook(d, 1, 17, e, d, a, c, 1);
     jpegdct(a, b);
+
+    /* The same steps with each kernel set the CPU supports. */
+    for (k = 0; k < EDN_SETS; k++)
+      if (edn_sets[k]->supported())
+        sets_ok &= edn_check(edn_sets[k], in_a, in_b);
   }
 
+  for (k = 0; k < EDN_SETS; k++)
+    if (edn_sets[k]->supported())
+      sets_ok &= edn_check_random(edn_sets[k]);
+  sets_ok &= edn_check_stream();
+
   long int exp_output[200] =
       {3760, 4269, 3126, 1030, 2453, -4601, 1981, -1056, 2621, 4269,
        3058, 1030, 2378, -4601, 1902, -1056, 2548, 4269, 2988, 1030,
@@ -350,12 +1406,18 @@ int main()
        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
        0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
-  res = (0 == memcmp(output, exp_output, 200 * sizeof(output[0]))) && (10243 == c) && (-441886230 == d) && (-441886230 == e);
+  res = (0 == memcmp(output, exp_output, 200 * sizeof(output[0]))) && (10243 == c) && (-441886230 == d) && (-441886230 == e) && sets_ok;
 
   correct = res == 1 ? 1 : 0;
 
   printf("The result is: %d\n", correct);
 
+#ifdef BENCHMARK
+  printf("kernels: %s\n", edn_kernels()->name);
+  benchmark();
+  benchmark_stream();
+#endif
+
   return 0;
 }
 
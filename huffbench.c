@@ -52,6 +52,15 @@
 #include <assert.h>
 #include <stdint.h>
 
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef BENCHMARK
+#include <time.h>
+#endif
+
 /* BEEBS heap is just an array */
 
 #define HEAP_SIZE 8192
@@ -236,29 +245,18 @@ heap_adjust(size_t *freq, size_t *heap, int n, int k)
   heap[k] = v;
 }
 
-// Huffman compression/decompression function
-void compdecomp(byte *data, size_t data_len)
+// build the codes for data_len bytes of data; returns the longest
+// code length, which is 0 when fewer than two byte values occur
+static size_t
+huff_trie_codes(const byte *data, size_t data_len, bits32 *code, byte *clen)
 {
-  size_t i, j, n, mask;
-  bits32 k, t;
-  byte c;
-  byte *cptr;
-  byte *dptr = data;
-
-  /*
-     COMPRESSION
-   */
-
-  // allocate data space
-  byte *comp = (byte *)malloc_beebs(data_len + 1);
+  size_t i, j, n;
+  const byte *dptr = data;
 
   size_t freq[512]; // allocate frequency table
   size_t heap[256]; // allocate heap
   int link[512];    // allocate link array
-  bits32 code[256]; // huffman codes
-  byte clen[256];   // bit lengths of codes
 
-  memset(comp, 0, sizeof(byte) * (data_len + 1));
   memset(freq, 0, sizeof(size_t) * 512);
   memset(heap, 0, sizeof(size_t) * 256);
   memset(link, 0, sizeof(int) * 512);
@@ -359,23 +357,26 @@ void compdecomp(byte *data, size_t data_len)
     }
   }
 
-  // make sure longest codes fit in unsigned long-bits
-  if (maxi > (sizeof(unsigned long) * 8))
-  {
-    return;
-  }
+  // watch for one-value file!
+  if (maxx == 0)
+    return 0;
+
+  return maxi;
+}
+
+// encode data_len bytes of data into comp a bit at a time; returns
+// the number of bytes stored, or 0 if that would reach data_len
+static size_t
+huff_encode_bitwise(const byte *data, size_t data_len, const bits32 *code,
+                    const byte *clen, byte *comp)
+{
+  size_t i, j, mask;
+  const byte *dptr = data;
 
   // encode data
   size_t comp_len = 0; // number of data_len output
-  char bout = 0;       // byte of encoded data
+  byte bout = 0;       // byte of encoded data
   int bit = -1;        // count of bits stored in bout
-  dptr = data;
-
-  // watch for one-value file!
-  if (maxx == 0)
-  {
-    return;
-  }
 
   for (j = 0; j < data_len; ++j)
   {
@@ -394,7 +395,7 @@ void compdecomp(byte *data, size_t data_len)
         // check for output longer than input!
         if (comp_len == data_len)
         {
-          return;
+          return 0;
         }
 
         bit = 0;
@@ -421,12 +422,19 @@ void compdecomp(byte *data, size_t data_len)
   comp[comp_len] = bout;
   ++comp_len;
 
-  // printf("data len = %u\n",data_len);
-  // printf("comp len = %u\n",comp_len);
+  return comp_len;
+}
 
-  /*
-     DECOMPRESSION
-   */
+// decode data_len bytes from comp into data a bit at a time
+static void
+huff_decode_trie(const byte *comp, byte *data, size_t data_len,
+                 const bits32 *code, const byte *clen)
+{
+  size_t i, j, n, mask;
+  bits32 k, t;
+  byte c;
+  const byte *cptr;
+  byte *dptr;
 
   // allocate heap2
   bits32 heap2[256];
@@ -528,11 +536,1620 @@ void compdecomp(byte *data, size_t data_len)
       ++cptr;
     }
   }
+}
+
+// Huffman compression/decompression function
+void compdecomp(byte *data, size_t data_len)
+{
+  size_t maxi, comp_len;
+
+  /*
+     COMPRESSION
+   */
+
+  // allocate data space
+  byte *comp = (byte *)malloc_beebs(data_len + 1);
+
+  bits32 code[256]; // huffman codes
+  byte clen[256];   // bit lengths of codes
+
+  memset(comp, 0, sizeof(byte) * (data_len + 1));
+
+  maxi = huff_trie_codes(data, data_len, code, clen);
+
+  // make sure longest codes fit in unsigned long-bits
+  if (maxi > (sizeof(unsigned long) * 8))
+  {
+    return;
+  }
+
+  // watch for one-value file!
+  if (maxi == 0)
+  {
+    return;
+  }
+
+  comp_len = huff_encode_bitwise(data, data_len, code, clen, comp);
+  if (comp_len == 0)
+    return;
+
+  // printf("data len = %u\n",data_len);
+  // printf("comp len = %u\n",comp_len);
+
+  /*
+     DECOMPRESSION
+   */
+
+  huff_decode_trie(comp, data, data_len, code, clen);
 
   // remove work areas
   free_beebs(comp);
 }
 
+/* ------------------------- table decoder ------------------------- */
+
+/* Decodes with a table over the next HUFF_TABLE_BITS bits of a 64-bit
+   bit buffer instead of walking the trie a bit at a time. An entry of
+   the first table holds the one or two codes that start those bits, or
+   links to a secondary table over the next bits for longer codes. Codes
+   longer than HUFF_TABLE_BITS + HUFF_SUB_BITS are not handled. */
+
+#define HUFF_TABLE_BITS 11
+#define HUFF_SUB_BITS 12
+#define HUFF_MAX_LEN (HUFF_TABLE_BITS + HUFF_SUB_BITS)
+
+/* Entry: first symbol in bits 0-7, second in 8-15, bits used in 16-21,
+   symbols in 22-23 and, for two, the first one's bits in 24-29; or
+   HUFF_LINK, the secondary table's width in bits
+   24-29 and its offset in 0-23. */
+#define HUFF_LINK 0x80000000u
+#define HUFF_ENTRY(sym, len, nsym)                                          \
+  ((uint32_t)(sym) | (uint32_t)(len) << 16 | (uint32_t)(nsym) << 22)
+
+typedef struct
+{
+  uint32_t *entry; /* First table, then the secondary ones. */
+  size_t size;
+} HuffDecoder;
+
+void huff_decoder_free(HuffDecoder *d)
+{
+  free(d->entry);
+  d->entry = NULL;
+}
+
+/* Builds the tables for code and clen. Returns 1, or 0 if a code is
+   longer than HUFF_MAX_LEN or out of memory. */
+int huff_decoder_init(HuffDecoder *d, const bits32 *code, const byte *clen)
+{
+  const size_t top = (size_t)1 << HUFF_TABLE_BITS, mask = top - 1;
+  byte width[1 << HUFF_TABLE_BITS];
+  uint32_t *single;
+  size_t i, j, off;
+  int m;
+
+  memset(width, 0, sizeof(width));
+  for (m = 0; m < 256; m++)
+    if (clen[m] > HUFF_MAX_LEN)
+      return 0;
+    else if (clen[m] > HUFF_TABLE_BITS)
+    {
+      i = code[m] >> (clen[m] - HUFF_TABLE_BITS);
+      if (width[i] < clen[m] - HUFF_TABLE_BITS)
+        width[i] = clen[m] - HUFF_TABLE_BITS;
+    }
+
+  d->size = top;
+  for (i = 0; i < top; i++)
+    if (width[i])
+      d->size += (size_t)1 << width[i];
+  d->entry = calloc(d->size, sizeof(uint32_t));
+  single = malloc(top * sizeof(uint32_t));
+  if (!d->entry || !single)
+  {
+    free(single);
+    huff_decoder_free(d);
+    return 0;
+  }
+
+  for (i = 0, off = top; i < top; i++)
+    if (width[i])
+    {
+      d->entry[i] = HUFF_LINK | (uint32_t)width[i] << 24 | (uint32_t)off;
+      off += (size_t)1 << width[i];
+    }
+  for (m = 0; m < 256; m++)
+  {
+    int l = clen[m];
+
+    if (l == 0)
+      continue;
+    if (l <= HUFF_TABLE_BITS)
+    {
+      i = (size_t)code[m] << (HUFF_TABLE_BITS - l);
+      for (j = 0; j < (size_t)1 << (HUFF_TABLE_BITS - l); j++)
+        d->entry[i + j] = HUFF_ENTRY(m, l, 1);
+    }
+    else
+    {
+      uint32_t link = d->entry[code[m] >> (l - HUFF_TABLE_BITS)];
+      int w = (link >> 24) & 63, r = l - HUFF_TABLE_BITS;
+      uint32_t *sub = d->entry + (link & 0xffffff);
+
+      i = (size_t)(code[m] & (((bits32)1 << r) - 1)) << (w - r);
+      for (j = 0; j < (size_t)1 << (w - r); j++)
+        sub[i + j] = HUFF_ENTRY(m, r, 1);
+    }
+  }
+
+  /* Pair each short code with a second one that fits in the bits left. */
+  memcpy(single, d->entry, top * sizeof(uint32_t));
+  for (i = 0; i < top; i++)
+  {
+    uint32_t e = single[i], e2;
+    int l = (e >> 16) & 63;
+
+    if (e & HUFF_LINK || l == 0 || l >= HUFF_TABLE_BITS)
+      continue;
+    e2 = single[(i << l) & mask];
+    if (!(e2 & HUFF_LINK) && (int)((e2 >> 16) & 63) <= HUFF_TABLE_BITS - l)
+      d->entry[i] = HUFF_ENTRY((e & 0xff) | (e2 & 0xff) << 8,
+                               l + ((e2 >> 16) & 63), 2)
+                    | (uint32_t)l << 24;
+  }
+  free(single);
+  return 1;
+}
+
+/* A bit reader over a stream: the next bits first bit highest, how many
+   there are, and the next byte to load. Bytes past end read as 0, and
+   pad counts them. The stream's own bits are those before limit, which
+   may come before end; huff_reader_ok tells whether more were used. */
+
+typedef struct
+{
+  uint64_t buf;
+  int cnt;
+  const byte *p, *end;
+  const byte *start;
+  size_t pad, bits;
+} HuffReader;
+
+static inline void
+huff_reader_init(HuffReader *r, const byte *p, const byte *limit,
+                 const byte *end)
+{
+  r->buf = 0;
+  r->cnt = 0;
+  r->p = p;
+  r->end = end;
+  r->start = p;
+  r->pad = 0;
+  r->bits = 8 * (size_t)(limit - p);
+}
+
+/* 1 if the codes read so far lie within the stream's own bits. */
+static inline int
+huff_reader_ok(const HuffReader *r)
+{
+  return 8 * ((size_t)(r->p - r->start) + r->pad) - r->cnt <= r->bits;
+}
+
+/* Decodes one entry's symbols into out[0] and, if left allows, out[stride].
+   Returns how many, or 0 on a bit pattern no code starts with. */
+static inline int
+huff_step(const uint32_t *entry, HuffReader *r, byte *out, size_t stride,
+          size_t left)
+{
+  uint32_t e;
+  int len;
+
+  if (r->end - r->p >= 8)
+  {
+    uint64_t v;
+
+    memcpy(&v, r->p, 8);
+    r->buf |= __builtin_bswap64(v) >> r->cnt;
+    r->p += (63 - r->cnt) >> 3;
+    r->cnt |= 56;
+  }
+  else
+    for (; r->cnt <= 56; r->cnt += 8)
+      if (r->p < r->end)
+        r->buf |= (uint64_t)*r->p++ << (56 - r->cnt);
+      else
+        r->pad++;
+
+  e = entry[r->buf >> (64 - HUFF_TABLE_BITS)];
+  if (e & HUFF_LINK)
+  {
+    int w = (e >> 24) & 63;
+
+    e = entry[(e & 0xffffff) + ((r->buf << HUFF_TABLE_BITS) >> (64 - w))];
+    r->buf <<= HUFF_TABLE_BITS;
+    r->cnt -= HUFF_TABLE_BITS;
+  }
+  len = (e >> 16) & 63;
+  if (len == 0)
+    return 0;
+  out[0] = (byte)e;
+  if ((e >> 22 & 3) == 2)
+  {
+    if (left > 1)
+    {
+      r->buf <<= len;
+      r->cnt -= len;
+      out[stride] = (byte)(e >> 8);
+      return 2;
+    }
+    len = (e >> 24) & 63;
+  }
+  r->buf <<= len;
+  r->cnt -= len;
+  return 1;
+}
+
+/* Decodes count symbols from r into out, stride bytes apart. Returns 1,
+   or 0 on a bit pattern no code starts with or if the codes run past the
+   stream's own bits. */
+static inline int
+huff_decode_reader(const uint32_t *entry, HuffReader *r, byte *out,
+                   size_t count, size_t stride)
+{
+  while (count > 0)
+  {
+    int k = huff_step(entry, r, out, stride, count);
+
+    if (k == 0)
+      return 0;
+    out += k * stride;
+    count -= k;
+  }
+  return huff_reader_ok(r);
+}
+
+/* Decodes data_len bytes from the comp_len bytes at comp. Returns 1, or
+   0 on a bit pattern no code starts with or if comp_len bytes are too
+   few. */
+int huff_decode_table(const HuffDecoder *d, const byte *comp, size_t comp_len,
+                      byte *data, size_t data_len)
+{
+  HuffReader r;
+
+  huff_reader_init(&r, comp, comp + comp_len, comp + comp_len);
+  return huff_decode_reader(d->entry, &r, data, data_len, 1);
+}
+
+/* -------------------------- word encoder -------------------------- */
+
+/* Encodes into a 64-bit accumulator and stores 32 bits at a time, giving
+   the same bytes as huff_encode_bitwise. Each table entry holds a code
+   shifted up past its length, so a symbol costs one load, one shift and
+   OR, and a test for a full word; with codes of at most 16 bits two
+   symbols go in before the test. */
+
+typedef struct
+{
+  uint64_t entry[256]; /* Code << 6 | length. */
+  int maxlen;
+} HuffEncoder;
+
+/* Builds the table for code and clen. Returns 1, or 0 if a code is over
+   32 bits. */
+int huff_encoder_init(HuffEncoder *e, const bits32 *code, const byte *clen)
+{
+  int m;
+
+  e->maxlen = 0;
+  for (m = 0; m < 256; m++)
+  {
+    if (clen[m] > 32)
+      return 0;
+    e->entry[m] = (uint64_t)code[m] << 6 | clen[m];
+    if (clen[m] > e->maxlen)
+      e->maxlen = clen[m];
+  }
+  return 1;
+}
+
+/* Encodes count bytes of data, stride apart, into comp. Returns the
+   number of bytes stored, or 0 if that would be over cap. */
+static inline size_t
+huff_encode_stride(const HuffEncoder *e, const byte *data, size_t count,
+                   size_t stride, byte *comp, size_t cap)
+{
+  const uint64_t *entry = e->entry;
+  uint64_t acc = 0; /* Pending bits, the last lowest. */
+  size_t i = 0, o = 0;
+  int bits = 0;     /* Pending bits, under 32 between words. */
+
+#define HUFF_PUT(sym)                                                       \
+  do                                                                        \
+  {                                                                         \
+    uint64_t x = entry[sym];                                                \
+    acc = acc << (x & 63) | x >> 6;                                         \
+    bits += x & 63;                                                         \
+  } while (0)
+
+#define HUFF_FLUSH()                                                        \
+  if (bits >= 32)                                                           \
+  {                                                                         \
+    uint32_t w = __builtin_bswap32((uint32_t)(acc >> (bits - 32)));         \
+                                                                            \
+    if (o + 4 > cap)                                                        \
+      return 0;                                                             \
+    memcpy(comp + o, &w, 4);                                                \
+    o += 4;                                                                 \
+    bits -= 32;                                                             \
+  }
+
+  if (e->maxlen <= 16)
+    for (; i + 2 <= count; i += 2)
+    {
+      HUFF_PUT(data[i * stride]);
+      HUFF_PUT(data[(i + 1) * stride]);
+      HUFF_FLUSH();
+    }
+  for (; i < count; i++)
+  {
+    HUFF_PUT(data[i * stride]);
+    HUFF_FLUSH();
+  }
+
+#undef HUFF_PUT
+#undef HUFF_FLUSH
+
+  for (; bits > 0; bits -= 8)
+  {
+    if (o >= cap)
+      return 0;
+    comp[o++] = (byte)(bits >= 8 ? acc >> (bits - 8) : acc << (8 - bits));
+  }
+  return o;
+}
+
+/* Encodes data_len bytes of data into comp. Returns the number of bytes
+   stored, or 0 if that would be over cap. */
+size_t huff_encode_word(const HuffEncoder *e, const byte *data,
+                        size_t data_len, byte *comp, size_t cap)
+{
+  return huff_encode_stride(e, data, data_len, 1, comp, cap);
+}
+
+/* ------------------------- canonical codes ------------------------- */
+
+/* Codes of at most HUFF_LIMIT bits, assigned in order of length and
+   then of byte value, so the lengths alone define them. The lengths are
+   minimum-redundancy ones computed in place over the frequencies in
+   ascending order; if any is over HUFF_LIMIT, the longest are cut to
+   HUFF_LIMIT and codes moved one bit deeper until the code space sums to
+   one again.
+
+   A compressed stream is the data length as a base-128 varint, a bitmap
+   of the 256 byte values that occur, their code lengths four bits each,
+   low nibble first, and the codes, first bit highest. */
+
+#define HUFF_LIMIT 15
+#define HUFF_HEADER_MAX (10 + 32 + 128)
+
+void huff_count(const byte *data, size_t data_len, size_t *freq)
+{
+  size_t i;
+
+  memset(freq, 0, 256 * sizeof(size_t));
+  for (i = 0; i < data_len; i++)
+    ++freq[data[i]];
+}
+
+/* Code lengths for freq, at most limit bits. Returns the longest. */
+int huff_canonical_lengths(const size_t *freq, byte *clen, int limit)
+{
+  size_t w[256];
+  int sym[256], num[64];
+  int n = 0, i, j, len, root, leaf, next, avbl, used, dpth;
+  long total;
+
+  memset(clen, 0, 256);
+  for (i = 0; i < 256; i++)
+    if (freq[i])
+    {
+      /* Insertion sort by frequency, then byte value. */
+      for (j = n++; j > 0 && freq[sym[j - 1]] > freq[i]; j--)
+        sym[j] = sym[j - 1];
+      sym[j] = i;
+    }
+  if (n == 0)
+    return 0;
+  if (n == 1)
+  {
+    clen[sym[0]] = 1;
+    return 1;
+  }
+  for (i = 0; i < n; i++)
+    w[i] = freq[sym[i]];
+
+  /* Parent pointers, left to right. */
+  w[0] += w[1];
+  root = 0;
+  leaf = 2;
+  for (next = 1; next < n - 1; next++)
+  {
+    if (leaf >= n || w[root] < w[leaf])
+    {
+      w[next] = w[root];
+      w[root++] = next;
+    }
+    else
+      w[next] = w[leaf++];
+    if (leaf >= n || (root < next && w[root] < w[leaf]))
+    {
+      w[next] += w[root];
+      w[root++] = next;
+    }
+    else
+      w[next] += w[leaf++];
+  }
+  /* Depths of the internal nodes, right to left. */
+  w[n - 2] = 0;
+  for (next = n - 3; next >= 0; next--)
+    w[next] = w[w[next]] + 1;
+  /* Depths of the leaves, right to left. */
+  avbl = 1;
+  used = dpth = 0;
+  root = n - 2;
+  next = n - 1;
+  while (avbl > 0)
+  {
+    while (root >= 0 && (int)w[root] == dpth)
+    {
+      used++;
+      root--;
+    }
+    while (avbl > used)
+    {
+      w[next--] = dpth;
+      avbl--;
+    }
+    avbl = 2 * used;
+    dpth++;
+    used = 0;
+  }
+
+  /* Count lengths, cut to limit and repair the code space. */
+  memset(num, 0, sizeof(num));
+  for (i = 0; i < n; i++)
+    num[w[i] < (size_t)limit ? w[i] : (size_t)limit]++;
+  for (total = 0, len = 1; len <= limit; len++)
+    total += (long)num[len] << (limit - len);
+  while (total > 1L << limit)
+  {
+    num[limit]--;
+    for (len = limit - 1; len > 0; len--)
+      if (num[len])
+      {
+        num[len]--;
+        num[len + 1] += 2;
+        break;
+      }
+    total--;
+  }
+
+  /* The longest codes go to the rarest bytes. */
+  for (i = 0, len = limit; len > 0; len--)
+    for (j = 0; j < num[len]; j++)
+      clen[sym[i++]] = (byte)len;
+  return clen[sym[0]];
+}
+
+/* Canonical codes for clen. */
+void huff_canonical_codes(const byte *clen, bits32 *code)
+{
+  bits32 next[HUFF_LIMIT + 2], c = 0;
+  int count[HUFF_LIMIT + 1], m, len;
+
+  memset(count, 0, sizeof(count));
+  for (m = 0; m < 256; m++)
+    count[clen[m]]++;
+  count[0] = 0;
+  for (len = 1; len <= HUFF_LIMIT; len++)
+  {
+    c = (c + count[len - 1]) << 1;
+    next[len] = c;
+  }
+  for (m = 0; m < 256; m++)
+    code[m] = clen[m] ? next[clen[m]]++ : 0;
+}
+
+/* Writes the header for data_len bytes coded with clen. Returns its
+   size, at most HUFF_HEADER_MAX. */
+size_t huff_write_header(byte *out, size_t data_len, const byte *clen)
+{
+  size_t o = 0;
+  int m, k = 0;
+
+  do
+  {
+    out[o++] = (byte)(data_len & 127) | (data_len > 127 ? 128 : 0);
+    data_len >>= 7;
+  } while (data_len);
+  memset(out + o, 0, 32);
+  for (m = 0; m < 256; m++)
+    if (clen[m])
+      out[o + m / 8] |= (byte)(1 << (m % 8));
+  o += 32;
+  for (m = 0; m < 256; m++)
+    if (clen[m])
+    {
+      if (k++ & 1)
+        out[o++] |= (byte)(clen[m] << 4);
+      else
+        out[o] = clen[m];
+    }
+  return o + (k & 1);
+}
+
+/* Reads a header from the in_len bytes at in. Returns its size, or 0 if
+   it is cut short or its lengths are not a prefix code. */
+size_t huff_read_header(const byte *in, size_t in_len, size_t *data_len,
+                        byte *clen)
+{
+  size_t o = 0, n = 0;
+  long total = 0;
+  int shift = 0, m, k = 0;
+
+  do
+  {
+    if (o >= in_len || shift > 63)
+      return 0;
+    n |= (size_t)(in[o] & 127) << shift;
+    shift += 7;
+  } while (in[o++] & 128);
+  if (in_len - o < 32)
+    return 0;
+  memset(clen, 0, 256);
+  for (m = 0; m < 256; m++)
+    if (in[o + m / 8] >> (m % 8) & 1)
+      clen[m] = 1;
+  o += 32;
+  for (m = 0; m < 256; m++)
+    if (clen[m])
+    {
+      if (o + (k >> 1) >= in_len)
+        return 0;
+      clen[m] = in[o + (k >> 1)] >> (k & 1 ? 4 : 0) & 15;
+      k++;
+      if (clen[m] == 0)
+        return 0;
+      total += 1L << (HUFF_LIMIT - clen[m]);
+    }
+  if (total > 1L << HUFF_LIMIT)
+    return 0;
+  *data_len = n;
+  return o + ((k + 1) >> 1);
+}
+
+/* Compresses data_len bytes into out, which needs room for
+   HUFF_HEADER_MAX + data_len. Returns the stream's size, or 0 if it
+   would not be shorter than the data. */
+size_t huff_compress(const byte *data, size_t data_len, byte *out)
+{
+  size_t freq[256], h, c;
+  bits32 code[256];
+  byte clen[256];
+  HuffEncoder e;
+
+  huff_count(data, data_len, freq);
+  huff_canonical_lengths(freq, clen, HUFF_LIMIT);
+  huff_canonical_codes(clen, code);
+  huff_encoder_init(&e, code, clen);
+  h = huff_write_header(out, data_len, clen);
+  if (h + 1 >= data_len)
+    return 0;
+  c = huff_encode_word(&e, data, data_len, out + h, data_len - h - 1);
+  return c ? h + c : 0;
+}
+
+/* Decompresses the in_len byte stream at in into data, which holds cap
+   bytes. Returns 1 and sets *data_len, or 0 if the stream is invalid,
+   truncated or too long. */
+int huff_decompress(const byte *in, size_t in_len, byte *data, size_t cap,
+                    size_t *data_len)
+{
+  bits32 code[256];
+  byte clen[256];
+  HuffDecoder d;
+  size_t h = huff_read_header(in, in_len, data_len, clen);
+  int ok;
+
+  if (h == 0 || *data_len > cap)
+    return 0;
+  huff_canonical_codes(clen, code);
+  if (!huff_decoder_init(&d, code, clen))
+    return 0;
+  ok = huff_decode_table(&d, in + h, in_len - h, data, *data_len);
+  huff_decoder_free(&d);
+  return ok;
+}
+
+/* ---------------------- interleaved streams ---------------------- */
+
+/* The symbols spread round-robin over HUFF_STREAMS bitstreams, so the
+   decoder can follow several independent chains of table lookups in one
+   loop instead of one. The stream is the header of huff_compress, the
+   sizes of all bitstreams but the last, 4 bytes little-endian each, and
+   the bitstreams; bitstream k holds symbols k, k + HUFF_STREAMS, ... */
+
+#define HUFF_STREAMS 4
+
+/* The most a bitstream whose size is stored can take. */
+#define HUFF_STREAM_MAX ((size_t)0xffffffff)
+
+/* Compresses data_len bytes into out, which needs room for
+   HUFF_HEADER_MAX + 4 * HUFF_STREAMS + data_len. Returns the stream's
+   size, or 0 if it would not be shorter than the data or one of the
+   first HUFF_STREAMS - 1 bitstreams would be over HUFF_STREAM_MAX
+   bytes. */
+size_t huff_compress4(const byte *data, size_t data_len, byte *out)
+{
+  size_t freq[256], h, o, z, count, cap;
+  bits32 code[256];
+  byte clen[256];
+  HuffEncoder e;
+  int k, b;
+
+  huff_count(data, data_len, freq);
+  huff_canonical_lengths(freq, clen, HUFF_LIMIT);
+  huff_canonical_codes(clen, code);
+  huff_encoder_init(&e, code, clen);
+  h = huff_write_header(out, data_len, clen);
+  o = h + 4 * (HUFF_STREAMS - 1);
+  for (k = 0; k < HUFF_STREAMS; k++)
+  {
+    count = data_len > (size_t)k ? (data_len - k - 1) / HUFF_STREAMS + 1 : 0;
+    if (o + 1 >= data_len)
+      return 0;
+    cap = data_len - o - 1;
+    if (k < HUFF_STREAMS - 1 && cap > HUFF_STREAM_MAX)
+      cap = HUFF_STREAM_MAX;
+    z = huff_encode_stride(&e, data + k, count, HUFF_STREAMS, out + o, cap);
+    if (z == 0 && count > 0)
+      return 0;
+    if (k < HUFF_STREAMS - 1)
+      for (b = 0; b < 4; b++)
+        out[h + 4 * k + b] = (byte)(z >> (8 * b));
+    o += z;
+  }
+  return o;
+}
+
+/* Decompresses the in_len byte stream of huff_compress4 at in into data,
+   which holds cap bytes. Returns 1 and sets *data_len, or 0 if the
+   stream is invalid or too long. */
+int huff_decompress4(const byte *in, size_t in_len, byte *data, size_t cap,
+                     size_t *data_len)
+{
+  const byte *end = in + in_len;
+  bits32 code[256];
+  byte clen[256];
+  HuffDecoder d;
+  HuffReader r0, r1, r2, r3;
+  size_t h = huff_read_header(in, in_len, data_len, clen);
+  size_t o, z[HUFF_STREAMS], left[HUFF_STREAMS], n;
+  byte *o0, *o1, *o2, *o3;
+  int k, b, ok = 1;
+
+  if (h == 0 || *data_len > cap || in_len - h < 4 * (HUFF_STREAMS - 1))
+    return 0;
+  n = *data_len;
+  o = h + 4 * (HUFF_STREAMS - 1);
+  for (k = 0; k < HUFF_STREAMS - 1; k++)
+  {
+    for (z[k] = 0, b = 3; b >= 0; b--)
+      z[k] = z[k] << 8 | in[h + 4 * k + b];
+    if (z[k] > in_len - o)
+      return 0;
+    o += z[k];
+  }
+  for (k = 0; k < HUFF_STREAMS; k++)
+    left[k] = n > (size_t)k ? (n - k - 1) / HUFF_STREAMS + 1 : 0;
+  huff_canonical_codes(clen, code);
+  if (!huff_decoder_init(&d, code, clen))
+    return 0;
+
+  /* Each reader may load bytes of the next bitstream, but fails if it
+     decodes any of them. */
+  o = h + 4 * (HUFF_STREAMS - 1);
+  huff_reader_init(&r0, in + o, in + o + z[0], end);
+  o += z[0];
+  huff_reader_init(&r1, in + o, in + o + z[1], end);
+  o += z[1];
+  huff_reader_init(&r2, in + o, in + o + z[2], end);
+  o += z[2];
+  huff_reader_init(&r3, in + o, end, end);
+  o0 = data, o1 = data + 1, o2 = data + 2, o3 = data + 3;
+  while (left[0] && left[1] && left[2] && left[3])
+  {
+    int k0 = huff_step(d.entry, &r0, o0, HUFF_STREAMS, left[0]);
+    int k1 = huff_step(d.entry, &r1, o1, HUFF_STREAMS, left[1]);
+    int k2 = huff_step(d.entry, &r2, o2, HUFF_STREAMS, left[2]);
+    int k3 = huff_step(d.entry, &r3, o3, HUFF_STREAMS, left[3]);
+
+    if (!k0 || !k1 || !k2 || !k3)
+    {
+      ok = 0;
+      break;
+    }
+    o0 += HUFF_STREAMS * k0, left[0] -= k0;
+    o1 += HUFF_STREAMS * k1, left[1] -= k1;
+    o2 += HUFF_STREAMS * k2, left[2] -= k2;
+    o3 += HUFF_STREAMS * k3, left[3] -= k3;
+  }
+  ok = ok && huff_decode_reader(d.entry, &r0, o0, left[0], HUFF_STREAMS)
+       && huff_decode_reader(d.entry, &r1, o1, left[1], HUFF_STREAMS)
+       && huff_decode_reader(d.entry, &r2, o2, left[2], HUFF_STREAMS)
+       && huff_decode_reader(d.entry, &r3, o3, left[3], HUFF_STREAMS);
+  huff_decoder_free(&d);
+  return ok;
+}
+
+/* --------------------------- container --------------------------- */
+
+/* Data split into chunks of a fixed size, each compressed on its own
+   with its own code, so chunks can be coded and decoded in parallel and
+   any one can be read without the others:
+
+     "HFC1", the data length and the chunk size as varints, the chunk
+     size no more than the data length unless that is 0,
+     chunks + 1 offsets from the start, 8 bytes little-endian each,
+     the chunks: HUFF_RAW and the bytes, or HUFF_CODED and a stream of
+     huff_compress.
+
+   With USE_PTHREADS chunks are handed out to nthreads threads from a
+   shared counter; the container is the same for any thread count. */
+
+#define HUFF_RAW 0
+#define HUFF_CODED 1
+#define HUFF_MAX_THREADS 256
+
+typedef struct
+{
+  size_t data_len, chunk, chunks;
+  const byte *base, *index; /* Container, and its offsets. */
+} HuffContainer;
+
+typedef struct
+{
+  const byte *src;
+  byte *dst;
+  const HuffContainer *hc;
+  size_t slot, *size;       /* Compressing: room and size of each chunk. */
+  size_t next;              /* Next chunk to take. */
+  int failed;
+} HuffJob;
+
+static size_t
+huff_put_varint(byte *out, size_t v)
+{
+  size_t o = 0;
+
+  do
+  {
+    out[o++] = (byte)(v & 127) | (v > 127 ? 128 : 0);
+    v >>= 7;
+  } while (v);
+  return o;
+}
+
+static size_t
+huff_get_varint(const byte *in, size_t in_len, size_t *v)
+{
+  size_t o = 0;
+  int shift = 0;
+
+  *v = 0;
+  do
+  {
+    if (o >= in_len || shift > 63)
+      return 0;
+    *v |= (size_t)(in[o] & 127) << shift;
+    shift += 7;
+  } while (in[o++] & 128);
+  return o;
+}
+
+static size_t
+huff_chunk_len(const HuffContainer *hc, size_t c)
+{
+  return c + 1 < hc->chunks ? hc->chunk : hc->data_len - c * hc->chunk;
+}
+
+static size_t
+huff_chunk_offset(const HuffContainer *hc, size_t c)
+{
+  uint64_t v = 0;
+  int k;
+
+  for (k = 7; k >= 0; k--)
+    v = v << 8 | hc->index[8 * c + k];
+  return (size_t)v;
+}
+
+static size_t
+huff_container_head(size_t data_len, size_t chunk, byte *out)
+{
+  byte tmp[24];
+  size_t o = 4;
+
+  if (!out)
+    out = tmp;
+  memcpy(out, "HFC1", 4);
+  o += huff_put_varint(out + o, data_len);
+  o += huff_put_varint(out + o, chunk);
+  return o;
+}
+
+/* Room needed to compress data_len bytes in chunks of chunk, or 0 if
+   chunk is 0. */
+size_t huff_container_bound(size_t data_len, size_t chunk)
+{
+  size_t chunks;
+
+  if (chunk == 0)
+    return 0;
+  if (chunk > data_len && data_len > 0)
+    chunk = data_len;
+  chunks = (data_len + chunk - 1) / chunk;
+
+  return huff_container_head(data_len, chunk, NULL) + 8 * (chunks + 1)
+         + chunks * (1 + HUFF_HEADER_MAX + chunk);
+}
+
+/* Runs fn on job from nthreads threads. */
+static void
+huff_run(int nthreads, void *(*fn)(void *), HuffJob *job)
+{
+#ifdef USE_PTHREADS
+  pthread_t thread[HUFF_MAX_THREADS];
+  char started[HUFF_MAX_THREADS];
+  int t;
+
+  nthreads = nthreads > HUFF_MAX_THREADS ? HUFF_MAX_THREADS : nthreads;
+  for (t = 1; t < nthreads; t++)
+    started[t] = pthread_create(&thread[t], NULL, fn, job) == 0;
+  fn(job);
+  for (t = 1; t < nthreads; t++)
+    if (started[t])
+      pthread_join(thread[t], NULL);
+#else
+  (void)nthreads;
+  fn(job);
+#endif
+}
+
+static void *
+huff_compress_chunks(void *arg)
+{
+  HuffJob *job = arg;
+  const HuffContainer *hc = job->hc;
+  size_t c;
+
+  while ((c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+         < hc->chunks)
+  {
+    const byte *src = job->src + c * hc->chunk;
+    byte *dst = job->dst + c * job->slot;
+    size_t n = huff_chunk_len(hc, c), z = huff_compress(src, n, dst + 1);
+
+    if (z)
+      dst[0] = HUFF_CODED;
+    else
+    {
+      dst[0] = HUFF_RAW;
+      memcpy(dst + 1, src, n);
+      z = n;
+    }
+    job->size[c] = 1 + z;
+  }
+  return NULL;
+}
+
+/* Compresses data_len bytes into out, which needs room for
+   huff_container_bound, on nthreads threads. Returns the container's
+   size, or 0 if chunk is 0 or out of memory. */
+size_t huff_container_compress(const byte *data, size_t data_len,
+                               size_t chunk, byte *out, int nthreads)
+{
+  HuffContainer hc;
+  HuffJob job;
+  size_t head, o, c;
+  byte *slots;
+  int k;
+
+  if (chunk == 0)
+    return 0;
+  if (chunk > data_len && data_len > 0)
+    chunk = data_len;
+  head = huff_container_head(data_len, chunk, out);
+  hc.data_len = data_len;
+  hc.chunk = chunk;
+  hc.chunks = (data_len + chunk - 1) / chunk;
+  slots = out + head + 8 * (hc.chunks + 1);
+  memset(&job, 0, sizeof(job));
+  job.src = data;
+  job.dst = slots;
+  job.hc = &hc;
+  job.slot = 1 + HUFF_HEADER_MAX + chunk;
+  job.size = malloc(hc.chunks * sizeof(size_t) + 1);
+  if (!job.size)
+    return 0;
+  huff_run(nthreads < 1 ? 1 : nthreads, huff_compress_chunks, &job);
+
+  /* Close the gaps between the chunks, and write the index. */
+  o = head + 8 * (hc.chunks + 1);
+  for (c = 0; c <= hc.chunks; c++)
+  {
+    for (k = 0; k < 8; k++)
+      out[head + 8 * c + k] = (byte)((uint64_t)o >> (8 * k));
+    if (c < hc.chunks)
+    {
+      memmove(out + o, slots + c * job.slot, job.size[c]);
+      o += job.size[c];
+    }
+  }
+  free(job.size);
+  return o;
+}
+
+/* Reads the header and index of the in_len byte container at in.
+   Returns 1, or 0 if they are invalid. */
+int huff_container_open(HuffContainer *hc, const byte *in, size_t in_len)
+{
+  size_t o = 4, k, c, prev;
+
+  if (in_len < 4 || memcmp(in, "HFC1", 4))
+    return 0;
+  if (!(k = huff_get_varint(in + o, in_len - o, &hc->data_len)))
+    return 0;
+  o += k;
+  if (!(k = huff_get_varint(in + o, in_len - o, &hc->chunk)) || !hc->chunk)
+    return 0;
+  o += k;
+  if (hc->data_len > 0 && hc->chunk > hc->data_len)
+    return 0;
+  hc->chunks = hc->data_len / hc->chunk + (hc->data_len % hc->chunk != 0);
+  if (hc->chunks >= (in_len - o) / 8)
+    return 0;
+  hc->base = in;
+  hc->index = in + o;
+  prev = o + 8 * (hc->chunks + 1);
+  for (c = 0; c <= hc->chunks; c++)
+  {
+    size_t off = huff_chunk_offset(hc, c);
+
+    if (off < prev + (c > 0) || off > in_len
+        || (c > 0 && off - prev > 1 + huff_chunk_len(hc, c - 1)))
+      return 0;
+    prev = off;
+  }
+  return 1;
+}
+
+/* Decompresses chunk c into data, which needs room for the chunk size.
+   Returns 1, or 0 if the chunk is invalid. */
+int huff_container_read(const HuffContainer *hc, size_t c, byte *data)
+{
+  size_t off = huff_chunk_offset(hc, c), end = huff_chunk_offset(hc, c + 1);
+  size_t n = huff_chunk_len(hc, c), got;
+  const byte *p = hc->base + off;
+
+  if (p[0] == HUFF_RAW)
+  {
+    if (end - off - 1 != n)
+      return 0;
+    memcpy(data, p + 1, n);
+    return 1;
+  }
+  return p[0] == HUFF_CODED
+         && huff_decompress(p + 1, end - off - 1, data, n, &got) && got == n;
+}
+
+static void *
+huff_decompress_chunks(void *arg)
+{
+  HuffJob *job = arg;
+  const HuffContainer *hc = job->hc;
+  size_t c;
+
+  while ((c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+         < hc->chunks)
+    if (!huff_container_read(hc, c, job->dst + c * hc->chunk))
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/* Decompresses the in_len byte container at in into data, which holds
+   cap bytes, on nthreads threads. Returns 1 and sets *data_len, or 0 if
+   the container is invalid or too long. */
+int huff_container_decompress(const byte *in, size_t in_len, byte *data,
+                              size_t cap, size_t *data_len, int nthreads)
+{
+  HuffContainer hc;
+  HuffJob job;
+
+  if (!huff_container_open(&hc, in, in_len) || hc.data_len > cap)
+    return 0;
+  memset(&job, 0, sizeof(job));
+  job.dst = data;
+  job.hc = &hc;
+  huff_run(nthreads < 1 ? 1 : nthreads, huff_decompress_chunks, &job);
+  *data_len = hc.data_len;
+  return !job.failed;
+}
+
+int huff_cpu_count(void)
+{
+#if defined(USE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n < 1 ? 1 : (int)n;
+#else
+  return 1;
+#endif
+}
+
+/* Encodes with compdecomp's codes and checks that both decoders restore
+   orig_data, and bytes with Fibonacci frequencies, whose codes reach the
+   secondary tables. */
+
+#define HUFF_FIB_SYMBOLS 22
+#define HUFF_FIB_SIZE 46367 /* Sum of the first 22 Fibonacci numbers. */
+
+static int
+huff_check_table(void)
+{
+  static byte src[HUFF_FIB_SIZE], comp[HUFF_FIB_SIZE], out[HUFF_FIB_SIZE];
+  bits32 code[256];
+  byte clen[256];
+  size_t n, i, comp_len, f0 = 1, f1 = 1, f;
+  unsigned int seed = 1;
+  HuffDecoder d;
+  int s, pass, ok = 1;
+
+  for (i = 0, s = 0; s < HUFF_FIB_SYMBOLS; s++, f = f0 + f1, f0 = f1, f1 = f)
+    for (f = 0; f < f0; f++)
+      src[i++] = (byte)(s * 7 + 'A');
+  for (i = HUFF_FIB_SIZE - 1; i > 0; i--)
+  {
+    byte t = src[i];
+
+    seed = seed * 1103515245u + 12345u;
+    n = (seed >> 8) % (i + 1);
+    src[i] = src[n];
+    src[n] = t;
+  }
+
+  for (pass = 0; pass < 2; pass++)
+  {
+    const byte *data = pass ? src : orig_data;
+
+    n = pass ? HUFF_FIB_SIZE : TEST_SIZE;
+    if (huff_trie_codes(data, n, code, clen) == 0)
+      return 0;
+    comp_len = huff_encode_bitwise(data, n, code, clen, comp);
+    if (comp_len == 0 || !huff_decoder_init(&d, code, clen))
+      return 0;
+    memset(out, 0, n);
+    ok &= huff_decode_table(&d, comp, comp_len, out, n);
+    ok &= 0 == memcmp(out, data, n);
+    ok &= !huff_decode_table(&d, comp, comp_len - 1, out, n);
+    if (pass)
+      ok &= d.size > (1 << HUFF_TABLE_BITS);
+    huff_decoder_free(&d);
+    memset(out, 0, n);
+    huff_decode_trie(comp, out, n, code, clen);
+    ok &= 0 == memcmp(out, data, n);
+  }
+  return ok;
+}
+
+/* Checks that the canonical lengths cost as many bits as the trie's when
+   no code is over the limit, that the Fibonacci data's are cut to
+   HUFF_LIMIT with the code space filled, and that both streams decode
+   and a truncated one does not. */
+static int
+huff_check_canonical(void)
+{
+  static byte src[HUFF_FIB_SIZE], comp[HUFF_HEADER_MAX + HUFF_FIB_SIZE];
+  static byte out[HUFF_FIB_SIZE];
+  size_t freq[256], n, bits0, bits1, got;
+  bits32 code[256];
+  byte clen[256], tlen[256];
+  size_t i, f0 = 1, f1 = 1, f;
+  int s, m, pass, ok = 1, maxlen;
+  long total;
+
+  for (i = 0, s = 0; s < HUFF_FIB_SYMBOLS; s++, f = f0 + f1, f0 = f1, f1 = f)
+    for (f = 0; f < f0; f++)
+      src[i++] = (byte)(s * 7 + 'A');
+
+  for (pass = 0; pass < 2; pass++)
+  {
+    const byte *data = pass ? src : orig_data;
+
+    n = pass ? HUFF_FIB_SIZE : TEST_SIZE;
+    huff_count(data, n, freq);
+    huff_trie_codes(data, n, code, tlen);
+    maxlen = huff_canonical_lengths(freq, clen, HUFF_LIMIT);
+    for (bits0 = bits1 = 0, total = 0, m = 0; m < 256; m++)
+    {
+      bits0 += freq[m] * tlen[m];
+      bits1 += freq[m] * clen[m];
+      if (clen[m])
+        total += 1L << (HUFF_LIMIT - clen[m]);
+    }
+    ok &= total == 1L << HUFF_LIMIT;
+    if (pass)
+      ok &= maxlen == HUFF_LIMIT && bits1 > bits0;
+    else
+      ok &= bits1 == bits0;
+
+    memset(out, 0, n);
+    i = huff_compress(data, n, comp);
+    ok &= i > 0 && huff_decompress(comp, i, out, n, &got) && got == n
+          && 0 == memcmp(out, data, n);
+    ok &= !huff_decompress(comp, 40, out, n, &got)
+          && !huff_decompress(comp, i - 1, out, n, &got)
+          && !huff_decompress(comp, i, out, n - 1, &got);
+  }
+  return ok;
+}
+
+/* Checks that the word encoder stores the bytes of the bitwise one, for
+   the trie codes, canonical ones and over-long codes, on every prefix
+   of orig_data and on the Fibonacci data, and that a short cap fails. */
+static int
+huff_check_word(void)
+{
+  static byte src[HUFF_FIB_SIZE], comp0[HUFF_FIB_SIZE], comp1[HUFF_FIB_SIZE];
+  size_t freq[256], n, c0, c1, i, f0 = 1, f1 = 1, f;
+  bits32 code[256];
+  byte clen[256];
+  HuffEncoder e;
+  int s, pass, ok = 1;
+
+  for (i = 0, s = 0; s < HUFF_FIB_SYMBOLS; s++, f = f0 + f1, f0 = f1, f1 = f)
+    for (f = 0; f < f0; f++)
+      src[i++] = (byte)(s * 7 + 'A');
+
+  for (pass = 0; pass < 4; pass++)
+  {
+    const byte *data = pass & 2 ? src : orig_data;
+    size_t len = pass & 2 ? HUFF_FIB_SIZE : TEST_SIZE;
+
+    if (pass & 1)
+    {
+      huff_count(data, len, freq);
+      huff_canonical_lengths(freq, clen, HUFF_LIMIT);
+      huff_canonical_codes(clen, code);
+    }
+    else
+      huff_trie_codes(data, len, code, clen);
+    ok &= huff_encoder_init(&e, code, clen);
+    for (n = pass & 2 ? len : 1; n <= len; n++)
+    {
+      memset(comp0, 0, n);
+      c0 = huff_encode_bitwise(data, n, code, clen, comp0);
+      c1 = huff_encode_word(&e, data, n, comp1, n);
+      ok &= c0 == c1 && 0 == memcmp(comp0, comp1, c0);
+      if (c1 > 4)
+        ok &= huff_encode_word(&e, data, n, comp1, c1 - 1) == 0;
+    }
+  }
+  clen['A'] = 33;
+  ok &= !huff_encoder_init(&e, code, clen);
+  return ok;
+}
+
+#define HUFF_CONTAINER_CHECK 100000
+#define HUFF_CONTAINER_CHUNK 4096
+
+/* Builds data of Fibonacci, orig_data, constant and random stretches and
+   checks that containers made on 1 and 3 threads are the same bytes,
+   decode on 1 and 3 threads and chunk by chunk, and that a damaged index
+   or an inconsistent header is refused. */
+static int
+huff_check_container(void)
+{
+  size_t n = HUFF_CONTAINER_CHECK, bound, z0, z1, got, i, c;
+  byte *data = malloc(n), *out = malloc(n + HUFF_CONTAINER_CHUNK);
+  byte *c0 = NULL, *c1 = NULL;
+  unsigned int seed = 5;
+  HuffContainer hc;
+  int ok = 1, raw = 0;
+
+  bound = huff_container_bound(n, HUFF_CONTAINER_CHUNK);
+  c0 = malloc(bound);
+  c1 = malloc(bound);
+  if (!data || !out || !c0 || !c1)
+  {
+    free(data), free(out), free(c0), free(c1);
+    return 0;
+  }
+  for (i = 0; i < n; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    if (i < 30000)
+      data[i] = orig_data[(seed >> 8) % TEST_SIZE];
+    else if (i < 50000)
+      data[i] = 'Q';
+    else if (i < 60000)
+      data[i] = (byte)(seed >> 16);
+    else
+      data[i] = (byte)('A' + __builtin_ctz((seed >> 8) | 0x100000));
+  }
+
+  z0 = huff_container_compress(data, n, HUFF_CONTAINER_CHUNK, c0, 1);
+  z1 = huff_container_compress(data, n, HUFF_CONTAINER_CHUNK, c1, 3);
+  ok &= z0 > 0 && z0 < n && z0 == z1 && 0 == memcmp(c0, c1, z0);
+  ok &= huff_container_decompress(c0, z0, out, n, &got, 3) && got == n
+        && 0 == memcmp(out, data, n);
+  memset(out, 0, n);
+  ok &= huff_container_decompress(c0, z0, out, n, &got, 1) && got == n
+        && 0 == memcmp(out, data, n);
+  ok &= !huff_container_decompress(c0, z0, out, n - 1, &got, 1);
+
+  ok &= huff_container_open(&hc, c0, z0);
+  for (c = hc.chunks; ok && c-- > 0;)
+  {
+    memset(out, 0, HUFF_CONTAINER_CHUNK);
+    ok &= huff_container_read(&hc, c, out)
+          && 0 == memcmp(out, data + c * HUFF_CONTAINER_CHUNK,
+                         huff_chunk_len(&hc, c));
+    raw += c0[huff_chunk_offset(&hc, c)] == HUFF_RAW;
+  }
+  ok &= raw > 0 && raw < (int)hc.chunks;
+
+  c0[hc.index - c0 + 8 * 3 + 1] ^= 0x40;
+  ok &= !huff_container_open(&hc, c0, z0);
+  ok &= !huff_container_open(&hc, c1, 20);
+  ok &= huff_container_bound(n, 0) == 0
+        && huff_container_compress(data, n, 0, c1, 1) == 0;
+
+  /* Headers whose chunk count overflows the index size, whose chunk
+     size is over the data length, and whose chunk is too long. */
+  {
+    byte bad[64];
+    size_t h, off[2];
+
+    memset(bad, 0, sizeof(bad));
+    h = huff_container_head((size_t)-1, 1, bad);
+    for (i = 0; h + 8 * i < sizeof(bad); i++)
+      bad[h + 8 * i] = (byte)(40 + i);
+    ok &= !huff_container_open(&hc, bad, sizeof(bad));
+    memset(bad, 0, sizeof(bad));
+    h = huff_container_head(10, 10, bad);
+    off[0] = h + 16;
+    off[1] = off[0] + 11;
+    for (i = 0; i < 16; i++)
+      bad[h + i] = (byte)(off[i / 8] >> (8 * (i % 8)));
+    bad[off[0]] = HUFF_RAW;
+    ok &= huff_container_open(&hc, bad, off[1]);
+    huff_container_head(10, 100, bad);
+    ok &= !huff_container_open(&hc, bad, off[1]);
+    huff_container_head(10, 10, bad);
+    bad[h + 8] += 1;
+    ok &= !huff_container_open(&hc, bad, off[1] + 1);
+  }
+  free(data), free(out), free(c0), free(c1);
+  return ok;
+}
+
+/* Checks the interleaved streams on every prefix of orig_data that they
+   shorten and on the Fibonacci data, and that stream sizes past the end
+   are refused. */
+static int
+huff_check_streams(void)
+{
+  static byte src[HUFF_FIB_SIZE], out[HUFF_FIB_SIZE];
+  static byte comp[HUFF_HEADER_MAX + 4 * HUFF_STREAMS + HUFF_FIB_SIZE];
+  size_t n, z, got, i, f0 = 1, f1 = 1, f;
+  int s, ok = 1, coded = 0;
+
+  for (i = 0, s = 0; s < HUFF_FIB_SYMBOLS; s++, f = f0 + f1, f0 = f1, f1 = f)
+    for (f = 0; f < f0; f++)
+      src[i++] = (byte)(s * 7 + 'A');
+
+  for (n = 1; n <= TEST_SIZE; n++)
+    if ((z = huff_compress4(orig_data, n, comp)))
+    {
+      memset(out, 0, n);
+      ok &= huff_decompress4(comp, z, out, n, &got) && got == n
+            && 0 == memcmp(out, orig_data, n);
+      coded++;
+    }
+  ok &= coded > TEST_SIZE / 2;
+
+  z = huff_compress4(src, HUFF_FIB_SIZE, comp);
+  ok &= z > 0 && huff_decompress4(comp, z, out, HUFF_FIB_SIZE, &got)
+        && got == HUFF_FIB_SIZE && 0 == memcmp(out, src, HUFF_FIB_SIZE);
+  ok &= !huff_decompress4(comp, z / 2, out, HUFF_FIB_SIZE, &got);
+  return ok;
+}
+
+#ifdef BENCHMARK
+
+#define BENCH_MAX_BYTES 100000000
+#define BENCH_MAX_TRIE 10000000 /* The trie walk takes too long beyond. */
+
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Bytes drawn from orig_data, so with its frequencies. */
+static void
+bench_fill(byte *data, size_t n)
+{
+  unsigned int seed = 1;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    data[i] = orig_data[(seed >> 8) % TEST_SIZE];
+  }
+}
+
+/* Decode MB/s of the trie walk and the table decoder, from TEST_SIZE
+   bytes to BENCH_MAX_BYTES. */
+static void
+benchmark_decode(void)
+{
+  static const size_t sizes[] = {TEST_SIZE, 5000, 50000, 500000, 5000000,
+                                 50000000, BENCH_MAX_BYTES};
+  byte *data = malloc(BENCH_MAX_BYTES), *out = malloc(BENCH_MAX_BYTES);
+  byte *comp = malloc(BENCH_MAX_BYTES + 1);
+  bits32 code[256];
+  byte clen[256];
+  HuffDecoder d;
+  size_t k;
+
+  if (!data || !out || !comp)
+  {
+    free(data), free(out), free(comp);
+    return;
+  }
+  printf("\n%10s %10s %12s %12s\n", "bytes", "ratio", "trie MB/s",
+         "table MB/s");
+  for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+  {
+    size_t n = sizes[k], comp_len, reps, r;
+    double t0, tt = 0, tb;
+    int ok;
+
+    bench_fill(data, n);
+    huff_trie_codes(data, n, code, clen);
+    comp_len = huff_encode_bitwise(data, n, code, clen, comp);
+    if (comp_len == 0 || !huff_decoder_init(&d, code, clen))
+      break;
+    reps = 20000000 / n + 1;
+    if (n <= BENCH_MAX_TRIE)
+    {
+      t0 = now_seconds();
+      for (r = 0; r < reps; r++)
+        huff_decode_trie(comp, out, n, code, clen);
+      tt = (now_seconds() - t0) / reps;
+    }
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+      ok = huff_decode_table(&d, comp, comp_len, out, n);
+    tb = (now_seconds() - t0) / reps;
+    ok &= 0 == memcmp(out, data, n);
+    huff_decoder_free(&d);
+    printf("%10zu %10.3f", n, (double)comp_len / n);
+    if (n <= BENCH_MAX_TRIE)
+      printf(" %12.1f", n / tt * 1e-6);
+    else
+      printf(" %12s", "-");
+    printf(" %12.1f%s\n", n / tb * 1e-6, ok ? "" : " (mismatch)");
+  }
+  free(data), free(out), free(comp);
+}
+
+#define BENCH_MAX_BUILD 10000000
+
+/* Code build, and build plus encode, of the trie builder and the
+   canonical one, both encoding a bit at a time. */
+static void
+benchmark_build(void)
+{
+  byte *data = malloc(BENCH_MAX_BUILD);
+  byte *comp = malloc(HUFF_HEADER_MAX + BENCH_MAX_BUILD);
+  size_t n;
+
+  if (!data || !comp)
+  {
+    free(data), free(comp);
+    return;
+  }
+  printf("\n%10s %12s %12s %12s %12s %10s %10s\n", "bytes", "trie us",
+         "canon us", "trie MB/s", "canon MB/s", "trie out", "canon out");
+  for (n = TEST_SIZE; n <= BENCH_MAX_BUILD; n *= 10)
+  {
+    size_t freq[256], reps = 20000000 / n + 1, r, out0 = 0, out1 = 0;
+    bits32 code[256];
+    byte clen[256];
+    double t0, tb0, tb1, te0, te1;
+
+    bench_fill(data, n);
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+      huff_trie_codes(data, n, code, clen);
+    tb0 = (now_seconds() - t0) / reps;
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+    {
+      huff_count(data, n, freq);
+      huff_canonical_lengths(freq, clen, HUFF_LIMIT);
+      huff_canonical_codes(clen, code);
+    }
+    tb1 = (now_seconds() - t0) / reps;
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+    {
+      huff_trie_codes(data, n, code, clen);
+      out0 = huff_encode_bitwise(data, n, code, clen, comp);
+    }
+    te0 = (now_seconds() - t0) / reps;
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+      out1 = huff_compress(data, n, comp);
+    te1 = (now_seconds() - t0) / reps;
+    printf("%10zu %12.2f %12.2f %12.1f %12.1f %10zu %10zu\n", n, tb0 * 1e6,
+           tb1 * 1e6, n / te0 * 1e-6, n / te1 * 1e-6, out0, out1);
+  }
+  free(data), free(comp);
+}
+
+/* Encode MB/s of the bitwise and word encoders with the same codes. */
+static void
+benchmark_encode(void)
+{
+  byte *data = malloc(BENCH_MAX_BYTES), *comp = malloc(BENCH_MAX_BYTES);
+  size_t n;
+
+  if (!data || !comp)
+  {
+    free(data), free(comp);
+    return;
+  }
+  printf("\n%10s %12s %12s\n", "bytes", "bit MB/s", "word MB/s");
+  for (n = TEST_SIZE; n <= BENCH_MAX_BYTES; n *= 10)
+  {
+    size_t freq[256], reps = 20000000 / n + 1, r, c0 = 0, c1 = 0;
+    bits32 code[256];
+    byte clen[256];
+    HuffEncoder e;
+    double t0, tb, tw;
+
+    bench_fill(data, n);
+    huff_count(data, n, freq);
+    huff_canonical_lengths(freq, clen, HUFF_LIMIT);
+    huff_canonical_codes(clen, code);
+    huff_encoder_init(&e, code, clen);
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+      c0 = huff_encode_bitwise(data, n, code, clen, comp);
+    tb = (now_seconds() - t0) / reps;
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+      c1 = huff_encode_word(&e, data, n, comp, n);
+    tw = (now_seconds() - t0) / reps;
+    printf("%10zu %12.1f %12.1f%s\n", n, n / tb * 1e-6, n / tw * 1e-6,
+           c0 == c1 ? "" : " (size mismatch)");
+  }
+  free(data), free(comp);
+}
+
+#define BENCH_CONTAINER_BYTES 64000000
+
+/* Ratio and MB/s of containers with chunks of 64 KB and 1 MB for 1 to
+   all CPUs, next to huff_compress and huff_decompress over the whole
+   buffer with one code. */
+static void
+benchmark_container(void)
+{
+  static const size_t chunks[] = {65536, 1048576};
+  size_t n = BENCH_CONTAINER_BYTES, bound = huff_container_bound(n, 65536);
+  byte *data = malloc(n), *out = malloc(n), *comp = malloc(bound);
+  int ncpu = huff_cpu_count(), t, k;
+  size_t z, got;
+  double t0, tc, td;
+
+  if (!data || !out || !comp)
+  {
+    free(data), free(out), free(comp);
+    return;
+  }
+  bench_fill(data, n);
+  printf("\n%-14s %8s %8s %12s %12s\n", "container", "threads", "ratio",
+         "comp MB/s", "decomp MB/s");
+  t0 = now_seconds();
+  z = huff_compress(data, n, comp);
+  tc = now_seconds() - t0;
+  t0 = now_seconds();
+  huff_decompress(comp, z, out, n, &got);
+  td = now_seconds() - t0;
+  printf("%-14s %8d %8.4f %12.1f %12.1f%s\n", "one code", 1,
+         (double)z / n, n / tc * 1e-6, n / td * 1e-6,
+         memcmp(out, data, n) ? " (mismatch)" : "");
+  for (k = 0; k < 2; k++)
+    for (t = 1; t <= ncpu; t = t < ncpu && 2 * t > ncpu ? ncpu : 2 * t)
+    {
+      char label[32];
+
+      snprintf(label, sizeof(label), "%zu KB chunks", chunks[k] >> 10);
+      t0 = now_seconds();
+      z = huff_container_compress(data, n, chunks[k], comp, t);
+      tc = now_seconds() - t0;
+      memset(out, 0, n);
+      t0 = now_seconds();
+      huff_container_decompress(comp, z, out, n, &got, t);
+      td = now_seconds() - t0;
+      printf("%-14s %8d %8.4f %12.1f %12.1f%s\n", label, t, (double)z / n,
+             n / tc * 1e-6, n / td * 1e-6,
+             memcmp(out, data, n) ? " (mismatch)" : "");
+    }
+  free(data), free(out), free(comp);
+}
+
+/* Decode MB/s of one bitstream and of HUFF_STREAMS interleaved ones on
+   the same data, tables included. */
+static void
+benchmark_streams(void)
+{
+  byte *data = malloc(BENCH_MAX_BYTES), *out = malloc(BENCH_MAX_BYTES);
+  byte *comp = malloc(HUFF_HEADER_MAX + 4 * HUFF_STREAMS + BENCH_MAX_BYTES);
+  size_t n;
+
+  if (!data || !out || !comp)
+  {
+    free(data), free(out), free(comp);
+    return;
+  }
+  printf("\n%10s %12s %12s\n", "bytes", "1 MB/s", "4 MB/s");
+  for (n = TEST_SIZE; n <= BENCH_MAX_BYTES; n *= 10)
+  {
+    size_t reps = 20000000 / n + 1, r, z, got;
+    double t0, t1, t4;
+    int ok = 1;
+
+    bench_fill(data, n);
+    z = huff_compress(data, n, comp);
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+      ok &= huff_decompress(comp, z, out, n, &got);
+    t1 = (now_seconds() - t0) / reps;
+    ok &= 0 == memcmp(out, data, n);
+    memset(out, 0, n);
+    z = huff_compress4(data, n, comp);
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+      ok &= huff_decompress4(comp, z, out, n, &got);
+    t4 = (now_seconds() - t0) / reps;
+    ok &= 0 == memcmp(out, data, n);
+    printf("%10zu %12.1f %12.1f%s\n", n, n / t1 * 1e-6, n / t4 * 1e-6,
+           ok ? "" : " (mismatch)");
+  }
+  free(data), free(out), free(comp);
+}
+
+#endif /* BENCHMARK */
+
 /* ------------------------------ main ------------------------------ */
 
 int main()
@@ -550,12 +2167,23 @@ int main()
     compdecomp(test_data, TEST_SIZE);
   }
 
-  res = 0 == memcmp(test_data, orig_data, TEST_SIZE * sizeof(orig_data[0]));
+  res = 0 == memcmp(test_data, orig_data, TEST_SIZE * sizeof(orig_data[0]))
+        && huff_check_table() && huff_check_canonical()
+        && huff_check_word() && huff_check_container()
+        && huff_check_streams();
 
   correct = res == 1 ? 1 : 0;
 
   printf("The result is: %d\n", correct);
 
+#ifdef BENCHMARK
+  benchmark_decode();
+  benchmark_build();
+  benchmark_encode();
+  benchmark_container();
+  benchmark_streams();
+#endif
+
   return 0;
 }
 
@@ -34,8 +34,29 @@
 
 #define RPT 3
 
+#ifdef USE_PTHREADS
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#ifdef BENCHMARK
+#include <math.h>
+#include <time.h>
+#endif
 
 #define UPPERLIMIT 20
 #define RANDOM_VALUE (RandomInteger())
@@ -43,6 +64,8 @@
 #define MOD_SIZE 8095
 typedef long matrix[UPPERLIMIT][UPPERLIMIT];
 
+typedef struct GemmPool GemmPool;
+
 int values_match(long v1, long v2)
 {
   return (v1 == v2);
@@ -100,6 +123,835 @@ int RandomInteger(void)
   return (Seed);
 }
 
+/* ---------------------------- Gemm ----------------------------- */
+
+/*
+ * General M x N x K integer matrix multiply, C = A * B, for row-major
+ * matrices with leading dimensions lda, ldb and ldc. The loops are
+ * blocked so that a KC x NC panel of B stays in L2/L3 and a MC x KC block
+ * of A in L2 while a MR x NR tile of C is accumulated in registers by the
+ * micro-kernel. Both operands are packed first so the micro-kernel reads
+ * them sequentially; packing pads the edges with zeros, so the kernel
+ * always works on full tiles. 32-bit products wrap modulo 2**32 as the
+ * SIMD instructions do.
+ */
+
+#define GEMM_KC 256
+#define GEMM_MC 96
+#define GEMM_NC 2048
+
+#define GEMM32_MR 6
+#define GEMM32_NR 16
+#define GEMM64_MR 6
+#define GEMM64_NR 8
+
+/*
+ * Micro-kernels: tile = A sliver (kc x MR) * B sliver (kc x NR).
+ */
+#if defined(__AVX2__)
+
+#define KERNEL32_ROW(r)                                                  \
+  av = _mm256_set1_epi32(a[r]);                                          \
+  c##r##0 = _mm256_add_epi32(c##r##0, _mm256_mullo_epi32(av, b0));       \
+  c##r##1 = _mm256_add_epi32(c##r##1, _mm256_mullo_epi32(av, b1))
+
+#define KERNEL32_STORE(r)                                                \
+  _mm256_storeu_si256((__m256i *)(tile + r * GEMM32_NR), c##r##0);       \
+  _mm256_storeu_si256((__m256i *)(tile + r * GEMM32_NR + 8), c##r##1)
+
+static void KernelInt32(int kc, const int32_t *a, const int32_t *b,
+                        int32_t *tile)
+{
+  __m256i c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51;
+  __m256i av, b0, b1;
+  int p;
+
+  c00 = c01 = c10 = c11 = c20 = c21 = _mm256_setzero_si256();
+  c30 = c31 = c40 = c41 = c50 = c51 = _mm256_setzero_si256();
+
+  for (p = 0; p < kc; p++, a += GEMM32_MR, b += GEMM32_NR)
+  {
+    b0 = _mm256_loadu_si256((const __m256i *)b);
+    b1 = _mm256_loadu_si256((const __m256i *)(b + 8));
+    KERNEL32_ROW(0);
+    KERNEL32_ROW(1);
+    KERNEL32_ROW(2);
+    KERNEL32_ROW(3);
+    KERNEL32_ROW(4);
+    KERNEL32_ROW(5);
+  }
+
+  KERNEL32_STORE(0);
+  KERNEL32_STORE(1);
+  KERNEL32_STORE(2);
+  KERNEL32_STORE(3);
+  KERNEL32_STORE(4);
+  KERNEL32_STORE(5);
+}
+
+/* Low 64 bits of the lane products; AVX2 alone has no 64-bit multiply. */
+#if defined(__AVX512DQ__) && defined(__AVX512VL__)
+#define mullo_epi64(x, y) _mm256_mullo_epi64(x, y)
+#else
+static inline __m256i mullo_epi64(__m256i x, __m256i y)
+{
+  __m256i cross;
+
+  cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), y),
+                           _mm256_mul_epu32(x, _mm256_srli_epi64(y, 32)));
+  return _mm256_add_epi64(_mm256_mul_epu32(x, y),
+                          _mm256_slli_epi64(cross, 32));
+}
+#endif
+
+#define KERNEL64_ROW(r)                                                  \
+  av = _mm256_set1_epi64x(a[r]);                                         \
+  c##r##0 = _mm256_add_epi64(c##r##0, mullo_epi64(av, b0));              \
+  c##r##1 = _mm256_add_epi64(c##r##1, mullo_epi64(av, b1))
+
+#define KERNEL64_STORE(r)                                                \
+  _mm256_storeu_si256((__m256i *)(tile + r * GEMM64_NR), c##r##0);       \
+  _mm256_storeu_si256((__m256i *)(tile + r * GEMM64_NR + 4), c##r##1)
+
+static void KernelInt64(int kc, const int64_t *a, const int64_t *b,
+                        int64_t *tile)
+{
+  __m256i c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51;
+  __m256i av, b0, b1;
+  int p;
+
+  c00 = c01 = c10 = c11 = c20 = c21 = _mm256_setzero_si256();
+  c30 = c31 = c40 = c41 = c50 = c51 = _mm256_setzero_si256();
+
+  for (p = 0; p < kc; p++, a += GEMM64_MR, b += GEMM64_NR)
+  {
+    b0 = _mm256_loadu_si256((const __m256i *)b);
+    b1 = _mm256_loadu_si256((const __m256i *)(b + 4));
+    KERNEL64_ROW(0);
+    KERNEL64_ROW(1);
+    KERNEL64_ROW(2);
+    KERNEL64_ROW(3);
+    KERNEL64_ROW(4);
+    KERNEL64_ROW(5);
+  }
+
+  KERNEL64_STORE(0);
+  KERNEL64_STORE(1);
+  KERNEL64_STORE(2);
+  KERNEL64_STORE(3);
+  KERNEL64_STORE(4);
+  KERNEL64_STORE(5);
+}
+
+#else
+
+static void KernelInt32(int kc, const int32_t *a, const int32_t *b,
+                        int32_t *tile)
+{
+  uint32_t acc[GEMM32_MR * GEMM32_NR];
+  int p, i, j;
+
+  memset(acc, 0, sizeof(acc));
+  for (p = 0; p < kc; p++, a += GEMM32_MR, b += GEMM32_NR)
+    for (i = 0; i < GEMM32_MR; i++)
+      for (j = 0; j < GEMM32_NR; j++)
+        acc[i * GEMM32_NR + j] += (uint32_t)a[i] * (uint32_t)b[j];
+  for (i = 0; i < GEMM32_MR * GEMM32_NR; i++)
+    tile[i] = (int32_t)acc[i];
+}
+
+static void KernelInt64(int kc, const int64_t *a, const int64_t *b,
+                        int64_t *tile)
+{
+  uint64_t acc[GEMM64_MR * GEMM64_NR];
+  int p, i, j;
+
+  memset(acc, 0, sizeof(acc));
+  for (p = 0; p < kc; p++, a += GEMM64_MR, b += GEMM64_NR)
+    for (i = 0; i < GEMM64_MR; i++)
+      for (j = 0; j < GEMM64_NR; j++)
+        acc[i * GEMM64_NR + j] += (uint64_t)a[i] * (uint64_t)b[j];
+  for (i = 0; i < GEMM64_MR * GEMM64_NR; i++)
+    tile[i] = (int64_t)acc[i];
+}
+
+#endif
+
+/* ---------------------------- GemmPool ----------------------------- */
+
+/*
+ * Parallel Gemm. C is cut into GEMM_MC x GEMM_PAR_NC output tiles, each a
+ * task that runs the whole blocked loop nest for its tile over all of K,
+ * so tasks never share output and the result does not depend on the
+ * thread count. Every worker starts with a contiguous run of tasks in its
+ * own queue and, once that is drained, steals from the other queues in
+ * turn. Owner and thieves both claim from the front with an atomic add,
+ * which keeps the queues lock free.
+ *
+ * Each worker first touches its own packing buffers, so on a NUMA
+ * machine their pages are placed on the node the worker runs on; with
+ * USE_PTHREADS on Linux the workers are also pinned to one CPU each.
+ * Without USE_PTHREADS the pool has a single worker, the calling thread.
+ */
+
+#define GEMM_PAR_NC 512
+#define GEMM_MAX_THREADS 256
+
+typedef struct
+{
+  int next; /* Next unclaimed task. */
+  int end;
+  char pad[64 - 2 * sizeof(int)];
+} GemmQueue;
+
+typedef struct
+{
+  void (*block)(int m, int n, int k, const void *A, int lda, const void *B,
+                int ldb, void *C, int ldc, void *pa, void *pb);
+  size_t size;
+  int m, n, k, lda, ldb, ldc;
+  const char *A, *B;
+  char *C;
+} GemmJob;
+
+#ifdef USE_PTHREADS
+typedef struct
+{
+  GemmPool *pool;
+  int id;
+} GemmWorkerArg;
+#endif
+
+struct GemmPool
+{
+  int nthreads;
+  const GemmJob *job;
+  int tilesM, tiles;
+  GemmQueue queue[GEMM_MAX_THREADS];
+  void *packA[GEMM_MAX_THREADS], *packB[GEMM_MAX_THREADS];
+#ifdef USE_PTHREADS
+  pthread_t thread[GEMM_MAX_THREADS];
+  GemmWorkerArg arg[GEMM_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  int generation, pending, quit;
+#endif
+};
+
+#define GEMM_PACK_A_SIZE ((size_t)GEMM_MC * GEMM_KC * sizeof(int64_t))
+#define GEMM_PACK_B_SIZE ((size_t)GEMM_KC * GEMM_PAR_NC * sizeof(int64_t))
+
+/*
+ * Allocates packing buffers large enough for either element type for
+ * every worker. Returns 0 if out of memory.
+ */
+static int GemmPoolBuffers(GemmPool *pool)
+{
+  int id;
+
+  for (id = 0; id < pool->nthreads; id++)
+  {
+    pool->packA[id] = malloc(GEMM_PACK_A_SIZE);
+    pool->packB[id] = malloc(GEMM_PACK_B_SIZE);
+    if (pool->packA[id] == NULL || pool->packB[id] == NULL)
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * First touch of a worker's packing buffers, by the worker that uses them.
+ */
+static void GemmWorkerBuffers(GemmPool *pool, int id)
+{
+  memset(pool->packA[id], 0, GEMM_PACK_A_SIZE);
+  memset(pool->packB[id], 0, GEMM_PACK_B_SIZE);
+}
+
+static void GemmWorkerRun(GemmPool *pool, int id)
+{
+  const GemmJob *job = pool->job;
+  size_t sz = job->size;
+  int v, t, it, jt, i0, j0;
+
+  for (v = 0; v < pool->nthreads; v++)
+  {
+    GemmQueue *q = &pool->queue[(id + v) % pool->nthreads];
+
+    while ((t = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->end)
+    {
+      /* Consecutive tasks walk down a column of tiles. */
+      it = t % pool->tilesM;
+      jt = t / pool->tilesM;
+      i0 = it * GEMM_MC;
+      j0 = jt * GEMM_PAR_NC;
+      job->block(job->m - i0 < GEMM_MC ? job->m - i0 : GEMM_MC,
+                 job->n - j0 < GEMM_PAR_NC ? job->n - j0 : GEMM_PAR_NC,
+                 job->k, job->A + (size_t)i0 * job->lda * sz, job->lda,
+                 job->B + (size_t)j0 * sz, job->ldb,
+                 job->C + ((size_t)i0 * job->ldc + j0) * sz, job->ldc,
+                 pool->packA[id], pool->packB[id]);
+    }
+  }
+}
+
+#ifdef USE_PTHREADS
+static void *GemmWorkerThread(void *p)
+{
+  GemmPool *pool = ((GemmWorkerArg *)p)->pool;
+  int id = ((GemmWorkerArg *)p)->id;
+  int seen = 0;
+
+#ifdef __linux__
+  {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(id % CPU_SETSIZE, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+#endif
+  GemmWorkerBuffers(pool, id);
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+  {
+    while (pool->generation == seen && !pool->quit)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->quit)
+      break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    GemmWorkerRun(pool, id);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+#endif
+
+/*
+ * Creates a pool of nthreads workers, counting the calling thread, which
+ * takes part in every multiply. If a thread cannot be started the pool
+ * keeps the workers it has. Returns NULL if out of memory.
+ */
+GemmPool *GemmPoolCreate(int nthreads)
+{
+  GemmPool *pool = calloc(1, sizeof(GemmPool));
+  int i;
+
+  if (pool == NULL)
+    return NULL;
+#ifdef USE_PTHREADS
+  if (nthreads > GEMM_MAX_THREADS)
+    nthreads = GEMM_MAX_THREADS;
+#else
+  nthreads = 1;
+#endif
+  if (nthreads < 1)
+    nthreads = 1;
+  pool->nthreads = nthreads;
+  if (!GemmPoolBuffers(pool))
+  {
+    for (i = 0; i < nthreads; i++)
+    {
+      free(pool->packA[i]);
+      free(pool->packB[i]);
+    }
+    free(pool);
+    return NULL;
+  }
+  GemmWorkerBuffers(pool, 0);
+
+#ifdef USE_PTHREADS
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (i = 1; i < nthreads; i++)
+  {
+    pool->arg[i].pool = pool;
+    pool->arg[i].id = i;
+    if (pthread_create(&pool->thread[i], NULL, GemmWorkerThread,
+                       &pool->arg[i]) != 0)
+      break;
+  }
+  pool->nthreads = i;
+  for (; i < nthreads; i++)
+  {
+    free(pool->packA[i]);
+    free(pool->packB[i]);
+  }
+#endif
+  return pool;
+}
+
+void GemmPoolDestroy(GemmPool *pool)
+{
+  int i;
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 1; i < pool->nthreads; i++)
+    pthread_join(pool->thread[i], NULL);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+#endif
+  for (i = 0; i < pool->nthreads; i++)
+  {
+    free(pool->packA[i]);
+    free(pool->packB[i]);
+  }
+  free(pool);
+}
+
+/*
+ * Number of CPUs available, for sizing a pool.
+ */
+int GemmCpuCount(void)
+{
+#if defined(USE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n < 1 ? 1 : (int)n;
+#else
+  return 1;
+#endif
+}
+
+static void GemmPoolRun(GemmPool *pool, const GemmJob *job)
+{
+  int w, nt = pool->nthreads;
+
+  pool->job = job;
+  pool->tilesM = (job->m + GEMM_MC - 1) / GEMM_MC;
+  pool->tiles = pool->tilesM * ((job->n + GEMM_PAR_NC - 1) / GEMM_PAR_NC);
+  for (w = 0; w < nt; w++)
+  {
+    pool->queue[w].next = (int)((long)pool->tiles * w / nt);
+    pool->queue[w].end = (int)((long)pool->tiles * (w + 1) / nt);
+  }
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock(&pool->lock);
+  pool->pending = nt - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+#endif
+
+  GemmWorkerRun(pool, 0);
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+/*
+ * Packing, the blocked loop nest and the edge handling are the same for
+ * both element types. UT is the unsigned type used for wrapping adds.
+ */
+#define GEMM_DEFINE(NAME, T, UT, MR, NR, KERNEL)                          \
+  static T NAME##PackA[GEMM_MC * GEMM_KC];                                \
+  static T NAME##PackB[GEMM_KC * GEMM_NC];                                \
+                                                                          \
+  /* MR-row slivers of the mc x kc block at A, column by column. */       \
+  static void NAME##PackBlockA(int mc, int kc, const T *A, int lda, T *dst) \
+  {                                                                       \
+    int ir, p, i;                                                         \
+                                                                          \
+    for (ir = 0; ir < mc; ir += MR)                                       \
+      for (p = 0; p < kc; p++)                                            \
+        for (i = 0; i < MR; i++)                                          \
+          *dst++ = ir + i < mc ? A[(ir + i) * lda + p] : 0;               \
+  }                                                                       \
+                                                                          \
+  /* NR-column slivers of the kc x nc panel at B, row by row. */          \
+  static void NAME##PackPanelB(int kc, int nc, const T *B, int ldb, T *dst) \
+  {                                                                       \
+    int jr, p, j;                                                         \
+                                                                          \
+    for (jr = 0; jr < nc; jr += NR)                                       \
+      for (p = 0; p < kc; p++)                                            \
+        for (j = 0; j < NR; j++)                                          \
+          *dst++ = jr + j < nc ? B[p * ldb + jr + j] : 0;                 \
+  }                                                                       \
+                                                                          \
+  /* C += packed A block * packed B panel. */                             \
+  static void NAME##Macro(int mc, int nc, int kc, const T *pa,            \
+                          const T *pb, T *C, int ldc)                     \
+  {                                                                       \
+    T tile[MR * NR];                                                      \
+    int ir, jr, i, j, mr, nr;                                             \
+                                                                          \
+    for (jr = 0; jr < nc; jr += NR)                                       \
+      for (ir = 0; ir < mc; ir += MR)                                     \
+      {                                                                   \
+        KERNEL(kc, pa + ir * kc, pb + jr * kc, tile);                     \
+        mr = mc - ir < MR ? mc - ir : MR;                                 \
+        nr = nc - jr < NR ? nc - jr : NR;                                 \
+        for (i = 0; i < mr; i++)                                          \
+          for (j = 0; j < nr; j++)                                        \
+            C[(ir + i) * ldc + jr + j] = (T)((UT)C[(ir + i) * ldc + jr + j] \
+                                             + (UT)tile[i * NR + j]);     \
+      }                                                                   \
+  }                                                                       \
+                                                                          \
+  /* The blocked loop nest, packing through the caller's buffers pa    \
+     (GEMM_MC x GEMM_KC) and pb (GEMM_KC x GEMM_NC). */                   \
+  static void NAME##Block(int m, int n, int k, const T *A, int lda,       \
+                          const T *B, int ldb, T *C, int ldc, T *pa,      \
+                          T *pb)                                          \
+  {                                                                       \
+    int jc, pc, ic, nc, kc, mc, i;                                        \
+                                                                          \
+    for (i = 0; i < m; i++)                                               \
+      memset(C + i * ldc, 0, n * sizeof(T));                              \
+                                                                          \
+    for (jc = 0; jc < n; jc += GEMM_NC)                                   \
+    {                                                                     \
+      nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;                           \
+      for (pc = 0; pc < k; pc += GEMM_KC)                                 \
+      {                                                                   \
+        kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;                         \
+        NAME##PackPanelB(kc, nc, B + pc * ldb + jc, ldb, pb);             \
+        for (ic = 0; ic < m; ic += GEMM_MC)                               \
+        {                                                                 \
+          mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;                       \
+          NAME##PackBlockA(mc, kc, A + ic * lda + pc, lda, pa);           \
+          NAME##Macro(mc, nc, kc, pa, pb, C + ic * ldc + jc, ldc);        \
+        }                                                                 \
+      }                                                                   \
+    }                                                                     \
+  }                                                                       \
+                                                                          \
+  static void NAME##BlockV(int m, int n, int k, const void *A, int lda,   \
+                           const void *B, int ldb, void *C, int ldc,      \
+                           void *pa, void *pb)                            \
+  {                                                                       \
+    NAME##Block(m, n, k, (const T *)A, lda, (const T *)B, ldb, (T *)C,    \
+                ldc, (T *)pa, (T *)pb);                                   \
+  }                                                                       \
+                                                                          \
+  void NAME(int m, int n, int k, const T *A, int lda, const T *B,         \
+            int ldb, T *C, int ldc)                                       \
+  {                                                                       \
+    NAME##Block(m, n, k, A, lda, B, ldb, C, ldc, NAME##PackA,             \
+                NAME##PackB);                                             \
+  }                                                                       \
+                                                                          \
+  void NAME##Parallel(GemmPool *pool, int m, int n, int k, const T *A,    \
+                      int lda, const T *B, int ldb, T *C, int ldc)        \
+  {                                                                       \
+    GemmJob job;                                                          \
+                                                                          \
+    job.block = NAME##BlockV;                                             \
+    job.size = sizeof(T);                                                 \
+    job.m = m;                                                            \
+    job.n = n;                                                            \
+    job.k = k;                                                            \
+    job.A = (const char *)A;                                              \
+    job.B = (const char *)B;                                              \
+    job.C = (char *)C;                                                    \
+    job.lda = lda;                                                        \
+    job.ldb = ldb;                                                        \
+    job.ldc = ldc;                                                        \
+    GemmPoolRun(pool, &job);                                              \
+  }
+
+GEMM_DEFINE(GemmInt32, int32_t, uint32_t, GEMM32_MR, GEMM32_NR, KernelInt32)
+GEMM_DEFINE(GemmInt64, int64_t, uint64_t, GEMM64_MR, GEMM64_NR, KernelInt64)
+
+/*
+ * The naive i-j-k loop of Multiply, for run-time sizes. Used to verify
+ * the Gemm routines.
+ */
+void MultiplyNaive32(int m, int n, int k, const int32_t *A, const int32_t *B,
+                     int32_t *Res)
+{
+  int Outer, Inner, Index;
+  uint32_t sum;
+
+  for (Outer = 0; Outer < m; Outer++)
+    for (Inner = 0; Inner < n; Inner++)
+    {
+      sum = ZERO;
+      for (Index = 0; Index < k; Index++)
+        sum += (uint32_t)A[Outer * k + Index] * (uint32_t)B[Index * n + Inner];
+      Res[Outer * n + Inner] = (int32_t)sum;
+    }
+}
+
+void MultiplyNaive64(int m, int n, int k, const int64_t *A, const int64_t *B,
+                     int64_t *Res)
+{
+  int Outer, Inner, Index;
+  int64_t sum;
+
+  for (Outer = 0; Outer < m; Outer++)
+    for (Inner = 0; Inner < n; Inner++)
+    {
+      sum = ZERO;
+      for (Index = 0; Index < k; Index++)
+        sum += A[Outer * k + Index] * B[Index * n + Inner];
+      Res[Outer * n + Inner] = sum;
+    }
+}
+
+/*
+ * Multiplies random m x k and k x n matrices, m * k and k * n at most
+ * CHECK_MAX * CHECK_MAX, with Gemm and the naive loops and returns 1 if
+ * both element types agree.
+ */
+#define CHECK_MAX 160
+
+int32_t CheckA32[CHECK_MAX * CHECK_MAX], CheckB32[CHECK_MAX * CHECK_MAX];
+int32_t CheckC32[CHECK_MAX * CHECK_MAX], CheckR32[CHECK_MAX * CHECK_MAX];
+int64_t CheckA64[CHECK_MAX * CHECK_MAX], CheckB64[CHECK_MAX * CHECK_MAX];
+int64_t CheckC64[CHECK_MAX * CHECK_MAX], CheckR64[CHECK_MAX * CHECK_MAX];
+
+int CheckGemm(int m, int n, int k)
+{
+  int i;
+
+  for (i = 0; i < m * k; i++)
+    CheckA64[i] = CheckA32[i] = RANDOM_VALUE;
+  for (i = 0; i < k * n; i++)
+    CheckB64[i] = CheckB32[i] = RANDOM_VALUE;
+
+  GemmInt32(m, n, k, CheckA32, k, CheckB32, n, CheckC32, n);
+  MultiplyNaive32(m, n, k, CheckA32, CheckB32, CheckR32);
+  GemmInt64(m, n, k, CheckA64, k, CheckB64, n, CheckC64, n);
+  MultiplyNaive64(m, n, k, CheckA64, CheckB64, CheckR64);
+
+  return 0 == memcmp(CheckC32, CheckR32, m * n * sizeof(CheckC32[0]))
+         && 0 == memcmp(CheckC64, CheckR64, m * n * sizeof(CheckC64[0]));
+}
+
+/*
+ * The same check for the parallel path, against the serial Gemm.
+ */
+int CheckGemmParallel(GemmPool *pool, int m, int n, int k)
+{
+  int i;
+
+  for (i = 0; i < m * k; i++)
+    CheckA64[i] = CheckA32[i] = RANDOM_VALUE;
+  for (i = 0; i < k * n; i++)
+    CheckB64[i] = CheckB32[i] = RANDOM_VALUE;
+
+  GemmInt32Parallel(pool, m, n, k, CheckA32, k, CheckB32, n, CheckC32, n);
+  GemmInt32(m, n, k, CheckA32, k, CheckB32, n, CheckR32, n);
+  GemmInt64Parallel(pool, m, n, k, CheckA64, k, CheckB64, n, CheckC64, n);
+  GemmInt64(m, n, k, CheckA64, k, CheckB64, n, CheckR64, n);
+
+  return 0 == memcmp(CheckC32, CheckR32, m * n * sizeof(CheckC32[0]))
+         && 0 == memcmp(CheckC64, CheckR64, m * n * sizeof(CheckC64[0]));
+}
+
+/* ---------------------------- benchmark ----------------------------- */
+
+#ifdef BENCHMARK
+#ifndef BENCH_MAX_SIZE
+#define BENCH_MAX_SIZE 4096
+#endif
+
+/* Beyond this size the naive loop is too slow to time on every run;
+   larger results are spot-checked instead. */
+#define BENCH_NAIVE_MAX 512
+
+double NowSeconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * GOPS of GemmInt64Parallel on p = 1 .. all CPUs. Strong scaling keeps
+ * n fixed; weak scaling grows n with the cube root of p so the work per
+ * thread stays constant. Speedups are against one worker and against
+ * the single-threaded naive Multiply loop at BENCH_NAIVE_MAX.
+ */
+void BenchmarkScaling(double naive)
+{
+  int ncpu = GemmCpuCount();
+  int strong = BENCH_MAX_SIZE < 2048 ? BENCH_MAX_SIZE : 2048;
+  int weak = strong / 2;
+  int pass, p, i, n;
+  double t0, t, gops, gops1 = 0;
+  int64_t *a, *b, *c;
+
+  printf("naive Multiply, 1 thread, n = %d: %.2f GOPS\n", BENCH_NAIVE_MAX,
+         naive);
+
+  for (pass = 0; pass < 2; pass++)
+  {
+    printf("%s scaling, int64:\n", pass == 0 ? "strong" : "weak");
+    for (p = 1; p <= ncpu; p = p * 2 > ncpu && p != ncpu ? ncpu : p * 2)
+    {
+      GemmPool *pool = GemmPoolCreate(p);
+
+      n = pass == 0 ? strong : (int)(weak * cbrt((double)p) + 0.5);
+      a = malloc((size_t)n * n * sizeof(*a));
+      b = malloc((size_t)n * n * sizeof(*b));
+      c = malloc((size_t)n * n * sizeof(*c));
+      if (pool == NULL || a == NULL || b == NULL || c == NULL)
+      {
+        free(a);
+        free(b);
+        free(c);
+        if (pool != NULL)
+          GemmPoolDestroy(pool);
+        break;
+      }
+      InitSeed();
+      for (i = 0; i < n * n; i++)
+        a[i] = RANDOM_VALUE;
+      for (i = 0; i < n * n; i++)
+        b[i] = RANDOM_VALUE;
+
+      GemmInt64Parallel(pool, n, n, n, a, n, b, n, c, n); /* Warm up. */
+      t0 = NowSeconds();
+      GemmInt64Parallel(pool, n, n, n, a, n, b, n, c, n);
+      t = NowSeconds() - t0;
+      gops = 2.0 * n * n * n / t * 1e-9;
+      if (p == 1)
+        gops1 = gops;
+      printf("  %3d threads, n = %4d: %7.2f GOPS, %5.2fx vs 1 thread "
+             "(%3.0f%% efficiency), %6.1fx vs naive\n",
+             p, n, gops, gops / gops1, 100.0 * gops / gops1 / p,
+             gops / naive);
+
+      free(a);
+      free(b);
+      free(c);
+      GemmPoolDestroy(pool);
+    }
+  }
+}
+
+/*
+ * GOPS (two operations per multiply-add) of the naive loop and of Gemm
+ * for square matrices of each size.
+ */
+void Benchmark(void)
+{
+  static const int sizes[] = {20, 64, 128, 256, 512, 1024, 2048, 4096};
+  int s, i, j, p, n, reps, ok;
+  double t0, tn, t32, t64, ops, naive = 0;
+
+  for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+  {
+    int32_t *a32, *b32, *c32, *r32;
+    int64_t *a64, *b64, *c64, *r64;
+
+    n = sizes[s];
+    if (n > BENCH_MAX_SIZE)
+      break;
+    ops = 2.0 * n * n * n;
+    reps = (int)(2e9 / ops) + 1;
+
+    a32 = malloc((size_t)n * n * sizeof(*a32));
+    b32 = malloc((size_t)n * n * sizeof(*b32));
+    c32 = malloc((size_t)n * n * sizeof(*c32));
+    r32 = malloc((size_t)n * n * sizeof(*r32));
+    a64 = malloc((size_t)n * n * sizeof(*a64));
+    b64 = malloc((size_t)n * n * sizeof(*b64));
+    c64 = malloc((size_t)n * n * sizeof(*c64));
+    r64 = malloc((size_t)n * n * sizeof(*r64));
+    if (a32 == NULL || b32 == NULL || c32 == NULL || r32 == NULL
+        || a64 == NULL || b64 == NULL || c64 == NULL || r64 == NULL)
+    {
+      free(a32);
+      free(b32);
+      free(c32);
+      free(r32);
+      free(a64);
+      free(b64);
+      free(c64);
+      free(r64);
+      break;
+    }
+
+    InitSeed();
+    for (i = 0; i < n * n; i++)
+      a64[i] = a32[i] = RANDOM_VALUE;
+    for (i = 0; i < n * n; i++)
+      b64[i] = b32[i] = RANDOM_VALUE;
+
+    tn = 0;
+    if (n <= BENCH_NAIVE_MAX)
+    {
+      t0 = NowSeconds();
+      for (i = 0; i < reps; i++)
+        MultiplyNaive64(n, n, n, a64, b64, r64);
+      tn = (NowSeconds() - t0) / reps;
+      naive = ops / tn * 1e-9;
+      MultiplyNaive32(n, n, n, a32, b32, r32);
+    }
+
+    t0 = NowSeconds();
+    for (i = 0; i < reps; i++)
+      GemmInt32(n, n, n, a32, n, b32, n, c32, n);
+    t32 = (NowSeconds() - t0) / reps;
+
+    t0 = NowSeconds();
+    for (i = 0; i < reps; i++)
+      GemmInt64(n, n, n, a64, n, b64, n, c64, n);
+    t64 = (NowSeconds() - t0) / reps;
+
+    if (n <= BENCH_NAIVE_MAX)
+      ok = 0 == memcmp(c32, r32, (size_t)n * n * sizeof(*c32))
+           && 0 == memcmp(c64, r64, (size_t)n * n * sizeof(*c64));
+    else
+    {
+      ok = 1;
+      for (i = 0; i < n; i += n / 7)
+        for (j = 0; j < n; j += n / 5)
+        {
+          int64_t sum = 0;
+
+          for (p = 0; p < n; p++)
+            sum += a64[i * n + p] * b64[p * n + j];
+          ok &= sum == c64[i * n + j];
+          ok &= (int32_t)(uint32_t)sum == c32[i * n + j];
+        }
+    }
+
+    if (tn > 0)
+      printf("%5d: naive %7.2f GOPS, int32 %7.2f GOPS, int64 %7.2f GOPS%s\n",
+             n, ops / tn * 1e-9, ops / t32 * 1e-9, ops / t64 * 1e-9,
+             ok ? "" : " MISMATCH");
+    else
+      printf("%5d: naive       -      , int32 %7.2f GOPS, int64 %7.2f GOPS%s\n",
+             n, ops / t32 * 1e-9, ops / t64 * 1e-9, ok ? "" : " MISMATCH");
+
+    free(a32);
+    free(b32);
+    free(c32);
+    free(r32);
+    free(a64);
+    free(b64);
+    free(c64);
+    free(r64);
+  }
+
+  BenchmarkScaling(naive);
+}
+#endif
+
 /* ------------------------------ main ------------------------------ */
 
 int main()
@@ -211,10 +1063,64 @@ int main()
   res = 0 == memcmp(ResultArray, exp,
                     UPPERLIMIT * UPPERLIMIT * sizeof(exp[0][0]));
 
+  /* The blocked Gemm on the same 20 x 20 inputs, then on sizes that
+     leave partial tiles in every dimension. */
+
+  {
+    static int64_t A64[UPPERLIMIT * UPPERLIMIT], B64[UPPERLIMIT * UPPERLIMIT];
+    static int64_t C64[UPPERLIMIT * UPPERLIMIT];
+
+    for (OuterIndex = 0; OuterIndex < UPPERLIMIT; OuterIndex++)
+      for (InnerIndex = 0; InnerIndex < UPPERLIMIT; InnerIndex++)
+      {
+        A64[OuterIndex * UPPERLIMIT + InnerIndex] =
+            ArrayA_ref[OuterIndex][InnerIndex];
+        B64[OuterIndex * UPPERLIMIT + InnerIndex] =
+            ArrayB_ref[OuterIndex][InnerIndex];
+      }
+    GemmInt64(UPPERLIMIT, UPPERLIMIT, UPPERLIMIT, A64, UPPERLIMIT, B64,
+              UPPERLIMIT, C64, UPPERLIMIT);
+    for (OuterIndex = 0; OuterIndex < UPPERLIMIT; OuterIndex++)
+      for (InnerIndex = 0; InnerIndex < UPPERLIMIT; InnerIndex++)
+        if (!values_match(C64[OuterIndex * UPPERLIMIT + InnerIndex],
+                          exp[OuterIndex][InnerIndex]))
+          res = 0;
+
+    res &= CheckGemm(UPPERLIMIT, UPPERLIMIT, UPPERLIMIT);
+    res &= CheckGemm(1, 1, 1);
+    res &= CheckGemm(37, 53, 71);
+    res &= CheckGemm(CHECK_MAX, 101, CHECK_MAX - 1);
+    /* Several K panels, the last one partial. */
+    res &= CheckGemm(37, 45, GEMM_KC + 61);
+  }
+
+  {
+    /* Two pools alive at once must not share any state. */
+    GemmPool *pool = GemmPoolCreate(3), *pool2 = GemmPoolCreate(2);
+
+    if (pool == NULL || pool2 == NULL)
+      res = 0;
+    else
+    {
+      res &= CheckGemmParallel(pool, UPPERLIMIT, UPPERLIMIT, UPPERLIMIT);
+      res &= CheckGemmParallel(pool2, CHECK_MAX, CHECK_MAX, CHECK_MAX - 3);
+      res &= CheckGemmParallel(pool, CHECK_MAX, CHECK_MAX, CHECK_MAX - 3);
+      res &= CheckGemmParallel(pool, 64, 80, GEMM_KC + 61);
+    }
+    if (pool != NULL)
+      GemmPoolDestroy(pool);
+    if (pool2 != NULL)
+      GemmPoolDestroy(pool2);
+  }
+
   correct = res == 1 ? 1 : 0;
 
   printf("The result is: %d\n", correct);
 
+#ifdef BENCHMARK
+  Benchmark();
+#endif
+
   return 0;
 }
 
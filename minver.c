@@ -61,6 +61,15 @@
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifdef BENCHMARK
+#include <stdlib.h>
+#include <time.h>
+#endif
+
 #define VERIFY_FLOAT_EPS 1.0e-5
 
 #define float_eq_beebs(exp, actual) (fabsf(exp - actual) < VERIFY_FLOAT_EPS)
@@ -210,6 +219,747 @@ int minver(int row, int col, float eps)
   return (0);
 }
 
+/* ------------------------------ batch ------------------------------ */
+
+/* Batched inversion and multiplication of 3x3 and 4x4 float matrices.
+   Batches are structure of arrays: element (r, c) of matrix i is at
+   m[(r * N + c) * count + i], so one SIMD register holds the same
+   element of consecutive matrices and every lane runs the same closed
+   form cofactor expansion. Nothing branches on the data, and a partial
+   final group is copied into a zero padded block so every group is
+   full. The V* macros select 8 lanes with AVX, 4 with SSE2 and plain
+   floats otherwise. */
+
+#if defined(__AVX__)
+#define VLANES 8
+typedef __m256 vfloat;
+#define VLOAD(p) _mm256_loadu_ps(p)
+#define VSTORE(p, x) _mm256_storeu_ps(p, x)
+#define VSET1(x) _mm256_set1_ps(x)
+#define VADD(x, y) _mm256_add_ps(x, y)
+#define VSUB(x, y) _mm256_sub_ps(x, y)
+#define VMUL(x, y) _mm256_mul_ps(x, y)
+#define VDIV(x, y) _mm256_div_ps(x, y)
+#define VABS(x) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x)
+#define VGT(x, y) _mm256_cmp_ps(x, y, _CMP_GT_OQ)
+#define VSEL(m, x, y) _mm256_blendv_ps(y, x, m)
+#define VCOUNT(m) __builtin_popcount(_mm256_movemask_ps(m))
+#elif defined(__SSE2__)
+#define VLANES 4
+typedef __m128 vfloat;
+#define VLOAD(p) _mm_loadu_ps(p)
+#define VSTORE(p, x) _mm_storeu_ps(p, x)
+#define VSET1(x) _mm_set1_ps(x)
+#define VADD(x, y) _mm_add_ps(x, y)
+#define VSUB(x, y) _mm_sub_ps(x, y)
+#define VMUL(x, y) _mm_mul_ps(x, y)
+#define VDIV(x, y) _mm_div_ps(x, y)
+#define VABS(x) _mm_andnot_ps(_mm_set1_ps(-0.0f), x)
+#define VGT(x, y) _mm_cmpgt_ps(x, y)
+#define VSEL(m, x, y) _mm_or_ps(_mm_and_ps(m, x), _mm_andnot_ps(m, y))
+#define VCOUNT(m) __builtin_popcount(_mm_movemask_ps(m))
+#else
+#define VLANES 1
+typedef float vfloat;
+#define VLOAD(p) (*(p))
+#define VSTORE(p, x) (*(p) = (x))
+#define VSET1(x) (x)
+#define VADD(x, y) ((x) + (y))
+#define VSUB(x, y) ((x) - (y))
+#define VMUL(x, y) ((x) * (y))
+#define VDIV(x, y) ((x) / (y))
+#define VABS(x) minver_fabs(x)
+#define VGT(x, y) ((x) > (y) ? 1.0f : 0.0f)
+#define VSEL(m, x, y) ((m) != 0.0f ? (x) : (y))
+#define VCOUNT(m) ((m) != 0.0f)
+#endif
+
+/* x*y - z*w */
+#define VDIFF(x, y, z, w) VSUB(VMUL(x, y), VMUL(z, w))
+
+/* Inverts VLANES 3x3 matrices. m and inv point to element (0, 0) of the
+   first matrix, consecutive elements being stride floats apart. Returns
+   the number of singular matrices, whose inverse is set to zero. */
+
+static int
+minver3_lanes(const float *m, float *inv, float *det, int stride, float eps)
+{
+  vfloat m0 = VLOAD(m), m1 = VLOAD(m + stride), m2 = VLOAD(m + 2 * stride);
+  vfloat m3 = VLOAD(m + 3 * stride), m4 = VLOAD(m + 4 * stride);
+  vfloat m5 = VLOAD(m + 5 * stride), m6 = VLOAD(m + 6 * stride);
+  vfloat m7 = VLOAD(m + 7 * stride), m8 = VLOAD(m + 8 * stride);
+  vfloat c0, c1, c2, d, ok, r, zero = VSET1(0.0f);
+
+  c0 = VDIFF(m4, m8, m5, m7);
+  c1 = VDIFF(m5, m6, m3, m8);
+  c2 = VDIFF(m3, m7, m4, m6);
+  d = VADD(VADD(VMUL(m0, c0), VMUL(m1, c1)), VMUL(m2, c2));
+  ok = VGT(VABS(d), VSET1(eps));
+  r = VSEL(ok, VDIV(VSET1(1.0f), d), zero);
+
+  VSTORE(inv, VMUL(c0, r));
+  VSTORE(inv + stride, VMUL(VDIFF(m2, m7, m1, m8), r));
+  VSTORE(inv + 2 * stride, VMUL(VDIFF(m1, m5, m2, m4), r));
+  VSTORE(inv + 3 * stride, VMUL(c1, r));
+  VSTORE(inv + 4 * stride, VMUL(VDIFF(m0, m8, m2, m6), r));
+  VSTORE(inv + 5 * stride, VMUL(VDIFF(m2, m3, m0, m5), r));
+  VSTORE(inv + 6 * stride, VMUL(c2, r));
+  VSTORE(inv + 7 * stride, VMUL(VDIFF(m1, m6, m0, m7), r));
+  VSTORE(inv + 8 * stride, VMUL(VDIFF(m0, m4, m1, m3), r));
+  VSTORE(det, d);
+
+  return VLANES - VCOUNT(ok);
+}
+
+/* The same for 4x4 matrices, from the 2x2 minors of the top two rows (s)
+   and the bottom two rows (c). */
+
+static int
+minver4_lanes(const float *m, float *inv, float *det, int stride, float eps)
+{
+  vfloat a[16], s0, s1, s2, s3, s4, s5, c0, c1, c2, c3, c4, c5;
+  vfloat d, ok, r, zero = VSET1(0.0f);
+  int i;
+
+  for (i = 0; i < 16; i++)
+    a[i] = VLOAD(m + i * stride);
+
+  s0 = VDIFF(a[0], a[5], a[4], a[1]);
+  s1 = VDIFF(a[0], a[6], a[4], a[2]);
+  s2 = VDIFF(a[0], a[7], a[4], a[3]);
+  s3 = VDIFF(a[1], a[6], a[5], a[2]);
+  s4 = VDIFF(a[1], a[7], a[5], a[3]);
+  s5 = VDIFF(a[2], a[7], a[6], a[3]);
+  c5 = VDIFF(a[10], a[15], a[14], a[11]);
+  c4 = VDIFF(a[9], a[15], a[13], a[11]);
+  c3 = VDIFF(a[9], a[14], a[13], a[10]);
+  c2 = VDIFF(a[8], a[15], a[12], a[11]);
+  c1 = VDIFF(a[8], a[14], a[12], a[10]);
+  c0 = VDIFF(a[8], a[13], a[12], a[9]);
+
+  d = VADD(VSUB(VMUL(s0, c5), VMUL(s1, c4)), VMUL(s2, c3));
+  d = VADD(VSUB(VADD(d, VMUL(s3, c2)), VMUL(s4, c1)), VMUL(s5, c0));
+  ok = VGT(VABS(d), VSET1(eps));
+  r = VSEL(ok, VDIV(VSET1(1.0f), d), zero);
+
+#define MINV4_OUT(k, x, p, y, q, z, w)                                     \
+  VSTORE(inv + (k) * stride,                                             \
+         VMUL(VADD(VSUB(VMUL(x, p), VMUL(y, q)), VMUL(z, w)), r))
+
+  MINV4_OUT(0, a[5], c5, a[6], c4, a[7], c3);
+  MINV4_OUT(1, a[2], c4, a[1], c5, VSUB(zero, a[3]), c3);
+  MINV4_OUT(2, a[13], s5, a[14], s4, a[15], s3);
+  MINV4_OUT(3, a[10], s4, a[9], s5, VSUB(zero, a[11]), s3);
+  MINV4_OUT(4, a[6], c2, a[4], c5, VSUB(zero, a[7]), c1);
+  MINV4_OUT(5, a[0], c5, a[2], c2, a[3], c1);
+  MINV4_OUT(6, a[14], s2, a[12], s5, VSUB(zero, a[15]), s1);
+  MINV4_OUT(7, a[8], s5, a[10], s2, a[11], s1);
+  MINV4_OUT(8, a[4], c4, a[5], c2, a[7], c0);
+  MINV4_OUT(9, a[1], c2, a[0], c4, VSUB(zero, a[3]), c0);
+  MINV4_OUT(10, a[12], s4, a[13], s2, a[15], s0);
+  MINV4_OUT(11, a[9], s2, a[8], s4, VSUB(zero, a[11]), s0);
+  MINV4_OUT(12, a[5], c1, a[4], c3, VSUB(zero, a[6]), c0);
+  MINV4_OUT(13, a[0], c3, a[1], c1, a[2], c0);
+  MINV4_OUT(14, a[13], s1, a[12], s3, VSUB(zero, a[14]), s0);
+  MINV4_OUT(15, a[8], s3, a[9], s1, a[10], s0);
+#undef MINV4_OUT
+  VSTORE(det, d);
+
+  return VLANES - VCOUNT(ok);
+}
+
+/* c = a * b for VLANES pairs of N x N matrices; N is a compile time
+   constant in each instance so the loops unroll completely. */
+
+#define MMUL_LANES_DEFINE(N)                                               \
+  static void mmul##N##_lanes(const float *a, const float *b, float *c,  \
+                              int stride)                                \
+  {                                                                      \
+    vfloat x[N * N], y[N * N], w;                                        \
+    int i, j, k;                                                         \
+                                                                         \
+    for (i = 0; i < N * N; i++)                                          \
+    {                                                                    \
+      x[i] = VLOAD(a + i * stride);                                      \
+      y[i] = VLOAD(b + i * stride);                                      \
+    }                                                                    \
+    for (i = 0; i < N; i++)                                              \
+      for (j = 0; j < N; j++)                                            \
+      {                                                                  \
+        w = VMUL(x[i * N], y[j]);                                        \
+        for (k = 1; k < N; k++)                                          \
+          w = VADD(w, VMUL(x[i * N + k], y[k * N + j]));                 \
+        VSTORE(c + (i * N + j) * stride, w);                             \
+      }                                                                  \
+  }
+
+MMUL_LANES_DEFINE(3)
+MMUL_LANES_DEFINE(4)
+
+/* Batch entry points. count matrices in structure of arrays layout; det
+   may be NULL. The inversions return the number of matrices with
+   |det| <= eps, whose inverse is left as zero. */
+
+#define BATCH_DEFINE(N)                                                    \
+  int minver##N##_batch(int count, const float *m, float *inv,           \
+                        float *det, float eps)                           \
+  {                                                                      \
+    float pm[N * N * VLANES], pinv[N * N * VLANES], pdet[VLANES];        \
+    float dummy[VLANES];                                                 \
+    int i, e, l, rest, singular = 0;                                     \
+                                                                         \
+    for (i = 0; i + VLANES <= count; i += VLANES)                        \
+      singular += minver##N##_lanes(m + i, inv + i,                      \
+                                    det ? det + i : dummy, count, eps);  \
+    rest = count - i;                                                    \
+    if (rest > 0)                                                        \
+    {                                                                    \
+      for (e = 0; e < N * N; e++)                                        \
+        for (l = 0; l < VLANES; l++)                                     \
+          pm[e * VLANES + l] = l < rest ? m[e * count + i + l]           \
+                                        : (e % (N + 1) == 0);            \
+      singular += minver##N##_lanes(pm, pinv, pdet, VLANES, eps);        \
+      for (e = 0; e < N * N; e++)                                        \
+        for (l = 0; l < rest; l++)                                       \
+          inv[e * count + i + l] = pinv[e * VLANES + l];                 \
+      for (l = 0; l < rest && det; l++)                                  \
+        det[i + l] = pdet[l];                                            \
+    }                                                                    \
+    return singular;                                                     \
+  }                                                                      \
+                                                                         \
+  void mmul##N##_batch(int count, const float *a, const float *b,        \
+                       float *c)                                         \
+  {                                                                      \
+    float pa[N * N * VLANES], pb[N * N * VLANES], pc[N * N * VLANES];    \
+    int i, e, l, rest;                                                   \
+                                                                         \
+    for (i = 0; i + VLANES <= count; i += VLANES)                        \
+      mmul##N##_lanes(a + i, b + i, c + i, count);                       \
+    rest = count - i;                                                    \
+    if (rest > 0)                                                        \
+    {                                                                    \
+      for (e = 0; e < N * N; e++)                                        \
+        for (l = 0; l < VLANES; l++)                                     \
+        {                                                                \
+          pa[e * VLANES + l] = l < rest ? a[e * count + i + l] : 0.0f;   \
+          pb[e * VLANES + l] = l < rest ? b[e * count + i + l] : 0.0f;   \
+        }                                                                \
+      mmul##N##_lanes(pa, pb, pc, VLANES);                               \
+      for (e = 0; e < N * N; e++)                                        \
+        for (l = 0; l < rest; l++)                                       \
+          c[e * count + i + l] = pc[e * VLANES + l];                     \
+    }                                                                    \
+  }
+
+BATCH_DEFINE(3)
+BATCH_DEFINE(4)
+
+/* Checks the batched routines against minver and mmul. minver only
+   unscrambles its row swaps correctly when it makes none, so the random
+   3x3 matrices compared with it are column diagonally dominant, which
+   keeps every pivot on the diagonal. The batch also holds a_ref, whose
+   determinant is -150, and a singular matrix. Random 4x4 matrices times
+   their batched inverse must give the identity. Returns 1 if all
+   agree. */
+
+#define BATCH_CHECK 45
+
+static float batch_m[16 * BATCH_CHECK], batch_inv[16 * BATCH_CHECK];
+static float batch_c[16 * BATCH_CHECK], batch_det[BATCH_CHECK];
+
+static void
+batch_random(int n, unsigned *seed)
+{
+  int i, j, k;
+
+  for (i = 0; i < n * n * BATCH_CHECK; i++)
+  {
+    *seed = *seed * 1103515245u + 12345u;
+    batch_m[i] = (float)((*seed >> 16) % 2001) / 100.0f - 10.0f;
+  }
+  for (i = 0; i < BATCH_CHECK; i++)
+    for (k = 0; k < n; k++)
+    {
+      float sum = 1.0f;
+
+      for (j = 0; j < n; j++)
+        if (j != k)
+          sum += minver_fabs(batch_m[(j * n + k) * BATCH_CHECK + i]);
+      batch_m[(k * n + k) * BATCH_CHECK + i] = (i & 1) ? sum : -sum;
+    }
+}
+
+static int
+batch_check(void)
+{
+  unsigned seed = 1;
+  int i, j, k, singular, ok = 1;
+
+  batch_random(3, &seed);
+  for (j = 0; j < 3; j++)
+    for (k = 0; k < 3; k++)
+    {
+      batch_m[(j * 3 + k) * BATCH_CHECK] = a_ref[j][k];
+      batch_m[(j * 3 + k) * BATCH_CHECK + BATCH_CHECK - 1] = (float)(j + k);
+    }
+
+  singular = minver3_batch(BATCH_CHECK, batch_m, batch_inv, batch_det,
+                           1.0e-6f);
+  ok &= singular == 1;
+  ok &= float_eq_beebs(batch_det[0], -150.0f);
+  for (j = 0; j < 9; j++)
+    ok &= batch_inv[j * BATCH_CHECK + BATCH_CHECK - 1] == 0.0f;
+
+  for (i = 1; i < BATCH_CHECK - 1; i++)
+  {
+    float big = 0.0f, err = 0.0f, x;
+
+    for (j = 0; j < 3; j++)
+      for (k = 0; k < 3; k++)
+        a[j][k] = batch_m[(j * 3 + k) * BATCH_CHECK + i];
+    ok &= minver(3, 3, 1.0e-6f) == 0;
+    for (j = 0; j < 3; j++)
+      for (k = 0; k < 3; k++)
+      {
+        x = minver_fabs(batch_inv[(j * 3 + k) * BATCH_CHECK + i] - a[j][k]);
+        big = minver_fabs(a[j][k]) > big ? minver_fabs(a[j][k]) : big;
+        err = x > err ? x : err;
+      }
+    ok &= err <= 1.0e-5f * big;
+    ok &= minver_fabs(batch_det[i] - det) <= 1.0e-5f * minver_fabs(det);
+  }
+
+  /* mmul3_batch on a_ref and b, as mmul. */
+  memcpy(a, a_ref, 3 * 3 * sizeof(a[0][0]));
+  mmul(3, 3, 3, 3);
+  for (j = 0; j < 3; j++)
+    for (k = 0; k < 3; k++)
+      batch_c[(j * 3 + k) * BATCH_CHECK] = b[j][k];
+  mmul3_batch(BATCH_CHECK, batch_m, batch_c, batch_inv);
+  for (j = 0; j < 3; j++)
+    for (k = 0; k < 3; k++)
+      ok &= float_eq_beebs(batch_inv[(j * 3 + k) * BATCH_CHECK], c[j][k]);
+
+  /* 4x4: m * m^-1 = I. */
+  batch_random(4, &seed);
+  ok &= minver4_batch(BATCH_CHECK, batch_m, batch_inv, NULL, 1.0e-6f) == 0;
+  mmul4_batch(BATCH_CHECK, batch_m, batch_inv, batch_c);
+  for (i = 0; i < BATCH_CHECK; i++)
+    for (j = 0; j < 4; j++)
+      for (k = 0; k < 4; k++)
+        ok &= minver_fabs(batch_c[(j * 4 + k) * BATCH_CHECK + i]
+                          - (j == k)) < 1.0e-5f;
+
+  return ok;
+}
+
+/* ------------------------------ minver_n ------------------------------ */
+
+/* Gauss-Jordan inversion of an n x n matrix of any size, float and
+   double. a (leading dimension lda) is the input and is overwritten;
+   the inverse goes to inv (leading dimension ldi). Both are supplied by
+   the caller, ideally aligned to a cache line with the leading
+   dimensions a multiple of one, and so is work, which must hold
+   minver_n_work(n) elements.
+
+   Partial pivoting never moves data: perm[i] is the row of a that holds
+   logical row i, so a row swap exchanges two entries of perm. The
+   column unscrambling that minver does element by element is folded
+   into the final copy to inv.
+
+   The columns are eliminated GJ_NB at a time. A panel of GJ_NB columns
+   is reduced for all rows, unblocked; the rest of the matrix then gets
+   the whole panel's update at once as a matrix multiply with the
+   panel's pivot rows, which is where nearly all of the 2n^3 flops go.
+
+   Returns 0, or 1 if a pivot is no larger than eps in magnitude, as
+   minver does. *det receives the determinant when det is not NULL. */
+
+#define GJ_NB 32
+
+int minver_n_work(int n)
+{
+  return GJ_NB * n;
+}
+
+#define GJ_DEFINE(SFX, T)                                                    \
+  /* rows[i] += (or =, for the first `reset` rows listed after skip)       \
+     P[i] * W over ncols columns starting at col: P the kb panel columns  \
+     at pcol of each row, W kb x ncols with leading dimension ldw. Four   \
+     rows by eight columns of the result are held in locals. */            \
+  static void gj_update_##SFX(int m, const int *perm, T *a, int lda,       \
+                              int pcol, int kb, const T *W, int ldw,       \
+                              int col, int ncols, int r0, int r1)          \
+  {                                                                        \
+    T acc[4][8], *row[4];                                                  \
+    const T *pr[4];                                                        \
+    int i, j, p, r, jj, nr;                                                \
+                                                                           \
+    for (i = 0; i < m; i += 4)                                             \
+    {                                                                      \
+      nr = m - i < 4 ? m - i : 4;                                          \
+      for (r = 0; r < 4; r++)                                              \
+      {                                                                    \
+        row[r] = a + perm[i + (r < nr ? r : 0)] * lda + col;               \
+        pr[r] = a + perm[i + (r < nr ? r : 0)] * lda + pcol;               \
+      }                                                                    \
+      for (j = 0; j + 8 <= ncols; j += 8)                                  \
+      {                                                                    \
+        for (r = 0; r < 4; r++)                                            \
+          for (jj = 0; jj < 8; jj++)                                       \
+            acc[r][jj] = i + r >= r0 && i + r < r1 ? 0 : row[r][j + jj];   \
+        for (p = 0; p < kb; p++)                                           \
+          for (r = 0; r < 4; r++)                                          \
+            for (jj = 0; jj < 8; jj++)                                     \
+              acc[r][jj] += pr[r][p] * W[p * ldw + j + jj];                \
+        for (r = nr - 1; r >= 0; r--)                                      \
+          for (jj = 0; jj < 8; jj++)                                       \
+            row[r][j + jj] = acc[r][jj];                                   \
+      }                                                                    \
+      for (; j < ncols; j++)                                               \
+        for (r = 0; r < nr; r++)                                           \
+        {                                                                  \
+          T w = i + r >= r0 && i + r < r1 ? 0 : row[r][j];                 \
+          for (p = 0; p < kb; p++)                                         \
+            w += pr[r][p] * W[p * ldw + j];                                \
+          row[r][j] = w;                                                   \
+        }                                                                  \
+    }                                                                      \
+  }                                                                        \
+                                                                           \
+  int minver_n_##SFX(int n, T *a, int lda, T *inv, int ldi, int *perm,    \
+                     T *work, T eps, T *det)                               \
+  {                                                                        \
+    int i, j, c, k0, kb, p, t, sign = 1;                                   \
+    T w, piv, d = 1, *rj, *ri;                                             \
+                                                                           \
+    for (i = 0; i < n; i++)                                                \
+      perm[i] = i;                                                         \
+                                                                           \
+    for (k0 = 0; k0 < n; k0 += GJ_NB)                                      \
+    {                                                                      \
+      kb = n - k0 < GJ_NB ? n - k0 : GJ_NB;                                \
+                                                                           \
+      /* The panel, columns k0 .. k0 + kb - 1, for every row. */           \
+      for (j = k0; j < k0 + kb; j++)                                       \
+      {                                                                    \
+        p = j;                                                             \
+        for (i = j + 1; i < n; i++)                                        \
+        {                                                                  \
+          w = a[perm[i] * lda + j];                                        \
+          piv = a[perm[p] * lda + j];                                      \
+          if ((w < 0 ? -w : w) > (piv < 0 ? -piv : piv))                   \
+            p = i;                                                         \
+        }                                                                  \
+        if (p != j)                                                        \
+        {                                                                  \
+          t = perm[j];                                                     \
+          perm[j] = perm[p];                                               \
+          perm[p] = t;                                                     \
+          sign = -sign;                                                    \
+        }                                                                  \
+        rj = a + perm[j] * lda;                                            \
+        piv = rj[j];                                                       \
+        if ((piv < 0 ? -piv : piv) <= eps)                                 \
+        {                                                                  \
+          if (det)                                                         \
+            *det = 0;                                                      \
+          return 1;                                                        \
+        }                                                                  \
+        d *= piv;                                                          \
+                                                                           \
+        rj[j] = 1;                                                         \
+        for (c = k0; c < k0 + kb; c++)                                     \
+          rj[c] /= piv;                                                    \
+        for (i = 0; i < n; i++)                                            \
+          if (i != j)                                                      \
+          {                                                                \
+            ri = a + perm[i] * lda;                                        \
+            w = ri[j];                                                     \
+            ri[j] = 0;                                                     \
+            for (c = k0; c < k0 + kb; c++)                                 \
+              ri[c] -= w * rj[c];                                          \
+          }                                                                \
+      }                                                                    \
+                                                                           \
+      /* The panel's pivot rows outside the panel, before they change. */ \
+      for (i = 0; i < kb; i++)                                             \
+      {                                                                    \
+        rj = a + perm[k0 + i] * lda;                                       \
+        memcpy(work + i * n, rj, k0 * sizeof(T));                          \
+        memcpy(work + i * n + k0, rj + k0 + kb,                            \
+               (n - k0 - kb) * sizeof(T));                                 \
+      }                                                                    \
+                                                                           \
+      /* Every row += its panel part times those rows; the pivot rows     \
+         themselves are replaced instead. */                               \
+      gj_update_##SFX(n, perm, a, lda, k0, kb, work, n, 0, k0, k0,         \
+                      k0 + kb);                                            \
+      gj_update_##SFX(n, perm, a, lda, k0, kb, work + k0, n, k0 + kb,      \
+                      n - k0 - kb, k0, k0 + kb);                           \
+    }                                                                      \
+                                                                           \
+    /* inv(A) = inv(PA) P: logical row i and column j of the result go    \
+       to row i and column perm[j]. */                                     \
+    for (i = 0; i < n; i++)                                                \
+    {                                                                      \
+      ri = a + perm[i] * lda;                                              \
+      for (j = 0; j < n; j++)                                              \
+        inv[i * ldi + perm[j]] = ri[j];                                    \
+    }                                                                      \
+                                                                           \
+    if (det)                                                               \
+      *det = sign * d;                                                     \
+    return 0;                                                              \
+  }
+
+GJ_DEFINE(f, float)
+GJ_DEFINE(d, double)
+
+/* Inverts a random, well conditioned n x n matrix, n <= GJ_CHECK_MAX,
+   in both precisions and returns the largest |A inv(A) - I| for
+   each. */
+
+#define GJ_CHECK_MAX 100
+
+static float gj_af[GJ_CHECK_MAX * GJ_CHECK_MAX];
+static float gj_invf[GJ_CHECK_MAX * GJ_CHECK_MAX];
+static double gj_ad[GJ_CHECK_MAX * GJ_CHECK_MAX];
+static double gj_invd[GJ_CHECK_MAX * GJ_CHECK_MAX];
+static double gj_ref[GJ_CHECK_MAX * GJ_CHECK_MAX];
+static float gj_workf[GJ_NB * GJ_CHECK_MAX];
+static double gj_workd[GJ_NB * GJ_CHECK_MAX];
+static int gj_perm[GJ_CHECK_MAX];
+
+static void
+gj_fill(int n, double *m, unsigned seed)
+{
+  int i;
+
+  for (i = 0; i < n * n; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    m[i] = (double)((seed >> 8) & 0xffff) / 65536.0 - 0.5;
+    if (i % (n + 1) == 0)
+      m[i] += 2.0;
+  }
+}
+
+static int
+gj_check(int n, unsigned seed, double *errf, double *errd)
+{
+  int i, j, k, ok = 1;
+
+  gj_fill(n, gj_ref, seed);
+  for (i = 0; i < n * n; i++)
+  {
+    gj_af[i] = gj_ref[i];
+    gj_ad[i] = gj_ref[i];
+  }
+  ok &= minver_n_f(n, gj_af, n, gj_invf, n, gj_perm, gj_workf, 1.0e-6f,
+                   NULL) == 0;
+  ok &= minver_n_d(n, gj_ad, n, gj_invd, n, gj_perm, gj_workd, 1.0e-12,
+                   NULL) == 0;
+
+  *errf = *errd = 0;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < n; j++)
+    {
+      double sf = 0, sd = 0;
+
+      for (k = 0; k < n; k++)
+      {
+        sf += gj_ref[i * n + k] * gj_invf[k * n + j];
+        sd += gj_ref[i * n + k] * gj_invd[k * n + j];
+      }
+      sf = fabs(sf - (i == j));
+      sd = fabs(sd - (i == j));
+      *errf = sf > *errf ? sf : *errf;
+      *errd = sd > *errd ? sd : *errd;
+    }
+  return ok;
+}
+
+/* ---------------------------- benchmark ---------------------------- */
+
+#ifdef BENCHMARK
+#define BENCH_BATCH 4096
+#define BENCH_ROUNDS 2000
+
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifndef BENCH_MAX_N
+#define BENCH_MAX_N 2048
+#endif
+
+/* Rows of A inv(A) - I sampled for the residual beyond 256. */
+#define BENCH_RESIDUAL_ROWS 8
+
+/* Inversions per second, GFLOPS (2 n^3 flops per inversion) and the
+   largest |A inv(A) - I| of minver_n_f and minver_n_d for n = 3 ..
+   BENCH_MAX_N, on cache line aligned buffers. */
+
+#define BENCH_N_DEFINE(SFX, T)                                             \
+  static void bench_n_##SFX(int n, const double *ref, double *t_out,     \
+                            double *err_out)                             \
+  {                                                                      \
+    size_t sz = ((size_t)n * n * sizeof(T) + 63) & ~(size_t)63;          \
+    T *m = NULL, *inv = NULL, *work = NULL;                              \
+    int *perm = malloc(n * sizeof(int));                                 \
+    int i, j, k, r, reps = (int)(2e8 / (2.0 * n * n * n)) + 1;           \
+    double t0, err = 0;                                                  \
+                                                                         \
+    *t_out = *err_out = 0;                                               \
+    if (perm != NULL && posix_memalign((void **)&m, 64, sz) == 0 &&      \
+        posix_memalign((void **)&inv, 64, sz) == 0 &&                    \
+        posix_memalign((void **)&work, 64,                               \
+                       minver_n_work(n) * sizeof(T)) == 0)               \
+    {                                                                    \
+      t0 = now_seconds();                                                \
+      for (r = 0; r < reps; r++)                                         \
+      {                                                                  \
+        for (i = 0; i < n * n; i++)                                      \
+          m[i] = (T)ref[i];                                              \
+        minver_n_##SFX(n, m, n, inv, n, perm, work, (T)1.0e-30, NULL);   \
+      }                                                                  \
+      *t_out = (now_seconds() - t0) / reps;                              \
+                                                                         \
+      for (i = 0; i < n; i += n > 256 ? n / BENCH_RESIDUAL_ROWS : 1)     \
+        for (j = 0; j < n; j++)                                          \
+        {                                                                \
+          double sum = 0;                                                \
+          for (k = 0; k < n; k++)                                        \
+            sum += ref[(size_t)i * n + k] * inv[(size_t)k * n + j];      \
+          sum = fabs(sum - (i == j));                                    \
+          err = sum > err ? sum : err;                                   \
+        }                                                                \
+      *err_out = err;                                                    \
+    }                                                                    \
+    free(m);                                                             \
+    free(inv);                                                           \
+    free(work);                                                          \
+    free(perm);                                                          \
+  }
+
+BENCH_N_DEFINE(f, float)
+BENCH_N_DEFINE(d, double)
+
+static void
+benchmark_n(void)
+{
+  static const int sizes[] = {3, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048};
+  int s, n;
+
+  for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+  {
+    double *ref, tf, td, ef, ed, flops;
+
+    n = sizes[s];
+    if (n > BENCH_MAX_N)
+      break;
+    flops = 2.0 * n * n * n;
+    ref = malloc((size_t)n * n * sizeof(double));
+    if (ref == NULL)
+      break;
+    gj_fill(n, ref, 99u);
+    bench_n_f(n, ref, &tf, &ef);
+    bench_n_d(n, ref, &td, &ed);
+    free(ref);
+    if (tf == 0 || td == 0)
+      break; /* Out of memory. */
+    printf("n = %4d: float %10.3g inv/s %6.2f GFLOPS err %.1e; "
+           "double %10.3g inv/s %6.2f GFLOPS err %.1e\n",
+           n, 1 / tf, flops / tf * 1e-9, ef, 1 / td, flops / td * 1e-9, ed);
+  }
+}
+
+/* Matrices per second: minver one 3x3 at a time against the batched
+   routines. */
+
+static void
+benchmark(void)
+{
+  float *m = malloc(16 * BENCH_BATCH * sizeof(float));
+  float *inv = malloc(16 * BENCH_BATCH * sizeof(float));
+  float *det = malloc(BENCH_BATCH * sizeof(float));
+  unsigned seed = 7;
+  double t0, t, total = (double)BENCH_BATCH * BENCH_ROUNDS;
+  float sink = 0.0f;
+  int i, r, j, k;
+
+  for (i = 0; i < 16 * BENCH_BATCH; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    m[i] = (float)((seed >> 16) % 2001) / 100.0f - 10.0f;
+  }
+
+  t0 = now_seconds();
+  for (r = 0; r < BENCH_ROUNDS / 10; r++)
+    for (i = 0; i < BENCH_BATCH; i++)
+    {
+      for (j = 0; j < 3; j++)
+        for (k = 0; k < 3; k++)
+          a[j][k] = m[(j * 3 + k) * BENCH_BATCH + i];
+      minver(3, 3, 1.0e-6f);
+      sink += a[0][0];
+    }
+  t = now_seconds() - t0;
+  printf("minver 3x3:       %8.2f M/s\n", total / 10 / t * 1e-6);
+
+  t0 = now_seconds();
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    minver3_batch(BENCH_BATCH, m, inv, det, 1.0e-6f);
+  t = now_seconds() - t0;
+  printf("minver3_batch:    %8.2f M/s\n", total / t * 1e-6);
+
+  t0 = now_seconds();
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    minver4_batch(BENCH_BATCH, m, inv, det, 1.0e-6f);
+  t = now_seconds() - t0;
+  printf("minver4_batch:    %8.2f M/s\n", total / t * 1e-6);
+
+  t0 = now_seconds();
+  for (r = 0; r < BENCH_ROUNDS / 10; r++)
+    for (i = 0; i < BENCH_BATCH; i++)
+    {
+      for (j = 0; j < 3; j++)
+        for (k = 0; k < 3; k++)
+          a[j][k] = m[(j * 3 + k) * BENCH_BATCH + i];
+      mmul(3, 3, 3, 3);
+      sink += c[0][0];
+    }
+  t = now_seconds() - t0;
+  printf("mmul 3x3:         %8.2f M/s\n", total / 10 / t * 1e-6);
+
+  t0 = now_seconds();
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    mmul3_batch(BENCH_BATCH, m, m, inv);
+  t = now_seconds() - t0;
+  printf("mmul3_batch:      %8.2f M/s\n", total / t * 1e-6);
+
+  t0 = now_seconds();
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    mmul4_batch(BENCH_BATCH, m, m, inv);
+  t = now_seconds() - t0;
+  printf("mmul4_batch:      %8.2f M/s\n", total / t * 1e-6);
+
+  printf("checksum: %g\n", sink + inv[0] + det[0]);
+  free(m);
+  free(inv);
+  free(det);
+
+  benchmark_n();
+}
+#endif
+
 /* ------------------------------ main ------------------------------ */
 
 int main()
@@ -248,10 +998,37 @@ int main()
 
   res = float_eq_beebs(det, -16.6666718);
 
+  res &= batch_check();
+
+  /* minver_n on a_ref against the closed form (the rounding differs
+     by an ulp or two), then on larger matrices
+     that cross several panels. */
+  {
+    float ai[9], ainv[9], bi[9], work3[GJ_NB * 3], d3;
+    int perm3[3];
+    double errf, errd;
+
+    memcpy(ai, a_ref, sizeof(ai));
+    minver3_batch(1, ai, bi, NULL, 1.0e-6f);
+    res &= minver_n_f(3, ai, 3, ainv, 3, perm3, work3, 1.0e-6f, &d3) == 0;
+    res &= fabsf(d3 + 150.0f) < 150.0f * 1.0e-6f;
+    for (i = 0; i < 9; i++)
+      res &= fabsf(ainv[i] - bi[i]) < 1.0e-5f;
+
+    res &= gj_check(GJ_NB + 5, 3u, &errf, &errd);
+    res &= errf < 1.0e-4 && errd < 1.0e-12;
+    res &= gj_check(GJ_CHECK_MAX, 5u, &errf, &errd);
+    res &= errf < 1.0e-4 && errd < 1.0e-12;
+  }
+
   correct = res == 1 ? 1 : 0;
 
   printf("The result is: %d\n", correct);
 
+#ifdef BENCHMARK
+  benchmark();
+#endif
+
   return 0;
 }
 
@@ -26,6 +26,26 @@ some 128-bit arithmetic.
 #include <stdio.h>
 #include <stdint.h>
 
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#ifdef BENCHMARK
+#include <time.h>
+#endif
+
+/* Number of independent (a, b, m) triples used by the batched check. */
+#define BATCH 37
+
+/* Largest multi-precision modulus, in 64-bit limbs (4096 bits). */
+#define MP_MAX_LIMBS 64
+
+#ifdef __GNUC__
+#define MP_INLINE static inline __attribute__((always_inline))
+#else
+#define MP_INLINE static inline
+#endif
+
 typedef uint64_t uint64;
 typedef int64_t int64;
 
@@ -204,6 +224,729 @@ void xbinGCD(uint64 a, uint64 b, volatile uint64 *pu, volatile uint64 *pv)
   return;
 }
 
+/* -------------------------- montmul_batch -------------------------- */
+
+/* Computes r[i] = montmul(abar[i], bbar[i], m[i], mprime[i]) for n
+independent operand sets. Every lane carries its own modulus, so the
+moduli need not be related. With AVX2 four multiplies run side by side,
+with AVX-512 eight; there is no 64 x 64 lane multiply on either, so each
+lane rebuilds the 128-bit product from 32-bit limbs with the same
+partial products as the portable mulul64 above. Left over elements, and
+targets without vector support, go through the scalar montmul (which
+uses __int128 where the compiler has it). */
+
+#if defined(__AVX2__)
+static inline void
+mulul64_x4(__m256i u, __m256i v, __m256i *whi, __m256i *wlo)
+{
+  const __m256i mask = _mm256_set1_epi64x(0xFFFFFFFF);
+  __m256i u1, v1, t, k, w0, w1, w2;
+
+  u1 = _mm256_srli_epi64(u, 32);
+  v1 = _mm256_srli_epi64(v, 32);
+
+  t = _mm256_mul_epu32(u, v); // u0*v0; mul_epu32 reads the low halves.
+  w0 = _mm256_and_si256(t, mask);
+  k = _mm256_srli_epi64(t, 32);
+
+  t = _mm256_add_epi64(_mm256_mul_epu32(u1, v), k);
+  w1 = _mm256_and_si256(t, mask);
+  w2 = _mm256_srli_epi64(t, 32);
+
+  t = _mm256_add_epi64(_mm256_mul_epu32(u, v1), w1);
+  k = _mm256_srli_epi64(t, 32);
+
+  *wlo = _mm256_add_epi64(_mm256_slli_epi64(t, 32), w0);
+  *whi = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(u1, v1), w2), k);
+}
+
+/* Low-order 64 bits of u*v in each lane. */
+
+static inline __m256i
+mullo64_x4(__m256i u, __m256i v)
+{
+  __m256i cross;
+
+  cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(u, 32), v),
+                           _mm256_mul_epu32(u, _mm256_srli_epi64(v, 32)));
+  return _mm256_add_epi64(_mm256_mul_epu32(u, v),
+                          _mm256_slli_epi64(cross, 32));
+}
+
+/* All ones in each lane where u < v (unsigned). */
+
+static inline __m256i
+cmpltu64_x4(__m256i u, __m256i v)
+{
+  const __m256i sign = _mm256_set1_epi64x(0x8000000000000000LL);
+
+  return _mm256_cmpgt_epi64(_mm256_xor_si256(v, sign),
+                            _mm256_xor_si256(u, sign));
+}
+
+static inline __m256i
+montmul_x4(__m256i abar, __m256i bbar, __m256i m, __m256i mprime)
+{
+  __m256i thi, tlo, tm, tmmhi, tmmlo, uhi, ulo, carry, ov;
+
+  mulul64_x4(abar, bbar, &thi, &tlo); // t = abar*bbar.
+  tm = mullo64_x4(tlo, mprime);
+  mulul64_x4(tm, m, &tmmhi, &tmmlo); // tmm = tm*m.
+
+  ulo = _mm256_add_epi64(tlo, tmmlo);
+  carry = cmpltu64_x4(ulo, tlo); // -1 where the low add carried.
+  uhi = _mm256_sub_epi64(_mm256_add_epi64(thi, tmmhi), carry);
+
+  ov = _mm256_or_si256(cmpltu64_x4(uhi, thi),
+                       _mm256_and_si256(_mm256_cmpeq_epi64(uhi, thi), carry));
+
+  // ulo = uhi - (m & -(ov | (uhi >= m))), with no branching.
+  ov = _mm256_or_si256(ov, _mm256_xor_si256(cmpltu64_x4(uhi, m),
+                                            _mm256_set1_epi64x(-1)));
+  return _mm256_sub_epi64(uhi, _mm256_and_si256(m, ov));
+}
+#endif
+
+#if defined(__AVX512F__)
+static inline void
+mulul64_x8(__m512i u, __m512i v, __m512i *whi, __m512i *wlo)
+{
+  const __m512i mask = _mm512_set1_epi64(0xFFFFFFFF);
+  __m512i u1, v1, t, k, w0, w1, w2;
+
+  u1 = _mm512_srli_epi64(u, 32);
+  v1 = _mm512_srli_epi64(v, 32);
+
+  t = _mm512_mul_epu32(u, v);
+  w0 = _mm512_and_si512(t, mask);
+  k = _mm512_srli_epi64(t, 32);
+
+  t = _mm512_add_epi64(_mm512_mul_epu32(u1, v), k);
+  w1 = _mm512_and_si512(t, mask);
+  w2 = _mm512_srli_epi64(t, 32);
+
+  t = _mm512_add_epi64(_mm512_mul_epu32(u, v1), w1);
+  k = _mm512_srli_epi64(t, 32);
+
+  *wlo = _mm512_add_epi64(_mm512_slli_epi64(t, 32), w0);
+  *whi = _mm512_add_epi64(_mm512_add_epi64(_mm512_mul_epu32(u1, v1), w2), k);
+}
+
+static inline __m512i
+mullo64_x8(__m512i u, __m512i v)
+{
+  __m512i cross;
+
+  cross = _mm512_add_epi64(_mm512_mul_epu32(_mm512_srli_epi64(u, 32), v),
+                           _mm512_mul_epu32(u, _mm512_srli_epi64(v, 32)));
+  return _mm512_add_epi64(_mm512_mul_epu32(u, v),
+                          _mm512_slli_epi64(cross, 32));
+}
+
+static inline __m512i
+montmul_x8(__m512i abar, __m512i bbar, __m512i m, __m512i mprime)
+{
+  __m512i thi, tlo, tm, tmmhi, tmmlo, uhi, ulo;
+  __mmask8 carry, ov;
+
+  mulul64_x8(abar, bbar, &thi, &tlo);
+  tm = mullo64_x8(tlo, mprime);
+  mulul64_x8(tm, m, &tmmhi, &tmmlo);
+
+  ulo = _mm512_add_epi64(tlo, tmmlo);
+  carry = _mm512_cmplt_epu64_mask(ulo, tlo);
+  uhi = _mm512_add_epi64(thi, tmmhi);
+  uhi = _mm512_mask_add_epi64(uhi, carry, uhi, _mm512_set1_epi64(1));
+
+  ov = _mm512_cmplt_epu64_mask(uhi, thi)
+       | (_mm512_cmpeq_epi64_mask(uhi, thi) & carry);
+  ov |= _mm512_cmpge_epu64_mask(uhi, m);
+
+  return _mm512_mask_sub_epi64(uhi, ov, uhi, m);
+}
+#endif
+
+void montmul_batch(uint64 *r, const uint64 *abar, const uint64 *bbar,
+                   const uint64 *m, const uint64 *mprime, int n)
+{
+  int i = 0;
+
+#if defined(__AVX512F__)
+  for (; i + 8 <= n; i += 8)
+  {
+    __m512i p = montmul_x8(_mm512_loadu_si512(abar + i),
+                           _mm512_loadu_si512(bbar + i),
+                           _mm512_loadu_si512(m + i),
+                           _mm512_loadu_si512(mprime + i));
+    _mm512_storeu_si512(r + i, p);
+  }
+#endif
+#if defined(__AVX2__)
+  for (; i + 4 <= n; i += 4)
+  {
+    __m256i p = montmul_x4(_mm256_loadu_si256((const __m256i *)(abar + i)),
+                           _mm256_loadu_si256((const __m256i *)(bbar + i)),
+                           _mm256_loadu_si256((const __m256i *)(m + i)),
+                           _mm256_loadu_si256((const __m256i *)(mprime + i)));
+    _mm256_storeu_si256((__m256i *)(r + i), p);
+  }
+#endif
+  for (; i < n; i++)
+    r[i] = montmul(abar[i], bbar[i], m[i], mprime[i]);
+}
+
+/* ---------------------------- mp support ---------------------------- */
+
+/* Multi-precision numbers are little-endian arrays of n 64-bit limbs.
+All of the routines below are built on mulul64. */
+
+/* Returns the low half of a*b + c + *carry and leaves the high half in
+*carry. The sum cannot overflow 128 bits. */
+
+MP_INLINE uint64
+mac64(uint64 a, uint64 b, uint64 c, uint64 *carry)
+{
+  uint64 hi, lo;
+
+  mulul64(a, b, &hi, &lo);
+  lo += c;
+  hi += lo < c;
+  lo += *carry;
+  hi += lo < *carry;
+  *carry = hi;
+  return lo;
+}
+
+/* Number of leading zeros in a nonzero x. */
+
+static int
+nlz64(uint64 x)
+{
+  int n = 0;
+
+  if (x <= 0x00000000FFFFFFFFULL) { n += 32; x <<= 32; }
+  if (x <= 0x0000FFFFFFFFFFFFULL) { n += 16; x <<= 16; }
+  if (x <= 0x00FFFFFFFFFFFFFFULL) { n += 8; x <<= 8; }
+  if (x <= 0x0FFFFFFFFFFFFFFFULL) { n += 4; x <<= 4; }
+  if (x <= 0x3FFFFFFFFFFFFFFFULL) { n += 2; x <<= 2; }
+  if (x <= 0x7FFFFFFFFFFFFFFFULL) { n += 1; }
+  return n;
+}
+
+/* Divides (u1 || u0) by v, giving the quotient as the result and the
+remainder in *r. Must have u1 < v. Without __int128 this is divlu from
+the Hacker's Delight collection, widened to 64-bit words. */
+
+#ifdef __SIZEOF_INT128__
+static uint64
+divlu64(uint64 u1, uint64 u0, uint64 v, uint64 *r)
+{
+  unsigned __int128 u = ((unsigned __int128)u1 << 64) | u0;
+
+  *r = u % v;
+  return u / v;
+}
+#else
+static uint64
+divlu64(uint64 u1, uint64 u0, uint64 v, uint64 *r)
+{
+  const uint64 b = 0x100000000ULL; // Number base (32 bits).
+  uint64 un1, un0, vn1, vn0, q1, q0, un32, un21, un10, rhat;
+  int s;
+
+  s = nlz64(v); // 0 <= s <= 63.
+  v = v << s;   // Normalize divisor.
+  vn1 = v >> 32;
+  vn0 = v & 0xFFFFFFFF;
+
+  un32 = (u1 << s) | (s == 0 ? 0 : u0 >> (64 - s));
+  un10 = u0 << s;
+  un1 = un10 >> 32;
+  un0 = un10 & 0xFFFFFFFF;
+
+  q1 = un32 / vn1;
+  rhat = un32 - q1 * vn1;
+  while (q1 >= b || q1 * vn0 > b * rhat + un1)
+  {
+    q1 = q1 - 1;
+    rhat = rhat + vn1;
+    if (rhat >= b)
+      break;
+  }
+
+  un21 = un32 * b + un1 - q1 * v;
+
+  q0 = un21 / vn1;
+  rhat = un21 - q0 * vn1;
+  while (q0 >= b || q0 * vn0 > b * rhat + un0)
+  {
+    q0 = q0 - 1;
+    rhat = rhat + vn1;
+    if (rhat >= b)
+      break;
+  }
+
+  *r = (un21 * b + un0 - q0 * v) >> s;
+  return q1 * b + q0;
+}
+#endif
+
+/* w = u*v, schoolbook. w has 2n limbs. */
+
+void mpmul(uint64 *w, const uint64 *u, const uint64 *v, int n)
+{
+  uint64 c;
+  int i, j;
+
+  for (i = 0; i < 2 * n; i++)
+    w[i] = 0;
+  for (i = 0; i < n; i++)
+  {
+    c = 0;
+    for (j = 0; j < n; j++)
+      w[i + j] = mac64(u[j], v[i], w[i + j], &c);
+    w[i + n] = c;
+  }
+}
+
+/* r = u mod v, where u has m <= 2n + 1 limbs and v has n >= 2 limbs, and
+the top limb of v is nonzero. This is Knuth's Algorithm D from [Knu2]
+section 4.3.1 with 64-bit digits; the quotient is not kept. */
+
+void mpmod(uint64 *r, const uint64 *u, int m, const uint64 *v, int n)
+{
+  uint64 un[2 * MP_MAX_LIMBS + 2], vn[MP_MAX_LIMBS];
+  uint64 qhat, rhat, phi, plo, k, borrow, t, c;
+  int s, i, j;
+
+  s = nlz64(v[n - 1]);
+  for (i = n - 1; i > 0; i--)
+    vn[i] = (v[i] << s) | (s == 0 ? 0 : v[i - 1] >> (64 - s));
+  vn[0] = v[0] << s;
+
+  un[m] = s == 0 ? 0 : u[m - 1] >> (64 - s);
+  for (i = m - 1; i > 0; i--)
+    un[i] = (u[i] << s) | (s == 0 ? 0 : u[i - 1] >> (64 - s));
+  un[0] = u[0] << s;
+
+  for (j = m - n; j >= 0; j--)
+  {
+    /* Estimate the quotient digit, then refine it so that it is at most
+       one too large. */
+
+    if (un[j + n] >= vn[n - 1])
+    {
+      qhat = ~(uint64)0;
+      rhat = un[j + n - 1] + vn[n - 1];
+      c = rhat < vn[n - 1]; // rhat no longer fits in a digit.
+    }
+    else
+    {
+      qhat = divlu64(un[j + n], un[j + n - 1], vn[n - 1], &rhat);
+      c = 0;
+    }
+    while (!c)
+    {
+      mulul64(qhat, vn[n - 2], &phi, &plo);
+      if (phi < rhat || (phi == rhat && plo <= un[j + n - 2]))
+        break;
+      qhat = qhat - 1;
+      rhat = rhat + vn[n - 1];
+      c = rhat < vn[n - 1];
+    }
+
+    /* Multiply and subtract. */
+
+    k = 0;
+    borrow = 0;
+    for (i = 0; i < n; i++)
+    {
+      plo = mac64(qhat, vn[i], 0, &k);
+      t = un[i + j] - plo;
+      c = un[i + j] < plo;
+      un[i + j] = t - borrow;
+      borrow = c + (t < borrow);
+    }
+    t = un[j + n] - k;
+    c = un[j + n] < k;
+    un[j + n] = t - borrow;
+    borrow = c + (t < borrow);
+
+    /* If we subtracted too much, add back. */
+
+    if (borrow)
+    {
+      c = 0;
+      for (i = 0; i < n; i++)
+      {
+        t = un[i + j] + vn[i];
+        uint64 c1 = t < vn[i];
+        un[i + j] = t + c;
+        c = c1 + (un[i + j] < c);
+      }
+      un[j + n] += c;
+    }
+  }
+
+  /* Unnormalize the remainder. */
+
+  for (i = 0; i < n - 1; i++)
+    r[i] = (un[i] >> s) | (s == 0 ? 0 : un[i + 1] << (64 - s));
+  r[n - 1] = un[n - 1] >> s;
+}
+
+/* r = t - m if t >= m, else t, where t has n + 1 limbs and t < 2m. No
+branching on the data. */
+
+MP_INLINE void
+mpcondsub(uint64 *r, const uint64 *t, const uint64 *m, int n)
+{
+  uint64 d[MP_MAX_LIMBS];
+  uint64 borrow = 0, mask, x;
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    x = t[i] - m[i];
+    uint64 b1 = t[i] < m[i];
+    d[i] = x - borrow;
+    borrow = b1 | (x < borrow);
+  }
+
+  // Keep t exactly when t[n] - borrow underflows, i.e. t < m.
+
+  mask = -(uint64)(t[n] < borrow);
+  for (i = 0; i < n; i++)
+    r[i] = (t[i] & mask) | (d[i] & ~mask);
+}
+
+/* --------------------------- mpmontmul ---------------------------- */
+
+/* Multi-precision counterpart of montmul: r = a*b*R**-1 mod m with
+R = 2**(64n), a, b < m, m odd. mprime is -m**-1 mod 2**64 and only
+depends on m[0], so it comes straight out of xbinGCD as in the single
+word case. Coarsely Integrated Operand Scanning (CIOS): each word of b
+is multiplied in and one word of the product reduced in the same pass,
+so the working value never grows beyond n + 2 limbs. r may alias a or
+b. */
+
+MP_INLINE void
+mpmontmul_n(uint64 *r, const uint64 *a, const uint64 *b, const uint64 *m,
+            uint64 mprime, int n)
+{
+  uint64 t[MP_MAX_LIMBS + 2];
+  uint64 c, mq;
+  int i, j;
+
+  for (j = 0; j < n + 1; j++)
+    t[j] = 0;
+
+  for (i = 0; i < n; i++)
+  {
+    c = 0;
+    for (j = 0; j < n; j++)
+      t[j] = mac64(a[j], b[i], t[j], &c);
+    t[n] += c;
+    t[n + 1] = t[n] < c;
+
+    mq = t[0] * mprime;
+    c = 0;
+    mac64(mq, m[0], t[0], &c); // Low word is zero by construction.
+    for (j = 1; j < n; j++)
+      t[j - 1] = mac64(mq, m[j], t[j], &c);
+    t[n - 1] = t[n] + c;
+    t[n] = t[n + 1] + (t[n - 1] < c);
+  }
+
+  mpcondsub(r, t, m, n);
+}
+
+/* r = a*a*R**-1 mod m. Squaring forms each cross product a[i]*a[j]
+once and doubles the sum, nearly halving the multiplies, then reduces
+the 2n limb square a word at a time (separated operand scanning). */
+
+MP_INLINE void
+mpmontsqr_n(uint64 *r, const uint64 *a, const uint64 *m, uint64 mprime,
+            int n)
+{
+  uint64 t[2 * MP_MAX_LIMBS + 1];
+  uint64 c, hi, lo, mq, top, x;
+  int i, j;
+
+  for (i = 0; i < 2 * n; i++)
+    t[i] = 0;
+
+  for (i = 0; i < n - 1; i++)
+  {
+    c = 0;
+    for (j = i + 1; j < n; j++)
+      t[i + j] = mac64(a[i], a[j], t[i + j], &c);
+    t[i + n] = c;
+  }
+
+  t[2 * n - 1] = t[2 * n - 2] >> 63;
+  for (i = 2 * n - 2; i > 0; i--)
+    t[i] = (t[i] << 1) | (t[i - 1] >> 63);
+  t[0] <<= 1;
+
+  c = 0;
+  for (i = 0; i < n; i++)
+  {
+    mulul64(a[i], a[i], &hi, &lo);
+    x = t[2 * i] + lo;
+    uint64 c1 = x < lo;
+    t[2 * i] = x + c;
+    c = c1 + (t[2 * i] < c);
+    x = t[2 * i + 1] + hi;
+    c1 = x < hi;
+    t[2 * i + 1] = x + c;
+    c = c1 + (t[2 * i + 1] < c);
+  }
+
+  top = 0;
+  for (i = 0; i < n; i++)
+  {
+    mq = t[i] * mprime;
+    c = 0;
+    for (j = 0; j < n; j++)
+      t[i + j] = mac64(mq, m[j], t[i + j], &c);
+    x = t[i + n] + c;
+    uint64 c1 = x < c;
+    t[i + n] = x + top;
+    top = c1 + (t[i + n] < top);
+  }
+  t[2 * n] = top;
+
+  mpcondsub(r, t + n, m, n);
+}
+
+/* Entry points with the limb count fixed at compile time, so the inner
+loops have constant trip counts. */
+
+#define MPMONT_DEFINE(BITS)                                                \
+  void mpmontmul##BITS(uint64 *r, const uint64 *a, const uint64 *b,        \
+                       const uint64 *m, uint64 mprime)                     \
+  {                                                                        \
+    mpmontmul_n(r, a, b, m, mprime, (BITS) / 64);                          \
+  }                                                                        \
+  void mpmontsqr##BITS(uint64 *r, const uint64 *a, const uint64 *m,        \
+                       uint64 mprime)                                      \
+  {                                                                        \
+    mpmontsqr_n(r, a, m, mprime, (BITS) / 64);                             \
+  }
+
+MPMONT_DEFINE(128)
+MPMONT_DEFINE(256)
+MPMONT_DEFINE(512)
+MPMONT_DEFINE(1024)
+MPMONT_DEFINE(2048)
+MPMONT_DEFINE(4096)
+
+typedef void (*mpmontmul_fn)(uint64 *, const uint64 *, const uint64 *,
+                             const uint64 *, uint64);
+typedef void (*mpmontsqr_fn)(uint64 *, const uint64 *, const uint64 *,
+                             uint64);
+
+static const struct
+{
+  int bits;
+  mpmontmul_fn mul;
+  mpmontsqr_fn sqr;
+} mpmont_sizes[] = {
+    {128, mpmontmul128, mpmontsqr128},
+    {256, mpmontmul256, mpmontsqr256},
+    {512, mpmontmul512, mpmontsqr512},
+    {1024, mpmontmul1024, mpmontsqr1024},
+    {2048, mpmontmul2048, mpmontsqr2048},
+    {4096, mpmontmul4096, mpmontsqr4096},
+};
+
+#define MPMONT_NSIZES ((int)(sizeof(mpmont_sizes) / sizeof(mpmont_sizes[0])))
+
+/* Pseudo-random limbs for the checks (xorshift64). */
+
+static uint64
+mprand(uint64 *state)
+{
+  uint64 x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/* Montgomery constants for an n-limb odd modulus m: mprime, and
+r2 = R**2 mod m for converting into Montgomery form. */
+
+static void
+mpmont_setup(const uint64 *m, int n, uint64 *mprime, uint64 *r2)
+{
+  uint64 u[2 * MP_MAX_LIMBS + 1];
+  volatile uint64 rinv, mp;
+  int i;
+
+  xbinGCD(0x8000000000000000ULL, m[0], &rinv, &mp);
+  *mprime = mp;
+
+  for (i = 0; i < 2 * n; i++)
+    u[i] = 0;
+  u[2 * n] = 1;
+  mpmod(r2, u, 2 * n + 1, m, n);
+}
+
+/* Computes (a*b)**4 mod m for random n-limb a, b and m both through
+mpmontmul/mpmontsqr and through mpmul/mpmod, and returns nonzero if the
+two disagree. */
+
+static int
+mpmont_check(int k, uint64 *seed)
+{
+  uint64 m[MP_MAX_LIMBS], a[MP_MAX_LIMBS], b[MP_MAX_LIMBS];
+  uint64 r2[MP_MAX_LIMBS], one[MP_MAX_LIMBS], p[MP_MAX_LIMBS];
+  uint64 p1[MP_MAX_LIMBS], w[2 * MP_MAX_LIMBS];
+  uint64 mprime;
+  int n = mpmont_sizes[k].bits / 64;
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    m[i] = mprand(seed);
+    a[i] = mprand(seed);
+    b[i] = mprand(seed);
+    one[i] = 0;
+  }
+  m[0] |= 1;                        // Must be odd.
+  m[n - 1] |= 0x8000000000000000ULL; // a, b < m.
+  a[n - 1] >>= 1;
+  b[n - 1] >>= 1;
+  one[0] = 1;
+
+  mpmul(w, a, b, n);
+  mpmod(p1, w, 2 * n, m, n);
+  mpmul(w, p1, p1, n);
+  mpmod(p1, w, 2 * n, m, n);
+  mpmul(w, p1, p1, n);
+  mpmod(p1, w, 2 * n, m, n);
+
+  mpmont_setup(m, n, &mprime, r2);
+  mpmont_sizes[k].mul(a, a, r2, m, mprime); // abar = a*R mod m.
+  mpmont_sizes[k].mul(b, b, r2, m, mprime); // bbar = b*R mod m.
+  mpmont_sizes[k].mul(p, a, b, m, mprime);
+  mpmont_sizes[k].sqr(p, p, m, mprime);
+  mpmont_sizes[k].sqr(p, p, m, mprime);
+  mpmont_sizes[k].mul(p, p, one, m, mprime); // Back to a normal number.
+
+  for (i = 0; i < n; i++)
+    if (p[i] != p1[i])
+      return 1;
+  return 0;
+}
+
+/* ---------------------------- benchmark ---------------------------- */
+
+#ifdef BENCHMARK
+#define BENCH_N 4096
+#define BENCH_ROUNDS 2000
+
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Multiplies per second of a plain loop over montmul against
+   montmul_batch, both squaring the same BENCH_N residues in place. */
+
+static void
+benchmark(void)
+{
+  static uint64 x[BENCH_N], m[BENCH_N], mprime[BENCH_N];
+  volatile uint64 rinv, mp;
+  uint64 sink = 0;
+  double t0, ts, tb;
+  int i, k;
+
+  for (i = 0; i < BENCH_N; i++)
+  {
+    m[i] = (0xfae849273928f89fULL ^ ((uint64)i * 0x9e3779b97f4a7c15ULL)) | 1;
+    xbinGCD(0x8000000000000000ULL, m[i], &rinv, &mp);
+    mprime[i] = mp;
+    x[i] = modul64(0, (uint64)i + 2, m[i]);
+  }
+
+  t0 = now_seconds();
+  for (k = 0; k < BENCH_ROUNDS; k++)
+    for (i = 0; i < BENCH_N; i++)
+      x[i] = montmul(x[i], x[i], m[i], mprime[i]);
+  ts = now_seconds() - t0;
+  for (i = 0; i < BENCH_N; i++)
+    sink ^= x[i];
+
+  t0 = now_seconds();
+  for (k = 0; k < BENCH_ROUNDS; k++)
+    montmul_batch(x, x, x, m, mprime, BENCH_N);
+  tb = now_seconds() - t0;
+  for (i = 0; i < BENCH_N; i++)
+    sink ^= x[i];
+
+  printf("montmul scalar: %.1f Mmul/s\n", BENCH_N * (double)BENCH_ROUNDS / ts / 1e6);
+  printf("montmul batch:  %.1f Mmul/s (%.2fx)\n",
+         BENCH_N * (double)BENCH_ROUNDS / tb / 1e6, ts / tb);
+  printf("checksum: %016llx\n", (unsigned long long)sink);
+
+  /* Multi-precision: schoolbook multiply plus division against
+     Montgomery multiply and square, per operand size. */
+
+  for (k = 0; k < MPMONT_NSIZES; k++)
+  {
+    static uint64 mm[MP_MAX_LIMBS], r2[MP_MAX_LIMBS], y[MP_MAX_LIMBS];
+    static uint64 w[2 * MP_MAX_LIMBS];
+    uint64 seed = 0x2545f4914f6cdd1dULL, mp;
+    int bits = mpmont_sizes[k].bits;
+    int n = bits / 64;
+    int reps = (int)(2e8 / ((double)bits * bits)) + 1;
+    double tdiv, tmul, tsqr;
+
+    for (i = 0; i < n; i++)
+    {
+      mm[i] = mprand(&seed);
+      y[i] = mprand(&seed);
+    }
+    mm[0] |= 1;
+    mm[n - 1] |= 0x8000000000000000ULL;
+    y[n - 1] >>= 1;
+    mpmont_setup(mm, n, &mp, r2);
+
+    t0 = now_seconds();
+    for (i = 0; i < reps; i++)
+    {
+      mpmul(w, y, y, n);
+      mpmod(y, w, 2 * n, mm, n);
+    }
+    tdiv = now_seconds() - t0;
+
+    t0 = now_seconds();
+    for (i = 0; i < reps; i++)
+      mpmont_sizes[k].mul(y, y, r2, mm, mp);
+    tmul = now_seconds() - t0;
+
+    t0 = now_seconds();
+    for (i = 0; i < reps; i++)
+      mpmont_sizes[k].sqr(y, y, mm, mp);
+    tsqr = now_seconds() - t0;
+
+    printf("%4d bits: mulmod+div %8.3f us, montmul %8.3f us (%.2fx), "
+           "montsqr %8.3f us (%.2fx)\n",
+           bits, tdiv / reps * 1e6, tmul / reps * 1e6, tdiv / tmul,
+           tsqr / reps * 1e6, tdiv / tsqr);
+  }
+}
+#endif
+
 /* ------------------------------ main ------------------------------ */
 
 int main()
@@ -292,10 +1035,70 @@ int main()
       errors = 1;
   }
 
+  /* The batched path: BATCH unrelated moduli, each with its own a and b,
+     raised to (a*b)**4 exactly as above and checked against the same
+     simple p1 calculation. */
+
+  {
+    uint64 m[BATCH], mprime[BATCH], rinv[BATCH], abar[BATCH], bbar[BATCH];
+    uint64 p[BATCH], p1[BATCH];
+    volatile uint64 vrinv, vmprime;
+
+    for (i = 0; i < BATCH; i++)
+    {
+      uint64 a, b, phi, plo;
+
+      m[i] = (in_m ^ ((uint64)i * 0x9e3779b97f4a7c15ULL)) | 1;
+      a = (in_a ^ ((uint64)i << 17)) % m[i];
+      b = (in_b + (uint64)i * 0x0123456789abcdefULL) % m[i];
+
+      mulul64(a, b, &phi, &plo);
+      p1[i] = modul64(phi, plo, m[i]);
+      mulul64(p1[i], p1[i], &phi, &plo);
+      p1[i] = modul64(phi, plo, m[i]);
+      mulul64(p1[i], p1[i], &phi, &plo);
+      p1[i] = modul64(phi, plo, m[i]);
+
+      xbinGCD(0x8000000000000000LL, m[i], &vrinv, &vmprime);
+      rinv[i] = vrinv;
+      mprime[i] = vmprime;
+      abar[i] = modul64(a, 0, m[i]);
+      bbar[i] = modul64(b, 0, m[i]);
+    }
+
+    montmul_batch(p, abar, bbar, m, mprime, BATCH);
+    montmul_batch(p, p, p, m, mprime, BATCH);
+    montmul_batch(p, p, p, m, mprime, BATCH);
+
+    for (i = 0; i < BATCH; i++)
+    {
+      uint64 phi, plo;
+
+      mulul64(p[i], rinv[i], &phi, &plo);
+      if (modul64(phi, plo, m[i]) != p1[i])
+        errors = 1;
+    }
+  }
+
+  /* Multi-precision moduli from 128 to 4096 bits. */
+
+  {
+    uint64 seed = 0x0549372187237fefULL;
+    int k;
+
+    for (k = 0; k < MPMONT_NSIZES; k++)
+      for (i = 0; i < RPT; i++)
+        errors |= mpmont_check(k, &seed);
+  }
+
   correct = errors == 0 ? 1 : 0;
 
   printf("The result is: %d\n", correct);
 
+#ifdef BENCHMARK
+  benchmark();
+#endif
+
   return 0;
 }
 
@@ -58,9 +58,25 @@
 
 #define RPT 3
 
+#include <float.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifdef BENCHMARK
+#include <time.h>
+#endif
 
 #define PI 3.141592653589793
 #define SOLAR_MASS (4 * PI * PI)
@@ -152,6 +168,1325 @@ bodies_energy(struct body *bodies, unsigned int nbodies)
   return e;
 }
 
+/* ------------------------------ SoA bodies ------------------------------ */
+
+/* A structure of arrays body store for the time-stepping integrator.
+   Each array holds npad entries plus one vector of slack, so a kernel
+   may load a full vector starting at any real body. The entries past n
+   have zero mass and sit at the origin; pairs at zero distance are
+   skipped, so they never contribute. rsqrt selects the force kernel: 0
+   for an exact sqrt and divide, 1 for a reciprocal square root estimate
+   refined by Newton steps. */
+
+struct body_soa
+{
+  unsigned int n, npad;
+  int rsqrt;
+  double *x, *y, *z, *vx, *vy, *vz, *mass, *ax, *ay, *az;
+};
+
+#if defined(__AVX512F__)
+#define VDLANES 8
+#define vdouble __m512d
+#define VDLOAD(p) _mm512_loadu_pd(p)
+#define VDSTORE(p, x) _mm512_storeu_pd(p, x)
+#define VDSET1(x) _mm512_set1_pd(x)
+#define VDADD(x, y) _mm512_add_pd(x, y)
+#define VDSUB(x, y) _mm512_sub_pd(x, y)
+#define VDMUL(x, y) _mm512_mul_pd(x, y)
+#define VDDIV(x, y) _mm512_div_pd(x, y)
+#define VDSQRT(x) _mm512_sqrt_pd(x)
+#define VDRSQRT0(x) _mm512_rsqrt14_pd(x)
+#define VDRSQRT_STEPS 2
+#define VDPOS(r2, x)                                                         \
+  _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(r2, _mm512_setzero_pd(),          \
+                                         _CMP_GT_OQ),                      \
+                      x)
+#elif defined(__AVX__)
+#define VDLANES 4
+#define vdouble __m256d
+#define VDLOAD(p) _mm256_loadu_pd(p)
+#define VDSTORE(p, x) _mm256_storeu_pd(p, x)
+#define VDSET1(x) _mm256_set1_pd(x)
+#define VDADD(x, y) _mm256_add_pd(x, y)
+#define VDSUB(x, y) _mm256_sub_pd(x, y)
+#define VDMUL(x, y) _mm256_mul_pd(x, y)
+#define VDDIV(x, y) _mm256_div_pd(x, y)
+#define VDSQRT(x) _mm256_sqrt_pd(x)
+#define VDRSQRT0(x) _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(x)))
+#define VDNOTFLT(x)                                                          \
+  _mm256_or_pd(_mm256_cmp_pd(x, _mm256_set1_pd(FLT_MAX), _CMP_GT_OQ),       \
+               _mm256_and_pd(_mm256_cmp_pd(x, _mm256_set1_pd(FLT_MIN),      \
+                                           _CMP_LT_OQ),                     \
+                             _mm256_cmp_pd(x, _mm256_setzero_pd(),          \
+                                           _CMP_GT_OQ)))
+#define VDANY(m) _mm256_movemask_pd(m)
+#define VDSELECT(m, x, y) _mm256_blendv_pd(y, x, m)
+#define VDRSQRT_STEPS 3
+#define VDPOS(r2, x)                                                         \
+  _mm256_and_pd(_mm256_cmp_pd(r2, _mm256_setzero_pd(), _CMP_GT_OQ), x)
+#elif defined(__SSE2__)
+#define VDLANES 2
+#define vdouble __m128d
+#define VDLOAD(p) _mm_loadu_pd(p)
+#define VDSTORE(p, x) _mm_storeu_pd(p, x)
+#define VDSET1(x) _mm_set1_pd(x)
+#define VDADD(x, y) _mm_add_pd(x, y)
+#define VDSUB(x, y) _mm_sub_pd(x, y)
+#define VDMUL(x, y) _mm_mul_pd(x, y)
+#define VDDIV(x, y) _mm_div_pd(x, y)
+#define VDSQRT(x) _mm_sqrt_pd(x)
+#define VDRSQRT0(x) _mm_cvtps_pd(_mm_rsqrt_ps(_mm_cvtpd_ps(x)))
+#define VDNOTFLT(x)                                                          \
+  _mm_or_pd(_mm_cmpgt_pd(x, _mm_set1_pd(FLT_MAX)),                          \
+            _mm_and_pd(_mm_cmplt_pd(x, _mm_set1_pd(FLT_MIN)),               \
+                       _mm_cmpgt_pd(x, _mm_setzero_pd())))
+#define VDANY(m) _mm_movemask_pd(m)
+#define VDSELECT(m, x, y) _mm_or_pd(_mm_and_pd(m, x), _mm_andnot_pd(m, y))
+#define VDRSQRT_STEPS 3
+#define VDPOS(r2, x) _mm_and_pd(_mm_cmpgt_pd(r2, _mm_setzero_pd()), x)
+#else
+#define VDLANES 1
+#define vdouble double
+#define VDLOAD(p) (*(p))
+#define VDSTORE(p, x) (*(p) = (x))
+#define VDSET1(x) (x)
+#define VDADD(x, y) ((x) + (y))
+#define VDSUB(x, y) ((x) - (y))
+#define VDMUL(x, y) ((x) * (y))
+#define VDDIV(x, y) ((x) / (y))
+#define VDSQRT(x) sqrt(x)
+#define VDRSQRT0(x) (1.0 / sqrt(x))
+#define VDRSQRT_STEPS 0
+#define VDPOS(r2, x) ((r2) > 0.0 ? (x) : 0.0)
+#endif
+
+static double
+vd_hsum(vdouble v)
+{
+  double lane[VDLANES], sum = 0.0;
+  int k;
+
+  VDSTORE(lane, v);
+  for (k = 0; k < VDLANES; k++)
+    sum += lane[k];
+  return sum;
+}
+
+/* 1 / |r|, exactly or from the estimate, each Newton step
+   y (1.5 - 0.5 r2 y^2) doubling the bits. With AVX or SSE2 the estimate
+   is taken in float, so lanes whose r2 is outside the normal float range
+   (|r| below about 1e-19 or above 1e19) fall back to the exact sqrt and
+   divide; r2 = 0 is left to VDPOS. */
+
+static inline vdouble
+vd_invr_exact(vdouble r2)
+{
+  return VDDIV(VDSET1(1.0), VDSQRT(r2));
+}
+
+static inline vdouble
+vd_invr_rsqrt(vdouble r2)
+{
+  vdouble y = VDRSQRT0(r2), h = VDMUL(VDSET1(0.5), r2);
+  int k;
+
+  for (k = 0; k < VDRSQRT_STEPS; k++)
+    y = VDMUL(y, VDSUB(VDSET1(1.5), VDMUL(h, VDMUL(y, y))));
+#ifdef VDNOTFLT
+  {
+    vdouble out = VDNOTFLT(r2);
+
+    if (__builtin_expect(VDANY(out), 0))
+      y = VDSELECT(out, vd_invr_exact(r2), y);
+  }
+#endif
+  return y;
+}
+
+void body_soa_free(struct body_soa *s)
+{
+  free(s->x), free(s->y), free(s->z);
+  free(s->vx), free(s->vy), free(s->vz);
+  free(s->mass), free(s->ax), free(s->ay), free(s->az);
+}
+
+/* Returns 1, or 0 with nothing left allocated. */
+
+int body_soa_alloc(struct body_soa *s, unsigned int n)
+{
+  double **arr[10];
+  size_t bytes;
+  unsigned int k;
+
+  arr[0] = &s->x, arr[1] = &s->y, arr[2] = &s->z;
+  arr[3] = &s->vx, arr[4] = &s->vy, arr[5] = &s->vz;
+  arr[6] = &s->mass, arr[7] = &s->ax, arr[8] = &s->ay, arr[9] = &s->az;
+  s->n = n;
+  s->npad = (n + VDLANES - 1) / VDLANES * VDLANES;
+  s->rsqrt = 0;
+  bytes = ((s->npad + VDLANES) * sizeof(double) + 63) & ~(size_t)63;
+  for (k = 0; k < 10; k++)
+    *arr[k] = NULL;
+  for (k = 0; k < 10; k++)
+  {
+    if (posix_memalign((void **)arr[k], 64, bytes))
+    {
+      *arr[k] = NULL;
+      body_soa_free(s);
+      return 0;
+    }
+    memset(*arr[k], 0, bytes);
+  }
+  return 1;
+}
+
+void body_soa_to_aos(const struct body_soa *s, struct body *bodies)
+{
+  unsigned int i;
+
+  for (i = 0; i < s->n; i++)
+  {
+    bodies[i].x[0] = s->x[i];
+    bodies[i].x[1] = s->y[i];
+    bodies[i].x[2] = s->z[i];
+    bodies[i].v[0] = s->vx[i];
+    bodies[i].v[1] = s->vy[i];
+    bodies[i].v[2] = s->vz[i];
+    bodies[i].mass = s->mass[i];
+  }
+}
+
+void body_soa_from_aos(struct body_soa *s, const struct body *bodies)
+{
+  unsigned int i;
+
+  for (i = 0; i < s->n; i++)
+  {
+    s->x[i] = bodies[i].x[0];
+    s->y[i] = bodies[i].x[1];
+    s->z[i] = bodies[i].x[2];
+    s->vx[i] = bodies[i].v[0];
+    s->vy[i] = bodies[i].v[1];
+    s->vz[i] = bodies[i].v[2];
+    s->mass[i] = bodies[i].mass;
+  }
+}
+
+/* Kinetic plus potential energy, as bodies_energy computes it. */
+
+double
+body_soa_energy(const struct body_soa *s)
+{
+  double e = 0.0;
+  unsigned int i, j;
+
+  for (i = 0; i < s->n; i++)
+  {
+    vdouble xi = VDSET1(s->x[i]), yi = VDSET1(s->y[i]);
+    vdouble zi = VDSET1(s->z[i]), acc = VDSET1(0.0);
+
+    e += s->mass[i] * (s->vx[i] * s->vx[i] + s->vy[i] * s->vy[i] + s->vz[i] * s->vz[i]) / 2.;
+    for (j = i + 1; j < s->n; j += VDLANES)
+    {
+      vdouble dx = VDSUB(xi, VDLOAD(s->x + j));
+      vdouble dy = VDSUB(yi, VDLOAD(s->y + j));
+      vdouble dz = VDSUB(zi, VDLOAD(s->z + j));
+      vdouble r2 = VDADD(VDADD(VDMUL(dx, dx), VDMUL(dy, dy)), VDMUL(dz, dz));
+
+      acc = VDADD(acc, VDPOS(r2, VDMUL(VDLOAD(s->mass + j),
+                                       vd_invr_exact(r2))));
+    }
+    e -= s->mass[i] * vd_hsum(acc);
+  }
+  return e;
+}
+
+/* Accelerations of bodies i0 .. i1 - 1 from all the others,
+   sum_j m_j (x_j - x_i) / |x_j - x_i|^3. */
+
+#define BODY_ACCEL_DEFINE(KIND)                                              \
+  static void body_accel_##KIND(struct body_soa *s, unsigned int i0,       \
+                                unsigned int i1)                           \
+  {                                                                        \
+    unsigned int i, j;                                                     \
+                                                                           \
+    for (i = i0; i < i1; i++)                                              \
+    {                                                                      \
+      vdouble xi = VDSET1(s->x[i]), yi = VDSET1(s->y[i]);                  \
+      vdouble zi = VDSET1(s->z[i]);                                        \
+      vdouble ax = VDSET1(0.0), ay = VDSET1(0.0), az = VDSET1(0.0);        \
+                                                                           \
+      for (j = 0; j < s->npad; j += VDLANES)                               \
+      {                                                                    \
+        vdouble dx = VDSUB(VDLOAD(s->x + j), xi);                          \
+        vdouble dy = VDSUB(VDLOAD(s->y + j), yi);                          \
+        vdouble dz = VDSUB(VDLOAD(s->z + j), zi);                          \
+        vdouble r2 =                                                       \
+            VDADD(VDADD(VDMUL(dx, dx), VDMUL(dy, dy)), VDMUL(dz, dz));     \
+        vdouble inv = vd_invr_##KIND(r2);                                  \
+        vdouble f = VDPOS(r2, VDMUL(VDLOAD(s->mass + j),                   \
+                                    VDMUL(inv, VDMUL(inv, inv))));         \
+                                                                           \
+        ax = VDADD(ax, VDMUL(dx, f));                                      \
+        ay = VDADD(ay, VDMUL(dy, f));                                      \
+        az = VDADD(az, VDMUL(dz, f));                                      \
+      }                                                                    \
+      s->ax[i] = vd_hsum(ax);                                              \
+      s->ay[i] = vd_hsum(ay);                                              \
+      s->az[i] = vd_hsum(az);                                              \
+    }                                                                      \
+  }
+
+BODY_ACCEL_DEFINE(exact)
+BODY_ACCEL_DEFINE(rsqrt)
+
+/* The velocity and position update of one step for all bodies. */
+
+static void
+body_kick_drift(struct body_soa *s, double dt)
+{
+  vdouble vdt = VDSET1(dt);
+  unsigned int j;
+
+  for (j = 0; j < s->npad; j += VDLANES)
+  {
+    vdouble vx = VDADD(VDLOAD(s->vx + j), VDMUL(vdt, VDLOAD(s->ax + j)));
+    vdouble vy = VDADD(VDLOAD(s->vy + j), VDMUL(vdt, VDLOAD(s->ay + j)));
+    vdouble vz = VDADD(VDLOAD(s->vz + j), VDMUL(vdt, VDLOAD(s->az + j)));
+
+    VDSTORE(s->vx + j, vx);
+    VDSTORE(s->vy + j, vy);
+    VDSTORE(s->vz + j, vz);
+    VDSTORE(s->x + j, VDADD(VDLOAD(s->x + j), VDMUL(vdt, vx)));
+    VDSTORE(s->y + j, VDADD(VDLOAD(s->y + j), VDMUL(vdt, vy)));
+    VDSTORE(s->z + j, VDADD(VDLOAD(s->z + j), VDMUL(vdt, vz)));
+  }
+}
+
+/* Advances the system by steps steps of dt, updating every velocity from
+   the accelerations and then every position from the new velocities,
+   the scheme of the original benchmark's advance. */
+
+void advance(struct body_soa *s, double dt, int steps)
+{
+  int k;
+
+  for (k = 0; k < steps; k++)
+  {
+    if (s->rsqrt)
+      body_accel_rsqrt(s, 0, s->n);
+    else
+      body_accel_exact(s, 0, s->n);
+    body_kick_drift(s, dt);
+  }
+}
+
+/* A random cluster of n equal masses totalling 1 in a ball of radius 1,
+   with small random velocities. */
+
+static void
+cluster_random(struct body_soa *s, unsigned int seed)
+{
+  unsigned int i;
+  double r[6];
+  int k;
+
+  for (i = 0; i < s->n; i++)
+  {
+    do
+    {
+      for (k = 0; k < 6; k++)
+      {
+        seed = seed * 1103515245u + 12345u;
+        r[k] = (double)((seed >> 8) & 0xffff) / 32768.0 - 1.0;
+      }
+    } while (r[0] * r[0] + r[1] * r[1] + r[2] * r[2] > 1.0);
+    s->x[i] = r[0], s->y[i] = r[1], s->z[i] = r[2];
+    s->vx[i] = 0.1 * r[3], s->vy[i] = 0.1 * r[4], s->vz[i] = 0.1 * r[5];
+    s->mass[i] = 1.0 / s->n;
+  }
+}
+
+/* ------------------------------ body_pool ------------------------------ */
+
+/* Worker threads for the parallel solvers. body_pool_run calls
+   fn(arg, task, worker) for every task in 0 .. ntasks - 1, the workers
+   and the calling thread claiming tasks in order with an atomic add;
+   worker, 0 .. nthreads - 1, numbers the calling thread 0 and lets a
+   task keep per-thread state. Without USE_PTHREADS the pool is just the
+   calling thread. */
+
+#define BODY_MAX_THREADS 256
+
+struct body_pool;
+
+struct body_worker
+{
+  struct body_pool *pool;
+  int id;
+};
+
+struct body_pool
+{
+  int nthreads;
+  void (*fn)(void *arg, unsigned int task, int worker);
+  void *arg;
+  unsigned int ntasks, next;
+  double *partial; /* Per-task results, kept from run to run. */
+  unsigned int npartial;
+#ifdef USE_PTHREADS
+  struct body_worker worker[BODY_MAX_THREADS];
+  pthread_t thread[BODY_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  int generation, pending, quit;
+#endif
+};
+
+static void
+body_pool_work(struct body_pool *pool, int id)
+{
+  unsigned int t;
+
+  while ((t = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+         pool->ntasks)
+    pool->fn(pool->arg, t, id);
+}
+
+#ifdef USE_PTHREADS
+static void *
+body_pool_thread(void *p)
+{
+  struct body_pool *pool = ((struct body_worker *)p)->pool;
+  int id = ((struct body_worker *)p)->id, seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+  {
+    while (pool->generation == seen && !pool->quit)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->quit)
+      break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    body_pool_work(pool, id);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+#endif
+
+/* A pool of nthreads threads counting the caller, or NULL if out of
+   memory. If a thread cannot be started the pool keeps the ones it
+   has. */
+
+struct body_pool *
+body_pool_create(int nthreads)
+{
+  struct body_pool *pool = calloc(1, sizeof(struct body_pool));
+
+  if (!pool)
+    return NULL;
+#ifdef USE_PTHREADS
+  if (nthreads > BODY_MAX_THREADS)
+    nthreads = BODY_MAX_THREADS;
+#else
+  nthreads = 1;
+#endif
+  pool->nthreads = nthreads < 1 ? 1 : nthreads;
+#ifdef USE_PTHREADS
+  {
+    int i;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (i = 1; i < pool->nthreads; i++)
+    {
+      pool->worker[i].pool = pool;
+      pool->worker[i].id = i;
+      if (pthread_create(&pool->thread[i], NULL, body_pool_thread,
+                         &pool->worker[i]) != 0)
+        break;
+    }
+    pool->nthreads = i;
+  }
+#endif
+  return pool;
+}
+
+void body_pool_destroy(struct body_pool *pool)
+{
+#ifdef USE_PTHREADS
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 1; i < pool->nthreads; i++)
+    pthread_join(pool->thread[i], NULL);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+#endif
+  free(pool->partial);
+  free(pool);
+}
+
+/* Room for a double per task of a run of ntasks, or NULL if out of
+   memory. The buffer is kept by the pool and grown only when needed. */
+
+static double *
+body_pool_partial(struct body_pool *pool, unsigned int ntasks)
+{
+  if (ntasks > pool->npartial || !pool->partial)
+  {
+    unsigned int want = ntasks ? ntasks : 1;
+    double *p = realloc(pool->partial, want * sizeof(double));
+
+    if (!p)
+      return NULL;
+    pool->partial = p;
+    pool->npartial = want;
+  }
+  return pool->partial;
+}
+
+void body_pool_run(struct body_pool *pool, unsigned int ntasks,
+                   void (*fn)(void *, unsigned int, int), void *arg)
+{
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->ntasks = ntasks;
+  pool->next = 0;
+#ifdef USE_PTHREADS
+  pthread_mutex_lock(&pool->lock);
+  pool->pending = pool->nthreads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+#endif
+
+  body_pool_work(pool, 0);
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+/* Number of CPUs available, for sizing a pool. */
+
+int body_cpu_count(void)
+{
+#if defined(USE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n < 1 ? 1 : (int)n;
+#else
+  return 1;
+#endif
+}
+
+/* --------------------------- tiled direct sum --------------------------- */
+
+/* Direct summation for pools of threads. A task is BODY_ROWS bodies and
+   sweeps the others BODY_COLS at a time, so one tile of columns stays
+   in L1 while every row of the task is summed against it; each row
+   keeps its vector accumulators across tiles. Every pair is summed from
+   both sides rather than once with the reaction added to the other
+   body, so a task writes only its own rows. Each row therefore sees the
+   same additions in the same order as in body_accel_exact or
+   body_accel_rsqrt, whatever thread runs it, and the energy is reduced
+   over tasks in task order: the results are the same bits for any
+   number of threads. */
+
+#define BODY_ROWS 32
+#define BODY_COLS 512
+
+/* Bodies in the cluster main checks the tiled sum against. */
+#define BODY_CHECK_N 1200
+
+struct body_tile_job
+{
+  struct body_soa *s;
+  double *partial; /* Energy of each task. */
+};
+
+#define BODY_TILE_DEFINE(KIND)                                               \
+  static void body_tile_task_##KIND(void *arg, unsigned int task,          \
+                                    int worker)                            \
+  {                                                                        \
+    struct body_tile_job *job = arg;                                       \
+    struct body_soa *s = job->s;                                           \
+    vdouble acc[BODY_ROWS][4];                                             \
+    unsigned int i0 = task * BODY_ROWS, i, j, j0, j1, r, nr;               \
+    double e = 0.0;                                                        \
+                                                                           \
+    (void)worker;                                                          \
+    nr = s->n - i0 < BODY_ROWS ? s->n - i0 : BODY_ROWS;                    \
+    for (r = 0; r < nr; r++)                                               \
+      acc[r][0] = acc[r][1] = acc[r][2] = acc[r][3] = VDSET1(0.0);         \
+    for (j0 = 0; j0 < s->npad; j0 += BODY_COLS)                            \
+    {                                                                      \
+      j1 = s->npad - j0 < BODY_COLS ? s->npad : j0 + BODY_COLS;            \
+      for (r = 0; r < nr; r++)                                             \
+      {                                                                    \
+        vdouble xi = VDSET1(s->x[i0 + r]), yi = VDSET1(s->y[i0 + r]);      \
+        vdouble zi = VDSET1(s->z[i0 + r]);                                 \
+        vdouble ax = acc[r][0], ay = acc[r][1], az = acc[r][2];            \
+        vdouble phi = acc[r][3];                                           \
+                                                                           \
+        for (j = j0; j < j1; j += VDLANES)                                 \
+        {                                                                  \
+          vdouble dx = VDSUB(VDLOAD(s->x + j), xi);                        \
+          vdouble dy = VDSUB(VDLOAD(s->y + j), yi);                        \
+          vdouble dz = VDSUB(VDLOAD(s->z + j), zi);                        \
+          vdouble r2 =                                                     \
+              VDADD(VDADD(VDMUL(dx, dx), VDMUL(dy, dy)), VDMUL(dz, dz));   \
+          vdouble inv = vd_invr_##KIND(r2);                                \
+          vdouble m = VDLOAD(s->mass + j);                                 \
+          vdouble f = VDPOS(r2, VDMUL(m, VDMUL(inv, VDMUL(inv, inv))));    \
+                                                                           \
+          ax = VDADD(ax, VDMUL(dx, f));                                    \
+          ay = VDADD(ay, VDMUL(dy, f));                                    \
+          az = VDADD(az, VDMUL(dz, f));                                    \
+          phi = VDADD(phi, VDPOS(r2, VDMUL(m, inv)));                      \
+        }                                                                  \
+        acc[r][0] = ax, acc[r][1] = ay, acc[r][2] = az, acc[r][3] = phi;   \
+      }                                                                    \
+    }                                                                      \
+    for (r = 0; r < nr; r++)                                               \
+    {                                                                      \
+      i = i0 + r;                                                          \
+      s->ax[i] = vd_hsum(acc[r][0]);                                       \
+      s->ay[i] = vd_hsum(acc[r][1]);                                       \
+      s->az[i] = vd_hsum(acc[r][2]);                                       \
+      e += s->mass[i] * ((s->vx[i] * s->vx[i] + s->vy[i] * s->vy[i] + s->vz[i] * s->vz[i]) - vd_hsum(acc[r][3])) / 2.; \
+    }                                                                      \
+    job->partial[task] = e;                                                \
+  }
+
+BODY_TILE_DEFINE(exact)
+BODY_TILE_DEFINE(rsqrt)
+
+/* The accelerations of all bodies into s->ax, ay and az by direct
+   summation on the pool; returns the total energy, or NAN if out of
+   memory. */
+
+double
+body_direct_forces(struct body_soa *s, struct body_pool *pool)
+{
+  struct body_tile_job job;
+  unsigned int k, ntasks = (s->n + BODY_ROWS - 1) / BODY_ROWS;
+  double e = 0.0;
+
+  job.s = s;
+  job.partial = body_pool_partial(pool, ntasks);
+  if (!job.partial)
+    return NAN;
+  body_pool_run(pool, ntasks, s->rsqrt ? body_tile_task_rsqrt
+                                       : body_tile_task_exact, &job);
+  for (k = 0; k < ntasks; k++)
+    e += job.partial[k];
+  return e;
+}
+
+/* advance with the forces summed on the pool. */
+
+void advance_parallel(struct body_soa *s, struct body_pool *pool, double dt,
+                      int steps)
+{
+  int k;
+
+  for (k = 0; k < steps; k++)
+  {
+    body_direct_forces(s, pool);
+    body_kick_drift(s, dt);
+  }
+}
+
+/* ----------------------------- Barnes-Hut ----------------------------- */
+
+/* An octree gravity solver, O(n log n) per step. The bodies are sorted
+   by the 63-bit Morton key of their position in the root cube and
+   copied in that order, so every cell of the octree is a contiguous
+   range of them. Nodes are laid out in pre-order in a pool that is
+   reused from build to build: a cell's subtree is the skip nodes
+   starting at the cell, so the walk needs no stack and runs through
+   memory forwards, and the order of the nodes follows the Morton order
+   of the bodies.
+
+   The build computes keys and reorders bodies in parallel chunks, then
+   builds the subtrees of the BH_CELLS cells BH_TOP_LEVELS below the
+   root as parallel tasks, each into its own buffer, and finally the top
+   levels over them. Node fields, mass and centre of mass of a subtree
+   never refer to other nodes by address, so the subtrees are spliced
+   in with a plain copy.
+
+   A node is accepted as a point mass by a body outside it when its side
+   is less than theta times the distance to its centre of mass; theta 0
+   opens every node and gives direct summation. Leaves hold up to
+   BH_LEAF bodies, summed directly. Each body's walk is independent and
+   the energy is reduced over tasks in order, so the results do not
+   depend on the number of threads. */
+
+#define BH_LEAF 8
+#define BH_LEVELS 21
+#define BH_TOP_LEVELS 2
+#define BH_CELLS (1 << (3 * BH_TOP_LEVELS))
+#define BH_CHUNK 256
+
+/* Bodies in the cluster main checks the tree against. */
+#define BH_CHECK_N 1000
+
+struct bh_node
+{
+  double cx, cy, cz, mass, side2;
+  unsigned int lo, hi, skip; /* Bodies lo .. hi - 1; nodes in subtree. */
+  char pad[64 - 5 * sizeof(double) - 3 * sizeof(unsigned int)];
+};
+
+struct bh_buf
+{
+  struct bh_node *node;
+  unsigned int count, cap;
+};
+
+struct bh_tree
+{
+  double theta, x0, y0, z0, side;
+  unsigned int n, ntasks;
+  int failed;
+  uint64_t *key, *key_tmp;
+  unsigned int *idx, *idx_tmp; /* Body at each Morton position. */
+  double *x, *y, *z, *m;       /* Bodies in Morton order. */
+  double *partial;             /* Energy of each force task. */
+  struct body_soa *s;
+  struct bh_buf top, cell[BH_CELLS];
+};
+
+int bh_init(struct bh_tree *t, unsigned int n, double theta)
+{
+  size_t nb = n ? n : 1; /* So that malloc never sees 0. */
+
+  memset(t, 0, sizeof(*t));
+  t->theta = theta;
+  t->n = n;
+  t->ntasks = (n + BH_CHUNK - 1) / BH_CHUNK;
+  t->key = malloc(nb * sizeof(uint64_t));
+  t->key_tmp = malloc(nb * sizeof(uint64_t));
+  t->idx = malloc(nb * sizeof(unsigned int));
+  t->idx_tmp = malloc(nb * sizeof(unsigned int));
+  t->x = malloc(nb * sizeof(double));
+  t->y = malloc(nb * sizeof(double));
+  t->z = malloc(nb * sizeof(double));
+  t->m = malloc(nb * sizeof(double));
+  t->partial = malloc((t->ntasks ? t->ntasks : 1) * sizeof(double));
+  return t->key && t->key_tmp && t->idx && t->idx_tmp && t->x && t->y &&
+         t->z && t->m && t->partial;
+}
+
+void bh_free(struct bh_tree *t)
+{
+  int c;
+
+  free(t->key), free(t->key_tmp), free(t->idx), free(t->idx_tmp);
+  free(t->x), free(t->y), free(t->z), free(t->m), free(t->partial);
+  free(t->top.node);
+  for (c = 0; c < BH_CELLS; c++)
+    free(t->cell[c].node);
+}
+
+/* Room for more nodes in a buffer, or 0 if out of memory. */
+
+static int
+bh_reserve(struct bh_buf *b, unsigned int more)
+{
+  if (b->count + more > b->cap)
+  {
+    unsigned int cap = b->cap * 2 > b->count + more ? b->cap * 2
+                                                    : b->count + more + 64;
+    struct bh_node *node = realloc(b->node, cap * sizeof(struct bh_node));
+
+    if (!node)
+      return 0;
+    b->node = node;
+    b->cap = cap;
+  }
+  return 1;
+}
+
+/* The low 21 bits of v spread to every third bit. */
+
+static uint64_t
+bh_spread(uint64_t v)
+{
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8) & 0x100f00f00f00f00fULL;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2) & 0x1249249249249249ULL;
+  return v;
+}
+
+static uint64_t
+bh_key(const struct bh_tree *t, double x, double y, double z)
+{
+  double scale = (1 << BH_LEVELS) / t->side, lim = (1 << BH_LEVELS) - 1;
+  double qx = (x - t->x0) * scale, qy = (y - t->y0) * scale;
+  double qz = (z - t->z0) * scale;
+
+  qx = qx < 0 ? 0 : qx > lim ? lim : qx;
+  qy = qy < 0 ? 0 : qy > lim ? lim : qy;
+  qz = qz < 0 ? 0 : qz > lim ? lim : qz;
+  return bh_spread((uint64_t)qx) << 2 | bh_spread((uint64_t)qy) << 1 |
+         bh_spread((uint64_t)qz);
+}
+
+static void
+bh_key_task(void *arg, unsigned int task, int worker)
+{
+  struct bh_tree *t = arg;
+  unsigned int i, end = (task + 1) * BH_CHUNK;
+
+  (void)worker;
+
+  for (i = task * BH_CHUNK; i < end && i < t->n; i++)
+  {
+    t->key[i] = bh_key(t, t->s->x[i], t->s->y[i], t->s->z[i]);
+    t->idx[i] = i;
+  }
+}
+
+static void
+bh_gather_task(void *arg, unsigned int task, int worker)
+{
+  struct bh_tree *t = arg;
+  unsigned int p, end = (task + 1) * BH_CHUNK;
+
+  (void)worker;
+
+  for (p = task * BH_CHUNK; p < end && p < t->n; p++)
+  {
+    t->x[p] = t->s->x[t->idx[p]];
+    t->y[p] = t->s->y[t->idx[p]];
+    t->z[p] = t->s->z[t->idx[p]];
+    t->m[p] = t->s->mass[t->idx[p]];
+  }
+}
+
+/* LSD radix sort of key and idx, eight bits a pass, skipping passes
+   where every key has the same digit. */
+
+static void
+bh_sort(struct bh_tree *t)
+{
+  unsigned int cnt[256], i, d, sum, n = t->n;
+  int shift;
+
+  for (shift = 0; shift < 64; shift += 8)
+  {
+    uint64_t *kt;
+    unsigned int *it;
+
+    memset(cnt, 0, sizeof(cnt));
+    for (i = 0; i < n; i++)
+      cnt[(t->key[i] >> shift) & 255]++;
+    if (cnt[(t->key[0] >> shift) & 255] == n)
+      continue;
+    for (d = 0, sum = 0; d < 256; d++)
+    {
+      unsigned int c = cnt[d];
+
+      cnt[d] = sum;
+      sum += c;
+    }
+    for (i = 0; i < n; i++)
+    {
+      unsigned int o = cnt[(t->key[i] >> shift) & 255]++;
+
+      t->key_tmp[o] = t->key[i];
+      t->idx_tmp[o] = t->idx[i];
+    }
+    kt = t->key, t->key = t->key_tmp, t->key_tmp = kt;
+    it = t->idx, t->idx = t->idx_tmp, t->idx_tmp = it;
+  }
+}
+
+/* First position in lo .. hi - 1 whose key is at least k. */
+
+static unsigned int
+bh_lower(const uint64_t *key, unsigned int lo, unsigned int hi, uint64_t k)
+{
+  while (lo < hi)
+  {
+    unsigned int mid = lo + (hi - lo) / 2;
+
+    if (key[mid] < k)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Appends the subtree of bodies lo .. hi - 1, a cell at level, to out
+   and returns its index, or ~0u if out of memory. With splice, cells
+   at BH_TOP_LEVELS are copied from the per-cell buffers. */
+
+static unsigned int
+bh_emit(struct bh_tree *t, struct bh_buf *out, unsigned int lo,
+        unsigned int hi, int level, int splice)
+{
+  double side = ldexp(t->side, -level), cx = 0, cy = 0, cz = 0, m = 0;
+  unsigned int k = out->count, j, c;
+  struct bh_node *nd;
+
+  if (splice && level == BH_TOP_LEVELS)
+  {
+    const struct bh_buf *cell =
+        &t->cell[t->key[lo] >> (3 * (BH_LEVELS - BH_TOP_LEVELS))];
+
+    if (!bh_reserve(out, cell->count))
+      return ~0u;
+    memcpy(out->node + k, cell->node, cell->count * sizeof(struct bh_node));
+    out->count += cell->count;
+    return k;
+  }
+
+  if (!bh_reserve(out, 1))
+    return ~0u;
+  out->count++;
+  if (hi - lo <= BH_LEAF || level == BH_LEVELS)
+  {
+    for (j = lo; j < hi; j++)
+    {
+      cx += t->m[j] * t->x[j];
+      cy += t->m[j] * t->y[j];
+      cz += t->m[j] * t->z[j];
+      m += t->m[j];
+    }
+  }
+  else
+  {
+    int shift = 3 * (BH_LEVELS - 1 - level);
+    uint64_t base = t->key[lo] >> shift & ~(uint64_t)7;
+    unsigned int b = lo, e;
+
+    for (c = 0; c < 8; c++, b = e)
+    {
+      e = c == 7 ? hi : bh_lower(t->key, b, hi, (base + c + 1) << shift);
+      if (b < e && bh_emit(t, out, b, e, level + 1, splice) == ~0u)
+        return ~0u;
+    }
+    for (j = k + 1; j < out->count; j += out->node[j].skip)
+    {
+      nd = &out->node[j];
+      cx += nd->mass * nd->cx;
+      cy += nd->mass * nd->cy;
+      cz += nd->mass * nd->cz;
+      m += nd->mass;
+    }
+  }
+
+  nd = &out->node[k];
+  nd->mass = m;
+  nd->cx = m > 0 ? cx / m : t->x[lo];
+  nd->cy = m > 0 ? cy / m : t->y[lo];
+  nd->cz = m > 0 ? cz / m : t->z[lo];
+  nd->side2 = side * side;
+  nd->lo = lo;
+  nd->hi = hi;
+  nd->skip = out->count - k;
+  return k;
+}
+
+static void
+bh_cell_task(void *arg, unsigned int task, int worker)
+{
+  struct bh_tree *t = arg;
+  int shift = 3 * (BH_LEVELS - BH_TOP_LEVELS);
+  unsigned int lo = bh_lower(t->key, 0, t->n, (uint64_t)task << shift);
+  unsigned int hi = bh_lower(t->key, lo, t->n, (uint64_t)(task + 1) << shift);
+
+  (void)worker;
+
+  t->cell[task].count = 0;
+  if (lo < hi && bh_emit(t, &t->cell[task], lo, hi, BH_TOP_LEVELS, 0) == ~0u)
+    __atomic_store_n(&t->failed, 1, __ATOMIC_RELAXED);
+}
+
+/* Builds the tree over the bodies of s, which must hold the n bodies
+   the tree was set up for. Returns 0 if out of memory. */
+
+int bh_build(struct bh_tree *t, struct body_soa *s, struct body_pool *pool)
+{
+  double x1, y1, z1, ext;
+  unsigned int i;
+
+  t->s = s;
+  t->failed = 0;
+  t->top.count = 0;
+  if (t->n == 0)
+    return 1;
+
+  t->x0 = x1 = s->x[0];
+  t->y0 = y1 = s->y[0];
+  t->z0 = z1 = s->z[0];
+  for (i = 1; i < t->n; i++)
+  {
+    t->x0 = s->x[i] < t->x0 ? s->x[i] : t->x0;
+    t->y0 = s->y[i] < t->y0 ? s->y[i] : t->y0;
+    t->z0 = s->z[i] < t->z0 ? s->z[i] : t->z0;
+    x1 = s->x[i] > x1 ? s->x[i] : x1;
+    y1 = s->y[i] > y1 ? s->y[i] : y1;
+    z1 = s->z[i] > z1 ? s->z[i] : z1;
+  }
+  ext = x1 - t->x0;
+  ext = y1 - t->y0 > ext ? y1 - t->y0 : ext;
+  ext = z1 - t->z0 > ext ? z1 - t->z0 : ext;
+  t->side = ext > 0 ? ext * (1 + 1e-12) : 1.0;
+
+  body_pool_run(pool, t->ntasks, bh_key_task, t);
+  bh_sort(t);
+  body_pool_run(pool, t->ntasks, bh_gather_task, t);
+  body_pool_run(pool, BH_CELLS, bh_cell_task, t);
+  if (t->failed || bh_emit(t, &t->top, 0, t->n, 0, 1) == ~0u)
+    return 0;
+  return 1;
+}
+
+/* Acceleration and potential at body p, in Morton order. */
+
+static void
+bh_walk(const struct bh_tree *t, unsigned int p, double *acc)
+{
+  const struct bh_node *node = t->top.node;
+  double xi = t->x[p], yi = t->y[p], zi = t->z[p];
+  double theta2 = t->theta * t->theta;
+  double ax = 0, ay = 0, az = 0, phi = 0, dx, dy, dz, r2, inv, f;
+  unsigned int k = 0, j, count = t->top.count;
+
+  while (k < count)
+  {
+    const struct bh_node *nd = &node[k];
+
+    if (nd->skip == 1)
+    {
+      for (j = nd->lo; j < nd->hi; j++)
+      {
+        dx = t->x[j] - xi;
+        dy = t->y[j] - yi;
+        dz = t->z[j] - zi;
+        r2 = dx * dx + dy * dy + dz * dz;
+        if (r2 > 0)
+        {
+          inv = 1.0 / sqrt(r2);
+          f = t->m[j] * inv * inv * inv;
+          ax += dx * f;
+          ay += dy * f;
+          az += dz * f;
+          phi -= t->m[j] * inv;
+        }
+      }
+      k++;
+      continue;
+    }
+
+    dx = nd->cx - xi;
+    dy = nd->cy - yi;
+    dz = nd->cz - zi;
+    r2 = dx * dx + dy * dy + dz * dz;
+    if (p - nd->lo >= nd->hi - nd->lo && nd->side2 < theta2 * r2)
+    {
+      inv = 1.0 / sqrt(r2);
+      f = nd->mass * inv * inv * inv;
+      ax += dx * f;
+      ay += dy * f;
+      az += dz * f;
+      phi -= nd->mass * inv;
+      k += nd->skip;
+    }
+    else
+      k++;
+  }
+  acc[0] = ax, acc[1] = ay, acc[2] = az, acc[3] = phi;
+}
+
+static void
+bh_force_task(void *arg, unsigned int task, int worker)
+{
+  struct bh_tree *t = arg;
+  struct body_soa *s = t->s;
+  unsigned int p, i, end = (task + 1) * BH_CHUNK;
+  double acc[4], e = 0;
+
+  (void)worker;
+
+  for (p = task * BH_CHUNK; p < end && p < t->n; p++)
+  {
+    bh_walk(t, p, acc);
+    i = t->idx[p];
+    s->ax[i] = acc[0];
+    s->ay[i] = acc[1];
+    s->az[i] = acc[2];
+    e += s->mass[i] * ((s->vx[i] * s->vx[i] + s->vy[i] * s->vy[i] + s->vz[i] * s->vz[i]) + acc[3]) / 2.;
+  }
+  t->partial[task] = e;
+}
+
+/* The accelerations of all bodies into s->ax, ay and az from a tree
+   built over s; returns the total energy. */
+
+double
+bh_forces(struct bh_tree *t, struct body_pool *pool)
+{
+  double e = 0;
+  unsigned int k;
+
+  body_pool_run(pool, t->ntasks, bh_force_task, t);
+  for (k = 0; k < t->ntasks; k++)
+    e += t->partial[k];
+  return e;
+}
+
+/* advance with the tree, rebuilt every step. Returns 0 if out of
+   memory. */
+
+int advance_bh(struct body_soa *s, struct bh_tree *t, struct body_pool *pool,
+               double dt, int steps)
+{
+  int k;
+
+  for (k = 0; k < steps; k++)
+  {
+    if (!bh_build(t, s, pool))
+      return 0;
+    bh_forces(t, pool);
+    body_kick_drift(s, dt);
+  }
+  return 1;
+}
+
+/* ---------------------------- benchmark ---------------------------- */
+
+#ifdef BENCHMARK
+
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifndef BENCH_MAX_N
+#define BENCH_MAX_N 4096
+#endif
+
+/* Pair interactions per second of advance, exact and rsqrt kernels, for
+   the solar system and random clusters, and the relative energy drift
+   for the solar system. The clusters are unsoftened, so close encounters
+   make their energy drift meaningless as a measure of the integrator. */
+
+static void
+benchmark(void)
+{
+  static const unsigned int sizes[] = {5, 64, 256, 1024, 4096};
+  struct body_soa s;
+  int z, kind;
+
+  for (z = 0; z < (int)(sizeof(sizes) / sizeof(sizes[0])); z++)
+  {
+    unsigned int n = sizes[z];
+    int steps = (int)(2e8 / ((double)n * n)) + 1;
+    double e0, e1, t0, t;
+
+    if (n > BENCH_MAX_N)
+      break;
+    if (!body_soa_alloc(&s, n))
+      return;
+    for (kind = 0; kind < 2; kind++)
+    {
+      if (n == 5)
+        body_soa_from_aos(&s, solar_bodies);
+      else
+        cluster_random(&s, 12345u);
+      s.rsqrt = kind;
+      e0 = body_soa_energy(&s);
+      t0 = now_seconds();
+      advance(&s, n == 5 ? 0.01 : 1e-5, steps);
+      t = now_seconds() - t0;
+      e1 = body_soa_energy(&s);
+      printf("n = %4u %s: %8.1f M interactions/s, %d steps",
+             n, kind ? "rsqrt" : "exact",
+             (double)n * n * steps / t * 1e-6, steps);
+      if (n == 5)
+        printf(", drift %.2e", fabs((e1 - e0) / e0));
+      printf("\n");
+    }
+    body_soa_free(&s);
+  }
+}
+
+
+/* bodies_energy and the direct kernel are timed up to this many
+   bodies. */
+#define BENCH_MAX_DIRECT 16384
+
+#ifndef BENCH_MAX_DIRECT_PAR
+#define BENCH_MAX_DIRECT_PAR 65536
+#endif
+
+/* The tiled direct sum on 1, 2, 4 .. all CPUs, interactions per second
+   and speedup over one thread, against bodies_energy on one thread
+   (which sums each pair once). */
+
+static void
+benchmark_direct(void)
+{
+  int ncpu = body_cpu_count(), p;
+  unsigned int n;
+
+  for (n = 1024; n <= BENCH_MAX_DIRECT_PAR; n *= 4)
+  {
+    struct body_soa s;
+    struct body *aos;
+    double t0, t, t1 = 0, pairs = (double)n * n;
+    int reps = (int)(4e8 / pairs) + 1, r;
+
+    if (!body_soa_alloc(&s, n))
+      break;
+    aos = malloc(n * sizeof(struct body));
+    cluster_random(&s, 12345u);
+    if (n <= BENCH_MAX_DIRECT && aos)
+    {
+      body_soa_to_aos(&s, aos);
+      t0 = now_seconds();
+      bodies_energy(aos, n);
+      t = now_seconds() - t0;
+      printf("n = %6u: bodies_energy %8.1f M pairs/s\n", n,
+             pairs / 2 / t * 1e-6);
+    }
+    for (p = 1;; p = p * 2 < ncpu ? p * 2 : ncpu)
+    {
+      struct body_pool *pool = body_pool_create(p);
+
+      if (!pool)
+        break;
+      body_direct_forces(&s, pool);
+      t0 = now_seconds();
+      for (r = 0; r < reps; r++)
+        body_direct_forces(&s, pool);
+      t = (now_seconds() - t0) / reps;
+      if (p == 1)
+        t1 = t;
+      printf("n = %6u: %3d threads %8.1f M interactions/s, speedup %.2f\n",
+             n, p, pairs / t * 1e-6, t1 / t);
+      body_pool_destroy(pool);
+      if (p == ncpu)
+        break;
+    }
+    free(aos);
+    body_soa_free(&s);
+  }
+}
+
+#ifndef BENCH_MAX_BH
+#define BENCH_MAX_BH 100000
+#endif
+
+/* Barnes-Hut at theta 0.5 on every CPU, build and force times, against
+   direct summation with bodies_energy and the exact force kernel: the
+   relative energy error and rms relative force error. */
+
+static void
+benchmark_bh(void)
+{
+  struct body_pool *pool = body_pool_create(body_cpu_count());
+  unsigned int n;
+
+  if (!pool)
+    return;
+  printf("Barnes-Hut, theta 0.5, %d threads\n", pool->nthreads);
+  for (n = 1000; n <= BENCH_MAX_BH; n *= 10)
+  {
+    struct body_soa s, d;
+    struct bh_tree t;
+    double t0, tb, tf, e, ref = 0, te = 0, ta = 0, num = 0, den = 0, da;
+    unsigned int i;
+
+    if (!body_soa_alloc(&s, n))
+      break;
+    if (!bh_init(&t, n, 0.5))
+    {
+      bh_free(&t);
+      body_soa_free(&s);
+      break;
+    }
+    cluster_random(&s, 12345u);
+    t0 = now_seconds();
+    bh_build(&t, &s, pool);
+    tb = now_seconds() - t0;
+    t0 = now_seconds();
+    e = bh_forces(&t, pool);
+    tf = now_seconds() - t0;
+    printf("n = %7u: build %8.3f ms, forces %9.3f ms", n, tb * 1e3,
+           tf * 1e3);
+
+    if (n <= BENCH_MAX_DIRECT && body_soa_alloc(&d, n))
+    {
+      struct body *aos = malloc(n * sizeof(struct body));
+
+      if (!aos)
+      {
+        printf("\n");
+        body_soa_free(&d);
+        bh_free(&t);
+        body_soa_free(&s);
+        break;
+      }
+      cluster_random(&d, 12345u);
+      body_soa_to_aos(&d, aos);
+      t0 = now_seconds();
+      ref = bodies_energy(aos, n);
+      te = now_seconds() - t0;
+      t0 = now_seconds();
+      body_accel_exact(&d, 0, n);
+      ta = now_seconds() - t0;
+      for (i = 0; i < n; i++)
+      {
+        da = (s.ax[i] - d.ax[i]) * (s.ax[i] - d.ax[i]) + (s.ay[i] - d.ay[i]) * (s.ay[i] - d.ay[i]) + (s.az[i] - d.az[i]) * (s.az[i] - d.az[i]);
+        num += da;
+        den += d.ax[i] * d.ax[i] + d.ay[i] * d.ay[i] + d.az[i] * d.az[i];
+      }
+      printf("; direct: bodies_energy %9.3f ms, forces %9.3f ms; "
+             "energy err %.1e, force err %.1e",
+             te * 1e3, ta * 1e3, fabs((e - ref) / ref), sqrt(num / den));
+      free(aos);
+      body_soa_free(&d);
+    }
+    printf("\n");
+    bh_free(&t);
+    body_soa_free(&s);
+  }
+  body_pool_destroy(pool);
+}
+
+#endif
+
 /* ------------------------------ main ------------------------------ */
 
 int main()
@@ -241,10 +1576,163 @@ int main()
   else
     res = 0;
 
+  /* The SoA store: the same energy, then the reference energy of the
+     original benchmark after 1000 steps of 0.01, exact and rsqrt.
+     offset_momentum is idempotent, so solar_bodies is in the original
+     benchmark's start state. */
+  for (m = 0; m < 2; m++)
+  {
+    struct body_soa s;
+
+    if (!body_soa_alloc(&s, BODIES_SIZE))
+      return 1;
+    body_soa_from_aos(&s, solar_bodies);
+    s.rsqrt = m;
+    res &= double_eq_beebs(100 * body_soa_energy(&s), -16.907516382852478);
+    advance(&s, 0.01, 1000);
+    res &= fabs(body_soa_energy(&s) - -0.169087605) < 5e-10;
+    body_soa_free(&s);
+  }
+
+  /* The rsqrt kernel to full precision whether or not r2 fits the float
+     estimate. */
+  {
+    static const double r2[] = {1e-300, 1e-40, 1.5e-38, 1e-20, 0.5,
+                                3.0,    1e20,  3e38,    1e39,  1e300};
+    double y;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(r2) / sizeof(r2[0]); i++)
+    {
+      y = vd_hsum(vd_invr_rsqrt(VDSET1(r2[i]))) / VDLANES;
+      res &= fabs(y * sqrt(r2[i]) - 1) < 1e-14;
+    }
+  }
+
+  /* Barnes-Hut. The solar system fits in one leaf, so the sums are
+     direct: the reference energies again. Then a random cluster: theta 0
+     against bodies_energy, theta 0.5 against the direct kernel, and the
+     same bits from one thread and three. Without USE_PTHREADS both pools
+     are the calling thread alone, so that last comparison is only made
+     in a USE_PTHREADS build. */
+  {
+    static struct body cl[BH_CHECK_N];
+    struct body_soa bs, ds;
+    struct bh_tree t;
+    struct body_pool *p1 = body_pool_create(1), *p3 = body_pool_create(3);
+    double e, ref, da, num = 0, den = 0;
+    unsigned int i;
+#ifdef USE_PTHREADS
+    double e3;
+#endif
+
+    if (!p1 || !p3 || !body_soa_alloc(&bs, BODIES_SIZE) ||
+        !bh_init(&t, BODIES_SIZE, 0.5))
+      return 1;
+    body_soa_from_aos(&bs, solar_bodies);
+    res &= bh_build(&t, &bs, p1);
+    res &= double_eq_beebs(100 * bh_forces(&t, p1), -16.907516382852478);
+    res &= advance_bh(&bs, &t, p1, 0.01, 1000);
+    res &= bh_build(&t, &bs, p1);
+    res &= fabs(bh_forces(&t, p1) - -0.169087605) < 5e-10;
+    bh_free(&t);
+    body_soa_free(&bs);
+
+    if (!body_soa_alloc(&bs, BH_CHECK_N) || !body_soa_alloc(&ds, BH_CHECK_N) ||
+        !bh_init(&t, BH_CHECK_N, 0.0))
+      return 1;
+    cluster_random(&bs, 7u);
+    cluster_random(&ds, 7u);
+    body_soa_to_aos(&bs, cl);
+    ref = bodies_energy(cl, BH_CHECK_N);
+    res &= bh_build(&t, &bs, p1);
+    res &= fabs((bh_forces(&t, p1) - ref) / ref) < 1e-12;
+
+    t.theta = 0.5;
+#ifdef USE_PTHREADS
+    res &= bh_build(&t, &bs, p3);
+    e3 = bh_forces(&t, p3);
+    memcpy(ds.vx, bs.ax, BH_CHECK_N * sizeof(double));
+#endif
+    res &= bh_build(&t, &bs, p1);
+    e = bh_forces(&t, p1);
+#ifdef USE_PTHREADS
+    res &= e == e3;
+    res &= memcmp(ds.vx, bs.ax, BH_CHECK_N * sizeof(double)) == 0;
+#endif
+    res &= fabs((e - ref) / ref) < 1e-3;
+
+    body_accel_exact(&ds, 0, BH_CHECK_N);
+    for (i = 0; i < BH_CHECK_N; i++)
+    {
+      da = (bs.ax[i] - ds.ax[i]) * (bs.ax[i] - ds.ax[i]) + (bs.ay[i] - ds.ay[i]) * (bs.ay[i] - ds.ay[i]) + (bs.az[i] - ds.az[i]) * (bs.az[i] - ds.az[i]);
+      num += da;
+      den += ds.ax[i] * ds.ax[i] + ds.ay[i] * ds.ay[i] + ds.az[i] * ds.az[i];
+    }
+    res &= sqrt(num / den) < 1e-2;
+
+    bh_free(&t);
+    body_soa_free(&bs);
+    body_soa_free(&ds);
+    body_pool_destroy(p1);
+    body_pool_destroy(p3);
+  }
+
+  /* The tiled direct sum: the reference energies for the solar system,
+     then for a cluster spanning several tiles of rows and columns, the
+     energy of bodies_energy and the same bits as body_accel_exact from
+     three threads and, in a USE_PTHREADS build, from one. */
+  {
+    static struct body cl[BODY_CHECK_N];
+    struct body_soa bs, ds;
+    struct body_pool *p1 = body_pool_create(1), *p3 = body_pool_create(3);
+    double e, ref;
+
+    if (!p1 || !p3 || !body_soa_alloc(&bs, BODIES_SIZE))
+      return 1;
+    body_soa_from_aos(&bs, solar_bodies);
+    res &= double_eq_beebs(100 * body_direct_forces(&bs, p3),
+                           -16.907516382852478);
+    advance_parallel(&bs, p3, 0.01, 1000);
+    res &= fabs(body_direct_forces(&bs, p3) - -0.169087605) < 5e-10;
+    body_soa_free(&bs);
+
+    if (!body_soa_alloc(&bs, BODY_CHECK_N) ||
+        !body_soa_alloc(&ds, BODY_CHECK_N))
+      return 1;
+    cluster_random(&bs, 11u);
+    cluster_random(&ds, 11u);
+    body_soa_to_aos(&bs, cl);
+    ref = bodies_energy(cl, BODY_CHECK_N);
+    e = body_direct_forces(&bs, p3);
+    res &= fabs((e - ref) / ref) < 1e-12;
+    body_accel_exact(&ds, 0, BODY_CHECK_N);
+    res &= memcmp(bs.ax, ds.ax, BODY_CHECK_N * sizeof(double)) == 0;
+    res &= memcmp(bs.ay, ds.ay, BODY_CHECK_N * sizeof(double)) == 0;
+    res &= memcmp(bs.az, ds.az, BODY_CHECK_N * sizeof(double)) == 0;
+#ifdef USE_PTHREADS
+    res &= body_direct_forces(&bs, p1) == e;
+    res &= memcmp(bs.ax, ds.ax, BODY_CHECK_N * sizeof(double)) == 0;
+    res &= memcmp(bs.ay, ds.ay, BODY_CHECK_N * sizeof(double)) == 0;
+    res &= memcmp(bs.az, ds.az, BODY_CHECK_N * sizeof(double)) == 0;
+#endif
+
+    body_soa_free(&bs);
+    body_soa_free(&ds);
+    body_pool_destroy(p1);
+    body_pool_destroy(p3);
+  }
+
   correct = res == 1 ? 1 : 0;
 
   printf("The result is: %d\n", correct);
 
+#ifdef BENCHMARK
+  benchmark();
+  benchmark_direct();
+  benchmark_bh();
+#endif
+
   return 0;
 }
 
@@ -21,6 +21,17 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+// On x86 the IDCT and colour conversion have SSE2 and AVX2 versions, picked at init from what the CPU supports.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PJPG_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef BENCHMARK
+#include <time.h>
+#endif
 //------------------------------------------------------------------------------
 // Set to 1 if right shifts on signed ints are always unsigned (logical) shifts
 // When 1, arithmetic right shifts will be emulated by using a logical shift
@@ -29,9 +40,20 @@
 
 // Define PJPG_INLINE to "inline" if your C compiler supports explicit inlining
 #define PJPG_INLINE
+
+// Huffman codes of up to this many bits are decoded with one table lookup, along with their extra bits when those fit too.
+// Each of the 4 Huffman tables grows by 4 << PJPG_HUFF_LOOKAHEAD_BITS bytes (8KB in all at 9 bits). 0 disables the tables,
+// leaving only the bit at a time decoder.
+#ifndef PJPG_HUFF_LOOKAHEAD_BITS
+#define PJPG_HUFF_LOOKAHEAD_BITS 9
+#endif
+#if PJPG_HUFF_LOOKAHEAD_BITS > 16
+#error "PJPG_HUFF_LOOKAHEAD_BITS must be at most 16, the longest Huffman code, for mMaxCode[] and the 16-bit lookup index"
+#endif
 //------------------------------------------------------------------------------
 typedef unsigned char uint8;
 typedef unsigned short uint16;
+typedef unsigned long long uint64;
 typedef signed char int8;
 typedef signed short int16;
 //------------------------------------------------------------------------------
@@ -158,11 +180,40 @@ extern "C"
                                   void *pCallback_data,
                                   unsigned char reduce);
 
+  // Initializes the decompressor to read the whole file from memory, such as a memory-mapped file, instead of through a callback.
+  // The entropy decoder then reads pData in place, a 64-bit word at a time when it holds no 0xFF byte, rather than through the
+  // 256 byte input buffer. pData must stay valid until decoding is done. Returns 0 on success, or one of the above error codes.
+  // Not thread safe.
+  unsigned char pjpeg_decode_init_mem(pjpeg_image_info_t *pInfo,
+                                      const unsigned char *pData,
+                                      unsigned long size,
+                                      unsigned char reduce);
+
   // Decompresses the file's next MCU. Returns 0 on success, PJPG_NO_MORE_BLOCKS if no more blocks are available, or an error code.
   // Must be called a total of m_MCUSPerRow*m_MCUSPerCol times to completely decompress the image.
   // Not thread safe.
   unsigned char pjpeg_decode_mcu(void);
 
+  // Pixel formats pjpeg_decode_image() can write.
+  typedef enum
+  {
+    PJPG_PIXEL_GRAY, // 1 byte per pixel: Y, or (77*R + 150*G + 29*B + 128) >> 8 for color images
+    PJPG_PIXEL_RGB,  // 3 bytes per pixel: R, G, B (Y replicated for grayscale images)
+    PJPG_PIXEL_RGBA  // 4 bytes per pixel: R, G, B, 255
+  } pjpeg_pixel_format_t;
+
+  // Decompresses all of the file's remaining MCU's straight into pDst, a bitmap of rowStride bytes per row, so the caller
+  // doesn't have to blit each MCU itself. Pixel (x, y) goes to pDst + y * rowStride + x * (bytes per pixel).
+  // The bitmap is m_width x m_height pixels, or ((m_width + 7) / 8) x ((m_height + 7) / 8) pixels in reduce mode (one per block).
+  // MCU's that straddle the right or bottom edge are clipped, so nothing is written outside the bitmap.
+  // May be called after some MCU's have been read with pjpeg_decode_mcu(); those stay unwritten.
+  // pInfo must be the one filled in by the last pjpeg_decode_init() or pjpeg_decode_init_mem().
+  // Returns 0 once the whole image is decoded, or an error code (PJPG_ASSERTION_ERROR for a bad pInfo, pDst, rowStride or format).
+  // Not thread safe.
+  unsigned char pjpeg_decode_image(pjpeg_image_info_t *pInfo,
+                                   unsigned char *pDst, int rowStride,
+                                   pjpeg_pixel_format_t format);
+
 #ifdef __cplusplus
 }
 #endif
@@ -366,8 +417,22 @@ static const int8 ZAG[] = {
 };
 
 //------------------------------------------------------------------------------
+#ifdef PJPG_X86
+// 768 bytes: with SIMD every block of the MCU is kept, to be transformed
+// together once the MCU is decoded
+static int16 gCoeffBuf[6 * 8 * 8];
+
+// 128 bytes: the MCU's Cb and Cr blocks, between IDCT and colour conversion
+static uint8 gChromaBuf[2 * 8 * 8];
+
+// SIMD level of the IDCT and colour conversion: 0 scalar, 1 SSE2, 2 AVX2.
+// Set at init from the CPU, but never above gSimdLimit.
+static uint8 gSimd;
+static uint8 gSimdLimit = 2;
+#else
 // 128 bytes
 static int16 gCoeffBuf[8 * 8];
+#endif
 
 // 8*8*4 bytes * 3 = 768
 static uint8 gMCUBufR[256];
@@ -386,9 +451,15 @@ typedef struct HuffTableT
   uint16 mMinCode[16];
   uint16 mMaxCode[16];
   uint8 mValPtr[16];
+#if PJPG_HUFF_LOOKAHEAD_BITS
+  // Indexed by the next PJPG_HUFF_LOOKAHEAD_BITS bits of input.
+  // mLookCode: bits to consume | (1 << 5 if mLookValue holds the extended extra bits) | (symbol << 8); 0 for longer codes.
+  uint16 mLookCode[1 << PJPG_HUFF_LOOKAHEAD_BITS];
+  int16 mLookValue[1 << PJPG_HUFF_LOOKAHEAD_BITS];
+#endif
 } HuffTable;
 
-// DC - 192
+// DC - 192, plus the lookahead tables
 static HuffTable gHuffTab0;
 
 static uint8 gHuffVal0[16];
@@ -396,7 +467,7 @@ static uint8 gHuffVal0[16];
 static HuffTable gHuffTab1;
 static uint8 gHuffVal1[16];
 
-// AC - 672
+// AC - 672, plus the lookahead tables
 static HuffTable gHuffTab2;
 static uint8 gHuffVal2[256];
 
@@ -414,6 +485,20 @@ static uint8 gInBufLeft;
 
 static uint16 gBitBuf;
 static uint8 gBitsLeft;
+
+// Entropy coded data is read through a 64-bit accumulator, holding gBitCnt
+// bits from its most significant end. Once a marker is reached zeros are fed.
+static uint64 gBitAcc;
+static uint8 gBitCnt;
+static uint8 gMarkerHit;
+
+// Memory input, from pjpeg_decode_init_mem(). Markers are read through
+// gInBuf, gMemOfs bytes having been handed to it; the entropy decoder reads
+// gMemPtr directly.
+static const uint8 *gMemData;
+static unsigned long gMemSize;
+static unsigned long gMemOfs;
+static const uint8 *gMemPtr;
 //------------------------------------------------------------------------------
 static uint16 gImageXSize;
 static uint16 gImageYSize;
@@ -439,7 +524,7 @@ static uint8 gMaxMCUXSize;
 static uint8 gMaxMCUYSize;
 static uint16 gMaxMCUSPerRow;
 static uint16 gMaxMCUSPerCol;
-static uint16 gNumMCUSRemaining;
+static unsigned long gNumMCUSRemaining;
 static uint8 gMCUOrg[6];
 
 static pjpeg_need_bytes_callback_t g_pNeedBytesCallback;
@@ -562,33 +647,167 @@ getBits1(uint8 numBits)
 }
 
 //------------------------------------------------------------------------------
-static PJPG_INLINE uint16
-getBits2(uint8 numBits)
+// Feeds memory input to the marker parser through gInBuf.
+static unsigned char
+memNeedBytes(unsigned char *pBuf, unsigned char buf_size,
+             unsigned char *pBytes_actually_read, void *pCallback_data)
 {
-  return getBits(numBits, 1);
+  unsigned long n = gMemSize - gMemOfs;
+
+  (void)pCallback_data;
+
+  if (n > buf_size)
+    n = buf_size;
+
+  memcpy(pBuf, gMemData + gMemOfs, n);
+  gMemOfs += n;
+  *pBytes_actually_read = (unsigned char)n;
+
+  return 0;
 }
 
 //------------------------------------------------------------------------------
-static PJPG_INLINE uint8
-getBit(void)
+// Starts entropy decoding at the byte getChar() would return next. With
+// memory input the bytes still in gInBuf are given back to gMemPtr.
+static void
+resetEntropyBits(void)
+{
+  gBitAcc = 0;
+  gBitCnt = 0;
+  gMarkerHit = 0;
+
+  if (gMemData)
+  {
+    gMemPtr = gMemData + gMemOfs - gInBufLeft;
+    gInBufLeft = 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Hands the input from gMemPtr back to getChar(), for restart marker scanning.
+static void
+syncMemInput(void)
+{
+  if (gMemData)
+  {
+    gMemOfs = (unsigned long)(gMemPtr - gMemData);
+    gInBufLeft = 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Returns the next entropy coded byte with 0xFF 0x00 unstuffed, or 0 from
+// the first marker on. The marker itself is left unread.
+static uint8
+getEntropyByte(void)
 {
-  uint8 ret = 0;
-  if (gBitBuf & 0x8000)
-    ret = 1;
+  uint8 c;
+
+  if (gMarkerHit)
+    return 0;
+
+  if (gMemData)
+  {
+    const uint8 *pEnd = gMemData + gMemSize;
+
+    if (gMemPtr == pEnd)
+    {
+      gMarkerHit = 1;
+      return 0;
+    }
+
+    c = *gMemPtr;
+    if (c != 0xFF)
+    {
+      gMemPtr++;
+      return c;
+    }
+
+    if ((pEnd - gMemPtr < 2) || (gMemPtr[1]))
+    {
+      gMarkerHit = 1;
+      return 0;
+    }
+
+    gMemPtr += 2;
+    return 0xFF;
+  }
+  else
+  {
+    uint8 n;
+
+    c = getChar();
+    if (c != 0xFF)
+      return c;
 
-  if (!gBitsLeft)
+    n = getChar();
+    if (!n)
+      return 0xFF;
+
+    stuffChar(n);
+    stuffChar(0xFF);
+    gMarkerHit = 1;
+    return 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Tops gBitAcc up to at least 57 bits. From memory, 8 bytes with no 0xFF
+// among them are loaded in one go: the whole bytes that fit are consumed
+// and the bits past them, ORed in early, are the same ones the next fill
+// ORs in again.
+static void
+fillEntropyBits(void)
+{
+  if ((gMemData) && (!gMarkerHit) && (gMemData + gMemSize - gMemPtr >= 8))
   {
-    gBitBuf |= getOctet(1);
+    const uint8 *p = gMemPtr;
+    uint64 w = ((uint64)p[0] << 56) | ((uint64)p[1] << 48) |
+               ((uint64)p[2] << 40) | ((uint64)p[3] << 32) |
+               ((uint64)p[4] << 24) | ((uint64)p[5] << 16) |
+               ((uint64)p[6] << 8) | (uint64)p[7];
+
+    // Nonzero if any byte is 0xFF (a zero byte in ~w).
+    if (!((~w - 0x0101010101010101ULL) & w & 0x8080808080808080ULL))
+    {
+      gBitAcc |= w >> gBitCnt;
+      gMemPtr += (63 - gBitCnt) >> 3;
+      gBitCnt |= 56;
+      return;
+    }
+  }
 
-    gBitsLeft += 8;
+  while (gBitCnt <= 56)
+  {
+    gBitAcc |= (uint64)getEntropyByte() << (56 - gBitCnt);
+    gBitCnt = (uint8)(gBitCnt + 8);
   }
+}
+
+//------------------------------------------------------------------------------
+// Entropy coded bits, 1 to 16 of them.
+static PJPG_INLINE uint16
+getBits2(uint8 numBits)
+{
+  uint16 ret;
 
-  gBitsLeft--;
-  gBitBuf <<= 1;
+  if (gBitCnt < numBits)
+    fillEntropyBits();
+
+  ret = (uint16)(gBitAcc >> (64 - numBits));
+  gBitAcc <<= numBits;
+  gBitCnt = (uint8)(gBitCnt - numBits);
 
   return ret;
 }
 
+//------------------------------------------------------------------------------
+static PJPG_INLINE uint8
+getBit(void)
+{
+  return (uint8)getBits2(1);
+}
+
 //------------------------------------------------------------------------------
 static uint16
 getExtendTest(uint8 i)
@@ -719,9 +938,53 @@ huffDecode(const HuffTable *pHuffTable, const uint8 *pHuffVal)
   return pHuffVal[j];
 }
 
+//------------------------------------------------------------------------------
+// Decodes a symbol and reads its extra bits (as many as its low 4 bits),
+// returning the symbol and the extra bits' huffExtend()ed value in *pValue.
+static PJPG_INLINE uint8
+huffDecodeExtend(const HuffTable *pHuffTable, const uint8 *pHuffVal,
+                 int16 *pValue)
+{
+  uint8 s, n;
+
+#if PJPG_HUFF_LOOKAHEAD_BITS
+  uint16 look, index;
+
+  if (gBitCnt < PJPG_HUFF_LOOKAHEAD_BITS)
+    fillEntropyBits();
+
+  index = (uint16)(gBitAcc >> (64 - PJPG_HUFF_LOOKAHEAD_BITS));
+  look = pHuffTable->mLookCode[index];
+
+  if (look)
+  {
+    uint8 len = look & 31;
+
+    gBitAcc <<= len;
+    gBitCnt = (uint8)(gBitCnt - len);
+    s = (uint8)(look >> 8);
+
+    if (look & 32)
+    {
+      *pValue = pHuffTable->mLookValue[index];
+      return s;
+    }
+  }
+  else
+    s = huffDecode(pHuffTable, pHuffVal);
+#else
+  s = huffDecode(pHuffTable, pHuffVal);
+#endif
+
+  n = s & 15;
+  *pValue = n ? huffExtend(getBits2(n), n) : 0;
+
+  return s;
+}
+
 //------------------------------------------------------------------------------
 static void
-huffCreate(const uint8 *pBits, HuffTable *pHuffTable)
+huffCreate(const uint8 *pBits, const uint8 *pHuffVal, HuffTable *pHuffTable)
 {
   uint8 i = 0;
   uint8 j = 0;
@@ -755,6 +1018,46 @@ huffCreate(const uint8 *pBits, HuffTable *pHuffTable)
     if (i > 15)
       break;
   }
+
+#if PJPG_HUFF_LOOKAHEAD_BITS
+  // Every input that starts with a code of up to PJPG_HUFF_LOOKAHEAD_BITS
+  // bits gets that code's entry; with the extended extra bits too if they
+  // are within the lookahead.
+  memset(pHuffTable->mLookCode, 0, sizeof(pHuffTable->mLookCode));
+
+  for (i = 0; i < PJPG_HUFF_LOOKAHEAD_BITS; i++)
+  {
+    uint8 len = i + 1;
+    uint8 fill = PJPG_HUFF_LOOKAHEAD_BITS - len;
+
+    if (pHuffTable->mMaxCode[i] == 0xFFFF)
+      continue;
+
+    // Codes past 2^len only come from bad DHT counts.
+    for (code = pHuffTable->mMinCode[i];
+         (code <= pHuffTable->mMaxCode[i]) && (code >> len) == 0; code++)
+    {
+      uint8 s = pHuffVal[(uint8)(pHuffTable->mValPtr[i] + (code - pHuffTable->mMinCode[i]))];
+      uint8 n = s & 15;
+      uint16 k;
+
+      for (k = 0; k < (1U << fill); k++)
+      {
+        uint16 index = (uint16)((code << fill) | k);
+
+        if (n <= fill)
+        {
+          pHuffTable->mLookCode[index] = (uint16)((len + n) | 32 | (s << 8));
+          pHuffTable->mLookValue[index] = n ? huffExtend(k >> (fill - n), n) : 0;
+        }
+        else
+          pHuffTable->mLookCode[index] = (uint16)(len | (s << 8));
+      }
+    }
+  }
+#else
+  (void)pHuffVal;
+#endif
 }
 
 //------------------------------------------------------------------------------
@@ -858,7 +1161,7 @@ readDHTMarker(void)
 
     left = (uint16)(left - totalRead);
 
-    huffCreate(bits, pHuffTable);
+    huffCreate(bits, pHuffVal, pHuffTable);
   }
 
   return 0;
@@ -1315,9 +1618,7 @@ fixInBuffer(void)
 
   stuffChar((uint8)(gBitBuf >> 8));
 
-  gBitsLeft = 8;
-  getBits2(8);
-  getBits2(8);
+  resetEntropyBits();
 }
 
 //------------------------------------------------------------------------------
@@ -1330,6 +1631,8 @@ processRestart(void)
   uint16 i;
   uint8 c = 0;
 
+  syncMemInput();
+
   for (i = 1536; i > 0; i--)
     if (getChar() == 0xFF)
       break;
@@ -1358,10 +1661,7 @@ processRestart(void)
   gNextRestartNum = (gNextRestartNum + 1) & 7;
 
   // Get the bit buffer going again
-
-  gBitsLeft = 8;
-  getBits2(8);
-  getBits2(8);
+  resetEntropyBits();
 
   return 0;
 }
@@ -1523,7 +1823,7 @@ initFrame(void)
   gMaxMCUSPerCol =
       (gImageYSize + (gMaxMCUYSize - 1)) >> ((gMaxMCUYSize == 8) ? 3 : 4);
 
-  gNumMCUSRemaining = gMaxMCUSPerRow * gMaxMCUSPerCol;
+  gNumMCUSRemaining = (unsigned long)gMaxMCUSPerRow * gMaxMCUSPerCol;
 
   return 0;
 }
@@ -2536,6 +2836,380 @@ transformBlockReduce(uint8 mcuBlock)
   }
 }
 
+#ifdef PJPG_X86
+//------------------------------------------------------------------------------
+// SIMD IDCT and colour conversion, bit exact with idctRows(), idctCols() and
+// transformBlock(). The 16-bit lanes wrap just as the scalar int16's do, and
+// the steps whose scalar versions work in wider ints are split so no lane
+// overflows. V is the intrinsic prefix: _mm for SSE2, _mm256 for AVX2.
+
+#define PJPG_SSE2 __attribute__((target("sse2")))
+#define PJPG_AVX2 __attribute__((target("avx2")))
+
+static uint8
+simdLevel(void)
+{
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+    return 2;
+  if (__builtin_cpu_supports("sse2"))
+    return 1;
+
+  return 0;
+}
+
+// (w * (256 * a + b) + 128) >> 8 as imul_b*() compute it, wrapped to 16
+// bits: w * a plus the rounded top of w * b, whose low half is rounded with
+// pavgw's 17-bit sum.
+#define PJPG_IMUL(V, w, a, b)                                                  \
+  ({                                                                           \
+    __typeof__(w) w_ = (w);                                                    \
+    __typeof__(w) r_ = V##_add_epi16(                                          \
+        V##_slli_epi16(V##_mulhi_epi16(w_, V##_set1_epi16(b)), 8),             \
+        V##_srli_epi16(V##_avg_epu16(V##_mullo_epi16(w_, V##_set1_epi16(b)),   \
+                                     V##_set1_epi16(127)),                     \
+                       7));                                                    \
+    (a) == 0 ? r_                                                              \
+             : ((a) == 1 ? V##_add_epi16(r_, w_)                               \
+                         : V##_add_epi16(r_, V##_add_epi16(w_, w_)));          \
+  })
+
+// One 1D Winograd IDCT over x[0..7], one transform per lane. Output i is
+// p[i] + q[i] for i < 3, then p[3] - q[3], p[3] + q[3], p[2] - q[2], ...
+#define PJPG_IDCT_1D(V, x, p, q)                                               \
+  do                                                                           \
+  {                                                                            \
+    __typeof__(x[0]) x4 = V##_sub_epi16(x[5], x[3]);                           \
+    __typeof__(x[0]) x7 = V##_add_epi16(x[5], x[3]);                           \
+    __typeof__(x[0]) x5 = V##_add_epi16(x[1], x[7]);                           \
+    __typeof__(x[0]) x6 = V##_sub_epi16(x[1], x[7]);                           \
+    __typeof__(x[0]) tmp1 = PJPG_IMUL(V, V##_sub_epi16(x4, x6), 0, 196);       \
+    __typeof__(x[0]) stg26 = V##_sub_epi16(PJPG_IMUL(V, x6, 1, 21), tmp1);     \
+    __typeof__(x[0]) x24 = V##_sub_epi16(tmp1, PJPG_IMUL(V, x4, 2, 157));      \
+    __typeof__(x[0]) x15 = V##_sub_epi16(x5, x7);                              \
+    __typeof__(x[0]) x30 = V##_add_epi16(x[0], x[4]);                          \
+    __typeof__(x[0]) x31 = V##_sub_epi16(x[0], x[4]);                          \
+    __typeof__(x[0]) x12 = V##_sub_epi16(x[2], x[6]);                          \
+    __typeof__(x[0]) x13 = V##_add_epi16(x[2], x[6]);                          \
+    __typeof__(x[0]) x32 = V##_sub_epi16(PJPG_IMUL(V, x12, 1, 106), x13);      \
+    q[0] = V##_add_epi16(x5, x7);                                              \
+    q[1] = V##_sub_epi16(stg26, q[0]);                                         \
+    q[2] = V##_sub_epi16(PJPG_IMUL(V, x15, 1, 106), q[1]);                     \
+    q[3] = V##_add_epi16(q[2], x24);                                           \
+    p[0] = V##_add_epi16(x30, x13);                                            \
+    p[1] = V##_add_epi16(x31, x32);                                            \
+    p[2] = V##_sub_epi16(x31, x32);                                            \
+    p[3] = V##_sub_epi16(x30, x13);                                            \
+  } while (0)
+
+// The row pass: outputs wrapped to 16 bits, as stored by idctRows().
+#define PJPG_IDCT_ROWS(V, x)                                                   \
+  do                                                                           \
+  {                                                                            \
+    __typeof__(x[0]) p[4], q[4];                                               \
+    PJPG_IDCT_1D(V, x, p, q);                                                  \
+    x[0] = V##_add_epi16(p[0], q[0]);                                          \
+    x[1] = V##_add_epi16(p[1], q[1]);                                          \
+    x[2] = V##_add_epi16(p[2], q[2]);                                          \
+    x[3] = V##_sub_epi16(p[3], q[3]);                                          \
+    x[4] = V##_add_epi16(p[3], q[3]);                                          \
+    x[5] = V##_sub_epi16(p[2], q[2]);                                          \
+    x[6] = V##_sub_epi16(p[1], q[1]);                                          \
+    x[7] = V##_sub_epi16(p[0], q[0]);                                          \
+  } while (0)
+
+// PJPG_DESCALE(a + b) + 128, where idctCols() adds in int: each operand's
+// top 9 bits and low 7 bits are summed apart.
+#define PJPG_DESCALE_ADD(V, a, b, round)                                       \
+  V##_add_epi16(                                                               \
+      V##_add_epi16(V##_srai_epi16(a, 7), V##_srai_epi16(b, 7)),               \
+      V##_add_epi16(                                                           \
+          V##_srli_epi16(                                                      \
+              V##_add_epi16(                                                   \
+                  V##_add_epi16(V##_srli_epi16(V##_slli_epi16(a, 9), 9),       \
+                                V##_srli_epi16(V##_slli_epi16(b, 9), 9)),      \
+                  V##_set1_epi16(round)),                                      \
+              7),                                                              \
+          V##_set1_epi16(128)))
+
+// a - b is a + ~b + 1.
+#define PJPG_DESCALE_SUB(V, a, b)                                              \
+  PJPG_DESCALE_ADD(V, a, V##_sub_epi16(V##_set1_epi16(-1), b), 65)
+
+// The column pass: outputs descaled and level shifted, ready to be clamped.
+#define PJPG_IDCT_COLS(V, x)                                                   \
+  do                                                                           \
+  {                                                                            \
+    __typeof__(x[0]) p[4], q[4];                                               \
+    PJPG_IDCT_1D(V, x, p, q);                                                  \
+    x[0] = PJPG_DESCALE_ADD(V, p[0], q[0], 64);                                \
+    x[1] = PJPG_DESCALE_ADD(V, p[1], q[1], 64);                                \
+    x[2] = PJPG_DESCALE_ADD(V, p[2], q[2], 64);                                \
+    x[3] = PJPG_DESCALE_SUB(V, p[3], q[3]);                                    \
+    x[4] = PJPG_DESCALE_ADD(V, p[3], q[3], 64);                                \
+    x[5] = PJPG_DESCALE_SUB(V, p[2], q[2]);                                    \
+    x[6] = PJPG_DESCALE_SUB(V, p[1], q[1]);                                    \
+    x[7] = PJPG_DESCALE_SUB(V, p[0], q[0]);                                    \
+  } while (0)
+
+// Transposes the 8x8 16-bit matrix x[0..7] (in each 128-bit lane).
+#define PJPG_TRANSPOSE8(V, x)                                                  \
+  do                                                                           \
+  {                                                                            \
+    __typeof__(x[0]) a0 = V##_unpacklo_epi16(x[0], x[1]);                      \
+    __typeof__(x[0]) a1 = V##_unpackhi_epi16(x[0], x[1]);                      \
+    __typeof__(x[0]) a2 = V##_unpacklo_epi16(x[2], x[3]);                      \
+    __typeof__(x[0]) a3 = V##_unpackhi_epi16(x[2], x[3]);                      \
+    __typeof__(x[0]) a4 = V##_unpacklo_epi16(x[4], x[5]);                      \
+    __typeof__(x[0]) a5 = V##_unpackhi_epi16(x[4], x[5]);                      \
+    __typeof__(x[0]) a6 = V##_unpacklo_epi16(x[6], x[7]);                      \
+    __typeof__(x[0]) a7 = V##_unpackhi_epi16(x[6], x[7]);                      \
+    __typeof__(x[0]) b0 = V##_unpacklo_epi32(a0, a2);                          \
+    __typeof__(x[0]) b1 = V##_unpackhi_epi32(a0, a2);                          \
+    __typeof__(x[0]) b2 = V##_unpacklo_epi32(a1, a3);                          \
+    __typeof__(x[0]) b3 = V##_unpackhi_epi32(a1, a3);                          \
+    __typeof__(x[0]) b4 = V##_unpacklo_epi32(a4, a6);                          \
+    __typeof__(x[0]) b5 = V##_unpackhi_epi32(a4, a6);                          \
+    __typeof__(x[0]) b6 = V##_unpacklo_epi32(a5, a7);                          \
+    __typeof__(x[0]) b7 = V##_unpackhi_epi32(a5, a7);                          \
+    x[0] = V##_unpacklo_epi64(b0, b4);                                         \
+    x[1] = V##_unpackhi_epi64(b0, b4);                                         \
+    x[2] = V##_unpacklo_epi64(b1, b5);                                         \
+    x[3] = V##_unpackhi_epi64(b1, b5);                                         \
+    x[4] = V##_unpacklo_epi64(b2, b6);                                         \
+    x[5] = V##_unpackhi_epi64(b2, b6);                                         \
+    x[6] = V##_unpacklo_epi64(b3, b7);                                         \
+    x[7] = V##_unpackhi_epi64(b3, b7);                                         \
+  } while (0)
+
+// YCbCr to RGB on 16-bit lanes, as convertCb() and convertCr() do it: G is
+// clamped after each of its two steps; R, G and B are left for packus to
+// clamp.
+#define PJPG_YCC_RGB(V, y, cb, cr, r, g, b)                                    \
+  do                                                                           \
+  {                                                                            \
+    __typeof__(y) cbG = V##_sub_epi16(                                         \
+        V##_srli_epi16(V##_mullo_epi16(cb, V##_set1_epi16(88)), 8),            \
+        V##_set1_epi16(44));                                                   \
+    __typeof__(y) cbB = V##_sub_epi16(                                         \
+        V##_add_epi16(cb, V##_srli_epi16(                                      \
+                              V##_mullo_epi16(cb, V##_set1_epi16(198)), 8)),   \
+        V##_set1_epi16(227));                                                  \
+    __typeof__(y) crR = V##_sub_epi16(                                         \
+        V##_add_epi16(cr, V##_srli_epi16(                                      \
+                              V##_mullo_epi16(cr, V##_set1_epi16(103)), 8)),   \
+        V##_set1_epi16(179));                                                  \
+    __typeof__(y) crG = V##_sub_epi16(                                         \
+        V##_srli_epi16(V##_mullo_epi16(cr, V##_set1_epi16(183)), 8),           \
+        V##_set1_epi16(91));                                                   \
+    r = V##_add_epi16(y, crR);                                                 \
+    g = V##_sub_epi16(V##_min_epi16(V##_max_epi16(V##_sub_epi16(y, cbG),       \
+                                                  V##_set1_epi16(0)),          \
+                                    V##_set1_epi16(255)),                      \
+                      crG);                                                    \
+    b = V##_add_epi16(y, cbB);                                                 \
+  } while (0)
+
+//------------------------------------------------------------------------------
+static PJPG_SSE2 void
+idctBlockSSE2(const int16 *pSrc, uint8 *pDst)
+{
+  __m128i x[8];
+  uint8 i;
+
+  for (i = 0; i < 8; i++)
+    x[i] = _mm_loadu_si128((const __m128i *)(pSrc + i * 8));
+
+  PJPG_TRANSPOSE8(_mm, x);
+  PJPG_IDCT_ROWS(_mm, x);
+  PJPG_TRANSPOSE8(_mm, x);
+  PJPG_IDCT_COLS(_mm, x);
+
+  for (i = 0; i < 8; i += 2)
+    _mm_storeu_si128((__m128i *)(pDst + i * 8), _mm_packus_epi16(x[i], x[i + 1]));
+}
+
+//------------------------------------------------------------------------------
+// Two blocks at once, one per 128-bit lane.
+static PJPG_AVX2 void
+idctBlocksAVX2(const int16 *pSrcA, const int16 *pSrcB, uint8 *pDstA,
+               uint8 *pDstB)
+{
+  __m256i x[8];
+  uint8 i;
+
+  for (i = 0; i < 8; i++)
+    x[i] = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(pSrcA + i * 8))),
+        _mm_loadu_si128((const __m128i *)(pSrcB + i * 8)), 1);
+
+  PJPG_TRANSPOSE8(_mm256, x);
+  PJPG_IDCT_ROWS(_mm256, x);
+  PJPG_TRANSPOSE8(_mm256, x);
+  PJPG_IDCT_COLS(_mm256, x);
+
+  for (i = 0; i < 8; i += 2)
+  {
+    __m256i p = _mm256_packus_epi16(x[i], x[i + 1]);
+
+    _mm_storeu_si128((__m128i *)(pDstA + i * 8), _mm256_castsi256_si128(p));
+    _mm_storeu_si128((__m128i *)(pDstB + i * 8), _mm256_extracti128_si256(p, 1));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Where each block of the MCU goes after the IDCT: Y into gMCUBufR, at its
+// place in the MCU, and Cb and Cr into gChromaBuf.
+static uint8 *
+simdBlockDst(uint8 mcuBlock)
+{
+  uint8 numY = (gScanType == PJPG_GRAYSCALE) ? 1 : (uint8)(gMaxBlocksPerMCU - 2);
+
+  if (mcuBlock >= numY)
+    return gChromaBuf + (mcuBlock - numY) * 64;
+
+  return gMCUBufR + mcuBlock * ((gScanType == PJPG_YH1V2) ? 128 : 64);
+}
+
+//------------------------------------------------------------------------------
+// The 8 chroma samples under 8 pixels of a row, each doubled when chroma is
+// horizontally subsampled.
+static PJPG_SSE2 __m128i
+loadChroma8(const uint8 *pSrc, uint8 hShift)
+{
+  if (hShift)
+  {
+    int v;
+    __m128i c;
+
+    memcpy(&v, pSrc, 4);
+    c = _mm_cvtsi32_si128(v);
+
+    return _mm_unpacklo_epi8(c, c);
+  }
+
+  return _mm_loadl_epi64((const __m128i *)pSrc);
+}
+
+// Converts the MCU from Y in gMCUBufR and chroma in gChromaBuf to RGB,
+// upsampling the chroma on the fly, two rows of a block (16 pixels) at a
+// time with CONVERT16(ofs, cb, cr).
+#define PJPG_CONVERT_MCU(CONVERT16)                                            \
+  do                                                                           \
+  {                                                                            \
+    uint8 hShift = (gScanType == PJPG_YH2V1) || (gScanType == PJPG_YH2V2);     \
+    uint8 vShift = (gScanType == PJPG_YH1V2) || (gScanType == PJPG_YH2V2);     \
+    uint8 block, y;                                                            \
+                                                                               \
+    for (block = 0; block < gMaxBlocksPerMCU - 2; block++)                     \
+    {                                                                          \
+      uint8 ofs = (uint8)(simdBlockDst(block) - gMCUBufR);                     \
+      uint8 chromaX = (uint8)(((ofs >> 6) & 1) * 4);                           \
+      uint8 blockY = (uint8)((ofs >> 7) * 8);                                  \
+                                                                               \
+      for (y = 0; y < 8; y += 2)                                               \
+      {                                                                        \
+        uint8 c0 = (uint8)(((blockY + y) >> vShift) * 8 + chromaX);            \
+        uint8 c1 = (uint8)(((blockY + y + 1) >> vShift) * 8 + chromaX);        \
+        __m128i cb = _mm_unpacklo_epi64(loadChroma8(gChromaBuf + c0, hShift),  \
+                                        loadChroma8(gChromaBuf + c1, hShift)); \
+        __m128i cr =                                                           \
+            _mm_unpacklo_epi64(loadChroma8(gChromaBuf + 64 + c0, hShift),      \
+                               loadChroma8(gChromaBuf + 64 + c1, hShift));     \
+                                                                               \
+        CONVERT16(ofs + y * 8, cb, cr);                                        \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+//------------------------------------------------------------------------------
+static PJPG_SSE2 void
+convert16SSE2(uint8 ofs, __m128i cb, __m128i cr)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i y = _mm_loadu_si128((const __m128i *)(gMCUBufR + ofs));
+  __m128i r0, g0, b0, r1, g1, b1;
+
+  PJPG_YCC_RGB(_mm, _mm_unpacklo_epi8(y, zero), _mm_unpacklo_epi8(cb, zero),
+               _mm_unpacklo_epi8(cr, zero), r0, g0, b0);
+  PJPG_YCC_RGB(_mm, _mm_unpackhi_epi8(y, zero), _mm_unpackhi_epi8(cb, zero),
+               _mm_unpackhi_epi8(cr, zero), r1, g1, b1);
+
+  _mm_storeu_si128((__m128i *)(gMCUBufR + ofs), _mm_packus_epi16(r0, r1));
+  _mm_storeu_si128((__m128i *)(gMCUBufG + ofs), _mm_packus_epi16(g0, g1));
+  _mm_storeu_si128((__m128i *)(gMCUBufB + ofs), _mm_packus_epi16(b0, b1));
+}
+
+//------------------------------------------------------------------------------
+static PJPG_AVX2 void
+convert16AVX2(uint8 ofs, __m128i cb, __m128i cr)
+{
+  __m256i y = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(gMCUBufR + ofs)));
+  __m256i r, g, b;
+
+  PJPG_YCC_RGB(_mm256, y, _mm256_cvtepu8_epi16(cb), _mm256_cvtepu8_epi16(cr),
+               r, g, b);
+
+  _mm_storeu_si128((__m128i *)(gMCUBufR + ofs),
+                   _mm_packus_epi16(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1)));
+  _mm_storeu_si128((__m128i *)(gMCUBufG + ofs),
+                   _mm_packus_epi16(_mm256_castsi256_si128(g), _mm256_extracti128_si256(g, 1)));
+  _mm_storeu_si128((__m128i *)(gMCUBufB + ofs),
+                   _mm_packus_epi16(_mm256_castsi256_si128(b), _mm256_extracti128_si256(b, 1)));
+}
+
+//------------------------------------------------------------------------------
+// The SIMD transformBlock() for a whole MCU: IDCT of every block kept in
+// gCoeffBuf, then the colour conversion.
+static PJPG_SSE2 void
+transformMCUSSE2(void)
+{
+  uint8 mcuBlock;
+
+  for (mcuBlock = 0; mcuBlock < gMaxBlocksPerMCU; mcuBlock++)
+    idctBlockSSE2(gCoeffBuf + mcuBlock * 64, simdBlockDst(mcuBlock));
+
+  if (gScanType == PJPG_GRAYSCALE)
+  {
+    memcpy(gMCUBufG, gMCUBufR, 64);
+    memcpy(gMCUBufB, gMCUBufR, 64);
+    return;
+  }
+
+  PJPG_CONVERT_MCU(convert16SSE2);
+}
+
+//------------------------------------------------------------------------------
+static PJPG_AVX2 void
+transformMCUAVX2(void)
+{
+  uint8 mcuBlock;
+
+  for (mcuBlock = 0; mcuBlock + 1 < gMaxBlocksPerMCU; mcuBlock += 2)
+    idctBlocksAVX2(gCoeffBuf + mcuBlock * 64, gCoeffBuf + (mcuBlock + 1) * 64,
+                   simdBlockDst(mcuBlock), simdBlockDst(mcuBlock + 1));
+
+  // An odd block out goes through twice, keeping the code all VEX encoded
+  if (mcuBlock < gMaxBlocksPerMCU)
+  {
+    uint8 scratch[64];
+
+    idctBlocksAVX2(gCoeffBuf + mcuBlock * 64, gCoeffBuf + mcuBlock * 64,
+                   simdBlockDst(mcuBlock), scratch);
+  }
+
+  if (gScanType == PJPG_GRAYSCALE)
+  {
+    memcpy(gMCUBufG, gMCUBufR, 64);
+    memcpy(gMCUBufB, gMCUBufR, 64);
+    return;
+  }
+
+  PJPG_CONVERT_MCU(convert16AVX2);
+}
+#endif /* PJPG_X86 */
+
 //------------------------------------------------------------------------------
 static uint8
 decodeNextMCU(void)
@@ -2559,24 +3233,25 @@ decodeNextMCU(void)
     uint8 componentID = gMCUOrg[mcuBlock];
     uint8 compQuant = gCompQuant[componentID];
     uint8 compDCTab = gCompDCTab[componentID];
-    uint8 numExtraBits, compACTab, k;
+    uint8 compACTab, k, s;
     const int16 *pQ = compQuant ? gQuant1 : gQuant0;
+    int16 *pCoeff = gCoeffBuf;
     uint16 r, dc;
+    int16 value;
 
-    uint8 s =
-        huffDecode(compDCTab ? &gHuffTab1 : &gHuffTab0,
-                   compDCTab ? gHuffVal1 : gHuffVal0);
+#ifdef PJPG_X86
+    if ((gSimd) && (!gReduce))
+      pCoeff += mcuBlock * 64;
+#endif
 
-    r = 0;
-    numExtraBits = s & 0xF;
-    if (numExtraBits)
-      r = getBits2(numExtraBits);
-    dc = huffExtend(r, s);
+    huffDecodeExtend(compDCTab ? &gHuffTab1 : &gHuffTab0,
+                     compDCTab ? gHuffVal1 : gHuffVal0, &value);
 
+    dc = (uint16)value;
     dc = dc + gLastDC[componentID];
     gLastDC[componentID] = dc;
 
-    gCoeffBuf[0] = dc * pQ[0];
+    pCoeff[0] = dc * pQ[0];
 
     compACTab = gCompACTab[componentID];
 
@@ -2586,12 +3261,8 @@ decodeNextMCU(void)
       for (k = 1; k < 64; k++)
       {
         s =
-            huffDecode(compACTab ? &gHuffTab3 : &gHuffTab2,
-                       compACTab ? gHuffVal3 : gHuffVal2);
-
-        numExtraBits = s & 0xF;
-        if (numExtraBits)
-          getBits2(numExtraBits);
+            huffDecodeExtend(compACTab ? &gHuffTab3 : &gHuffTab2,
+                             compACTab ? gHuffVal3 : gHuffVal2, &value);
 
         r = s >> 4;
         s &= 15;
@@ -2627,24 +3298,15 @@ decodeNextMCU(void)
       // Decode and dequantize AC coefficients
       for (k = 1; k < 64; k++)
       {
-        uint16 extraBits;
-
         s =
-            huffDecode(compACTab ? &gHuffTab3 : &gHuffTab2,
-                       compACTab ? gHuffVal3 : gHuffVal2);
-
-        extraBits = 0;
-        numExtraBits = s & 0xF;
-        if (numExtraBits)
-          extraBits = getBits2(numExtraBits);
+            huffDecodeExtend(compACTab ? &gHuffTab3 : &gHuffTab2,
+                             compACTab ? gHuffVal3 : gHuffVal2, &value);
 
         r = s >> 4;
         s &= 15;
 
         if (s)
         {
-          int16 ac;
-
           if (r)
           {
             if ((k + r) > 63)
@@ -2652,14 +3314,12 @@ decodeNextMCU(void)
 
             while (r)
             {
-              gCoeffBuf[ZAG[k++]] = 0;
+              pCoeff[ZAG[k++]] = 0;
               r--;
             }
           }
 
-          ac = huffExtend(extraBits, s);
-
-          gCoeffBuf[ZAG[k]] = ac * pQ[k];
+          pCoeff[ZAG[k]] = value * pQ[k];
         }
         else
         {
@@ -2669,7 +3329,7 @@ decodeNextMCU(void)
               return PJPG_DECODE_ERROR;
 
             for (r = 16; r > 0; r--)
-              gCoeffBuf[ZAG[k++]] = 0;
+              pCoeff[ZAG[k++]] = 0;
 
             k--; // - 1 because the loop counter is k
           }
@@ -2679,12 +3339,26 @@ decodeNextMCU(void)
       }
 
       while (k < 64)
-        gCoeffBuf[ZAG[k++]] = 0;
+        pCoeff[ZAG[k++]] = 0;
 
+#ifdef PJPG_X86
+      if (gSimd)
+        continue;
+#endif
       transformBlock(mcuBlock);
     }
   }
 
+#ifdef PJPG_X86
+  if ((gSimd) && (!gReduce))
+  {
+    if (gSimd == 2)
+      transformMCUAVX2();
+    else
+      transformMCUSSE2();
+  }
+#endif
+
   return 0;
 }
 
@@ -2710,40 +3384,169 @@ pjpeg_decode_mcu(void)
 }
 
 //------------------------------------------------------------------------------
-unsigned char
-pjpeg_decode_init(pjpeg_image_info_t *pInfo,
-                  pjpeg_need_bytes_callback_t pNeed_bytes_callback,
-                  void *pCallback_data, unsigned char reduce)
+// Writes the MCU decodeNextMCU() just produced into the destination bitmap,
+// clipped to its right and bottom edges.
+static void
+storeMCU(uint8 *pDst, long rowStride, pjpeg_pixel_format_t format,
+         uint16 mcuX, uint16 mcuY)
 {
-  uint8 status;
-
-  pInfo->m_width = 0;
-  pInfo->m_height = 0;
-  pInfo->m_comps = 0;
-  pInfo->m_MCUSPerRow = 0;
-  pInfo->m_MCUSPerCol = 0;
-  pInfo->m_scanType = PJPG_GRAYSCALE;
-  pInfo->m_MCUWidth = 0;
-  pInfo->m_MCUHeight = 0;
-  pInfo->m_pMCUBufR = (unsigned char *)0;
-  pInfo->m_pMCUBufG = (unsigned char *)0;
-  pInfo->m_pMCUBufB = (unsigned char *)0;
+  uint8 shift = gReduce ? 3 : 0;
+  uint8 mcuW = gMaxMCUXSize >> shift;
+  uint8 mcuH = gMaxMCUYSize >> shift;
+  uint16 imageW = (uint16)((gImageXSize + (1U << shift) - 1) >> shift);
+  uint16 imageH = (uint16)((gImageYSize + (1U << shift) - 1) >> shift);
+  uint16 x0 = mcuX * mcuW;
+  uint16 y0 = mcuY * mcuH;
+  uint8 w = (imageW - x0 < mcuW) ? (uint8)(imageW - x0) : mcuW;
+  uint8 h = (imageH - y0 < mcuH) ? (uint8)(imageH - y0) : mcuH;
+  uint8 bpp = (format == PJPG_PIXEL_GRAY) ? 1 : ((format == PJPG_PIXEL_RGB) ? 3 : 4);
+  uint8 gray = (gScanType == PJPG_GRAYSCALE);
+  uint8 idx[16];
+  uint8 x, y;
 
-  g_pNeedBytesCallback = pNeed_bytes_callback;
-  g_pCallback_data = pCallback_data;
-  gCallbackStatus = 0;
-  gReduce = reduce;
+  // In reduce mode each block holds a single pixel, in its first byte.
+  for (x = 0; x < w; x++)
+    idx[x] = gReduce ? (uint8)(x * 64) : (uint8)(((x & 8) << 3) | (x & 7));
 
-  status = init();
-  if ((status) || (gCallbackStatus))
-    return gCallbackStatus ? gCallbackStatus : status;
+  pDst += y0 * rowStride + (long)x0 * bpp;
 
-  status = locateSOFMarker();
-  if ((status) || (gCallbackStatus))
-    return gCallbackStatus ? gCallbackStatus : status;
+  for (y = 0; y < h; y++, pDst += rowStride)
+  {
+    uint8 ofs = gReduce ? (uint8)(y * 128) : (uint8)(((y & 8) << 4) | ((y & 7) << 3));
+    const uint8 *pR = gMCUBufR + ofs;
+    const uint8 *pG = gray ? pR : gMCUBufG + ofs;
+    const uint8 *pB = gray ? pR : gMCUBufB + ofs;
+    uint8 *pD = pDst;
 
-  status = initFrame();
-  if ((status) || (gCallbackStatus))
+    switch (format)
+    {
+    case PJPG_PIXEL_GRAY:
+    {
+      if (gray)
+      {
+        for (x = 0; x < w; x++)
+          pD[x] = pR[idx[x]];
+      }
+      else
+      {
+        for (x = 0; x < w; x++)
+        {
+          uint8 i = idx[x];
+          pD[x] = (uint8)((pR[i] * 77U + pG[i] * 150U + pB[i] * 29U + 128U) >> 8U);
+        }
+      }
+      break;
+    }
+    case PJPG_PIXEL_RGB:
+    {
+      for (x = 0; x < w; x++, pD += 3)
+      {
+        uint8 i = idx[x];
+        pD[0] = pR[i];
+        pD[1] = pG[i];
+        pD[2] = pB[i];
+      }
+      break;
+    }
+    default:
+    {
+      for (x = 0; x < w; x++, pD += 4)
+      {
+        uint8 i = idx[x];
+        pD[0] = pR[i];
+        pD[1] = pG[i];
+        pD[2] = pB[i];
+        pD[3] = 0xFF;
+      }
+      break;
+    }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+unsigned char
+pjpeg_decode_image(pjpeg_image_info_t *pInfo, unsigned char *pDst,
+                   int rowStride, pjpeg_pixel_format_t format)
+{
+  unsigned long done;
+  uint16 mcuX, mcuY;
+  uint8 shift = gReduce ? 3 : 0;
+  long rowBytes;
+
+  if ((!pInfo) || (!pDst) || (format > PJPG_PIXEL_RGBA) || (!gMaxMCUSPerRow))
+    return PJPG_ASSERTION_ERROR;
+  if ((pInfo->m_width != gImageXSize) || (pInfo->m_height != gImageYSize))
+    return PJPG_ASSERTION_ERROR;
+
+  rowBytes = (long)((pInfo->m_width + (1L << shift) - 1) >> shift);
+  rowBytes *= (format == PJPG_PIXEL_GRAY) ? 1 : ((format == PJPG_PIXEL_RGB) ? 3 : 4);
+  if (rowStride < rowBytes)
+    return PJPG_ASSERTION_ERROR;
+
+  done = (unsigned long)gMaxMCUSPerRow * gMaxMCUSPerCol - gNumMCUSRemaining;
+  mcuX = (uint16)(done % gMaxMCUSPerRow);
+  mcuY = (uint16)(done / gMaxMCUSPerRow);
+
+  for (;;)
+  {
+    uint8 status = pjpeg_decode_mcu();
+
+    if (status == PJPG_NO_MORE_BLOCKS)
+      return 0;
+    if (status)
+      return status;
+
+    storeMCU(pDst, rowStride, format, mcuX, mcuY);
+
+    if (++mcuX == gMaxMCUSPerRow)
+    {
+      mcuX = 0;
+      mcuY++;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+static uint8
+initDecoder(pjpeg_image_info_t *pInfo,
+            pjpeg_need_bytes_callback_t pNeed_bytes_callback,
+            void *pCallback_data, unsigned char reduce)
+{
+  uint8 status;
+
+  pInfo->m_width = 0;
+  pInfo->m_height = 0;
+  pInfo->m_comps = 0;
+  pInfo->m_MCUSPerRow = 0;
+  pInfo->m_MCUSPerCol = 0;
+  pInfo->m_scanType = PJPG_GRAYSCALE;
+  pInfo->m_MCUWidth = 0;
+  pInfo->m_MCUHeight = 0;
+  pInfo->m_pMCUBufR = (unsigned char *)0;
+  pInfo->m_pMCUBufG = (unsigned char *)0;
+  pInfo->m_pMCUBufB = (unsigned char *)0;
+
+  g_pNeedBytesCallback = pNeed_bytes_callback;
+  g_pCallback_data = pCallback_data;
+  gCallbackStatus = 0;
+  gReduce = reduce;
+#ifdef PJPG_X86
+  gSimd = simdLevel();
+  if (gSimd > gSimdLimit)
+    gSimd = gSimdLimit;
+#endif
+
+  status = init();
+  if ((status) || (gCallbackStatus))
+    return gCallbackStatus ? gCallbackStatus : status;
+
+  status = locateSOFMarker();
+  if ((status) || (gCallbackStatus))
+    return gCallbackStatus ? gCallbackStatus : status;
+
+  status = initFrame();
+  if ((status) || (gCallbackStatus))
     return gCallbackStatus ? gCallbackStatus : status;
 
   status = initScan();
@@ -2765,6 +3568,29 @@ pjpeg_decode_init(pjpeg_image_info_t *pInfo,
   return 0;
 }
 
+//------------------------------------------------------------------------------
+unsigned char
+pjpeg_decode_init(pjpeg_image_info_t *pInfo,
+                  pjpeg_need_bytes_callback_t pNeed_bytes_callback,
+                  void *pCallback_data, unsigned char reduce)
+{
+  gMemData = (const uint8 *)0;
+
+  return initDecoder(pInfo, pNeed_bytes_callback, pCallback_data, reduce);
+}
+
+//------------------------------------------------------------------------------
+unsigned char
+pjpeg_decode_init_mem(pjpeg_image_info_t *pInfo, const unsigned char *pData,
+                      unsigned long size, unsigned char reduce)
+{
+  gMemData = pData;
+  gMemSize = size;
+  gMemOfs = 0;
+
+  return initDecoder(pInfo, memNeedBytes, 0, reduce);
+}
+
 const unsigned char jpeg_data[] = {
     0xff, 0xd8, 0xff, 0xe0, 0x00, 0x10, 0x4a, 0x46,
     0x49, 0x46, 0x00, 0x01, 0x01, 0x01, 0x00, 0x48,
@@ -2857,6 +3683,982 @@ pjpeg_need_bytes_callback(unsigned char *pBuf,
   return 0;
 }
 
+/* ------------------------- test image encoder ------------------------- */
+
+/* A small baseline JPEG encoder, so the checks and the benchmark can make
+   images of any size and sampling. It uses a float DCT, the Annex K
+   quantization tables scaled by quality, and fixed Huffman tables whose
+   code lengths grow with run and size, up to 16 bits. */
+
+typedef struct
+{
+  unsigned char *buf;
+  size_t len, cap;
+  unsigned long acc; /* Pending bits, the oldest at bit bits - 1. */
+  int bits;
+  int oom;
+} JencOut;
+
+typedef struct
+{
+  unsigned short code[256];
+  unsigned char size[256];
+  unsigned char counts[16]; /* Codes of each length, as in DHT. */
+  unsigned char vals[256];  /* Symbols in code order, as in DHT. */
+  int nvals;
+} JencHuff;
+
+static const unsigned char jenc_luma_quant[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61,
+    12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56,
+    14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77,
+    24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103, 99};
+
+static const unsigned char jenc_chroma_quant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99};
+
+/* cos (k * pi / 16) for k = 0 .. 8. */
+static const double jenc_cos[9] = {
+    1.0, 0.98078528040323043, 0.92387953251128674, 0.83146961230254524,
+    0.70710678118654752, 0.55557023301960218, 0.38268343236508977,
+    0.19509032201612825, 0.0};
+
+static void
+jenc_byte(JencOut *o, unsigned char c)
+{
+  if (o->len == o->cap)
+  {
+    size_t cap = o->cap ? o->cap * 2 : 65536;
+    unsigned char *buf = realloc(o->buf, cap);
+
+    if (!buf)
+    {
+      o->oom = 1;
+      return;
+    }
+    o->buf = buf;
+    o->cap = cap;
+  }
+  o->buf[o->len++] = c;
+}
+
+static void
+jenc_word(JencOut *o, unsigned w)
+{
+  jenc_byte(o, (unsigned char)(w >> 8));
+  jenc_byte(o, (unsigned char)w);
+}
+
+/* Entropy coded bits, with a 0 stuffed after every 0xFF. */
+static void
+jenc_bits(JencOut *o, unsigned code, int len)
+{
+  o->acc = (o->acc << len) | code;
+  o->bits += len;
+  while (o->bits >= 8)
+  {
+    unsigned char c = (unsigned char)(o->acc >> (o->bits - 8));
+
+    o->bits -= 8;
+    jenc_byte(o, c);
+    if (c == 0xFF)
+      jenc_byte(o, 0);
+  }
+  o->acc &= (1UL << o->bits) - 1;
+}
+
+/* Pads the last byte with 1 bits. */
+static void
+jenc_flush(JencOut *o)
+{
+  if (o->bits)
+    jenc_bits(o, (1U << (8 - o->bits)) - 1, 8 - o->bits);
+}
+
+static int
+jenc_huff_length(int ac, int sym)
+{
+  int len;
+
+  if (!ac)
+    return sym + 2;
+  if (sym == 0x00)
+    return 2;
+  if (sym == 0xF0)
+    return 12;
+  len = 2 + (sym >> 4) + (sym & 15);
+  return len < 16 ? len : 16;
+}
+
+/* DC symbols are the sizes 0 .. 11; AC ones EOB, ZRL and run << 4 | size
+   for sizes 1 .. 10. Codes are canonical, shortest first. */
+static void
+jenc_huff_init(JencHuff *t, int ac)
+{
+  unsigned short code = 0;
+  int len, sym;
+
+  memset(t, 0, sizeof(*t));
+  for (len = 1; len <= 16; len++)
+  {
+    for (sym = 0; sym < 256; sym++)
+    {
+      int s = sym & 15;
+
+      if (ac ? (s == 0 ? (sym != 0x00 && sym != 0xF0) : s > 10) : sym > 11)
+        continue;
+      if (jenc_huff_length(ac, sym) != len)
+        continue;
+      t->code[sym] = code++;
+      t->size[sym] = (unsigned char)len;
+      t->counts[len - 1]++;
+      t->vals[t->nvals++] = (unsigned char)sym;
+    }
+    code <<= 1;
+  }
+}
+
+static int
+jenc_category(int v)
+{
+  int n = 0;
+
+  if (v < 0)
+    v = -v;
+  while (v)
+  {
+    n++;
+    v >>= 1;
+  }
+  return n;
+}
+
+static void
+jenc_value(JencOut *o, int v, int n)
+{
+  if (n)
+    jenc_bits(o, (unsigned)(v < 0 ? v - 1 : v) & ((1U << n) - 1), n);
+}
+
+/* Forward DCT, quantization and entropy coding of one block of level
+   shifted samples. */
+static void
+jenc_block(JencOut *o, const double *in, const unsigned char *quant,
+           const JencHuff *dc, const JencHuff *ac, int *pred)
+{
+  static double basis[8][8];
+  double tmp[64];
+  int q[64], u, v, x, y, k, run, diff, n;
+
+  if (basis[0][0] == 0.0)
+    for (u = 0; u < 8; u++)
+      for (x = 0; x < 8; x++)
+      {
+        int m = ((2 * x + 1) * u) & 31;
+        double c;
+
+        if (m > 16)
+          m = 32 - m;
+        c = m > 8 ? -jenc_cos[16 - m] : jenc_cos[m];
+        basis[u][x] = 0.5 * (u ? 1.0 : jenc_cos[4]) * c;
+      }
+
+  for (y = 0; y < 8; y++)
+    for (u = 0; u < 8; u++)
+    {
+      double s = 0;
+
+      for (x = 0; x < 8; x++)
+        s += basis[u][x] * in[y * 8 + x];
+      tmp[y * 8 + u] = s;
+    }
+
+  for (v = 0; v < 8; v++)
+    for (u = 0; u < 8; u++)
+    {
+      double s = 0;
+      int c;
+
+      for (y = 0; y < 8; y++)
+        s += basis[v][y] * tmp[y * 8 + u];
+      s /= quant[v * 8 + u];
+      c = (int)(s < 0 ? s - 0.5 : s + 0.5);
+      q[v * 8 + u] = c < -1023 ? -1023 : (c > 1023 ? 1023 : c);
+    }
+
+  diff = q[0] - *pred;
+  *pred = q[0];
+  n = jenc_category(diff);
+  jenc_bits(o, dc->code[n], dc->size[n]);
+  jenc_value(o, diff, n);
+
+  run = 0;
+  for (k = 1; k < 64; k++)
+  {
+    int c = q[ZAG[k]];
+
+    if (!c)
+    {
+      run++;
+      continue;
+    }
+    for (; run > 15; run -= 16)
+      jenc_bits(o, ac->code[0xF0], ac->size[0xF0]);
+    n = jenc_category(c);
+    jenc_bits(o, ac->code[(run << 4) | n], ac->size[(run << 4) | n]);
+    jenc_value(o, c, n);
+    run = 0;
+  }
+  if (run)
+    jenc_bits(o, ac->code[0x00], ac->size[0x00]);
+}
+
+/* Y, Cb or Cr of the RGB pixel at (x, y), clamped to the image, less 128. */
+static double
+jenc_sample(const unsigned char *rgb, int width, int height, int stride,
+            int x, int y, int comp)
+{
+  const unsigned char *p;
+
+  x = x < width ? x : width - 1;
+  y = y < height ? y : height - 1;
+  p = rgb + (long)y * stride + x * 3;
+  if (comp == 0)
+    return 0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2] - 128.0;
+  if (comp == 1)
+    return -0.168736 * p[0] - 0.331264 * p[1] + 0.5 * p[2];
+  return 0.5 * p[0] - 0.418688 * p[1] - 0.081312 * p[2];
+}
+
+/* Encodes the width x height RGB image at rgb as a baseline JPEG of the
+   given scan type, with a restart marker every restart MCU's if nonzero.
+   Chroma is the average of the pixels each sample covers. Returns a
+   malloc'd buffer of *len bytes, or 0 if out of memory. */
+static unsigned char *
+jenc_encode(const unsigned char *rgb, int width, int height, int stride,
+            pjpeg_scan_type_t type, int quality, int restart, size_t *len)
+{
+  static const unsigned char hv[5][2] = {{1, 1}, {1, 1}, {2, 1}, {1, 2}, {2, 2}};
+  JencOut o;
+  JencHuff dc, ac;
+  unsigned char quant[2][64];
+  int comps = type == PJPG_GRAYSCALE ? 1 : 3;
+  int hs = hv[type][0], vs = hv[type][1];
+  int mcus_x = (width + 8 * hs - 1) / (8 * hs);
+  int mcus_y = (height + 8 * vs - 1) / (8 * vs);
+  int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+  int pred[3] = {0, 0, 0}, mx, my, i, t, mcu = 0;
+
+  memset(&o, 0, sizeof(o));
+  jenc_huff_init(&dc, 0);
+  jenc_huff_init(&ac, 1);
+  for (i = 0; i < 64; i++)
+  {
+    int l = (jenc_luma_quant[i] * scale + 50) / 100;
+    int c = (jenc_chroma_quant[i] * scale + 50) / 100;
+
+    quant[0][i] = (unsigned char)(l < 1 ? 1 : (l > 255 ? 255 : l));
+    quant[1][i] = (unsigned char)(c < 1 ? 1 : (c > 255 ? 255 : c));
+  }
+
+  jenc_word(&o, 0xFFD8);
+
+  jenc_word(&o, 0xFFDB);
+  jenc_word(&o, 2 + 2 * 65);
+  for (t = 0; t < 2; t++)
+  {
+    jenc_byte(&o, (unsigned char)t);
+    for (i = 0; i < 64; i++)
+      jenc_byte(&o, quant[t][ZAG[i]]);
+  }
+
+  jenc_word(&o, 0xFFC0);
+  jenc_word(&o, 8 + 3 * comps);
+  jenc_byte(&o, 8);
+  jenc_word(&o, (unsigned)height);
+  jenc_word(&o, (unsigned)width);
+  jenc_byte(&o, (unsigned char)comps);
+  for (i = 0; i < comps; i++)
+  {
+    jenc_byte(&o, (unsigned char)(i + 1));
+    jenc_byte(&o, (unsigned char)(i ? 0x11 : (hs << 4) | vs));
+    jenc_byte(&o, (unsigned char)(i ? 1 : 0));
+  }
+
+  /* The same codes serve as tables 0 (luma) and 1 (chroma). */
+  jenc_word(&o, 0xFFC4);
+  jenc_word(&o, 2 + 2 * (17 + dc.nvals) + 2 * (17 + ac.nvals));
+  for (t = 0; t < 4; t++)
+  {
+    const JencHuff *h = t < 2 ? &dc : &ac;
+
+    jenc_byte(&o, (unsigned char)((t < 2 ? 0x00 : 0x10) | (t & 1)));
+    for (i = 0; i < 16; i++)
+      jenc_byte(&o, h->counts[i]);
+    for (i = 0; i < h->nvals; i++)
+      jenc_byte(&o, h->vals[i]);
+  }
+
+  if (restart)
+  {
+    jenc_word(&o, 0xFFDD);
+    jenc_word(&o, 4);
+    jenc_word(&o, (unsigned)restart);
+  }
+
+  jenc_word(&o, 0xFFDA);
+  jenc_word(&o, 6 + 2 * comps);
+  jenc_byte(&o, (unsigned char)comps);
+  for (i = 0; i < comps; i++)
+  {
+    jenc_byte(&o, (unsigned char)(i + 1));
+    jenc_byte(&o, (unsigned char)(i ? 0x11 : 0x00));
+  }
+  jenc_byte(&o, 0);
+  jenc_byte(&o, 63);
+  jenc_byte(&o, 0);
+
+  for (my = 0; my < mcus_y; my++)
+    for (mx = 0; mx < mcus_x; mx++, mcu++)
+    {
+      double block[64];
+      int bx, by, c, x, y;
+
+      if (restart && mcu && mcu % restart == 0)
+      {
+        jenc_flush(&o);
+        jenc_word(&o, 0xFFD0 + ((mcu / restart - 1) & 7));
+        pred[0] = pred[1] = pred[2] = 0;
+      }
+
+      for (by = 0; by < vs; by++)
+        for (bx = 0; bx < hs; bx++)
+        {
+          for (y = 0; y < 8; y++)
+            for (x = 0; x < 8; x++)
+              block[y * 8 + x] =
+                  jenc_sample(rgb, width, height, stride,
+                              (mx * hs + bx) * 8 + x, (my * vs + by) * 8 + y, 0);
+          jenc_block(&o, block, quant[0], &dc, &ac, &pred[0]);
+        }
+
+      for (c = 1; c < comps; c++)
+      {
+        for (y = 0; y < 8; y++)
+          for (x = 0; x < 8; x++)
+          {
+            double s = 0;
+
+            for (by = 0; by < vs; by++)
+              for (bx = 0; bx < hs; bx++)
+                s += jenc_sample(rgb, width, height, stride,
+                                 (mx * 8 + x) * hs + bx, (my * 8 + y) * vs + by, c);
+            block[y * 8 + x] = s / (hs * vs);
+          }
+        jenc_block(&o, block, quant[1], &dc, &ac, &pred[c]);
+      }
+    }
+
+  jenc_flush(&o);
+  jenc_word(&o, 0xFFD9);
+
+  if (o.oom)
+  {
+    free(o.buf);
+    return 0;
+  }
+  *len = o.len;
+  return o.buf;
+}
+
+/* Gradients under a checkerboard of 32 pixel squares, plus uniform noise
+   of +/- noise. */
+static void
+jenc_test_image(unsigned char *rgb, int width, int height, int stride,
+                int noise, unsigned seed)
+{
+  int x, y, c;
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      for (c = 0; c < 3; c++)
+      {
+        int v = c == 0 ? x * 255 / width
+                       : (c == 1 ? y * 255 / height
+                                 : (((x ^ y) & 32) ? 200 : 40));
+
+        seed = seed * 1103515245u + 12345u;
+        if (noise)
+          v += (int)((seed >> 8) % (unsigned)(2 * noise + 1)) - noise;
+        rgb[(long)y * stride + x * 3 + c] =
+            (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+      }
+}
+
+typedef struct
+{
+  const unsigned char *data;
+  size_t len, off;
+} JpegMem;
+
+unsigned char
+jpeg_mem_callback(unsigned char *pBuf, unsigned char buf_size,
+                  unsigned char *pBytes_actually_read, void *pCallback_data)
+{
+  JpegMem *m = pCallback_data;
+  size_t n = MIN(m->len - m->off, buf_size);
+
+  memcpy(pBuf, m->data + m->off, n);
+  *pBytes_actually_read = (unsigned char)n;
+  m->off += n;
+  return 0;
+}
+
+/* Reference blit of the MCU just decoded, a pixel at a time from the
+   block layout documented for pjpeg_image_info_t. */
+static void
+check_store_mcu(const pjpeg_image_info_t *info, unsigned char *dst,
+                int stride, pjpeg_pixel_format_t format, int reduce,
+                int mcu_x, int mcu_y)
+{
+  int bpp = format == PJPG_PIXEL_GRAY ? 1 : (format == PJPG_PIXEL_RGB ? 3 : 4);
+  int div = reduce ? 8 : 1;
+  int w = (info->m_width + div - 1) / div, h = (info->m_height + div - 1) / div;
+  int mw = info->m_MCUWidth / div, mh = info->m_MCUHeight / div, x, y;
+
+  for (y = 0; y < mh; y++)
+    for (x = 0; x < mw; x++)
+    {
+      int px = mcu_x * mw + x, py = mcu_y * mh + y, i;
+      unsigned char r, g, b, *d;
+
+      if (px >= w || py >= h)
+        continue;
+      if (reduce)
+        i = y * 128 + x * 64;
+      else
+        i = (y / 8) * 128 + (x / 8) * 64 + (y % 8) * 8 + x % 8;
+      r = info->m_pMCUBufR[i];
+      g = info->m_comps == 1 ? r : info->m_pMCUBufG[i];
+      b = info->m_comps == 1 ? r : info->m_pMCUBufB[i];
+      d = dst + (long)py * stride + px * bpp;
+      if (format == PJPG_PIXEL_GRAY)
+        d[0] = (unsigned char)((r * 77 + g * 150 + b * 29 + 128) >> 8);
+      else
+      {
+        d[0] = r, d[1] = g, d[2] = b;
+        if (format == PJPG_PIXEL_RGBA)
+          d[3] = 0xFF;
+      }
+    }
+}
+
+/* Decodes jpeg with pjpeg_decode_image() and with pjpeg_decode_mcu() plus
+   the reference blit, into bitmaps with 5 bytes of padding per row, and
+   compares them padding included; then again from memory input, which must
+   agree with the callback. If src is given the RGB result must also be
+   within tol on average of the encoded image. */
+static int
+check_decode_image(const unsigned char *jpeg, size_t len,
+                   pjpeg_pixel_format_t format, int reduce,
+                   const unsigned char *src, int src_stride, double tol)
+{
+  pjpeg_image_info_t info, other;
+  JpegMem m = {jpeg, len, 0};
+  int bpp = format == PJPG_PIXEL_GRAY ? 1 : (format == PJPG_PIXEL_RGB ? 3 : 4);
+  int w, h, stride, mx, my, ok;
+  unsigned char *a, *b;
+  size_t size;
+
+  if (pjpeg_decode_init(&info, jpeg_mem_callback, &m, (unsigned char)reduce))
+    return 0;
+  w = reduce ? (info.m_width + 7) / 8 : info.m_width;
+  h = reduce ? (info.m_height + 7) / 8 : info.m_height;
+  stride = w * bpp + 5;
+  size = (size_t)stride * h;
+  a = malloc(size);
+  b = malloc(size);
+  if (!a || !b)
+  {
+    free(a), free(b);
+    return 0;
+  }
+  memset(a, 0xA5, size);
+  memset(b, 0xA5, size);
+
+  other = info;
+  other.m_height++;
+  ok = PJPG_ASSERTION_ERROR == pjpeg_decode_image(&other, a, stride, format);
+  ok &= PJPG_ASSERTION_ERROR == pjpeg_decode_image(NULL, a, stride, format);
+  ok &= 0 == pjpeg_decode_image(&info, a, stride, format);
+  ok &= PJPG_ASSERTION_ERROR == pjpeg_decode_image(&info, a, stride - 6, format);
+
+  m.off = 0;
+  ok &= 0 == pjpeg_decode_init(&info, jpeg_mem_callback, &m, (unsigned char)reduce);
+  for (my = 0; ok && my < info.m_MCUSPerCol; my++)
+    for (mx = 0; ok && mx < info.m_MCUSPerRow; mx++)
+    {
+      ok = 0 == pjpeg_decode_mcu();
+      check_store_mcu(&info, b, stride, format, reduce, mx, my);
+    }
+  ok &= PJPG_NO_MORE_BLOCKS == pjpeg_decode_mcu();
+  ok &= 0 == memcmp(a, b, size);
+
+  memset(b, 0xA5, size);
+  ok &= 0 == pjpeg_decode_init_mem(&info, jpeg, len, (unsigned char)reduce);
+  ok &= 0 == pjpeg_decode_image(&info, b, stride, format);
+  ok &= 0 == memcmp(a, b, size);
+
+  if (ok && src && format == PJPG_PIXEL_RGB)
+  {
+    double err = 0;
+    int x, y;
+
+    for (y = 0; y < h; y++)
+      for (x = 0; x < w * 3; x++)
+        err += abs(a[(long)y * stride + x] - src[(long)y * src_stride + x]);
+    ok = err / ((double)w * h * 3) <= tol;
+  }
+
+  free(a), free(b);
+  return ok;
+}
+
+/* Truncated and corrupted copies of jpeg, in buffers of their exact size,
+   must decode from memory and through the callback without reading past
+   them; what comes out does not matter. */
+static int
+check_damaged(const unsigned char *jpeg, size_t len)
+{
+  size_t cut;
+
+  for (cut = 0; cut < 3; cut++)
+  {
+    size_t n = cut == 2 ? len : len * (cut + 1) / 3;
+    unsigned char *copy = malloc(n ? n : 1), *dst;
+    pjpeg_image_info_t info;
+    JpegMem m = {copy, n, 0};
+
+    if (!copy)
+      return 0;
+    memcpy(copy, jpeg, n);
+    if (cut == 2)
+      copy[n * 3 / 4] ^= 0x5A;
+
+    if (0 == pjpeg_decode_init_mem(&info, copy, n, 0))
+    {
+      dst = malloc((size_t)info.m_width * info.m_height);
+      if (dst)
+        pjpeg_decode_image(&info, dst, info.m_width, PJPG_PIXEL_GRAY);
+      free(dst);
+    }
+    if (0 == pjpeg_decode_init(&info, jpeg_mem_callback, &m, 0))
+    {
+      dst = malloc((size_t)info.m_width * info.m_height);
+      if (dst)
+        pjpeg_decode_image(&info, dst, info.m_width, PJPG_PIXEL_GRAY);
+      free(dst);
+    }
+    free(copy);
+  }
+
+  return 1;
+}
+
+/* The embedded image, then generated ones of every scan type at sizes
+   that end mid-MCU, with and without restart intervals, smooth and
+   noisy (for plenty of stuffed 0xFF bytes). An MCU decoded
+   with pjpeg_decode_mcu() before pjpeg_decode_image() must stay unwritten. */
+static int
+check_images(void)
+{
+  static const int sizes[][2] = {{1, 1}, {16, 16}, {37, 29}, {67, 45}};
+  int ok = 1, f, t, k;
+
+  for (f = PJPG_PIXEL_GRAY; f <= PJPG_PIXEL_RGBA; f++)
+    for (k = 0; k < 2; k++)
+      ok &= check_decode_image(jpeg_data, sizeof(jpeg_data),
+                               (pjpeg_pixel_format_t)f, k, 0, 0, 0);
+
+  for (t = PJPG_GRAYSCALE; t <= PJPG_YH2V2; t++)
+    for (k = 0; k < 4; k++)
+    {
+      int w = sizes[k][0], h = sizes[k][1], noise = (k & 1) ? 96 : 0;
+      unsigned char *rgb = malloc((size_t)w * h * 3), *jpeg;
+      size_t len;
+
+      if (!rgb)
+        return 0;
+      jenc_test_image(rgb, w, h, w * 3, noise, (unsigned)k);
+      jpeg = jenc_encode(rgb, w, h, w * 3, (pjpeg_scan_type_t)t, 95, k, &len);
+      if (!jpeg)
+      {
+        free(rgb);
+        return 0;
+      }
+      for (f = PJPG_PIXEL_GRAY; f <= PJPG_PIXEL_RGBA; f++)
+        ok &= check_decode_image(jpeg, len, (pjpeg_pixel_format_t)f, 0,
+                                 (t == PJPG_GRAYSCALE || noise) ? 0 : rgb,
+                                 w * 3, 8.0)
+              && check_decode_image(jpeg, len, (pjpeg_pixel_format_t)f, 1,
+                                    0, 0, 0);
+
+      ok &= check_damaged(jpeg, len);
+
+      if (w > 16)
+      {
+        pjpeg_image_info_t info;
+        JpegMem m = {jpeg, len, 0};
+        unsigned char *dst = malloc((size_t)w * h);
+
+        ok &= dst && 0 == pjpeg_decode_init(&info, jpeg_mem_callback, &m, 0);
+        if (ok)
+        {
+          memset(dst, 0, (size_t)w * h);
+          ok &= 0 == pjpeg_decode_mcu();
+          ok &= 0 == pjpeg_decode_image(&info, dst, w, PJPG_PIXEL_GRAY);
+          ok &= dst[0] == 0 && dst[info.m_MCUWidth] != 0
+                && dst[(long)info.m_MCUHeight * w] != 0;
+        }
+        free(dst);
+      }
+      free(jpeg);
+      free(rgb);
+    }
+
+  return ok;
+}
+
+#ifdef PJPG_X86
+/* Decodes jpeg to RGB with the SIMD level capped at each of 0 to level in
+   turn; all must succeed with the same bitmap. */
+static int
+check_simd_image(const unsigned char *jpeg, size_t len, uint8 level)
+{
+  pjpeg_image_info_t info;
+  unsigned char *ref = 0;
+  size_t size = 0;
+  int ok = 1, i;
+
+  for (i = 0; ok && i <= level; i++)
+  {
+    unsigned char *rgb;
+
+    gSimdLimit = (uint8)i;
+    ok = 0 == pjpeg_decode_init_mem(&info, jpeg, len, 0);
+    size = (size_t)info.m_width * info.m_height * 3;
+    rgb = ok ? malloc(size) : 0;
+    ok = rgb && 0 == pjpeg_decode_image(&info, rgb, info.m_width * 3,
+                                        PJPG_PIXEL_RGB);
+    if (ok && ref)
+      ok = 0 == memcmp(ref, rgb, size);
+    if (ref)
+      free(rgb);
+    else
+      ref = rgb;
+  }
+  gSimdLimit = 2;
+
+  free(ref);
+  return ok;
+}
+
+/* The SIMD IDCTs must match idctRows() and idctCols() on random blocks
+   over the whole int16 range and on sparse ones, which take the DC-only
+   shortcuts; and every image must decode the same at each SIMD level the
+   CPU has. */
+static int
+check_simd(void)
+{
+  static const int sizes[][2] = {{1, 1}, {37, 29}, {67, 45}, {128, 96}};
+  uint8 level = simdLevel();
+  unsigned seed = 1;
+  int ok = 1, n, i, t, k;
+
+  for (n = 0; level && n < 2000; n++)
+  {
+    int16 block[2][64];
+    uint8 ref[2][64], sse2[64], avx2[2][64];
+
+    for (k = 0; k < 2; k++)
+    {
+      for (i = 0; i < 64; i++)
+      {
+        seed = seed * 1103515245 + 12345;
+        block[k][i] = (int16)(seed >> 8);
+        if (n & 1)
+          block[k][i] = (seed >> 28) < 3 ? block[k][i] >> (seed >> 24 & 15) : 0;
+      }
+      memcpy(gCoeffBuf, block[k], sizeof(block[k]));
+      idctRows();
+      idctCols();
+      for (i = 0; i < 64; i++)
+        ref[k][i] = (uint8)gCoeffBuf[i];
+    }
+
+    idctBlockSSE2(block[0], sse2);
+    ok &= 0 == memcmp(ref[0], sse2, 64);
+    if (level == 2)
+    {
+      idctBlocksAVX2(block[0], block[1], avx2[0], avx2[1]);
+      ok &= 0 == memcmp(ref, avx2, sizeof(ref));
+    }
+  }
+
+  ok &= check_simd_image(jpeg_data, sizeof(jpeg_data), level);
+  for (t = PJPG_GRAYSCALE; t <= PJPG_YH2V2; t++)
+    for (k = 0; k < 4; k++)
+    {
+      int w = sizes[k][0], h = sizes[k][1];
+      unsigned char *rgb = malloc((size_t)w * h * 3), *jpeg;
+      size_t len;
+
+      if (!rgb)
+        return 0;
+      jenc_test_image(rgb, w, h, w * 3, (k & 1) ? 96 : 0, (unsigned)k);
+      jpeg = jenc_encode(rgb, w, h, w * 3, (pjpeg_scan_type_t)t, 50 + 15 * k,
+                         k, &len);
+      ok &= jpeg && check_simd_image(jpeg, len, level);
+      free(jpeg), free(rgb);
+    }
+
+  return ok;
+}
+#endif /* PJPG_X86 */
+
+#ifdef BENCHMARK
+
+#define BENCH_MAX_SIDE 8192
+
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* MP/s decoding generated H2V2 images of 64 x 64 to BENCH_MAX_SIDE
+   squared to RGB, blitting each MCU in the caller as picojpeg's users
+   had to, and with pjpeg_decode_image(). */
+static void
+benchmark_decode_image(void)
+{
+  int side;
+
+  printf("\n%10s %10s %14s %14s\n", "side", "bpp", "mcu+blit MP/s",
+         "image MP/s");
+  for (side = 64; side <= BENCH_MAX_SIDE; side *= 2)
+  {
+    size_t size = (size_t)side * side * 3, len, reps, r;
+    unsigned char *rgb = malloc(size), *a = malloc(size), *jpeg = 0;
+    pjpeg_image_info_t info;
+    JpegMem m;
+    double t0, tm, ti;
+    int ok = 1;
+
+    if (rgb)
+    {
+      jenc_test_image(rgb, side, side, side * 3, 8, 1);
+      jpeg = jenc_encode(rgb, side, side, side * 3, PJPG_YH2V2, 85, 0, &len);
+    }
+    if (!a || !jpeg)
+    {
+      free(rgb), free(a), free(jpeg);
+      break;
+    }
+
+    reps = 16000000 / ((size_t)side * side) + 1;
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+    {
+      int mx, my;
+
+      m = (JpegMem){jpeg, len, 0};
+      ok &= 0 == pjpeg_decode_init(&info, jpeg_mem_callback, &m, 0);
+      for (my = 0; ok && my < info.m_MCUSPerCol; my++)
+        for (mx = 0; ok && mx < info.m_MCUSPerRow; mx++)
+        {
+          int x, y;
+
+          ok = 0 == pjpeg_decode_mcu();
+          for (y = 0; y < 16; y++)
+            for (x = 0; x < 16; x++)
+            {
+              int i = (y / 8) * 128 + (x / 8) * 64 + (y % 8) * 8 + x % 8;
+              unsigned char *d = a + ((size_t)(my * 16 + y) * side + mx * 16 + x) * 3;
+
+              d[0] = info.m_pMCUBufR[i];
+              d[1] = info.m_pMCUBufG[i];
+              d[2] = info.m_pMCUBufB[i];
+            }
+        }
+    }
+    tm = (now_seconds() - t0) / reps;
+    memcpy(rgb, a, size);
+
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+    {
+      m = (JpegMem){jpeg, len, 0};
+      ok &= 0 == pjpeg_decode_init(&info, jpeg_mem_callback, &m, 0);
+      ok &= 0 == pjpeg_decode_image(&info, a, side * 3, PJPG_PIXEL_RGB);
+    }
+    ti = (now_seconds() - t0) / reps;
+    ok &= 0 == memcmp(rgb, a, size);
+
+    printf("%10d %10.2f %14.1f %14.1f%s\n", side,
+           len * 8.0 / ((double)side * side), side * side / tm * 1e-6,
+           side * side / ti * 1e-6, ok ? "" : " (mismatch)");
+    free(rgb), free(a), free(jpeg);
+  }
+}
+
+#define BENCH_ENTROPY_TRIALS 5
+
+/* Entropy decoding MB/s of compressed input: reduce mode skips the IDCT
+   and colour conversion, leaving mostly Huffman decoding. The 2048 x 2048
+   H1V1 images go from smooth at quality 75 to noisy at 100. At quality 75
+   there are few bits per block and the per-block work dominates. Each
+   figure is the fastest of BENCH_ENTROPY_TRIALS runs, taken in turn, as
+   one run can be 20% off. */
+static void
+benchmark_entropy(void)
+{
+  static const int quality[] = {75, 90, 100, 100};
+  static const int noise[] = {0, 8, 32, 128};
+  const int side = 2048;
+  size_t size = (size_t)side * side * 3;
+  unsigned char *rgb = malloc(size), *out = malloc(size / 64 + 1024);
+  int k;
+
+  if (!rgb || !out)
+  {
+    free(rgb), free(out);
+    return;
+  }
+  printf("\n%10s %10s %10s %14s %14s\n", "quality", "noise", "bpp",
+         "callback MB/s", "memory MB/s");
+  for (k = 0; k < 4; k++)
+  {
+    unsigned char *jpeg;
+    size_t len, reps, r;
+    pjpeg_image_info_t info;
+    JpegMem m;
+    double t0, t, tc, tm;
+    int ok = 1, trial;
+
+    jenc_test_image(rgb, side, side, side * 3, noise[k], 1);
+    jpeg = jenc_encode(rgb, side, side, side * 3, PJPG_YH1V1, quality[k], 0,
+                       &len);
+    if (!jpeg)
+      break;
+    reps = 50000000 / BENCH_ENTROPY_TRIALS / len + 1;
+
+    for (tc = tm = 1e30, trial = 0; trial < BENCH_ENTROPY_TRIALS; trial++)
+    {
+      t0 = now_seconds();
+      for (r = 0; r < reps; r++)
+      {
+        m = (JpegMem){jpeg, len, 0};
+        ok &= 0 == pjpeg_decode_init(&info, jpeg_mem_callback, &m, 1);
+        ok &= 0 == pjpeg_decode_image(&info, out, side / 8, PJPG_PIXEL_GRAY);
+      }
+      t = (now_seconds() - t0) / reps;
+      tc = t < tc ? t : tc;
+
+      t0 = now_seconds();
+      for (r = 0; r < reps; r++)
+      {
+        ok &= 0 == pjpeg_decode_init_mem(&info, jpeg, len, 1);
+        ok &= 0 == pjpeg_decode_image(&info, out, side / 8, PJPG_PIXEL_GRAY);
+      }
+      t = (now_seconds() - t0) / reps;
+      tm = t < tm ? t : tm;
+    }
+
+    printf("%10d %10d %10.2f %14.1f %14.1f%s\n", quality[k], noise[k],
+           len * 8.0 / ((double)side * side), len / tc * 1e-6,
+           len / tm * 1e-6, ok ? "" : " (mismatch)");
+    free(jpeg);
+  }
+  free(rgb), free(out);
+}
+
+#ifdef PJPG_X86
+/* MP/s decoding 2048 x 2048 images to RGB with pjpeg_decode_image() at
+   each SIMD level the CPU has: IDCT and colour conversion scalar, SSE2
+   and AVX2. */
+static void
+benchmark_simd(void)
+{
+  static const pjpeg_scan_type_t types[] = {PJPG_YH1V1, PJPG_YH2V2};
+  const int side = 2048;
+  size_t size = (size_t)side * side * 3;
+  unsigned char *rgb = malloc(size), *a = malloc(size);
+  uint8 level = simdLevel(), i;
+  int k;
+
+  if (!rgb || !a)
+  {
+    free(rgb), free(a);
+    return;
+  }
+  printf("\n%10s %10s %14s %14s %14s\n", "scan", "bpp", "scalar MP/s",
+         "SSE2 MP/s", "AVX2 MP/s");
+  jenc_test_image(rgb, side, side, side * 3, 8, 1);
+  for (k = 0; k < 2; k++)
+  {
+    size_t len, reps = 4, r;
+    unsigned char *jpeg = jenc_encode(rgb, side, side, side * 3, types[k], 85,
+                                      0, &len);
+    pjpeg_image_info_t info;
+    int ok = 1;
+
+    if (!jpeg)
+      break;
+    printf("%10s %10.2f", k ? "H2V2" : "H1V1",
+           len * 8.0 / ((double)side * side));
+    for (i = 0; i <= 2; i++)
+    {
+      double t0;
+
+      if (i > level)
+      {
+        printf(" %14s", "-");
+        continue;
+      }
+      gSimdLimit = i;
+      t0 = now_seconds();
+      for (r = 0; r < reps; r++)
+      {
+        ok &= 0 == pjpeg_decode_init_mem(&info, jpeg, len, 0);
+        ok &= 0 == pjpeg_decode_image(&info, a, side * 3, PJPG_PIXEL_RGB);
+      }
+      printf(" %14.1f", side * side / ((now_seconds() - t0) / reps) * 1e-6);
+    }
+    printf("%s\n", ok ? "" : " (error)");
+    gSimdLimit = 2;
+    free(jpeg);
+  }
+  free(rgb), free(a);
+}
+#endif /* PJPG_X86 */
+
+#endif /* BENCHMARK */
+
 pjpeg_image_info_t pInfo;
 
 /* ------------------------------ main ------------------------------ */
@@ -2910,12 +4712,24 @@ int main()
       48, 48, 48, 48, 48, 48, 48, 48,
       47, 47, 47, 47, 47, 47, 47, 47};
 
-  res = (0 == memcmp(pInfo.m_pMCUBufR, r_ref, 64)) && (0 == memcmp(pInfo.m_pMCUBufG, g_ref, 64)) && (0 == memcmp(pInfo.m_pMCUBufB, b_ref, 64));
+  res = (0 == memcmp(pInfo.m_pMCUBufR, r_ref, 64)) && (0 == memcmp(pInfo.m_pMCUBufG, g_ref, 64)) && (0 == memcmp(pInfo.m_pMCUBufB, b_ref, 64))
+        && check_images();
+#ifdef PJPG_X86
+  res = res && check_simd();
+#endif
 
   correct = res == 1 ? 1 : 0;
 
   printf("The result is: %d\n", correct);
 
+#ifdef BENCHMARK
+  benchmark_decode_image();
+  benchmark_entropy();
+#ifdef PJPG_X86
+  benchmark_simd();
+#endif
+#endif
+
   return 0;
 }
 
@@ -33,6 +33,20 @@
 #include <math.h>
 #include <stdio.h>
 
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifdef BENCHMARK
+#include <stdlib.h>
+#include <time.h>
+#endif
+
 #define MAX 100
 
 /* Statistics Program:
@@ -53,6 +67,12 @@ double Coef;
 
 #define double_eq_beebs(exp, actual) (fabs(exp - actual) < VERIFY_DOUBLE_EPS)
 
+/* Sums taken in a different order may differ in the last bit or
+   two. */
+
+#define double_near_beebs(exp, actual) \
+  (fabs(exp - actual) <= 1.0e-15 * fabs(exp))
+
 void InitSeed()
 /*
  * Initializes the seed used in the random number generator.
@@ -128,6 +148,466 @@ void Initialize(double Array[])
     Array[i] = i + RandomInteger() / 8095.0;
 }
 
+/* ---------------------------- StatsAcc ----------------------------- */
+
+/* A one-pass accumulator for the statistics above over a stream of
+   pairs (a, b): the count, the sums, the means, the sums of squared
+   deviations from the means and the sum of cross deviations, from which
+   the variances, standard deviations, covariance and correlation
+   follow. Like Calc_Var_Stddev the variance divides by the count.
+
+   Stats_Update takes a batch in chunks of STATS_CHUNK pairs: a chunk is
+   summed, then its deviations from its own mean, two SIMD passes over
+   data still in L1, and the chunk's state is merged into the running
+   one with the pairwise formulas of Chan, Golub and LeVeque. Merging
+   deviations rather than accumulating raw sums of squares keeps the
+   variance accurate however large the mean, and lets partial states
+   from separate threads be combined with Stats_Merge. */
+
+#define STATS_CHUNK 256
+
+typedef struct
+{
+  double n;
+  double sumA, sumB;
+  double meanA, meanB;
+  double m2A, m2B; /* Sums of squared deviations from the mean. */
+  double cAB;      /* Sum of products of the deviations. */
+} StatsAcc;
+
+#if defined(__AVX512F__)
+#define VDLANES 8
+#define vdouble __m512d
+#define VDLOAD(p) _mm512_loadu_pd(p)
+#define VDSET1(x) _mm512_set1_pd(x)
+#define VDADD(x, y) _mm512_add_pd(x, y)
+#define VDSUB(x, y) _mm512_sub_pd(x, y)
+#define VDMUL(x, y) _mm512_mul_pd(x, y)
+#define VDSTORE(p, x) _mm512_storeu_pd(p, x)
+#elif defined(__AVX__)
+#define VDLANES 4
+#define vdouble __m256d
+#define VDLOAD(p) _mm256_loadu_pd(p)
+#define VDSET1(x) _mm256_set1_pd(x)
+#define VDADD(x, y) _mm256_add_pd(x, y)
+#define VDSUB(x, y) _mm256_sub_pd(x, y)
+#define VDMUL(x, y) _mm256_mul_pd(x, y)
+#define VDSTORE(p, x) _mm256_storeu_pd(p, x)
+#elif defined(__SSE2__)
+#define VDLANES 2
+#define vdouble __m128d
+#define VDLOAD(p) _mm_loadu_pd(p)
+#define VDSET1(x) _mm_set1_pd(x)
+#define VDADD(x, y) _mm_add_pd(x, y)
+#define VDSUB(x, y) _mm_sub_pd(x, y)
+#define VDMUL(x, y) _mm_mul_pd(x, y)
+#define VDSTORE(p, x) _mm_storeu_pd(p, x)
+#else
+#define VDLANES 1
+#define vdouble double
+#define VDLOAD(p) (*(p))
+#define VDSET1(x) (x)
+#define VDADD(x, y) ((x) + (y))
+#define VDSUB(x, y) ((x) - (y))
+#define VDMUL(x, y) ((x) * (y))
+#define VDSTORE(p, x) (*(p) = (x))
+#endif
+
+static double
+VdSum(vdouble v)
+{
+  double lane[VDLANES], sum = 0.0;
+  int k;
+
+  VDSTORE(lane, v);
+  for (k = 0; k < VDLANES; k++)
+    sum += lane[k];
+  return sum;
+}
+
+void Stats_Init(StatsAcc *s)
+{
+  s->n = 0;
+  s->sumA = s->sumB = 0;
+  s->meanA = s->meanB = 0;
+  s->m2A = s->m2B = s->cAB = 0;
+}
+
+/* Adds the pairs summarised by t to s. */
+
+void Stats_Merge(StatsAcc *s, const StatsAcc *t)
+{
+  double n = s->n + t->n, dA, dB, w;
+
+  if (t->n == 0)
+    return;
+  if (s->n == 0)
+  {
+    *s = *t;
+    return;
+  }
+  dA = t->meanA - s->meanA;
+  dB = t->meanB - s->meanB;
+  w = s->n * t->n / n;
+  s->sumA += t->sumA;
+  s->sumB += t->sumB;
+  s->meanA += dA * (t->n / n);
+  s->meanB += dB * (t->n / n);
+  s->m2A += t->m2A + dA * dA * w;
+  s->m2B += t->m2B + dB * dB * w;
+  s->cAB += t->cAB + dA * dB * w;
+  s->n = n;
+}
+
+/* The state of one chunk of n <= STATS_CHUNK pairs. */
+
+static void
+Stats_Chunk(StatsAcc *c, const double *a, const double *b, int n)
+{
+  vdouble sa = VDSET1(0.0), sb = VDSET1(0.0), ma, mb, da, db;
+  vdouble qa = VDSET1(0.0), qb = VDSET1(0.0), qab = VDSET1(0.0);
+  double ta = 0, tb = 0, x, y;
+  int i, nv = n / VDLANES * VDLANES;
+
+  for (i = 0; i < nv; i += VDLANES)
+  {
+    sa = VDADD(sa, VDLOAD(a + i));
+    sb = VDADD(sb, VDLOAD(b + i));
+  }
+  for (; i < n; i++)
+  {
+    ta += a[i];
+    tb += b[i];
+  }
+  c->n = n;
+  c->sumA = VdSum(sa) + ta;
+  c->sumB = VdSum(sb) + tb;
+  c->meanA = c->sumA / n;
+  c->meanB = c->sumB / n;
+
+  ma = VDSET1(c->meanA);
+  mb = VDSET1(c->meanB);
+  for (i = 0; i < nv; i += VDLANES)
+  {
+    da = VDSUB(VDLOAD(a + i), ma);
+    db = VDSUB(VDLOAD(b + i), mb);
+    qa = VDADD(qa, VDMUL(da, da));
+    qb = VDADD(qb, VDMUL(db, db));
+    qab = VDADD(qab, VDMUL(da, db));
+  }
+  ta = tb = 0;
+  c->cAB = 0;
+  for (i = nv; i < n; i++)
+  {
+    x = a[i] - c->meanA;
+    y = b[i] - c->meanB;
+    ta += x * x;
+    tb += y * y;
+    c->cAB += x * y;
+  }
+  c->m2A = VdSum(qa) + ta;
+  c->m2B = VdSum(qb) + tb;
+  c->cAB += VdSum(qab);
+}
+
+/* Adds the n pairs (a[i], b[i]) to s. */
+
+void Stats_Update(StatsAcc *s, const double *a, const double *b, long n)
+{
+  StatsAcc c;
+  long i;
+
+  for (i = 0; i < n; i += STATS_CHUNK)
+  {
+    Stats_Chunk(&c, a + i, b + i,
+                n - i < STATS_CHUNK ? (int)(n - i) : STATS_CHUNK);
+    Stats_Merge(s, &c);
+  }
+}
+
+double
+Stats_Var(const StatsAcc *s, int which)
+{
+  return (which ? s->m2B : s->m2A) / s->n;
+}
+
+double
+Stats_Stddev(const StatsAcc *s, int which)
+{
+  return sqrt(Stats_Var(s, which));
+}
+
+double
+Stats_Cov(const StatsAcc *s)
+{
+  return s->cAB / s->n;
+}
+
+double
+Stats_Corr(const StatsAcc *s)
+{
+  return s->cAB / (sqrt(s->m2A) * sqrt(s->m2B));
+}
+
+/* ------------------------- parallel reduction ------------------------- */
+
+/* Stats_UpdateParallel adds n pairs split into nthreads contiguous
+   parts, one per thread, each summarised with Stats_Update. The partial
+   states are then merged pairwise, neighbours first, as a balanced tree.
+   The split and the order of the merges depend only on n and nthreads,
+   so the result is the same bits from run to run for a given thread
+   count. Without USE_PTHREADS the parts are processed in turn by the
+   calling thread, with the same result. */
+
+#define STATS_MAX_THREADS 256
+
+typedef struct
+{
+  const double *a, *b;
+  long n;
+  StatsAcc acc;
+} StatsPart;
+
+static void *
+Stats_PartThread(void *p)
+{
+  StatsPart *part = p;
+
+  Stats_Init(&part->acc);
+  Stats_Update(&part->acc, part->a, part->b, part->n);
+  return NULL;
+}
+
+/* Runs fn on parts 1 .. nthreads - 1 in threads and on part 0 in the
+   caller, and waits for them all. */
+
+static void
+Stats_RunParts(int nthreads, void *(*fn)(void *), StatsPart *part)
+{
+  int t;
+#ifdef USE_PTHREADS
+  pthread_t thread[STATS_MAX_THREADS];
+  char started[STATS_MAX_THREADS];
+
+  for (t = 1; t < nthreads; t++)
+  {
+    started[t] = pthread_create(&thread[t], NULL, fn, &part[t]) == 0;
+    if (!started[t])
+      fn(&part[t]);
+  }
+  fn(&part[0]);
+  for (t = 1; t < nthreads; t++)
+    if (started[t])
+      pthread_join(thread[t], NULL);
+#else
+  for (t = 0; t < nthreads; t++)
+    fn(&part[t]);
+#endif
+}
+
+static void
+Stats_Split(StatsPart *part, int nthreads, const double *a, const double *b,
+            long n)
+{
+  long lo, hi;
+  int t;
+
+  for (t = 0; t < nthreads; t++)
+  {
+    lo = n / nthreads * t + (t < n % nthreads ? t : n % nthreads);
+    hi = lo + n / nthreads + (t < n % nthreads);
+    part[t].a = a + lo;
+    part[t].b = b + lo;
+    part[t].n = hi - lo;
+  }
+}
+
+void Stats_UpdateParallel(StatsAcc *s, const double *a, const double *b,
+                          long n, int nthreads)
+{
+  StatsPart part[STATS_MAX_THREADS];
+  int t, step;
+
+  nthreads = nthreads < 1 ? 1 : nthreads;
+  nthreads = nthreads > STATS_MAX_THREADS ? STATS_MAX_THREADS : nthreads;
+  Stats_Split(part, nthreads, a, b, n);
+  Stats_RunParts(nthreads, Stats_PartThread, part);
+  for (step = 1; step < nthreads; step *= 2)
+    for (t = 0; t + step < nthreads; t += 2 * step)
+      Stats_Merge(&part[t].acc, &part[t + step].acc);
+  Stats_Merge(s, &part[0].acc);
+}
+
+/* Number of CPUs available, for choosing a thread count. */
+
+int Stats_CpuCount(void)
+{
+#if defined(USE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n < 1 ? 1 : (int)n;
+#else
+  return 1;
+#endif
+}
+
+/* ---------------------------- benchmark ---------------------------- */
+
+#ifdef BENCHMARK
+
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifndef BENCH_MAX_SAMPLES
+#define BENCH_MAX_SAMPLES 10000000L
+#endif
+
+/* Calc_Sum_Mean, Calc_Var_Stddev and Calc_LinCorrCoef for n pairs. */
+
+static double
+ThreePass(const double *a, const double *b, long n)
+{
+  double sa = 0, sb = 0, ma, mb, va = 0, vb = 0, num = 0, at = 0, bt = 0;
+  long i;
+
+  for (i = 0; i < n; i++)
+    sa += a[i];
+  ma = sa / n;
+  for (i = 0; i < n; i++)
+    va += Square(a[i] - ma);
+  for (i = 0; i < n; i++)
+    sb += b[i];
+  mb = sb / n;
+  for (i = 0; i < n; i++)
+    vb += Square(b[i] - mb);
+  for (i = 0; i < n; i++)
+  {
+    num += (a[i] - ma) * (b[i] - mb);
+    at += Square(a[i] - ma);
+    bt += Square(b[i] - mb);
+  }
+  return num / (sqrt(at) * sqrt(bt)) + va + vb;
+}
+
+/* A part's plain sum of both of its arrays, the least work that still
+   reads every byte: the memory bandwidth Stats_UpdateParallel could
+   reach. */
+
+static void *
+ReadPartThread(void *p)
+{
+  StatsPart *part = p;
+  vdouble s0 = VDSET1(0.0), s1 = VDSET1(0.0);
+  long i, nv = part->n / VDLANES * VDLANES;
+  double t = 0;
+
+  for (i = 0; i < nv; i += VDLANES)
+  {
+    s0 = VDADD(s0, VDLOAD(part->a + i));
+    s1 = VDADD(s1, VDLOAD(part->b + i));
+  }
+  for (; i < part->n; i++)
+    t += part->a[i] + part->b[i];
+  part->acc.sumA = VdSum(VDADD(s0, s1)) + t;
+  return NULL;
+}
+
+/* GB/s of Stats_UpdateParallel on 1, 2, 4 .. all CPUs, at most
+   STATS_MAX_THREADS, for the largest arrays, next to the read bandwidth
+   of the same threads, so it shows when the statistics are limited by
+   DRAM rather than by arithmetic. */
+
+static void
+benchmark_parallel(const double *a, const double *b, long n)
+{
+  StatsPart part[STATS_MAX_THREADS];
+  int ncpu = Stats_CpuCount(), p, r, reps = 5;
+  double t0, ts, tr, bytes = 16.0 * n, sink = 0;
+  StatsAcc s;
+
+  ncpu = ncpu > STATS_MAX_THREADS ? STATS_MAX_THREADS : ncpu;
+  for (p = 1;; p = p * 2 < ncpu ? p * 2 : ncpu)
+  {
+    Stats_Split(part, p, a, b, n);
+    Stats_RunParts(p, ReadPartThread, part);
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+    {
+      Stats_RunParts(p, ReadPartThread, part);
+      sink += part[0].acc.sumA;
+    }
+    tr = (now_seconds() - t0) / reps;
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+    {
+      Stats_Init(&s);
+      Stats_UpdateParallel(&s, a, b, n, p);
+      sink += Stats_Corr(&s);
+    }
+    ts = (now_seconds() - t0) / reps;
+    printf("n = %ld, %3d threads: statistics %6.2f GB/s, read %6.2f GB/s "
+           "(%3.0f%%)\n",
+           n, p, bytes / ts * 1e-9, bytes / tr * 1e-9, 100 * tr / ts);
+    if (p == ncpu)
+      break;
+  }
+  printf("checksum: %g\n", sink);
+}
+
+/* Samples per second and GB/s of the three-pass functions and of
+   Stats_Update, for 10^3 .. BENCH_MAX_SAMPLES pairs. */
+
+static void
+benchmark(void)
+{
+  long n, i, reps, r;
+  double *a, *b, t0, t3, t1, sink = 0;
+  StatsAcc s;
+
+  a = malloc(BENCH_MAX_SAMPLES * sizeof(double));
+  b = malloc(BENCH_MAX_SAMPLES * sizeof(double));
+  if (!a || !b)
+    return;
+  InitSeed();
+  for (i = 0; i < BENCH_MAX_SAMPLES; i++)
+  {
+    a[i] = i % MAX + RandomInteger() / 8095.0;
+    b[i] = i % MAX + RandomInteger() / 8095.0;
+  }
+
+  for (n = 1000; n <= BENCH_MAX_SAMPLES; n *= 10)
+  {
+    reps = 100000000L / n + 1;
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+      sink += ThreePass(a, b, n);
+    t3 = (now_seconds() - t0) / reps;
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+    {
+      Stats_Init(&s);
+      Stats_Update(&s, a, b, n);
+      sink += Stats_Corr(&s);
+    }
+    t1 = (now_seconds() - t0) / reps;
+    printf("n = %10ld: three-pass %8.1f M pairs/s; one-pass %8.1f M "
+           "pairs/s, %6.2f GB/s\n",
+           n, n / t3 * 1e-6, n / t1 * 1e-6, 16.0 * n / t1 * 1e-9);
+  }
+  printf("checksum: %g\n", sink);
+  benchmark_parallel(a, b, BENCH_MAX_SAMPLES);
+  free(a);
+  free(b);
+}
+
+#endif
+
 /* ------------------------------ main ------------------------------ */
 
 int main()
@@ -160,10 +640,66 @@ int main()
 
   res = double_eq_beebs(expSumA, SumA) && double_eq_beebs(expSumB, SumB) && double_eq_beebs(expCoef, Coef);
 
+  /* The same statistics in one pass, whole and merged from uneven
+     parts. */
+  {
+    double MeanA, MeanB, VarA, VarB, StddevA, StddevB;
+    StatsAcc s, t;
+
+    InitSeed();
+    Initialize(ArrayA);
+    Initialize(ArrayB);
+    Calc_Sum_Mean(ArrayA, &SumA, &MeanA);
+    Calc_Var_Stddev(ArrayA, MeanA, &VarA, &StddevA);
+    Calc_Sum_Mean(ArrayB, &SumB, &MeanB);
+    Calc_Var_Stddev(ArrayB, MeanB, &VarB, &StddevB);
+
+    Stats_Init(&s);
+    Stats_Update(&s, ArrayA, ArrayB, MAX);
+    res &= double_near_beebs(expSumA, s.sumA) &&
+           double_near_beebs(expSumB, s.sumB) &&
+           double_eq_beebs(expCoef, Stats_Corr(&s));
+    res &= double_eq_beebs(MeanA, s.meanA) && double_eq_beebs(MeanB, s.meanB);
+    res &= double_near_beebs(VarA, Stats_Var(&s, 0)) &&
+           double_near_beebs(StddevB, Stats_Stddev(&s, 1));
+
+    Stats_Init(&s);
+    Stats_Init(&t);
+    Stats_Update(&s, ArrayA, ArrayB, 37);
+    Stats_Update(&t, ArrayA + 37, ArrayB + 37, MAX - 37);
+    Stats_Merge(&s, &t);
+    res &= double_near_beebs(expSumA, s.sumA) &&
+           double_near_beebs(expSumB, s.sumB) &&
+           double_eq_beebs(expCoef, Stats_Corr(&s)) &&
+           double_near_beebs(VarB, Stats_Var(&s, 1));
+  }
+
+  /* In parallel: the same statistics, and the same bits every time for
+     a given number of threads. Without USE_PTHREADS the parts run in
+     turn in this thread, so the second half only checks anything in a
+     USE_PTHREADS build. */
+  for (i = 1; i <= 4; i++)
+  {
+    StatsAcc s, t;
+
+    Stats_Init(&s);
+    Stats_Init(&t);
+    Stats_UpdateParallel(&s, ArrayA, ArrayB, MAX, i);
+    Stats_UpdateParallel(&t, ArrayA, ArrayB, MAX, i);
+    res &= double_near_beebs(expSumA, s.sumA) &&
+           double_near_beebs(expSumB, s.sumB) &&
+           double_eq_beebs(expCoef, Stats_Corr(&s));
+    res &= s.sumA == t.sumA && s.m2B == t.m2B && s.cAB == t.cAB;
+  }
+
   correct = res == 1 ? 1 : 0;
 
   printf("The result is: %d\n", correct);
 
+#ifdef BENCHMARK
+  benchmark();
+#endif
+
   return 0;
 }
 
@@ -81,8 +81,21 @@
 **                 (from the book C Programming for EEs by Hyun Soon Ahn)
 */
 
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#ifdef BENCHMARK
+#include <math.h>
+#include <time.h>
+#endif
 
 long int a[20][20], b[20], x[20];
 
@@ -144,6 +157,920 @@ int ludcmp(int nmax, int n)
   return (0);
 }
 
+/*************************************************************************/
+/*                                                                       */
+/*  Blocked LU for dense systems of any size.                            */
+/*                                                                       */
+/*  A is n x n, row major with leading dimension lda, and is overwritten */
+/*  by its factors: L (unit diagonal, not stored) below the diagonal and */
+/*  U on and above it. The factorisation is right looking: each panel of */
+/*  LU_NB columns is factored unblocked, the matching block row of U is  */
+/*  found by a triangular solve, and the rest of the matrix is updated   */
+/*  with one matrix multiply, where nearly all of the O(n^3) work is.    */
+/*                                                                       */
+/*  The double version uses partial pivoting, piv[i] being the row that  */
+/*  was swapped with row i. The long version does not pivot and divides  */
+/*  with truncation, exactly like ludcmp: because integer sums do not    */
+/*  depend on their order, it gives the same factors and solution as     */
+/*  ludcmp for any system ludcmp can solve. piv is set to the identity.  */
+/*                                                                       */
+/*  lu_factor_* return 0, or k + 1 if the k-th pivot is zero, in which   */
+/*  case the factorisation stops there. lu_factor_tile_* compute the     */
+/*  same factors with the task graph below on nthreads threads, and      */
+/*  return -1 if its workspace cannot be allocated.                      */
+/*  lu_forward_* applies the row swaps to b and solves L y = b in        */
+/*  place; lu_backward_* then solves U x = y in place.                   */
+/*                                                                       */
+/*************************************************************************/
+
+#define LU_NB 64
+
+/* Columns of C updated per pass of lu_gemm, so that the k x LU_GEMM_JB
+   block of B stays in cache. */
+#define LU_GEMM_JB 256
+
+/*************************************************************************/
+/*                                                                       */
+/*  Tile LU. The matrix is cut into nt x nt tiles of nb x nb, and step k */
+/*  of the blocked factorisation becomes a set of tasks:                 */
+/*                                                                       */
+/*    PANEL(k)     factor tile column k from the diagonal down           */
+/*    TRSM(k, j)   apply the step k swaps to tile column j and solve     */
+/*                 for tile (k, j) of U, j > k                           */
+/*    GEMM(k,i,j)  tile (i, j) -= L(i, k) U(k, j), i, j > k              */
+/*                                                                       */
+/*  PANEL(k) waits for the step k - 1 updates of column k, TRSM(k, j)    */
+/*  for PANEL(k) and the step k - 1 updates of column j, and GEMM(k,i,j) */
+/*  for TRSM(k, j). So the next panel can start while the rest of the    */
+/*  previous step's updates are still running.                           */
+/*                                                                       */
+/*  Ready tasks go on the deque of the worker that released them. A      */
+/*  worker pops its own newest task and, when it has none, steals the    */
+/*  oldest task of another worker. Each task writes only to its own      */
+/*  tiles, so the result does not depend on the number of threads.       */
+/*  Threads need USE_PTHREADS; otherwise the caller runs every task.     */
+/*                                                                       */
+/*************************************************************************/
+
+#define LU_TASK_PANEL 0
+#define LU_TASK_TRSM 1
+#define LU_TASK_GEMM 2
+
+#define LU_MAX_THREADS 256
+
+typedef int (*lu_exec_fn)(void *ctx, int type, int k, int i, int j);
+
+typedef struct
+{
+  int *task;
+  int top, bottom; /* Thieves take from top, the owner from bottom. */
+#ifdef USE_PTHREADS
+  pthread_mutex_t lock;
+#endif
+} lu_deque;
+
+typedef struct
+{
+  int nt, nthreads, total;
+  lu_exec_fn exec;
+  void *ctx;
+  int *panel_deps; /* Outstanding dependencies of PANEL(k). */
+  int *trsm_deps;  /* Of TRSM(k, j), at k * nt + j. */
+  int *info;       /* Result of PANEL(k). */
+  int failed;      /* A PANEL found a zero pivot. */
+  int done;        /* Tasks finished. */
+  lu_deque deque[LU_MAX_THREADS];
+} lu_dag;
+
+#ifdef USE_PTHREADS
+#define LU_LOCK(d) pthread_mutex_lock(&(d)->lock)
+#define LU_UNLOCK(d) pthread_mutex_unlock(&(d)->lock)
+#else
+#define LU_LOCK(d)
+#define LU_UNLOCK(d)
+#endif
+
+static void lu_push(lu_dag *g, int w, int type, int k, int i, int j)
+{
+  lu_deque *d = &g->deque[w];
+
+  LU_LOCK(d);
+  d->task[d->bottom++] = ((type * g->nt + k) * g->nt + i) * g->nt + j;
+  LU_UNLOCK(d);
+}
+
+/* Takes a task from worker v's deque: the newest if v is the caller's
+   own, the oldest otherwise. Returns -1 if it is empty. */
+
+static int lu_take(lu_dag *g, int v, int own)
+{
+  lu_deque *d = &g->deque[v];
+  int t = -1;
+
+  LU_LOCK(d);
+  if (d->bottom > d->top)
+    t = own ? d->task[--d->bottom] : d->task[d->top++];
+  LU_UNLOCK(d);
+  return t;
+}
+
+static void lu_worker(lu_dag *g, int w)
+{
+  int nt = g->nt;
+  int t, v, type, k, i, j;
+
+  while (__atomic_load_n(&g->done, __ATOMIC_ACQUIRE) < g->total)
+  {
+    t = lu_take(g, w, 1);
+    for (v = 1; t < 0 && v < g->nthreads; v++)
+      t = lu_take(g, (w + v) % g->nthreads, 0);
+    if (t < 0)
+    {
+#ifdef USE_PTHREADS
+      sched_yield();
+#endif
+      continue;
+    }
+
+    j = t % nt;
+    i = t / nt % nt;
+    k = t / nt / nt % nt;
+    type = t / nt / nt / nt;
+
+    /* After a failed PANEL tasks are still released, so that done
+       reaches total, but not run: the pivots they would apply were
+       never chosen. */
+    if (type == LU_TASK_PANEL)
+    {
+      g->info[k] = __atomic_load_n(&g->failed, __ATOMIC_ACQUIRE)
+                       ? 0
+                       : g->exec(g->ctx, type, k, k, k);
+      if (g->info[k])
+        __atomic_store_n(&g->failed, 1, __ATOMIC_RELEASE);
+      /* Highest j first, so that TRSM(k, k + 1), on the critical path,
+         is popped next. */
+      for (j = nt - 1; j > k; j--)
+        if (__atomic_sub_fetch(&g->trsm_deps[k * nt + j], 1,
+                               __ATOMIC_ACQ_REL) == 0)
+          lu_push(g, w, LU_TASK_TRSM, k, k, j);
+    }
+    else if (type == LU_TASK_TRSM)
+    {
+      if (!__atomic_load_n(&g->failed, __ATOMIC_ACQUIRE))
+        g->exec(g->ctx, type, k, k, j);
+      for (i = nt - 1; i > k; i--)
+        lu_push(g, w, LU_TASK_GEMM, k, i, j);
+    }
+    else
+    {
+      if (!__atomic_load_n(&g->failed, __ATOMIC_ACQUIRE))
+        g->exec(g->ctx, type, k, i, j);
+      if (j == k + 1)
+      {
+        if (__atomic_sub_fetch(&g->panel_deps[k + 1], 1,
+                               __ATOMIC_ACQ_REL) == 0)
+          lu_push(g, w, LU_TASK_PANEL, k + 1, k + 1, k + 1);
+      }
+      else if (__atomic_sub_fetch(&g->trsm_deps[(k + 1) * nt + j], 1,
+                                  __ATOMIC_ACQ_REL) == 0)
+        lu_push(g, w, LU_TASK_TRSM, k + 1, k + 1, j);
+    }
+
+    __atomic_add_fetch(&g->done, 1, __ATOMIC_ACQ_REL);
+  }
+}
+
+#ifdef USE_PTHREADS
+typedef struct
+{
+  lu_dag *g;
+  int w;
+} lu_worker_arg;
+
+static void *lu_worker_thread(void *p)
+{
+  lu_worker(((lu_worker_arg *)p)->g, ((lu_worker_arg *)p)->w);
+  return NULL;
+}
+#endif
+
+static void lu_dag_free(lu_dag *g)
+{
+  int w;
+
+  for (w = 0; w < g->nthreads; w++)
+  {
+    free(g->deque[w].task);
+#ifdef USE_PTHREADS
+    pthread_mutex_destroy(&g->deque[w].lock);
+#endif
+  }
+  free(g->panel_deps);
+  free(g->trsm_deps);
+  free(g->info);
+  free(g);
+}
+
+/* Runs the task graph of an nt x nt tile factorisation on nthreads
+   workers, the caller being one of them. Returns the first nonzero
+   PANEL result, after which no further task is run, 0, or -1 if out of
+   memory. A worker thread that cannot
+   be started leaves its share to the others. */
+
+static int lu_dag_run(int nt, int nthreads, lu_exec_fn exec, void *ctx)
+{
+  lu_dag *g;
+  int k, j, w, r = 0;
+
+#ifdef USE_PTHREADS
+  if (nthreads > LU_MAX_THREADS)
+    nthreads = LU_MAX_THREADS;
+#else
+  nthreads = 1;
+#endif
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nt == 0)
+    return 0;
+
+  g = calloc(1, sizeof(*g));
+  if (g == NULL)
+    return -1;
+  g->nt = nt;
+  g->nthreads = nthreads;
+  g->exec = exec;
+  g->ctx = ctx;
+  g->panel_deps = malloc(nt * sizeof(int));
+  g->trsm_deps = malloc(nt * nt * sizeof(int));
+  g->info = malloc(nt * sizeof(int));
+
+  for (k = 0; k < nt; k++)
+    g->total += 1 + (nt - 1 - k) + (nt - 1 - k) * (nt - 1 - k);
+  for (w = 0; w < nthreads; w++)
+  {
+    /* Every task is pushed once, and only by the worker that owns the
+       deque, so total entries always suffice. */
+    g->deque[w].task = malloc(g->total * sizeof(int));
+#ifdef USE_PTHREADS
+    pthread_mutex_init(&g->deque[w].lock, NULL);
+#endif
+    if (g->deque[w].task == NULL)
+      r = -1;
+  }
+  if (g->panel_deps == NULL || g->trsm_deps == NULL || g->info == NULL
+      || r != 0)
+  {
+    lu_dag_free(g);
+    return -1;
+  }
+
+  for (k = 0; k < nt; k++)
+  {
+    g->panel_deps[k] = nt - k;
+    for (j = 0; j < nt; j++)
+      g->trsm_deps[k * nt + j] = k == 0 ? 1 : 1 + nt - k;
+  }
+  lu_push(g, 0, LU_TASK_PANEL, 0, 0, 0);
+
+#ifdef USE_PTHREADS
+  {
+    pthread_t thread[LU_MAX_THREADS];
+    lu_worker_arg arg[LU_MAX_THREADS];
+    char started[LU_MAX_THREADS];
+
+    for (w = 1; w < nthreads; w++)
+    {
+      arg[w].g = g;
+      arg[w].w = w;
+      started[w] = pthread_create(&thread[w], NULL, lu_worker_thread,
+                                  &arg[w]) == 0;
+    }
+    lu_worker(g, 0);
+    for (w = 1; w < nthreads; w++)
+      if (started[w])
+        pthread_join(thread[w], NULL);
+  }
+#else
+  lu_worker(g, 0);
+#endif
+
+  for (k = 0; k < nt && !r; k++)
+    r = g->info[k];
+  lu_dag_free(g);
+  return r;
+}
+
+#define LU_DEFINE(SFX, T, PIVOT)                                           \
+  /* C -= A * B, with A m x k and B k x n. A 4 x 8 tile of C is held in  \
+     locals across the whole k loop; the fixed-length inner loops        \
+     vectorise. */                                                       \
+  static void lu_gemm_##SFX(int m, int n, int k, const T *A, int lda,     \
+                            const T *B, int ldb, T *C, int ldc)           \
+  {                                                                       \
+    T acc[4][8];                                                          \
+    int i, j, p, r, jj, j0, jb;                                           \
+                                                                          \
+    for (j0 = 0; j0 < n; j0 += LU_GEMM_JB)                                \
+    {                                                                     \
+      jb = n - j0 < LU_GEMM_JB ? n - j0 : LU_GEMM_JB;                     \
+      for (i = 0; i + 4 <= m; i += 4)                                     \
+      {                                                                   \
+        for (j = j0; j + 8 <= j0 + jb; j += 8)                            \
+        {                                                                 \
+          for (r = 0; r < 4; r++)                                         \
+            for (jj = 0; jj < 8; jj++)                                    \
+              acc[r][jj] = C[(i + r) * ldc + j + jj];                     \
+          for (p = 0; p < k; p++)                                         \
+            for (r = 0; r < 4; r++)                                       \
+              for (jj = 0; jj < 8; jj++)                                  \
+                acc[r][jj] -= A[(i + r) * lda + p] * B[p * ldb + j + jj]; \
+          for (r = 0; r < 4; r++)                                         \
+            for (jj = 0; jj < 8; jj++)                                    \
+              C[(i + r) * ldc + j + jj] = acc[r][jj];                     \
+        }                                                                 \
+        for (; j < j0 + jb; j++)                                          \
+          for (r = 0; r < 4; r++)                                         \
+            for (p = 0; p < k; p++)                                       \
+              C[(i + r) * ldc + j] -= A[(i + r) * lda + p] * B[p * ldb + j]; \
+      }                                                                   \
+      for (; i < m; i++)                                                  \
+        for (p = 0; p < k; p++)                                           \
+          for (j = j0; j < j0 + jb; j++)                                  \
+            C[i * ldc + j] -= A[i * lda + p] * B[p * ldb + j];            \
+    }                                                                     \
+  }                                                                       \
+                                                                          \
+  /* Unblocked factorisation of the m x kb panel at A. Rows are swapped   \
+     only within the panel; piv is relative to the panel. */              \
+  static int lu_panel_##SFX(int m, int kb, T *A, int lda, int *piv)       \
+  {                                                                       \
+    int i, j, c, p;                                                       \
+    T t;                                                                  \
+                                                                          \
+    for (j = 0; j < kb && j < m; j++)                                     \
+    {                                                                     \
+      p = j;                                                              \
+      if (PIVOT)                                                          \
+        for (i = j + 1; i < m; i++)                                       \
+          if ((A[i * lda + j] < 0 ? -A[i * lda + j] : A[i * lda + j])     \
+              > (A[p * lda + j] < 0 ? -A[p * lda + j] : A[p * lda + j]))  \
+            p = i;                                                        \
+      piv[j] = p;                                                         \
+      if (p != j)                                                         \
+        for (c = 0; c < kb; c++)                                          \
+        {                                                                 \
+          t = A[j * lda + c];                                             \
+          A[j * lda + c] = A[p * lda + c];                                \
+          A[p * lda + c] = t;                                             \
+        }                                                                 \
+      if (A[j * lda + j] == 0)                                            \
+        return j + 1;                                                     \
+                                                                          \
+      for (i = j + 1; i < m; i++)                                         \
+      {                                                                   \
+        A[i * lda + j] /= A[j * lda + j];                                 \
+        t = A[i * lda + j];                                               \
+        for (c = j + 1; c < kb; c++)                                      \
+          A[i * lda + c] -= t * A[j * lda + c];                           \
+      }                                                                   \
+    }                                                                     \
+    return 0;                                                             \
+  }                                                                       \
+                                                                          \
+  /* Applies the swaps piv[k1 .. k2 - 1] to the ncols columns at A. */    \
+  static void lu_swap_##SFX(int ncols, T *A, int lda, int k1, int k2,     \
+                            const int *piv)                               \
+  {                                                                       \
+    int r, c;                                                             \
+    T t;                                                                  \
+                                                                          \
+    for (r = k1; r < k2; r++)                                             \
+      if (piv[r] != r)                                                    \
+        for (c = 0; c < ncols; c++)                                       \
+        {                                                                 \
+          t = A[r * lda + c];                                             \
+          A[r * lda + c] = A[piv[r] * lda + c];                           \
+          A[piv[r] * lda + c] = t;                                        \
+        }                                                                 \
+  }                                                                       \
+                                                                          \
+  /* B = L^-1 B, L the kb x kb unit lower triangle at L, B kb x ncols. */ \
+  static void lu_trsm_##SFX(int kb, int ncols, const T *L, int ldl, T *B, \
+                            int ldb)                                      \
+  {                                                                       \
+    int i, j, c;                                                          \
+    T t;                                                                  \
+                                                                          \
+    for (j = 0; j < kb; j++)                                              \
+      for (i = j + 1; i < kb; i++)                                        \
+      {                                                                   \
+        t = L[i * ldl + j];                                               \
+        for (c = 0; c < ncols; c++)                                       \
+          B[i * ldb + c] -= t * B[j * ldb + c];                           \
+      }                                                                   \
+  }                                                                       \
+                                                                          \
+  /* Factors the panel whose top left corner is at k0 and makes its       \
+     pivots global. Returns 0 or the global index of the zero pivot + 1. */ \
+  static int lu_panel_at_##SFX(int n, T *A, int lda, int *piv, int k0,    \
+                               int kb)                                    \
+  {                                                                       \
+    int r, jj;                                                            \
+                                                                          \
+    r = lu_panel_##SFX(n - k0, kb, A + k0 * lda + k0, lda, piv + k0);     \
+    for (jj = 0; jj < (r ? r : kb); jj++)                                 \
+      piv[k0 + jj] += k0;                                                 \
+    return r ? k0 + r : 0;                                                \
+  }                                                                       \
+                                                                          \
+  int lu_factor_nb_##SFX(int n, T *A, int lda, int *piv, int nb)          \
+  {                                                                       \
+    int k0, kb, r;                                                        \
+                                                                          \
+    for (k0 = 0; k0 < n; k0 += nb)                                        \
+    {                                                                     \
+      kb = n - k0 < nb ? n - k0 : nb;                                     \
+                                                                          \
+      r = lu_panel_at_##SFX(n, A, lda, piv, k0, kb);                      \
+      if (r)                                                              \
+        return r;                                                         \
+      lu_swap_##SFX(k0, A, lda, k0, k0 + kb, piv);                        \
+                                                                          \
+      if (k0 + kb < n)                                                    \
+      {                                                                   \
+        lu_swap_##SFX(n - k0 - kb, A + k0 + kb, lda, k0, k0 + kb, piv);   \
+                                                                          \
+        /* U12 = L11^-1 A12. */                                           \
+        lu_trsm_##SFX(kb, n - k0 - kb, A + k0 * lda + k0, lda,            \
+                      A + k0 * lda + k0 + kb, lda);                       \
+                                                                          \
+        /* A22 -= L21 U12. */                                             \
+        lu_gemm_##SFX(n - k0 - kb, n - k0 - kb, kb,                       \
+                      A + (k0 + kb) * lda + k0, lda,                      \
+                      A + k0 * lda + k0 + kb, lda,                        \
+                      A + (k0 + kb) * lda + k0 + kb, lda);                \
+      }                                                                   \
+    }                                                                     \
+    return 0;                                                             \
+  }                                                                       \
+                                                                          \
+  /* One task of the tile factorisation; see lu_dag_run. */               \
+  typedef struct                                                          \
+  {                                                                       \
+    T *A;                                                                 \
+    int n, lda, nb;                                                       \
+    int *piv;                                                             \
+  } lu_tile_ctx_##SFX;                                                    \
+                                                                          \
+  static int lu_tile_exec_##SFX(void *p, int type, int k, int i, int j)   \
+  {                                                                       \
+    lu_tile_ctx_##SFX *c = (lu_tile_ctx_##SFX *)p;                        \
+    T *A = c->A;                                                          \
+    int n = c->n, lda = c->lda, nb = c->nb;                               \
+    int k0 = k * nb, i0 = i * nb, j0 = j * nb;                            \
+    int kb = n - k0 < nb ? n - k0 : nb;                                   \
+    int ib = n - i0 < nb ? n - i0 : nb;                                   \
+    int jb = n - j0 < nb ? n - j0 : nb;                                   \
+                                                                          \
+    if (type == LU_TASK_PANEL)                                            \
+      return lu_panel_at_##SFX(n, A, lda, c->piv, k0, kb);                \
+    if (type == LU_TASK_TRSM)                                             \
+    {                                                                     \
+      lu_swap_##SFX(jb, A + j0, lda, k0, k0 + kb, c->piv);                \
+      lu_trsm_##SFX(kb, jb, A + k0 * lda + k0, lda, A + k0 * lda + j0, lda); \
+    }                                                                     \
+    else                                                                  \
+      lu_gemm_##SFX(ib, jb, kb, A + i0 * lda + k0, lda, A + k0 * lda + j0, \
+                    lda, A + i0 * lda + j0, lda);                         \
+    return 0;                                                             \
+  }                                                                       \
+                                                                          \
+  int lu_factor_tile_##SFX(int n, T *A, int lda, int *piv, int nb,        \
+                           int nthreads)                                  \
+  {                                                                       \
+    lu_tile_ctx_##SFX c;                                                  \
+    int k0, r;                                                            \
+                                                                          \
+    c.A = A;                                                              \
+    c.n = n;                                                              \
+    c.lda = lda;                                                          \
+    c.nb = nb;                                                            \
+    c.piv = piv;                                                          \
+    r = lu_dag_run((n + nb - 1) / nb, nthreads, lu_tile_exec_##SFX, &c);  \
+                                                                          \
+    /* The swaps of each step still have to reach L to its left. */       \
+    for (k0 = nb; k0 < n && !r; k0 += nb)                                 \
+      lu_swap_##SFX(k0, A, lda, k0, n - k0 < nb ? n : k0 + nb, piv);      \
+    return r;                                                             \
+  }                                                                       \
+                                                                          \
+  int lu_factor_##SFX(int n, T *A, int lda, int *piv)                     \
+  {                                                                       \
+    return lu_factor_nb_##SFX(n, A, lda, piv, LU_NB);                     \
+  }                                                                       \
+                                                                          \
+  void lu_forward_##SFX(int n, const T *LU, int lda, const int *piv,      \
+                        T *b)                                             \
+  {                                                                       \
+    int i, j;                                                             \
+    T w;                                                                  \
+                                                                          \
+    for (i = 0; i < n; i++)                                               \
+      if (piv[i] != i)                                                    \
+      {                                                                   \
+        w = b[i];                                                         \
+        b[i] = b[piv[i]];                                                 \
+        b[piv[i]] = w;                                                    \
+      }                                                                   \
+    for (i = 1; i < n; i++)                                               \
+    {                                                                     \
+      w = b[i];                                                           \
+      for (j = 0; j < i; j++)                                             \
+        w -= LU[i * lda + j] * b[j];                                      \
+      b[i] = w;                                                           \
+    }                                                                     \
+  }                                                                       \
+                                                                          \
+  void lu_backward_##SFX(int n, const T *LU, int lda, T *b)               \
+  {                                                                       \
+    int i, j;                                                             \
+    T w;                                                                  \
+                                                                          \
+    for (i = n - 1; i >= 0; i--)                                          \
+    {                                                                     \
+      w = b[i];                                                           \
+      for (j = i + 1; j < n; j++)                                         \
+        w -= LU[i * lda + j] * b[j];                                      \
+      b[i] = w / LU[i * lda + i];                                         \
+    }                                                                     \
+  }
+
+LU_DEFINE(d, double, 1)
+LU_DEFINE(l, long, 0)
+
+/* Checks lu_*_l against ludcmp on an (n + 1) x (n + 1) system, n < 20,
+   and lu_*_d on the same system, whose exact solution is all ones when
+   b holds the row sums. Returns 1 on agreement. */
+
+int lu_check(int n, unsigned seed)
+{
+  long la[20 * 20], lb[20];
+  double da[20 * 20], db[20];
+  long tile_a[20][20];
+  int piv[20];
+  int i, j, ok = 1;
+
+  for (i = 0; i <= n; i++)
+  {
+    long w = 0;
+    for (j = 0; j <= n; j++)
+    {
+      seed = seed * 1103515245u + 12345u;
+      a[i][j] = (long)((seed >> 16) % 19) - 9;
+      if (i == j)
+        a[i][j] = 10 * (n + 1) + (long)((seed >> 20) % 7);
+      w += a[i][j];
+      tile_a[i][j] = a[i][j];
+      la[i * 20 + j] = a[i][j];
+      da[i * 20 + j] = a[i][j];
+    }
+    b[i] = lb[i] = w;
+    db[i] = w;
+  }
+
+  ok &= ludcmp(20, n) == 0;
+  ok &= lu_factor_l(n + 1, la, 20, piv) == 0;
+  lu_forward_l(n + 1, la, 20, piv, lb);
+  lu_backward_l(n + 1, la, 20, lb);
+  ok &= lu_factor_d(n + 1, da, 20, piv) == 0;
+  lu_forward_d(n + 1, da, 20, piv, db);
+  lu_backward_d(n + 1, da, 20, db);
+
+  for (i = 0; i <= n; i++)
+  {
+    ok &= lb[i] == x[i];
+    ok &= db[i] > 1 - 1e-9;
+    ok &= db[i] < 1 + 1e-9;
+  }
+
+  /* Again with panels of 4 columns, so that the blocked steps run. */
+  for (i = 0; i <= n; i++)
+  {
+    lb[i] = b[i];
+    db[i] = b[i];
+    for (j = 0; j <= n; j++)
+      la[i * 20 + j] = da[i * 20 + j] = tile_a[i][j];
+  }
+  ok &= lu_factor_nb_l(n + 1, la, 20, piv, 4) == 0;
+  lu_forward_l(n + 1, la, 20, piv, lb);
+  lu_backward_l(n + 1, la, 20, lb);
+  ok &= lu_factor_nb_d(n + 1, da, 20, piv, 4) == 0;
+  lu_forward_d(n + 1, da, 20, piv, db);
+  lu_backward_d(n + 1, da, 20, db);
+
+  for (i = 0; i <= n; i++)
+  {
+    ok &= lb[i] == x[i];
+    ok &= db[i] > 1 - 1e-9;
+    ok &= db[i] < 1 + 1e-9;
+  }
+
+  /* Again with the tile factorisation, on tiles small enough for the
+     task graph to have several steps. */
+  for (i = 0; i <= n; i++)
+  {
+    lb[i] = b[i];
+    db[i] = b[i];
+    for (j = 0; j <= n; j++)
+      la[i * 20 + j] = da[i * 20 + j] = tile_a[i][j];
+  }
+  ok &= lu_factor_tile_l(n + 1, la, 20, piv, 3, 3) == 0;
+  lu_forward_l(n + 1, la, 20, piv, lb);
+  lu_backward_l(n + 1, la, 20, lb);
+  ok &= lu_factor_tile_d(n + 1, da, 20, piv, 3, 3) == 0;
+  lu_forward_d(n + 1, da, 20, piv, db);
+  lu_backward_d(n + 1, da, 20, db);
+
+  for (i = 0; i <= n; i++)
+  {
+    ok &= lb[i] == x[i];
+    ok &= db[i] > 1 - 1e-9;
+    ok &= db[i] < 1 + 1e-9;
+  }
+  return ok;
+}
+
+/* Factors a random n x n system, n <= LU_CHECK_MAX, with pivoting both
+   blocked and by tiles on several threads, and compares the factors. */
+
+#define LU_CHECK_MAX 200
+
+double lu_check_a[LU_CHECK_MAX * LU_CHECK_MAX];
+double lu_check_t[LU_CHECK_MAX * LU_CHECK_MAX];
+
+/* If nthreads is 0, the second factorisation is unblocked instead,
+   checking the LU_NB panels of lu_factor_d itself. */
+
+int lu_tile_check(int n, int nb, int nthreads)
+{
+  int piv[LU_CHECK_MAX], tpiv[LU_CHECK_MAX];
+  unsigned seed = 4321u;
+  int i, ok = 1;
+
+  for (i = 0; i < n * n; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    lu_check_a[i] = lu_check_t[i] = (double)((seed >> 8) & 0xffff) / 65536.0;
+  }
+
+  ok &= lu_factor_d(n, lu_check_a, n, piv) == 0;
+  if (nthreads == 0)
+    ok &= lu_factor_nb_d(n, lu_check_t, n, tpiv, 1) == 0;
+  else
+    ok &= lu_factor_tile_d(n, lu_check_t, n, tpiv, nb, nthreads) == 0;
+  for (i = 0; i < n; i++)
+    ok &= piv[i] == tpiv[i];
+  for (i = 0; i < n * n; i++)
+  {
+    double d = lu_check_a[i] - lu_check_t[i];
+    ok &= d < 1e-9 && d > -1e-9;
+  }
+  return ok;
+}
+
+/* Factors a random n x n system whose column zcol is zero by tiles and
+   checks that it is reported singular at the same pivot as by
+   lu_factor_nb_d. */
+
+int lu_tile_singular_check(int n, int nb, int nthreads, int zcol)
+{
+  int piv[LU_CHECK_MAX], tpiv[LU_CHECK_MAX];
+  unsigned seed = 4321u;
+  int i, r;
+
+  for (i = 0; i < n * n; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    lu_check_a[i] = lu_check_t[i] =
+        i % n == zcol ? 0.0 : (double)((seed >> 8) & 0xffff) / 65536.0;
+  }
+
+  /* Pivots the failed panel never chose must not be used. */
+  for (i = 0; i < n; i++)
+    tpiv[i] = INT_MAX;
+  r = lu_factor_nb_d(n, lu_check_a, n, piv, nb);
+  return r == zcol + 1
+         && lu_factor_tile_d(n, lu_check_t, n, tpiv, nb, nthreads) == r;
+}
+
+/* ---------------------------- benchmark ---------------------------- */
+
+#ifdef BENCHMARK
+#ifndef BENCH_MAX_N
+#define BENCH_MAX_N 4000
+#endif
+
+/* The unblocked factorisation is only timed up to this size. */
+#define BENCH_UNBLOCKED_MAX 1000
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Fills A with a random, well conditioned system whose solution is all
+   ones. */
+
+static void bench_fill(int n, double *A, double *rhs)
+{
+  unsigned seed = 12345u;
+  int i, j;
+
+  for (i = 0; i < n; i++)
+  {
+    double w = 0;
+    for (j = 0; j < n; j++)
+    {
+      seed = seed * 1103515245u + 12345u;
+      A[(size_t)i * n + j] = (double)((seed >> 8) & 0xffff) / 65536.0 - 0.5;
+      if (i == j)
+        A[(size_t)i * n + j] += 4.0;
+      w += A[(size_t)i * n + j];
+    }
+    rhs[i] = w;
+  }
+}
+
+static int bench_cpus(void)
+{
+#if defined(USE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n < 1 ? 1 : (int)n;
+#else
+  return 1;
+#endif
+}
+
+/* Time per factorisation of ludcmp (n < 20 only, its arrays are fixed)
+   and of the blocked and tile long factorisations at small n, then
+   GFLOPS of the blocked and tile double factorisations on 1 .. all
+   CPUs, to show where the task graph starts to pay off. */
+
+static void benchmark_tile(void)
+{
+  static const int small[] = {4, 8, 12, 19};
+  static const int sizes[] = {100, 250, 500, 1000, 2000, 4000};
+  static long la[20 * 20];
+  int ncpu = bench_cpus();
+  int s, i, j, n, p, r, reps, piv[20];
+  double t0, tl, tb, tt;
+
+  for (s = 0; s < (int)(sizeof(small) / sizeof(small[0])); s++)
+  {
+    n = small[s];
+    reps = 20000;
+
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+    {
+      for (i = 0; i <= n; i++)
+        for (j = 0; j <= n; j++)
+          a[i][j] = i == j ? 4 * (n + 1) : (i + j) % 5;
+      ludcmp(20, n);
+    }
+    tl = now_seconds() - t0;
+
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+    {
+      for (i = 0; i <= n; i++)
+        for (j = 0; j <= n; j++)
+          la[i * 20 + j] = i == j ? 4 * (n + 1) : (i + j) % 5;
+      lu_factor_l(n + 1, la, 20, piv);
+    }
+    tb = now_seconds() - t0;
+
+    t0 = now_seconds();
+    for (r = 0; r < reps; r++)
+    {
+      for (i = 0; i <= n; i++)
+        for (j = 0; j <= n; j++)
+          la[i * 20 + j] = i == j ? 4 * (n + 1) : (i + j) % 5;
+      lu_factor_tile_l(n + 1, la, 20, piv, 4, ncpu);
+    }
+    tt = now_seconds() - t0;
+
+    printf("n = %4d: ludcmp %7.3f us, blocked %7.3f us, tile (nb 4, %d "
+           "threads) %7.3f us\n",
+           n + 1, tl / reps * 1e6, tb / reps * 1e6, ncpu, tt / reps * 1e6);
+  }
+
+  for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+  {
+    double *A, *rhs, flops;
+    int *ipiv;
+
+    n = sizes[s];
+    if (n > BENCH_MAX_N)
+      break;
+    A = malloc((size_t)n * n * sizeof(*A));
+    rhs = malloc(n * sizeof(*rhs));
+    ipiv = malloc(n * sizeof(*ipiv));
+    flops = 2.0 / 3.0 * n * (double)n * n;
+    if (A == NULL || rhs == NULL || ipiv == NULL)
+    {
+      free(A);
+      free(rhs);
+      free(ipiv);
+      break;
+    }
+
+    bench_fill(n, A, rhs);
+    t0 = now_seconds();
+    lu_factor_d(n, A, n, ipiv);
+    tb = now_seconds() - t0;
+    printf("n = %4d: blocked %6.2f GFLOPS; tile", n, flops / tb * 1e-9);
+
+    for (p = 1; p <= ncpu; p = p * 2 > ncpu && p != ncpu ? ncpu : p * 2)
+    {
+      bench_fill(n, A, rhs);
+      t0 = now_seconds();
+      if (lu_factor_tile_d(n, A, n, ipiv, LU_NB, p) < 0)
+      {
+        printf(" %d: out of memory", p);
+        break;
+      }
+      tt = now_seconds() - t0;
+      printf(" %d: %6.2f GFLOPS (%.2fx)", p, flops / tt * 1e-9, tb / tt);
+    }
+    printf("\n");
+
+    free(A);
+    free(rhs);
+    free(ipiv);
+  }
+}
+
+/* GFLOPS of the factorisation (2/3 n^3 flops) blocked and unblocked, and
+   of the solve (2 n^2 flops), with the largest error in x. */
+
+static void benchmark(void)
+{
+  static const int sizes[] = {100, 250, 500, 1000, 2000, 4000};
+  int s, i, n;
+
+  for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+  {
+    double *A, *rhs, t0, tb, tu = 0, ts, flops, err = 0;
+    int *piv;
+
+    n = sizes[s];
+    if (n > BENCH_MAX_N)
+      break;
+    A = malloc((size_t)n * n * sizeof(*A));
+    rhs = malloc(n * sizeof(*rhs));
+    piv = malloc(n * sizeof(*piv));
+    flops = 2.0 / 3.0 * n * (double)n * n;
+
+    if (n <= BENCH_UNBLOCKED_MAX)
+    {
+      bench_fill(n, A, rhs);
+      t0 = now_seconds();
+      lu_factor_nb_d(n, A, n, piv, 1);
+      tu = now_seconds() - t0;
+    }
+
+    bench_fill(n, A, rhs);
+    t0 = now_seconds();
+    lu_factor_d(n, A, n, piv);
+    tb = now_seconds() - t0;
+
+    t0 = now_seconds();
+    lu_forward_d(n, A, n, piv, rhs);
+    lu_backward_d(n, A, n, rhs);
+    ts = now_seconds() - t0;
+    for (i = 0; i < n; i++)
+      err = fmax(err, fabs(rhs[i] - 1));
+
+    printf("n = %4d: blocked %6.2f GFLOPS", n, flops / tb * 1e-9);
+    if (tu > 0)
+      printf(", unblocked %6.2f GFLOPS (%.1fx)", flops / tu * 1e-9, tu / tb);
+    printf(", solve %6.2f GFLOPS, max |x - 1| = %.2e\n",
+           2.0 * n * n / ts * 1e-9, err);
+
+    free(A);
+    free(rhs);
+    free(piv);
+  }
+
+  benchmark_tile();
+}
+#endif
+
 /* ------------------------------ main ------------------------------ */
 
 int main()
@@ -181,10 +1108,46 @@ int main()
 
   res = (0 == memcmp(x, x_ref, 20 * sizeof(x[0]))) && (0 == chkerr);
 
+  /* The blocked factorisation on the same system, then on random ones
+     against ludcmp. */
+  {
+    long la[6 * 6], lb[6];
+    int i, j, piv[6];
+
+    for (i = 0; i < 6; i++)
+    {
+      lb[i] = 0;
+      for (j = 0; j < 6; j++)
+      {
+        la[i * 6 + j] = (i + 1) + (j + 1);
+        if (i == j)
+          la[i * 6 + j] *= 2;
+        lb[i] += la[i * 6 + j];
+      }
+    }
+    res &= 0 == lu_factor_l(6, la, 6, piv);
+    lu_forward_l(6, la, 6, piv, lb);
+    lu_backward_l(6, la, 6, lb);
+    res &= 0 == memcmp(lb, x_ref, 6 * sizeof(lb[0]));
+
+    for (k = 1; k < 20; k++)
+      res &= lu_check(k, 7u * k);
+    res &= lu_tile_check(2 * LU_NB + 5, 0, 0);
+    res &= lu_tile_check(LU_CHECK_MAX, 32, 4);
+    res &= lu_tile_check(LU_CHECK_MAX - 3, 40, 3);
+    res &= lu_tile_singular_check(64, 8, 1, 0);
+    res &= lu_tile_singular_check(64, 8, 3, 0);
+    res &= lu_tile_singular_check(LU_CHECK_MAX - 3, 16, 4, 37);
+  }
+
   correct = res == 1 ? 1 : 0;
 
   printf("The result is: %d\n", correct);
 
+#ifdef BENCHMARK
+  benchmark();
+#endif
+
   return 0;
 }
 